@@ -130,6 +130,25 @@
 #define PW_IOCTL_MSR_ADDRS _IOW(APWR_IOCTL_MAGIC_NUM, 17, struct PWCollector_ioctl_arg *)
 #define PW_IOCTL_FREQ_RATIOS _IOR(APWR_IOCTL_MAGIC_NUM, 18, unsigned long *)
 #define PW_IOCTL_PLATFORM_RES_CONFIG _IOW(APWR_IOCTL_MAGIC_NUM, 19, struct PWCollector_ioctl_arg *)
+/*
+ * 'mmap' consumption: once the per-cpu buffers are mapped, 'read' returns a
+ * (u32) "cpu << 16 | segment" mask instead of copying the segment. The segment
+ * lives at offset (cpu * (PW_IOCTL_MMAP_SIZE / num buffers)) + (segment * PW_IOCTL_BUFFER_SIZE)
+ * of the mapping and MUST be handed back with this IOCTL (in_arg == the mask).
+ */
+#define PW_IOCTL_RELEASE_SEGMENT _IOW(APWR_IOCTL_MAGIC_NUM, 20, u32 *)
+/*
+ * Resize the per-cpu output buffers ('in_arg' == 'struct PWCollector_buffer_geometry').
+ * Only allowed outside a collection, and before the buffers are mmap-ed; Ring-3 should
+ * re-query 'PW_IOCTL_MMAP_SIZE' and 'PW_IOCTL_BUFFER_SIZE' afterwards.
+ */
+#define PW_IOCTL_BUFFER_GEOMETRY _IOW(APWR_IOCTL_MAGIC_NUM, 21, struct PWCollector_ioctl_arg *)
+/*
+ * Retrieve live produced/dropped/high-water counts: 'out_arg' is an array of
+ * 'struct PWCollector_buffer_stats' (one per output buffer). Returns the
+ * number of entries filled in.
+ */
+#define PW_IOCTL_BUFFER_STATS _IOR(APWR_IOCTL_MAGIC_NUM, 22, struct PWCollector_ioctl_arg *)
 
 /*
  * 32b-compatible version of the above
@@ -161,6 +180,9 @@
     #define PW_IOCTL_MSR_ADDRS32 _IOW(APWR_IOCTL_MAGIC_NUM, 17, compat_uptr_t)
     #define PW_IOCTL_FREQ_RATIOS32 _IOR(APWR_IOCTL_MAGIC_NUM, 18, compat_uptr_t)
     #define PW_IOCTL_PLATFORM_RES_CONFIG32 _IOW(APWR_IOCTL_MAGIC_NUM, 19, compat_uptr_t)
+    #define PW_IOCTL_RELEASE_SEGMENT32 _IOW(APWR_IOCTL_MAGIC_NUM, 20, compat_uptr_t)
+    #define PW_IOCTL_BUFFER_GEOMETRY32 _IOW(APWR_IOCTL_MAGIC_NUM, 21, compat_uptr_t)
+    #define PW_IOCTL_BUFFER_STATS32 _IOR(APWR_IOCTL_MAGIC_NUM, 22, compat_uptr_t)
 #endif // defined(HAVE_COMPAT_IOCTL) && defined(CONFIG_X86_64)
 
 #endif // _PW_IOCTL_H_
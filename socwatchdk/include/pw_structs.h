@@ -136,6 +136,12 @@
     #define NUM_SEGS_PER_BUFFER 4 /* MUST be POW-of-2 */
     #define NUM_SEGS_PER_BUFFER_MASK 3 /* MUST be (NUM_SEGS_PER_BUFFER - 1) */
 #endif
+/*
+ * Limits for 'PW_IOCTL_BUFFER_GEOMETRY'. 'NUM_SEGS_PER_BUFFER' (above)
+ * and 'PW_MIN_SEG_SIZE_BYTES' are the defaults.
+ */
+#define PW_MAX_SEGS_PER_BUFFER 32 /* MUST be POW-of-2 and <= # bits in an 'unsigned long' */
+#define PW_MIN_SEG_SIZE_BYTES 65536 /* Large enough for the biggest (u16 'data_len') message */
 
 #define SEG_SIZE (NUM_SAMPLES_PER_SEG * sizeof(PWCollector_sample_t))
 
@@ -347,6 +353,8 @@ typedef enum {
     GPU_C_STATE_META = 49, /* HACK! Used for GPU C-state metadata for fixed-length samples only! (temporary) */
     BANDWIDTH_MULTI = 50,
     BANDWIDTH_MULTI_META = 51, /* HACK! Used for elements of a BW compenent metadata for fixed-length samples only! (temporary) */
+    C_STATE_COMPACT = 52, /* Used for delta-encoded c-state samples (see 'PW_COMPACT_' below) */
+    P_STATE_COMPACT = 53, /* Used for delta-encoded p-state samples (see 'PW_COMPACT_' below) */
    SAMPLE_TYPE_END
 } sample_type_t;
 #define FOR_EACH_SAMPLE_TYPE(idx) for ( idx = C_STATE; idx < SAMPLE_TYPE_END; ++idx )
@@ -509,6 +517,32 @@ typedef struct c_msg {
     // u8 act_state; // State granted by hardware: the MSR that counted, and whose residency is encoded in the 'cx_res' field
 } c_msg_t;
 
+/*
+ * Compact C_STATE / P_STATE encodings. Produced instead of 'c_multi_msg_t' and
+ * 'p_msg_t' when Ring-3 sets 'POWER_COMPACT_SAMPLES_MASK' in the collection switches.
+ *
+ * Payloads are a sequence of bytes and LEB128 varints ("V" below; "Z" ==> zigzag-
+ * encoded signed varint). Counter values (MPERF, APERF and the C-state MSRs) are
+ * deltas, modulo 2^64, against a per-(cpu, counter) baseline that the decoder tracks:
+ * every counter starts at a baseline of zero, each decoded value becomes that counter's
+ * new baseline, and ALL baselines for that cpu/sample type are reset to zero on a
+ * 'PW_COMPACT_KEYFRAME' message (so a keyframe carries absolute values). The driver
+ * emits a keyframe periodically and after any dropped sample, which lets readers resync.
+ * Non-counter fields ('tps_epoch', frequencies, wakeup data) are always absolute.
+ *
+ * C_STATE_COMPACT:
+ *   u8 flags, u8 req_state, u8 wakeup_type, u8 num_msrs, V tps_epoch, V mperf,
+ *   [if PW_COMPACT_HAS_WAKEUP: Z (msg tsc - wakeup_tsc), V wakeup_data, Z timer_init_cpu, Z wakeup_pid, Z wakeup_tid]
+ *   followed by 'num_msrs' x { pw_msr_identifier_t id (2 bytes), V val }.
+ *   MSR baselines are keyed by 'id'. Without PW_COMPACT_HAS_WAKEUP, the wakeup fields
+ *   are absent and decode as "no wakeup" (wakeup tsc/data = 0, timer_init_cpu/pid/tid = -1).
+ * P_STATE_COMPACT:
+ *   u8 flags, V prev_req_frequency, V perf_status_val, V unhalted_core_value (APERF), V unhalted_ref_value (MPERF).
+ */
+#define PW_COMPACT_KEYFRAME (1 << 0)
+#define PW_COMPACT_HAS_WAKEUP (1 << 1)
+#define PW_COMPACT_BOUNDARY (1 << 2)
+
 typedef struct c_multi_msg {
     u64 mperf;
     u64 wakeup_tsc; // The TSC when the wakeup event was handled.
@@ -1808,6 +1842,7 @@ typedef enum power_data {
     PW_BANDWIDTH_SRR_CH0 = 30, /* DD should collect Channel 0 DRAM Self Refresh residency samples */
     PW_BANDWIDTH_SRR_CH1 = 31, /* DD should collect Channel 1 DRAM Self Refresh residency samples */
     PW_BANDWIDTH_TUNIT = 32, /* DD should collect T-Unit bandwidth samples */
+    PW_COMPACT_SAMPLES = 33, /* DD should delta-encode C-state and P-state samples */
     PW_MAX_POWER_DATA_MASK /* Marker used to indicate MAX valid 'power_data_t' enum value -- NOT used by DD */
 } power_data_t;
 
@@ -1844,6 +1879,7 @@ typedef enum power_data {
 #define POWER_BANDWIDTH_SRR_CH0_MASK (1ULL << PW_BANDWIDTH_SRR_CH0 )
 #define POWER_BANDWIDTH_SRR_CH1_MASK (1ULL << PW_BANDWIDTH_SRR_CH1)
 #define POWER_BANDWIDTH_TUNIT_MASK (1ULL << PW_BANDWIDTH_TUNIT )
+#define POWER_COMPACT_SAMPLES_MASK (1ULL << PW_COMPACT_SAMPLES )
 
 #define SET_COLLECTION_SWITCH(m,s) ( (m) |= (1ULL << (s) ) )
 #define RESET_COLLECTION_SWITCH(m,s) ( (m) &= ~(1ULL << (s) ) )
@@ -2059,6 +2095,28 @@ struct PWCollector_platform_res_info {
 };
 #define PW_PLATFORM_RES_INFO_HEADER_SIZE() (sizeof(PWCollector_platform_res_info_t) - sizeof(char[1]))
 
+/*
+ * Structure used by Ring-3 to size the per-cpu output
+ * buffers for the next collection.
+ */
+typedef struct PWCollector_buffer_geometry PWCollector_buffer_geometry_t;
+struct PWCollector_buffer_geometry {
+    u32 seg_size_bytes; // Size of each segment, INCLUDING the segment header. Power-of-2 multiple of PAGE_SIZE, >= PW_MIN_SEG_SIZE_BYTES
+    u32 num_segs; // # of segments per (per-cpu) buffer. POW-of-2, 2 <= num_segs <= PW_MAX_SEGS_PER_BUFFER
+};
+
+/*
+ * Live (per output buffer) statistics, returned by 'PW_IOCTL_BUFFER_STATS'
+ * one entry per buffer. May be read during a collection.
+ */
+typedef struct PWCollector_buffer_stats PWCollector_buffer_stats_t;
+struct PWCollector_buffer_stats {
+    u64 produced_samples; // # of samples written to this buffer in the current collection
+    u64 dropped_samples; // # of samples dropped because every segment was full
+    u32 high_water_segs; // Max # of segments simultaneously waiting for, or held by, the reader
+    u32 num_segs; // # of segments in this buffer
+};
+
 /*
  * Wrapper for ioctl arguments.
  * EVERY ioctl MUST use this struct!
@@ -233,6 +233,10 @@ static internal_state_t INTERNAL_STATE;
  * producing any C-state samples.
  */
 #define IS_C_STATE_MODE() ( INTERNAL_STATE.collection_switches & POWER_C_STATE_MASK )
+/*
+ * Should C/P-state samples use the compact (delta + varint) encoding?
+ */
+#define IS_COMPACT_MODE() ( INTERNAL_STATE.collection_switches & POWER_COMPACT_SAMPLES_MASK )
 
 
 /*
@@ -314,6 +318,14 @@ struct pw_msr_info_set {
      * Scratch memory required for "C_MULTI_MSG" sample support.
      */
     u8 *c_multi_msg_mem;
+    /*
+     * Compact encoding state: the last value sent to Ring-3 for each
+     * MSR (indexed like 'prev_msr_vals') and for MPERF, plus the number
+     * of samples left before the next keyframe.
+     */
+    u64 *compact_base;
+    u64 compact_mperf;
+    u32 compact_until_keyframe;
     /*
      * The number of MSRs we're currently tracking.
      */
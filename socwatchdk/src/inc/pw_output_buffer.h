@@ -75,6 +75,7 @@
  */
 typedef struct PWC_tps_msg PWC_tps_msg_t;
 struct PWCollector_msg;
+struct PWCollector_buffer_stats;
 struct c_msg;
 
 /*
@@ -95,6 +96,15 @@ struct PWC_tps_msg {
 };
 #pragma pack(pop)
 
+/*
+ * State carried from 'pw_reserve_msg()' to 'pw_commit_msg()'.
+ */
+typedef struct pw_msg_reservation pw_msg_reservation_t;
+struct pw_msg_reservation {
+    int cpu;
+    bool should_wakeup;
+};
+
 /*
  * Variable declarations.
  */
@@ -110,16 +120,23 @@ int pw_init_per_cpu_buffers(void);
 void pw_destroy_per_cpu_buffers(void);
 void pw_reset_per_cpu_buffers(void);
 int pw_map_per_cpu_buffers(struct vm_area_struct *vma, unsigned long *total_size);
+int pw_set_buffer_geometry(u32 seg_size_bytes, u32 num_segs);
 
 void pw_count_samples_produced_dropped(void);
 
 int pw_produce_generic_msg(struct PWCollector_msg *, bool);
 int pw_produce_generic_msg_on_cpu(int cpu, struct PWCollector_msg *, bool);
 
+void *pw_reserve_msg(u64 tsc, u16 cpuidx, u8 data_type, u16 data_len, pw_msg_reservation_t *res);
+int pw_commit_msg(pw_msg_reservation_t *res, bool allow_wakeup);
+
 bool pw_any_seg_full(u32 *val, const bool *is_flush_mode);
 unsigned long pw_consume_data(u32 mask, char __user *buffer, size_t bytes_to_read, size_t *bytes_read);
+int pw_hold_segment(u32 mask);
+int pw_release_segment(u32 mask);
 
 unsigned long pw_get_buffer_size(void);
+int pw_get_buffer_stats(struct PWCollector_buffer_stats __user *stats, int max_num_stats);
 
 void pw_wait_once(void);
 void pw_wakeup(void);
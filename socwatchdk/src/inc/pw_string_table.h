@@ -0,0 +1,93 @@
+/* ***********************************************************************************************
+
+  This file is provided under a dual BSD/GPLv2 license.  When using or 
+  redistributing this file, you may do so under either license.
+
+  GPL LICENSE SUMMARY
+
+  Copyright(c) 2013 Intel Corporation. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify 
+  it under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but 
+  WITHOUT ANY WARRANTY; without even the implied warranty of 
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License 
+  along with this program; if not, write to the Free Software 
+  Foundation, Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+  The full GNU General Public License is included in this distribution 
+  in the file called LICENSE.GPL.
+
+  Contact Information:
+  SOCWatch Developer Team <socwatchdevelopers@intel.com>
+
+  BSD LICENSE 
+
+  Copyright(c) 2013 Intel Corporation. All rights reserved.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without 
+  modification, are permitted provided that the following conditions 
+  are met:
+
+    * Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright 
+      notice, this list of conditions and the following disclaimer in 
+      the documentation and/or other materials provided with the 
+      distribution.
+    * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products derived 
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+  ***********************************************************************************************
+*/
+
+#ifndef _PW_STRING_TABLE_H_
+#define _PW_STRING_TABLE_H_ 1
+
+/*
+ * Session-wide intern table for names (wakelocks, IRQ device names, ...).
+ * All storage is preallocated when the driver loads, so interning a name
+ * from a tracepoint never allocates. Lookups are lock-free; only the first
+ * insertion of a name takes a lock.
+ */
+#define PW_STR_TABLE_MAX_ENTRIES 2048 /* MUST be POW-of-2 */
+#define PW_STR_TABLE_ARENA_SIZE (64 * 1024)
+
+/*
+ * Every name is emitted (e.g. as a constant pool entry) ONCE per session
+ * for each user that references it.
+ */
+typedef enum pw_str_kind {
+    PW_STR_WAKELOCK = 0,
+    PW_STR_IRQ,
+    PW_STR_NUM_KINDS
+} pw_str_kind_t;
+
+/*
+ * Public API.
+ */
+int pw_init_string_table(void);
+void pw_destroy_string_table(void);
+void pw_reset_string_table(void);
+
+int pw_intern_string(const char *str, size_t len, pw_str_kind_t kind, bool *should_emit);
+const char *pw_get_interned_string(int id);
+
+#endif // _PW_STRING_TABLE_H_
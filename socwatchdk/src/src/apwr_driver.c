@@ -95,6 +95,7 @@ struct pool_workqueue; // Get rid of warnings regarding trace_workqueue
 #include <linux/hash.h>
 #include <linux/poll.h>
 #include <linux/list.h>
+#include <linux/rculist_nulls.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/cpufreq.h>
@@ -131,6 +132,7 @@ struct pool_workqueue; // Get rid of warnings regarding trace_workqueue
 #include "pw_mem.h" // internally includes "pw_lock_defs.h"
 #include "pw_data_structs.h"
 #include "pw_output_buffer.h"
+#include "pw_string_table.h"
 #include "pw_defines.h"
 #include "pw_matrix.h"
 
@@ -330,6 +332,12 @@ static unsigned long startJIFF, stopJIFF;
 #define NUM_HASH_LOCKS (1UL << HASH_LOCK_BITS)
 #define HASH_LOCK_MASK (NUM_HASH_LOCKS - 1)
 
+/*
+ * Timer map updates take a hash lock. Lookups
+ * ('timer_find()') walk the map lock-free (RCU)
+ * and only take the lock if the node they hit
+ * is being rewritten (see 'tnode->gen').
+ */
 #define HASH_LOCK(i) LOCK(hash_locks[(i) & HASH_LOCK_MASK])
 #define HASH_UNLOCK(i) UNLOCK(hash_locks[(i) & HASH_LOCK_MASK])
 
@@ -560,6 +568,15 @@ static u64 startTSC_acpi_s3;
     #define PW_HLIST_FOR_EACH_ENTRY_RCU(tpos, pos, head, member) pos = NULL; hlist_for_each_entry_rcu(tpos, head, member)
 #endif
 
+/*
+ * Walk an 'hlist_nulls' list while removing entries. Caller must
+ * hold the lock protecting the list.
+ */
+#define PW_HLIST_NULLS_FOR_EACH_ENTRY_SAFE(tpos, pos, n, head, member) \
+    for (pos = (head)->first; \
+         (!is_a_nulls(pos)) && ({ n = pos->next; tpos = hlist_nulls_entry(pos, typeof(*tpos), member); 1; }); \
+         pos = n)
+
 #define ALLOW_WUWATCH_MSR_READ_WRITE 1
 #if ALLOW_WUWATCH_MSR_READ_WRITE
     #define WUWATCH_RDMSR_ON_CPU(cpu, addr, low, high) ({int __tmp = rdmsr_on_cpu((cpu), (addr), (low), (high)); __tmp;})
@@ -577,9 +594,23 @@ static u64 startTSC_acpi_s3;
  * Data structure definitions.
  */
 
+/*
+ * Timer nodes are never freed while the collector is loaded;
+ * a deleted node goes back to a (per-cpu) free list and may be
+ * reused right away. Lock-free readers of the timer map are
+ * protected by the 'nulls' end-of-list marker, which encodes
+ * the bucket index: a reader that ends up on a different bucket
+ * (because the node it was on was moved) restarts its lookup.
+ * 'list' links the node into a free list, 'hash_list' into
+ * the timer map. 'trace' points to a fixed slot of
+ * MAX_BACKTRACE_LENGTH entries in the node's block.
+ * 'gen' is odd while the node is being (re)written under
+ * the hash lock, and changes every time it is.
+ */
 typedef struct tnode tnode_t;
 struct tnode{
     struct hlist_node list;
+    struct hlist_nulls_node hash_list;
     unsigned long timer_addr;
     pid_t tid, pid;
     u64 tsc;
@@ -588,6 +619,7 @@ struct tnode{
     u16 trace_sent : 1;
     u16 trace_len : 14;
     unsigned long *trace;
+    unsigned int gen;
 };
 
 typedef struct hnode hnode_t;
@@ -598,6 +630,7 @@ struct hnode{
 typedef struct tblock tblock_t;
 struct tblock{
     struct tnode *data;
+    unsigned long *traces;
     tblock_t *next;
 };
 
@@ -620,7 +653,7 @@ struct irq_node{
     struct hlist_node list;
     struct rcu_head rcu;
     int irq;
-    char *name;
+    const char *name; // interned, see "pw_string_table.h"
     /*
      * We send IRQ # <-> DEV name
      * mappings to Ring-3 ONCE PER
@@ -654,34 +687,6 @@ struct irq_hash_node{
 #define IRQ_LOCK(i) LOCK(irq_map_locks[(i) & IRQ_LOCK_MASK])
 #define IRQ_UNLOCK(i) UNLOCK(irq_map_locks[(i) & IRQ_LOCK_MASK])
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-
-typedef struct wlock_node wlock_node_t;
-struct wlock_node{
-    struct hlist_node list;
-    struct rcu_head rcu;
-    int constant_pool_index;
-    unsigned long hash_val;
-    size_t wakelock_name_len;
-    char *wakelock_name;
-};
-
-typedef struct wlock_hash_node wlock_hash_node_t;
-struct wlock_hash_node{
-    struct hlist_head head;
-};
-
-#define NUM_WLOCK_MAP_BITS 6
-#define NUM_WLOCK_MAP_BUCKETS (1UL << NUM_WLOCK_MAP_BITS)
-#define WLOCK_MAP_HASH_MASK (NUM_WLOCK_MAP_BUCKETS - 1) /* Used for modulo: x % y == x & (y-1) iff y is pow-of-2 */
-#define WLOCK_MAP_HASH_FUNC(n) pw_hash_string(n)
-
-#define WLOCK_LOCK_MASK HASH_LOCK_MASK
-
-#define WLOCK_LOCK(i) LOCK(wlock_map_locks[(i) & WLOCK_LOCK_MASK])
-#define WLOCK_UNLOCK(i) UNLOCK(wlock_map_locks[(i) & WLOCK_LOCK_MASK])
-
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES 
 
 /*
  * For syscall nodes
@@ -729,9 +734,6 @@ static int pw_register_dev(void);
 static void pw_unregister_dev(void);
 // static int pw_read_msr_set_i(struct msr_set *msr_set, int *which_cx, u64 *cx_val);
 static int pw_read_msr_info_set_i(struct pw_msr_info_set *msr_set);
-#if DO_WAKELOCK_SAMPLE 
-static unsigned long pw_hash_string(const char *data);
-#endif // DO_WAKELOCK_SAMPLE
 static int pw_init_data_structures(void);
 static void pw_destroy_data_structures(void);
 
@@ -758,7 +760,7 @@ static u32 __read_mostly micro_patch_ver = 0x0;
 #define DEV_IS_OPEN 0 // see if device is in use
 static volatile unsigned long dev_status;
 
-static struct hnode timer_map[NUM_MAP_BUCKETS];
+static struct hlist_nulls_head timer_map[NUM_MAP_BUCKETS];
 
 #if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 static PWCollector_irq_mapping_t *irq_mappings_list = NULL;
@@ -766,11 +768,6 @@ static irq_hash_node_t irq_map[NUM_IRQ_MAP_BUCKETS];
 static int total_num_irq_mappings = 0;
 #endif //  DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-static wlock_hash_node_t wlock_map[NUM_WLOCK_MAP_BUCKETS];
-static int total_num_wlock_mappings = 0;
-#define GET_NEXT_CONSTANT_POOL_INDEX() total_num_wlock_mappings++
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
 
 DEFINE_PER_CPU(per_cpu_t, per_cpu_counts);
 
@@ -794,6 +791,15 @@ static struct pw_msr_info_set *pw_pcpu_msr_info_sets ____cacheline_aligned_in_sm
 
 static DEFINE_PER_CPU(u32, pcpu_prev_perf_status_val) = 0;
 
+/*
+ * Baselines for "P_STATE_COMPACT" samples.
+ */
+struct pw_compact_p_state {
+    u64 aperf, mperf;
+    u32 until_keyframe;
+};
+static DEFINE_PER_CPU(struct pw_compact_p_state, pcpu_compact_p_state);
+
 
 /*
  * TPS helper -- required for overhead
@@ -826,12 +832,6 @@ static spinlock_t hash_locks[NUM_HASH_LOCKS];
 #if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 static spinlock_t irq_map_locks[NUM_HASH_LOCKS];
 #endif
-/*
- * Wakelock map locks
- */
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-static spinlock_t wlock_map_locks[NUM_HASH_LOCKS];
-#endif
 
 /*
  * Base operating frequency -- required if
@@ -931,6 +931,15 @@ static DEFINE_PER_CPU_SHARED_ALIGNED(struct wakeup_event, wakeup_event_counter)
  * Did the user mmap our buffers?
  */
 static bool pw_did_mmap = false;
+/*
+ * How the client consumes the buffers: set by the first 'read' copy or
+ * 'mmap', and kept until the device is closed. Mixing the two would
+ * advance the consumer position twice.
+ */
+#define PW_CONSUMER_NONE 0
+#define PW_CONSUMER_READ 1
+#define PW_CONSUMER_MMAP 2
+static atomic_t pw_consumer_path = ATOMIC_INIT(PW_CONSUMER_NONE);
 
 
 /*
@@ -968,7 +977,6 @@ DECLARE_OVERHEAD_VARS(inter_common); // for "inter_common"
 DECLARE_OVERHEAD_VARS(irq_insert); // for "irq_insert"
 DECLARE_OVERHEAD_VARS(find_irq_node_i); // for "find_irq_node_i"
 DECLARE_OVERHEAD_VARS(wlock_insert); // for "wlock_insert"
-DECLARE_OVERHEAD_VARS(find_wlock_node_i); // for "find_wlock_node_i"
 DECLARE_OVERHEAD_VARS(sys_enter_helper_i);
 DECLARE_OVERHEAD_VARS(sys_exit_helper_i);
 
@@ -1064,10 +1072,13 @@ static inline void tscval(u64 *v)
 static void destroy_timer_map(void)
 {
     /*
-     * NOP: nothing to free here -- timer nodes
+     * Nothing to free here -- timer nodes
      * are freed when their corresponding
-     * (per-cpu) blocks are freed.
+     * (per-cpu) blocks are freed. We do need
+     * to wait for lock-free readers to finish
+     * before that happens, though.
      */
+    synchronize_rcu();
 };
 
 static int init_timer_map(void)
@@ -1075,7 +1086,7 @@ static int init_timer_map(void)
     int i=0;
 
     for(i=0; i<NUM_MAP_BUCKETS; ++i){
-        INIT_HLIST_HEAD(&timer_map[i].head);
+        INIT_HLIST_NULLS_HEAD(&timer_map[i], i);
     }
 
     for (i=0; i<NUM_HASH_LOCKS; ++i) {
@@ -1085,63 +1096,6 @@ static int init_timer_map(void)
     return SUCCESS;
 };
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-
-static int init_wlock_map(void)
-{
-    int i=0;
-
-    for(i=0; i<NUM_WLOCK_MAP_BUCKETS; ++i){
-        INIT_HLIST_HEAD(&wlock_map[i].head);
-    }
-
-    /*
-     * Init locks
-     */
-    for(i=0; i<NUM_HASH_LOCKS; ++i){
-        spin_lock_init(&wlock_map_locks[i]);
-    }
-
-    total_num_wlock_mappings = 0;
-
-    return SUCCESS;
-};
-
-static void wlock_destroy_node(struct wlock_node *node)
-{
-    if(node->wakelock_name){
-	pw_kfree(node->wakelock_name);
-	node->wakelock_name = NULL;
-    }
-    pw_kfree(node);
-};
-
-static void wlock_destroy_callback(struct rcu_head *head)
-{
-    struct wlock_node *node = container_of(head, struct wlock_node, rcu);
-
-    if (node) {
-        wlock_destroy_node(node);
-    }
-};
-
-static void destroy_wlock_map(void)
-{
-    int i=0;
-
-    for(i=0; i<NUM_WLOCK_MAP_BUCKETS; ++i){
-        struct hlist_head *head = &wlock_map[i].head;
-        while(!hlist_empty(head)){
-            struct wlock_node *node = hlist_entry(head->first, struct wlock_node, list);
-            hlist_del(&node->list);
-            wlock_destroy_callback(&node->rcu);
-        }
-    }
-    total_num_wlock_mappings  = 0;
-};
-
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-
 #if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 
 static int init_irq_map(void)
@@ -1172,10 +1126,6 @@ static void irq_destroy_callback(struct rcu_head *head)
         return;
     }
    
-    if(node->name){
-	pw_kfree(node->name);
-	node->name = NULL;
-    }
     if (node->cpu_bitmap) {
         pw_kfree(node->cpu_bitmap);
         node->cpu_bitmap = NULL;
@@ -1213,20 +1163,11 @@ static void free_timer_block(tblock_t *block)
     while (block) {
         tblock_t *next = block->next;
         if (block->data) {
-            int i=0;
-            for (i=0; i<NUM_TIMER_NODES_PER_BLOCK; ++i) {
-                /*
-                 * Check trace, just to be sure
-                 * (We shouldn't need this -- 'timer_destroy()'
-                 * explicitly checks and frees call trace
-                 * arrays).
-                 */
-                if (block->data[i].trace) {
-                    pw_kfree(block->data[i].trace);
-                }
-            }
             pw_kfree(block->data);
         }
+        if (block->traces) {
+            pw_kfree(block->traces);
+        }
         pw_kfree(block);
         block = next;
     }
@@ -1245,6 +1186,23 @@ static tblock_t *allocate_new_timer_block(struct hnode *free_head)
 	return NULL;
     }
     memset(block->data, 0, sizeof(tnode_t) * NUM_TIMER_NODES_PER_BLOCK);
+    /*
+     * Backtraces are stored in fixed, per-node slots
+     * allocated along with the nodes -- no allocations
+     * when a timer is inserted.
+     */
+    block->traces = pw_kmalloc(sizeof(unsigned long) * MAX_BACKTRACE_LENGTH * NUM_TIMER_NODES_PER_BLOCK, GFP_ATOMIC);
+    if(!block->traces){
+	pw_kfree(block->data);
+	pw_kfree(block);
+	return NULL;
+    }
+    {
+	int i=0;
+	for(i=0; i<NUM_TIMER_NODES_PER_BLOCK; ++i){
+	    block->data[i].trace = &block->traces[i * MAX_BACKTRACE_LENGTH];
+	}
+    }
     if(free_head){
 	LINK_FREE_TNODE_ENTRIES(block->data, NUM_TIMER_NODES_PER_BLOCK, free_head);
     }
@@ -1361,6 +1319,9 @@ static void pw_reset_msr_info_sets(void)
             if (likely(info_set->c_multi_msg_mem)) {
                 pw_kfree(info_set->c_multi_msg_mem);
             }
+            if (likely(info_set->compact_base)) {
+                pw_kfree(info_set->compact_base);
+            }
             memset(info_set, 0, sizeof(*info_set));
         }
     }
@@ -1394,14 +1355,12 @@ static void pw_destroy_data_structures(void)
 
     destroy_per_cpu_timer_blocks();
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-    destroy_wlock_map();
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-
 #if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
     destroy_irq_map();
 #endif // DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 
+    pw_destroy_string_table();
+
 
     destroy_sys_list();
 
@@ -1443,21 +1402,19 @@ static int pw_init_data_structures(void)
         return -ERROR;
     }
 
-#if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
-    if(init_irq_map()){
-        pw_pr_error("ERROR: could NOT initialize irq map!\n");
+    if (pw_init_string_table()) {
+        pw_pr_error("ERROR: could NOT initialize the string table!\n");
         pw_destroy_data_structures();
         return -ERROR;
     }
-#endif // DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-    if (init_wlock_map()) {
-        pw_pr_error("ERROR: could NOT initialize wlock map!\n");
+#if DO_CACHE_IRQ_DEV_NAME_MAPPINGS
+    if(init_irq_map()){
+        pw_pr_error("ERROR: could NOT initialize irq map!\n");
         pw_destroy_data_structures();
         return -ERROR;
     }
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
+#endif // DO_CACHE_IRQ_DEV_NAME_MAPPINGS
 
     if (init_sys_list()) {
         pw_pr_error("ERROR: could NOT initialize syscall map!\n");
@@ -1480,6 +1437,22 @@ static int pw_init_data_structures(void)
     return SUCCESS;
 };
 
+/*
+ * Bracket every write to a node that is, or may still be seen
+ * as, part of the timer map. Caller holds the hash lock.
+ */
+static inline void tnode_write_begin_i(tnode_t *node)
+{
+    node->gen++;
+    smp_wmb();
+};
+
+static inline void tnode_write_end_i(tnode_t *node)
+{
+    smp_wmb();
+    node->gen++;
+};
+
 /*
  * Free list manipulation routines.
  */
@@ -1491,11 +1464,11 @@ static int init_tnode_i(tnode_t *node, unsigned long timer_addr, pid_t tid, pid_
         return -ERROR;
     }
 
-    if(node->trace){
-        pw_kfree(node->trace);
-        node->trace = NULL;
+    if(trace_len > MAX_BACKTRACE_LENGTH){
+        trace_len = MAX_BACKTRACE_LENGTH;
     }
 
+    tnode_write_begin_i(node);
     node->timer_addr = timer_addr; node->tsc = tsc; node->tid = tid; node->pid = pid; node->init_cpu = init_cpu; node->trace_sent = 0; node->trace_len = trace_len;
 
     if(trace_len >  0){
@@ -1503,14 +1476,9 @@ static int init_tnode_i(tnode_t *node, unsigned long timer_addr, pid_t tid, pid_
          * Root timer!
          */
         node->is_root_timer = 1;
-        node->trace = pw_kmalloc(sizeof(unsigned long) * trace_len, GFP_ATOMIC);
-        if(!node->trace){
-            pw_pr_error("ERROR: could NOT allocate memory for backtrace!\n");
-            // pw_kfree(node);
-            return -ERROR;
-        }
         memcpy(node->trace, trace, sizeof(unsigned long) * trace_len); // dst, src
     }
+    tnode_write_end_i(node);
 
     /*
      * Ensure everyone sees this...
@@ -1538,25 +1506,7 @@ static tnode_t *get_next_free_tnode_i(unsigned long timer_addr, pid_t tid, pid_t
     if(!hlist_empty(head)){
 	struct tnode *node = hlist_entry(head->first, struct tnode, list);
 	hlist_del(&node->list);
-	/*
-	 * 'kmalloc' doesn't zero out memory -- set
-	 * 'trace' to NULL to avoid an invalid
-	 * 'free' in 'init_tnode_i(...)' just to
-	 * be sure (Shouldn't need to have to 
-	 * do this -- 'destroy_timer()' *should*
-	 * have handled it for us).
-	 */
-	node->trace = NULL;
-
-	if(init_tnode_i(node, timer_addr, tid, pid, tsc, init_cpu, trace_len, trace)){
-	    /*
-	     * Backtrace couldn't be inited -- re-enqueue
-	     * onto the free-list.
-	     */
-	    node->trace = NULL;
-	    hlist_add_head(&node->list, head);
-	    return NULL;
-	}
+	init_tnode_i(node, timer_addr, tid, pid, tsc, init_cpu, trace_len, trace);
 	return node;
     }
     return NULL;
@@ -1564,64 +1514,119 @@ static tnode_t *get_next_free_tnode_i(unsigned long timer_addr, pid_t tid, pid_t
 
 static void timer_destroy(struct tnode *node)
 {
-    per_cpu_mem_t *pcpu_mem = GET_MY_MEM_VARS();
-    struct hnode *free_head = &pcpu_mem->free_list_head;
-    
+    per_cpu_mem_t *pcpu_mem = NULL;
+    unsigned long flags;
+
     if (!node) {
         return;
     }
 
     OUTPUT(3, KERN_INFO "DESTROYING %p\n", node);
 
-    if(node->trace){
-	pw_kfree(node->trace);
-	node->trace = NULL;
+    /*
+     * The free list is only ever touched by its own
+     * cpu -- keep irqs (and migration) off while
+     * we push onto it.
+     */
+    local_irq_save(flags);
+    {
+        pcpu_mem = GET_MY_MEM_VARS();
+        hlist_add_head(&node->list, &pcpu_mem->free_list_head.head);
     }
-
-    hlist_add_head(&node->list, &((free_head)->head));
+    local_irq_restore(flags);
 };
 
 /*
  * Hash map routines.
  */
 
-static tnode_t *timer_find(unsigned long timer_addr, pid_t tid)
+/*
+ * Take a node out of the map. Clearing the key tells
+ * 'timer_find()' the node is no longer the timer it was
+ * looking for, even once it has been reused.
+ * Caller holds the hash lock.
+ */
+static inline void timer_unhash_i(tnode_t *node)
+{
+    tnode_write_begin_i(node);
+    hlist_nulls_del_rcu(&node->hash_list);
+    node->timer_addr = 0;
+    tnode_write_end_i(node);
+};
+
+/*
+ * Look a timer up. Nodes are recycled without a grace period,
+ * so a lock-free hit is only trusted if the node's 'gen' was
+ * even, and unchanged, around the copy of its fields. A node
+ * caught being rewritten is looked up again under the hash lock.
+ */
+static bool timer_find(unsigned long timer_addr, pid_t tid, tnode_t *entry)
 {
     int idx = TIMER_HASH_FUNC(timer_addr);
-    tnode_t *node = NULL, *retVal = NULL;
-    struct hlist_node *curr = NULL;
-    struct hlist_head *head = NULL;
+    tnode_t *node = NULL;
+    tnode_t copy;
+    struct hlist_nulls_node *curr = NULL;
+    unsigned int gen = 0;
+    bool found = false, busy = false;
 
-    HASH_LOCK(idx);
+    rcu_read_lock();
     {
-	head = &timer_map[idx].head;
+again:
+        hlist_nulls_for_each_entry_rcu(node, curr, &timer_map[idx], hash_list) {
+            gen = ACCESS_ONCE(node->gen);
+            smp_rmb();
+            if(node->timer_addr == timer_addr && (node->tid == tid || tid < 0)){
+                copy = *node;
+                smp_rmb();
+                if ((gen & 1) || ACCESS_ONCE(node->gen) != gen) {
+                    busy = true;
+                } else {
+                    found = true;
+                }
+                break;
+            }
+        }
+        /*
+         * We may have been moved to a different
+         * bucket by a concurrent delete + insert.
+         */
+        if (!found && !busy && get_nulls_value(curr) != idx) {
+            goto again;
+        }
+    }
+    rcu_read_unlock();
 
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, head, list) {
-	    if(node->timer_addr == timer_addr && (node->tid == tid || tid < 0)){
-		retVal = node;
-		break;
-	    }
-	}
+    if (busy) {
+        HASH_LOCK(idx);
+        {
+            hlist_nulls_for_each_entry(node, curr, &timer_map[idx], hash_list) {
+                if(node->timer_addr == timer_addr && (node->tid == tid || tid < 0)){
+                    copy = *node;
+                    found = true;
+                    break;
+                }
+            }
+        }
+        HASH_UNLOCK(idx);
+    }
+    if (found && entry) {
+        *entry = copy;
     }
-    HASH_UNLOCK(idx);
 
-    return retVal;
+    return found;
 };
 
 
 static void timer_insert(unsigned long timer_addr, pid_t tid, pid_t pid, u64 tsc, s32 init_cpu, int trace_len, unsigned long *trace)
 {
     int idx = TIMER_HASH_FUNC(timer_addr);
-    struct hlist_node *curr = NULL;
-    struct hlist_head *head = NULL;
+    struct hlist_nulls_node *curr = NULL;
     struct tnode *node = NULL, *new_node = NULL;
     bool found = false;
 
     HASH_LOCK(idx);
     {
-        head = &timer_map[idx].head;
-
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, head, list) {
+        hlist_nulls_for_each_entry(node, curr, &timer_map[idx], hash_list) {
             if(node->timer_addr == timer_addr){
                 /*
                  * Update-in-place.
@@ -1639,7 +1644,7 @@ static void timer_insert(unsigned long timer_addr, pid_t tid, pid_t pid, u64 tsc
              */
 	    new_node = get_next_free_tnode_i(timer_addr, tid, pid, tsc, init_cpu, trace_len, trace);
             if(likely(new_node)){
-                hlist_add_head(&new_node->list, &timer_map[idx].head);
+                hlist_nulls_add_head_rcu(&new_node->hash_list, &timer_map[idx]);
 #if DO_OVERHEAD_MEASUREMENTS
                 {
                     smp_mb();
@@ -1660,21 +1665,18 @@ static int timer_delete(unsigned long timer_addr, pid_t tid)
 {
     int idx = TIMER_HASH_FUNC(timer_addr);
     tnode_t *node = NULL, *found_node = NULL;
-    struct hlist_node *curr = NULL, *next = NULL;
-    struct hlist_head *head = NULL;
+    struct hlist_nulls_node *curr = NULL;
     int retVal = -ERROR;
 
     HASH_LOCK(idx);
     {
-	head = &timer_map[idx].head;
-
-        PW_HLIST_FOR_EACH_ENTRY_SAFE(node, curr, next, head, list) {
+        hlist_nulls_for_each_entry(node, curr, &timer_map[idx], hash_list) {
 	    // if(node->timer_addr == timer_addr && node->tid == tid){
             if(node->timer_addr == timer_addr) {
                 if (node->tid != tid){
                     OUTPUT(0, KERN_INFO "WARNING: stale timer tid value? node tid = %d, task tid = %d\n", node->tid, tid);
 		}
-		hlist_del(&node->list);
+		timer_unhash_i(node);
 		found_node = node;
 		retVal = SUCCESS;
 		OUTPUT(3, KERN_INFO "[%d]: TIMER_DELETE FOUND HRT = %p\n", tid, (void *)timer_addr);
@@ -1694,18 +1696,18 @@ static int timer_delete(unsigned long timer_addr, pid_t tid)
 static void delete_all_non_kernel_timers(void)
 {
     struct tnode *node = NULL;
-    struct hlist_node *curr = NULL, *next = NULL;
+    struct hlist_nulls_node *curr = NULL, *next = NULL;
     int i=0, num_timers = 0;
 
     for(i=0; i<NUM_MAP_BUCKETS; ++i)
 	{
 	    HASH_LOCK(i);
 	    {
-                PW_HLIST_FOR_EACH_ENTRY_SAFE(node, curr, next, &timer_map[i].head, list) {
+                PW_HLIST_NULLS_FOR_EACH_ENTRY_SAFE(node, curr, next, &timer_map[i], hash_list) {
                     if (node->is_root_timer == 0) {
 			++num_timers;
 			OUTPUT(3, KERN_INFO "[%d]: Timer %p (Node %p) has TRACE = %p\n", node->tid, (void *)node->timer_addr, node, node->trace);
-			hlist_del(&node->list);
+			timer_unhash_i(node);
 			timer_destroy(node);
 		    }
 		}
@@ -1718,18 +1720,18 @@ static void delete_all_non_kernel_timers(void)
 static void delete_timers_for_tid(pid_t tid)
 {
     struct tnode *node = NULL;
-    struct hlist_node *curr = NULL, *next = NULL;
+    struct hlist_nulls_node *curr = NULL, *next = NULL;
     int i=0, num_timers = 0;
 
     for(i=0; i<NUM_MAP_BUCKETS; ++i)
 	{
 	    HASH_LOCK(i);
 	    {
-                PW_HLIST_FOR_EACH_ENTRY_SAFE(node, curr, next, &timer_map[i].head, list) {
+                PW_HLIST_NULLS_FOR_EACH_ENTRY_SAFE(node, curr, next, &timer_map[i], hash_list) {
 		    if(node->is_root_timer == 0 && node->tid == tid){
 			++num_timers;
 			OUTPUT(3, KERN_INFO "[%d]: Timer %p (Node %p) has TRACE = %p\n", tid, (void *)node->timer_addr, node, node->trace);
-			hlist_del(&node->list);
+			timer_unhash_i(node);
 			timer_destroy(node);
 		    }
 		}
@@ -1743,12 +1745,12 @@ static void delete_timers_for_tid(pid_t tid)
 static int get_num_timers(void)
 {
     tnode_t *node = NULL;
-    struct hlist_node *curr = NULL;
+    struct hlist_nulls_node *curr = NULL;
     int i=0, num=0;
 
 
     for (i=0; i<NUM_MAP_BUCKETS; ++i) {
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, &timer_map[i].head, list) {
+        hlist_nulls_for_each_entry(node, curr, &timer_map[i], hash_list) {
 	    ++num;
 	    OUTPUT(3, KERN_INFO "[%d]: %d --> %p\n", i, node->tid, (void *)node->timer_addr);
 	}
@@ -1760,166 +1762,26 @@ static int get_num_timers(void)
 #if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
 
 #if DO_WAKELOCK_SAMPLE 
-static unsigned long pw_hash_string(const char *data)
-{
-    unsigned long hash = 0;
-    unsigned char c;
-    char *str = (char *)data;
-
-    BUG_ON(!data);
-
-    while ((c = *str++)) {
-        hash = c + (hash << 6) + (hash << 16) - hash;
-    }
-    return hash;
-};
-
-static wlock_node_t *get_next_free_wlock_node_i(unsigned long hash, size_t wlock_name_len, const char *wlock_name)
-{
-    wlock_node_t *node = pw_kmalloc(sizeof(wlock_node_t), GFP_ATOMIC);
-
-    if (likely(node)) {
-	memset(node, 0, sizeof(wlock_node_t));
-	node->hash_val = hash;
-
-	INIT_HLIST_NODE(&node->list);
-
-	if( !(node->wakelock_name = pw_kstrdup(wlock_name, GFP_ATOMIC))){
-	    pw_pr_error("ERROR: could NOT kstrdup wlock device name: %s\n", wlock_name);
-	    pw_kfree(node);
-	    node = NULL;
-	} else {
-            node->wakelock_name_len = wlock_name_len;
-        }
-    } else {
-	pw_pr_error("ERROR: could NOT allocate new wlock node!\n");
-    }
-
-    return node;
-};
-
 /*
- * Check if the given wlock # <-> DEV Name mapping exists and, if
- * it does, whether this mapping was sent for the given 'cpu'
- * (We need to send each such mapping ONCE PER CPU to ensure it is
- * received BEFORE a corresponding wlock C-state wakeup).
+ * Map a wakelock name to its constant pool index. Kernel wakelock names
+ * live in the (preallocated) string table, so this never allocates.
  */
-static int find_wlock_node_i(unsigned long hash, size_t wlock_name_len, const char *wlock_name)
-{
-    wlock_node_t *node = NULL;
-    struct hlist_node *curr = NULL;
-    int idx = hash & WLOCK_MAP_HASH_MASK;
-    int cp_index = -1;
-
-    rcu_read_lock();
-    {
-        PW_HLIST_FOR_EACH_ENTRY_RCU (node, curr, &wlock_map[idx].head, list) {
-            //printk(KERN_INFO "hash_val = %lu, name = %s, cp_index = %d\n", node->hash_val, node->wakelock_name, node->constant_pool_index);
-            if (node->hash_val == hash && node->wakelock_name_len == wlock_name_len && !strcmp(node->wakelock_name, wlock_name)) {
-                cp_index = node->constant_pool_index;
-                break;
-            }
-        }
-    }
-    rcu_read_unlock();
-
-    return cp_index;
-};
-
 static pw_mapping_type_t wlock_insert(size_t wlock_name_len, const char *wlock_name, int *cp_index)
 {
-    wlock_node_t *node = NULL;
-    unsigned long hash = WLOCK_MAP_HASH_FUNC(wlock_name);
-    pw_mapping_type_t retVal = PW_MAPPING_ERROR;
+    bool is_new = false;
 
     if (!wlock_name || !cp_index) {
         pw_pr_error("ERROR: NULL name/index?!\n");
         return PW_MAPPING_ERROR;
     }
 
-    *cp_index = find_wlock_node_i(hash, wlock_name_len, wlock_name);
-
-    //printk(KERN_INFO "wlock_insert: cp_index = %d, name = %s\n", *cp_index, wlock_name);
-
-    if (*cp_index >= 0) {
-        /*
-         * Mapping FOUND!
-         */
-        //printk(KERN_INFO "OK: mapping already exists for %s (cp_index = %d)\n", wlock_name, *cp_index);
-        return PW_MAPPING_EXISTS;
-    }
-
-    node = get_next_free_wlock_node_i(hash, wlock_name_len, wlock_name);
-
-    if (unlikely(node == NULL)) {
-	pw_pr_error("ERROR: could NOT allocate node for wlock insertion!\n");
-	return PW_MAPPING_ERROR;
-    }
-
-    WLOCK_LOCK(hash);
-    {
-        int idx = hash & WLOCK_MAP_HASH_MASK;
-        wlock_node_t *old_node = NULL;
-        struct hlist_node *curr = NULL;
-        /*
-         * It is THEORETICALLY possible that the same wakelock name was passed to 'acquire' twice and that
-         * a different process inserted an entry into the wakelock after our check and before we could insert
-         * (i.e. a race condition). Check for that first.
-         */
-        PW_HLIST_FOR_EACH_ENTRY(old_node, curr, &wlock_map[idx].head, list) {
-            if (old_node->hash_val == hash && old_node->wakelock_name_len == wlock_name_len && !strcmp(old_node->wakelock_name, wlock_name)) {
-                *cp_index = old_node->constant_pool_index;
-                //printk(KERN_INFO "wlock mapping EXISTS: cp_index = %d, name = %s\n", *cp_index, wlock_name);
-                break;
-            }
-        }
-        if (likely(*cp_index < 0)) {
-            /*
-             * OK: insert a new node.
-             */
-            *cp_index = node->constant_pool_index = GET_NEXT_CONSTANT_POOL_INDEX();
-	    hlist_add_head_rcu(&node->list, &wlock_map[idx].head);
-            retVal = PW_NEW_MAPPING_CREATED;
-            //printk(KERN_INFO "CREATED new wlock mapping: cp_index = %d, name = %s\n", *cp_index, wlock_name);
-        } else {
-            /*
-             * Hmnnn ... a race condition. Warn because this is very unlikely!
-             */
-            //printk(KERN_INFO "WARNING: race condition detected for wlock insert for node %s\n", wlock_name);
-            wlock_destroy_node(node);
-            retVal = PW_MAPPING_EXISTS;
-        }
+    *cp_index = pw_intern_string(wlock_name, wlock_name_len, PW_STR_WAKELOCK, &is_new);
+    if (unlikely(*cp_index < 0)) {
+        return PW_MAPPING_ERROR;
     }
-    WLOCK_UNLOCK(hash);
-
-    return retVal;
+    return is_new ? PW_NEW_MAPPING_CREATED : PW_MAPPING_EXISTS;
 };
 #endif // DO_WAKELOCK_SAMPLE
-
-/*
- * INTERNAL HELPER: retrieve number of
- * mappings in the wlock mappings list.
- */
-#if 0
-#ifndef __arm__
-static int get_num_wlock_mappings(void)
-{
-    int retVal = 0;
-    int i=0;
-    wlock_node_t *node = NULL;
-    struct hlist_node *curr = NULL;
-
-    for(i=0; i<NUM_WLOCK_MAP_BUCKETS; ++i)
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, &wlock_map[i].head, list) {
-	    ++retVal;
-	    OUTPUT(0, KERN_INFO "[%d]: wlock Num=%d, Dev=%s\n", i, node->wlock, node->name);
-	}
-
-    return retVal;
-
-};
-#endif // __arm__
-#endif // 0
 #endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
 
 /*
@@ -1949,12 +1811,17 @@ static irq_node_t *get_next_free_irq_node_i(int cpu, int irq_num, const char *ir
 
 	INIT_HLIST_NODE(&node->list);
 
-	if( !(node->name = pw_kstrdup(irq_name, GFP_ATOMIC))){
-	    pw_pr_error("ERROR: could NOT kstrdup irq device name: %s\n", irq_name);
-            pw_kfree(node->cpu_bitmap);
-	    pw_kfree(node);
-	    node = NULL;
-	}
+        {
+            bool is_new = false;
+            int id = pw_intern_string(irq_name, strlen(irq_name), PW_STR_IRQ, &is_new);
+            if (unlikely(id < 0)) {
+                pw_pr_error("ERROR: could NOT intern irq device name: %s\n", irq_name);
+                pw_kfree(node->cpu_bitmap);
+                pw_kfree(node);
+                return NULL;
+            }
+            node->name = pw_get_interned_string(id);
+        }
     } else {
 	pw_pr_error("ERROR: could NOT allocate new irq node!\n");
     }
@@ -2520,8 +2387,8 @@ static inline void produce_boundary_s_residency_msg_i(bool is_begin_boundary)
  */
 static inline void produce_w_sample(int cpu, u64 tsc, w_sample_type_t type, pid_t tid, pid_t pid, const char *wlname, const char *pname, u64 timeout)
 {
-    PWCollector_msg_t sample;
-    w_wakelock_msg_t w_msg;
+    pw_msg_reservation_t res;
+    w_wakelock_msg_t *w_msg = NULL;
     int cp_index = -1;
     size_t len = strlen(wlname);
     size_t msg_len = 0;
@@ -2529,73 +2396,38 @@ static inline void produce_w_sample(int cpu, u64 tsc, w_sample_type_t type, pid_
 
     pw_mapping_type_t map_type = wlock_insert(len, wlname, &cp_index);
 
-    sample.cpuidx = cpu;
-
     if (unlikely(map_type == PW_MAPPING_ERROR)) {
         printk(KERN_INFO "ERROR: could NOT insert wlname = %s into constant pool!\n", wlname);
         return;
     }
-    /*
-     * Preallocate any memory we might need, BEFORE disabling interrupts!
-     */
     if (unlikely(map_type == PW_NEW_MAPPING_CREATED)) {
+        /*
+         * We've inserted a new entry into our kernel wakelock constant pool. Tell wuwatch
+         * about it. The entry is written straight into the output buffer.
+         */
         msg_len = PW_CONSTANT_POOL_MSG_HEADER_SIZE + len + 1;
-        cp_msg = pw_kmalloc(msg_len, GFP_ATOMIC);
-        if (unlikely(cp_msg == NULL)) {
-            /*
-             * Hmnnnnn ... we'll need to destroy the newly created node. For now, don't handle this!!!
-             * TODO: handle this case!
-             */
-            printk(KERN_INFO "ERROR: could NOT allocate a new node for a constant-pool mapping: WILL LEAK MEMORY and THIS MAPPING WILL BE MISSING FROM YOUR END RESULTS!");
-            return;
-        }
-    }
-    // get_cpu();
-    {
-        if (unlikely(map_type == PW_NEW_MAPPING_CREATED)) {
-            /*
-             * We've inserted a new entry into our kernel wakelock constant pool. Tell wuwatch
-             * about it.
-             */
+        cp_msg = pw_reserve_msg(tsc, cpu, CONSTANT_POOL_ENTRY, msg_len, &res);
+        if (likely(cp_msg)) {
             cp_msg->entry_type = W_STATE; // This is a KERNEL walock constant pool mapping
             cp_msg->entry_len = len;
             cp_msg->entry_index = cp_index;
             memcpy(cp_msg->entry, wlname, len+1);
-
-            sample.tsc = tsc;
-            sample.data_type = CONSTANT_POOL_ENTRY;
-            sample.data_len = msg_len;
-            sample.p_data = (u64)((unsigned long)cp_msg);
-
-            pw_produce_generic_msg(&sample, false); // "false" ==> do NOT wakeup any sleeping readers
         }
-        /*
-         * OK, now send the actual wakelock sample.
-         */
-        w_msg.type = type;
-        w_msg.expires = timeout;
-        w_msg.tid = tid;
-        w_msg.pid = pid;
-        w_msg.constant_pool_index = cp_index;
-        // memcpy(w_msg.proc_name, pname, PW_MAX_PROC_NAME_SIZE); // process name
-        strncpy(w_msg.proc_name, pname, PW_MAX_PROC_NAME_SIZE); // process name
-
-        sample.tsc = tsc;
-        sample.data_type = W_STATE;
-        sample.data_len = sizeof(w_msg);
-        sample.p_data = (u64)(unsigned long)&w_msg;
-        /*
-         * OK, everything computed. Now copy
-         * this sample into an output buffer
-         */
-        pw_produce_generic_msg(&sample, false); // "false" ==> do NOT wakeup any sleeping readers
+        pw_commit_msg(&res, false); // "false" ==> do NOT wakeup any sleeping readers
     }
-    // put_cpu();
-
-    if (unlikely(cp_msg)) {
-        //printk(KERN_INFO "OK: sent wakelock mapping: cp_index = %d, name = %s\n", cp_index, wlname);
-        pw_kfree(cp_msg);
+    /*
+     * OK, now send the actual wakelock sample.
+     */
+    w_msg = pw_reserve_msg(tsc, cpu, W_STATE, sizeof(*w_msg), &res);
+    if (likely(w_msg)) {
+        w_msg->type = type;
+        w_msg->expires = timeout;
+        w_msg->tid = tid;
+        w_msg->pid = pid;
+        w_msg->constant_pool_index = cp_index;
+        strncpy(w_msg->proc_name, pname, PW_MAX_PROC_NAME_SIZE); // process name
     }
+    pw_commit_msg(&res, false); // "false" ==> do NOT wakeup any sleeping readers
     //printk(KERN_INFO "OK: sent wakelock msg for wlname = %s\n", wlname);
     return;
 };
@@ -2603,34 +2435,218 @@ static inline void produce_w_sample(int cpu, u64 tsc, w_sample_type_t type, pid_
 
 
 /*
- * Insert a P-state transition sample into a (per-cpu) output buffer.
+ * Helpers for the compact (delta + varint) C/P-state encodings.
+ * See the 'PW_COMPACT_' comment in "pw_structs.h" for the format.
  */
-static inline void produce_p_sample(int cpu, unsigned long long tsc, u32 req_freq, u32 perf_status, u8 is_boundary_sample, u64 aperf, u64 mperf)
+/*
+ * Emit a keyframe at least this often, per-cpu.
+ */
+#define PW_COMPACT_KEYFRAME_INTERVAL 64
+/*
+ * We encode C-state samples on the stack; samples with more
+ * MSRs than this use the regular format.
+ */
+#define PW_COMPACT_MAX_CX 16
+/*
+ * Worst case: 4 bytes of flags etc., 7 varints (epoch, mperf and the
+ * wakeup fields) and 'PW_COMPACT_MAX_CX' x {id, varint}.
+ */
+#define PW_COMPACT_MAX_VARINT_LEN 10
+#define PW_COMPACT_C_BUF_SIZE (4 + 7 * PW_COMPACT_MAX_VARINT_LEN + PW_COMPACT_MAX_CX * (sizeof(pw_msr_identifier_t) + PW_COMPACT_MAX_VARINT_LEN))
+#define PW_COMPACT_P_BUF_SIZE (1 + 4 * PW_COMPACT_MAX_VARINT_LEN)
+
+#define PW_ZIGZAG(v) ( ((u64)(s64)(v) << 1) ^ (u64)((s64)(v) >> 63) )
+
+/*
+ * Write 'val' as an LEB128 varint; returns the number of bytes written.
+ */
+static inline int pw_put_varint_i(u8 *dst, u64 val)
 {
-    struct PWCollector_msg sample;
-    p_msg_t p_msg;
+    int len = 0;
+    while (val >= 0x80) {
+        dst[len++] = (u8)(val | 0x80);
+        val >>= 7;
+    }
+    dst[len++] = (u8)val;
+    return len;
+};
 
-    sample.cpuidx = cpu;
-    sample.tsc = tsc;
+static inline bool pw_msr_ids_equal_i(const pw_msr_identifier_t *a, const pw_msr_identifier_t *b)
+{
+    return a->type == b->type && a->subtype == b->subtype && a->depth == b->depth;
+};
+
+/*
+ * Copy an encoded compact sample into a (per-cpu) output buffer.
+ * Returns false if the sample was dropped.
+ */
+static inline bool pw_produce_compact_msg_i(int cpu, u64 tsc, u8 data_type, const u8 *data, u16 data_len)
+{
+    pw_msg_reservation_t res;
+    void *dst = pw_reserve_msg(tsc, cpu, data_type, data_len, &res);
+    if (likely(dst)) {
+        memcpy(dst, data, data_len);
+    }
+    pw_commit_msg(&res, true); // "true" ==> wakeup sleeping readers, if required
+    return dst != NULL;
+};
+
+/*
+ * Insert a C_STATE_COMPACT sample into a (per-cpu) output buffer.
+ * Returns false if the sample could not be encoded compactly (the
+ * caller should then send a regular C_STATE sample).
+ * Must be called on 'cpu'.
+ */
+static bool produce_compact_c_sample_i(int cpu, u64 tsc, pw_msr_info_set_t *info_set, u8 req_state, int num_cx, u64 mperf, u32 epoch,
+                                       u64 event_tsc, u64 event_val, s32 event_init_cpu, pid_t event_pid, pid_t event_tid, u8 event_type)
+{
+    u8 buf[PW_COMPACT_C_BUF_SIZE];
+    u8 *ptr = buf + 4;
+    u8 flags = 0;
+    const pw_msr_val_t *msr_vals = &info_set->curr_msr_count[1]; // 'curr_msr_count[0]' is MPERF
+    int i = 0, j = 0;
+    unsigned long irq_flags;
+
+    if (unlikely(num_cx < 0 || num_cx > PW_COMPACT_MAX_CX || !info_set->compact_base)) {
+        return false;
+    }
+
+    local_irq_save(irq_flags);
+    {
+        bool is_keyframe = info_set->compact_until_keyframe == 0;
+        if (is_keyframe) {
+            flags |= PW_COMPACT_KEYFRAME;
+            info_set->compact_mperf = 0;
+            memset(info_set->compact_base, 0, sizeof(u64) * info_set->num_msrs);
+        }
+        ptr += pw_put_varint_i(ptr, epoch);
+        ptr += pw_put_varint_i(ptr, mperf - info_set->compact_mperf);
+        if (event_tsc) {
+            flags |= PW_COMPACT_HAS_WAKEUP;
+            ptr += pw_put_varint_i(ptr, PW_ZIGZAG(tsc - event_tsc));
+            ptr += pw_put_varint_i(ptr, event_val);
+            ptr += pw_put_varint_i(ptr, PW_ZIGZAG(event_init_cpu));
+            ptr += pw_put_varint_i(ptr, PW_ZIGZAG(event_pid));
+            ptr += pw_put_varint_i(ptr, PW_ZIGZAG(event_tid));
+        }
+        for (i=0; i<num_cx; ++i) {
+            u64 base = 0;
+            for (j=0; j<info_set->num_msrs; ++j) {
+                if (pw_msr_ids_equal_i(&info_set->prev_msr_vals[j].id, &msr_vals[i].id)) {
+                    base = info_set->compact_base[j];
+                    break;
+                }
+            }
+            memcpy(ptr, &msr_vals[i].id, sizeof(pw_msr_identifier_t));
+            ptr += sizeof(pw_msr_identifier_t);
+            ptr += pw_put_varint_i(ptr, msr_vals[i].val - base);
+        }
+        buf[0] = flags;
+        buf[1] = req_state;
+        buf[2] = event_type;
+        buf[3] = (u8)num_cx;
+
+        if (likely(pw_produce_compact_msg_i(cpu, tsc, C_STATE_COMPACT, buf, (u16)(ptr - buf)))) {
+            /*
+             * Ring-3 saw this sample: advance the baselines.
+             */
+            info_set->compact_mperf = mperf;
+            for (i=0; i<num_cx; ++i) {
+                for (j=0; j<info_set->num_msrs; ++j) {
+                    if (pw_msr_ids_equal_i(&info_set->prev_msr_vals[j].id, &msr_vals[i].id)) {
+                        info_set->compact_base[j] = msr_vals[i].val;
+                        break;
+                    }
+                }
+            }
+            info_set->compact_until_keyframe = is_keyframe ? (PW_COMPACT_KEYFRAME_INTERVAL - 1) : (info_set->compact_until_keyframe - 1);
+        } else {
+            /*
+             * Dropped: Ring-3 can only resync off a keyframe.
+             */
+            info_set->compact_until_keyframe = 0;
+        }
+    }
+    local_irq_restore(irq_flags);
+    return true;
+};
 
-    p_msg.unhalted_core_value = aperf;
-    p_msg.unhalted_ref_value = mperf;
+/*
+ * Insert a P_STATE_COMPACT sample into a (per-cpu) output buffer.
+ * Returns false if the sample is for another cpu: the delta state
+ * and the output buffer of 'cpu' belong to that cpu, so the caller
+ * should then send a regular P_STATE sample.
+ */
+static inline bool produce_compact_p_sample_i(int cpu, u64 tsc, u32 req_freq, u32 perf_status, u8 is_boundary_sample, u64 aperf, u64 mperf)
+{
+    u8 buf[PW_COMPACT_P_BUF_SIZE];
+    u8 *ptr = buf + 1;
+    u8 flags = 0;
+    struct pw_compact_p_state *state = &per_cpu(pcpu_compact_p_state, cpu);
+    unsigned long irq_flags;
 
-    p_msg.prev_req_frequency = req_freq;
-    p_msg.perf_status_val = (u16)perf_status;
-    p_msg.is_boundary_sample = is_boundary_sample;
+    local_irq_save(irq_flags);
+    if (cpu != smp_processor_id()) {
+        local_irq_restore(irq_flags);
+        return false;
+    }
+    {
+        /*
+         * Boundary samples are always keyframes.
+         */
+        bool is_keyframe = is_boundary_sample || state->until_keyframe == 0;
+        if (is_keyframe) {
+            flags |= PW_COMPACT_KEYFRAME;
+            state->aperf = state->mperf = 0;
+        }
+        if (is_boundary_sample) {
+            flags |= PW_COMPACT_BOUNDARY;
+        }
+        buf[0] = flags;
+        ptr += pw_put_varint_i(ptr, req_freq);
+        ptr += pw_put_varint_i(ptr, (u16)perf_status);
+        ptr += pw_put_varint_i(ptr, aperf - state->aperf);
+        ptr += pw_put_varint_i(ptr, mperf - state->mperf);
+
+        if (likely(pw_produce_compact_msg_i(cpu, tsc, P_STATE_COMPACT, buf, (u16)(ptr - buf)))) {
+            state->aperf = aperf;
+            state->mperf = mperf;
+            state->until_keyframe = is_keyframe ? (PW_COMPACT_KEYFRAME_INTERVAL - 1) : (state->until_keyframe - 1);
+        } else {
+            state->until_keyframe = 0;
+        }
+    }
+    local_irq_restore(irq_flags);
+    return true;
+};
 
-    sample.data_type = P_STATE;
-    sample.data_len = sizeof(p_msg);
-    sample.p_data = (u64)((unsigned long)&p_msg);
+/*
+ * Insert a P-state transition sample into a (per-cpu) output buffer.
+ */
+static inline void produce_p_sample(int cpu, unsigned long long tsc, u32 req_freq, u32 perf_status, u8 is_boundary_sample, u64 aperf, u64 mperf)
+{
+    pw_msg_reservation_t res;
+    p_msg_t *p_msg = NULL;
 
     pw_pr_debug("DEBUG: TSC = %llu, req_freq = %u, perf-status = %u\n", tsc, req_freq, perf_status);
 
+    if (IS_COMPACT_MODE() && produce_compact_p_sample_i(cpu, tsc, req_freq, perf_status, is_boundary_sample, aperf, mperf)) {
+        return;
+    }
+
     /*
-     * OK, everything computed. Now copy
-     * this sample into an output buffer
+     * Write the sample directly into an output buffer.
      */
-    pw_produce_generic_msg(&sample, true); // "true" ==> wakeup sleeping readers, if required
+    p_msg = pw_reserve_msg(tsc, cpu, P_STATE, sizeof(*p_msg), &res);
+    if (likely(p_msg)) {
+        p_msg->unhalted_core_value = aperf;
+        p_msg->unhalted_ref_value = mperf;
+
+        p_msg->prev_req_frequency = req_freq;
+        p_msg->perf_status_val = (u16)perf_status;
+        p_msg->is_boundary_sample = is_boundary_sample;
+    }
+    pw_commit_msg(&res, true); // "true" ==> wakeup sleeping readers, if required
 };
 
 /*
@@ -2979,7 +2995,7 @@ static void probe_hrtimer_start(struct hrtimer *hrt)
 		/*
 		 * Debugging
 		 */
-		if(!timer_find((unsigned long)sched_timer_addr, tid)){
+		if(!timer_find((unsigned long)sched_timer_addr, tid, NULL)){
 		    pw_pr_error("ERROR: could NOT find timer %p in hrtimer_start!\n", sched_timer_addr);
 		}
 	    }
@@ -3057,7 +3073,7 @@ static void timer_expire(void *timer_addr, pid_t tid)
 {
     int cpu = -1;
     pid_t pid = -1;
-    tnode_t *entry = NULL;
+    tnode_t entry;
     u64 tsc = 0;
     bool found = false;
     bool was_hit = false;
@@ -3102,12 +3118,12 @@ static void timer_expire(void *timer_addr, pid_t tid)
 
     cpu = CPU();
 
-    if ( (entry = (tnode_t *)timer_find((unsigned long)timer_addr, tid))) {
-	pid = entry->pid;
-	tsc = entry->tsc;
-        init_cpu = entry->init_cpu;
+    if (timer_find((unsigned long)timer_addr, tid, &entry)) {
+	pid = entry.pid;
+	tsc = entry.tsc;
+        init_cpu = entry.init_cpu;
 	found = true;
-        is_root = entry->is_root_timer;
+        is_root = entry.is_root_timer;
     } else {
 	/*
 	 * Couldn't find timer entry -- PID defaults to TID.
@@ -3163,7 +3179,7 @@ static void timer_expire(void *timer_addr, pid_t tid)
 	 * then replace with entry->tid
 	 */
 	if(tid < 0){
-	    tid = entry->tid;
+	    tid = entry.tid;
 	}
     }
     /*
@@ -3260,7 +3276,7 @@ static void probe_hrtimer_expire_exit(struct hrtimer *hrt)
             }else{
                 OUTPUT(3, KERN_INFO "OK: DELETED timer mapping for HRT = %p, TID = %d, NAME = %.20s\n", hrt, TIMER_START_PID(hrt), TIMER_START_COMM(hrt));
                 // debugging ONLY!
-                if(timer_find((unsigned long)hrt, TIMER_START_PID(hrt))){
+                if(timer_find((unsigned long)hrt, TIMER_START_PID(hrt), NULL)){
                     OUTPUT(0, KERN_INFO "WARNING: TIMER_FIND reports TIMER %p STILL IN MAP!\n", hrt);
                 }
             }
@@ -3581,49 +3597,47 @@ static void tps_lite(bool is_boundary_sample)
      * Data collected. Now enqueue it.
      */
     {
-        c_multi_msg_t cm;
-        struct PWCollector_msg sample;
-
-        sample.cpuidx = cpu;
-        sample.tsc = tsc;
-
-#ifndef __arm__
-        cm.mperf = mperf;
-#else
-        // TODO
-        cm.mperf = c0_time;
-#endif
-
-        cm.req_state = (u8)APERF;
-
-
-        cm.wakeup_tsc = 0x0; // don't care
-        cm.wakeup_data = 0x0; // don't care
-        cm.timer_init_cpu = 0x0; // don't care
-        cm.wakeup_pid = -1; // don't care
-        cm.wakeup_tid = -1; // don't care
-        cm.wakeup_type = 0x0; // don't care
-        /*
-         * The only field of interest is the 'num_msrs' value.
-         */
-        cm.num_msrs = 0x0;
-
+        pw_msg_reservation_t res;
+        c_multi_msg_t *cm = NULL;
+        u32 epoch = 0;
 
 #if DO_TPS_EPOCH_COUNTER
         /*
          * We're entering a new TPS "epoch".
          * Increment our counter.
          */
-        cm.tps_epoch = inc_tps_epoch_i();
+        epoch = inc_tps_epoch_i();
 #endif // DO_TPS_EPOCH_COUNTER
 
-        sample.data_type = C_STATE;
-        sample.data_len = C_MULTI_MSG_HEADER_SIZE();
-        sample.p_data = (u64)((unsigned long)&cm);
+        if (!IS_COLLECTING() && !is_boundary_sample) {
+            return;
+        }
 
-        if (IS_COLLECTING() || is_boundary_sample) {
-            pw_produce_generic_msg(&sample, true);
+        cm = pw_reserve_msg(tsc, cpu, C_STATE, C_MULTI_MSG_HEADER_SIZE(), &res);
+        if (likely(cm)) {
+#ifndef __arm__
+            cm->mperf = mperf;
+#else
+            // TODO
+            cm->mperf = c0_time;
+#endif
+
+            cm->req_state = (u8)APERF;
+
+
+            cm->wakeup_tsc = 0x0; // don't care
+            cm->wakeup_data = 0x0; // don't care
+            cm->timer_init_cpu = 0x0; // don't care
+            cm->wakeup_pid = -1; // don't care
+            cm->wakeup_tid = -1; // don't care
+            cm->wakeup_type = 0x0; // don't care
+            /*
+             * The only field of interest is the 'num_msrs' value.
+             */
+            cm->num_msrs = 0x0;
+            cm->tps_epoch = epoch;
         }
+        pw_commit_msg(&res, true);
     }
 };
 
@@ -3936,39 +3950,12 @@ static void tps(unsigned int type, unsigned int state)
 
         /*
          * Send the actual TPS message here.
+         * The message is written directly into the output buffer.
          */
         {
-            c_multi_msg_t *cm = (c_multi_msg_t *)info_set->c_multi_msg_mem;
-            BUG_ON(!cm);
-
-            sample.cpuidx = cpu;
-            sample.tsc = tsc;
-
-            msr_vals = (pw_msr_val_t *)cm->data;
-
-#ifndef __arm__
-            cm->mperf = info_set->curr_msr_count[0].val;
-#else
-            // TODO
-            cm->mperf = c0_time;
-#endif
-
-            cm->req_state = (u8)state;
-
-
-            cm->wakeup_tsc = event_tsc;
-            cm->wakeup_data = event_val;
-            cm->timer_init_cpu = event_init_cpu;
-            cm->wakeup_pid = event_pid;
-            cm->wakeup_tid = event_tid;
-            cm->wakeup_type = event_type;
-            cm->num_msrs = num_cx;
-
-            /*
-             * 'curr_msr_count[0]' contains the MPERF value, which is encoded separately. 
-             * We therefore read from 'curr_msr_count[1]'
-             */
-            memcpy(msr_vals, &info_set->curr_msr_count[1], sizeof(pw_msr_val_t) * num_cx);
+            pw_msg_reservation_t res;
+            c_multi_msg_t *cm = NULL;
+            u16 data_len = sizeof(pw_msr_val_t) * num_cx + C_MULTI_MSG_HEADER_SIZE();
 
 #if DO_TPS_EPOCH_COUNTER
             /*
@@ -3976,24 +3963,45 @@ static void tps(unsigned int type, unsigned int state)
              * Increment our counter.
              */
             epoch = inc_tps_epoch_i();
-            // epoch = 0x0;
-            cm->tps_epoch = epoch;
 #endif // DO_TPS_EPOCH_COUNTER
 
-            sample.data_type = C_STATE;
-            sample.data_len = sizeof(pw_msr_val_t) * num_cx + C_MULTI_MSG_HEADER_SIZE();
-            sample.p_data = (u64)((unsigned long)cm);
+            if (IS_COLLECTING()) {
+#ifndef __arm__
+                u64 mperf = info_set->curr_msr_count[0].val;
+#else
+                u64 mperf = c0_time;
+#endif
+                /*
+                 * Use the compact encoding, if Ring-3 asked for it (and this sample fits).
+                 */
+                if (!IS_COMPACT_MODE() || !produce_compact_c_sample_i(cpu, tsc, info_set, (u8)state, num_cx, mperf, epoch,
+                                                                      event_tsc, event_val, event_init_cpu, event_pid, event_tid, (u8)event_type)) {
+                    cm = pw_reserve_msg(tsc, cpu, C_STATE, data_len, &res);
+                    if (likely(cm)) {
+                        msr_vals = (pw_msr_val_t *)cm->data;
 
-            if (false && cpu == 0) {
-                printk(KERN_INFO "[%d]: TSC = %llu, #cx = %d, data_len = %u, break_type = %u\n", cpu, sample.tsc, num_cx, sample.data_len, cm->wakeup_type);
-            }
+                        cm->mperf = mperf;
 
-            if (false && cpu == 0 && num_cx == 1) {
-                printk(KERN_INFO "[%d]: TSC = %llu, 1 Cx MSR counted: id = %u, val = %llu\n", cpu, sample.tsc, info_set->curr_msr_count[1].id.depth, info_set->curr_msr_count[1].val);
-            }
+                        cm->req_state = (u8)state;
 
-            if (IS_COLLECTING()) {
-                pw_produce_generic_msg(&sample, true);
+
+                        cm->wakeup_tsc = event_tsc;
+                        cm->wakeup_data = event_val;
+                        cm->timer_init_cpu = event_init_cpu;
+                        cm->wakeup_pid = event_pid;
+                        cm->wakeup_tid = event_tid;
+                        cm->wakeup_type = event_type;
+                        cm->num_msrs = num_cx;
+                        cm->tps_epoch = epoch;
+
+                        /*
+                         * 'curr_msr_count[0]' contains the MPERF value, which is encoded separately. 
+                         * We therefore read from 'curr_msr_count[1]'
+                         */
+                        memcpy(msr_vals, &info_set->curr_msr_count[1], sizeof(pw_msr_val_t) * num_cx);
+                    }
+                    pw_commit_msg(&res, true);
+                }
             }
         }
 
@@ -5362,11 +5370,21 @@ static ssize_t pw_device_read(struct file *file, char __user *buffer, size_t len
         return 0; // "0" ==> EOF
     }
     /*
-     * 'mmap' unsupported, for now
+     * If the client mmap-ed our buffers then just tell it which segment
+     * to parse; it will release the segment once it's done with it.
+     * Otherwise this copy commits the client to 'read' consumption.
      */
-    if (false && pw_did_mmap) {
-        if (put_user(val, (u32 *)buffer)) {
+    if (atomic_cmpxchg(&pw_consumer_path, PW_CONSUMER_NONE, PW_CONSUMER_READ) == PW_CONSUMER_MMAP) {
+        if (length < sizeof(val)) {
+            pw_pr_error("ERROR: \"read\" buffer too small for a segment mask!\n");
+            return -ERROR;
+        }
+        if (pw_hold_segment(val)) {
+            return -ERROR;
+        }
+        if (put_user(val, (u32 __user *)buffer)) {
             pw_pr_error("ERROR in put_user\n");
+            pw_release_segment(val);
             return -ERROR;
         }
         return sizeof(val); // 'read' returns # of bytes actually read
@@ -5399,16 +5417,32 @@ static unsigned int pw_device_poll(struct file *filp, poll_table *wait)
 };
 
 /*
- * 'mmap' unsupported, for now
+ * Map the per-cpu output buffers (read-only) into the client's
+ * address space. The buffers are laid out back-to-back, in cpu order.
  */
 static int pw_device_mmap(struct file *filp, struct vm_area_struct *vma)
 {
     long length = vma->vm_end - vma->vm_start;
     unsigned long total_size = 0;
+    int prev_path = PW_CONSUMER_NONE;
 
     pw_pr_debug("MMAP received!\n");
 
-    if (true) {
+    if (IS_COLLECTING()) {
+        pw_pr_error("ERROR: cannot mmap buffers during an ongoing collection!\n");
+        return -ERROR;
+    }
+    /*
+     * Segment headers are owned by the driver; the client only
+     * gets to read them.
+     */
+    if (vma->vm_flags & VM_WRITE) {
+        pw_pr_error("ERROR: buffers can only be mapped read-only!\n");
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    if (vma->vm_pgoff != 0) {
+        pw_pr_error("ERROR: non-zero mmap offset %lu\n", vma->vm_pgoff);
         return -ERROR;
     }
 
@@ -5420,8 +5454,17 @@ static int pw_device_mmap(struct file *filp, struct vm_area_struct *vma)
         return -ERROR;
     }
 
+    prev_path = atomic_cmpxchg(&pw_consumer_path, PW_CONSUMER_NONE, PW_CONSUMER_MMAP);
+    if (prev_path == PW_CONSUMER_READ) {
+        pw_pr_error("ERROR: cannot mmap buffers that are consumed through \"read\"!\n");
+        return -EBUSY;
+    }
+
     if (pw_map_per_cpu_buffers(vma, &total_size)) {
         pw_pr_error("ERROR mapping per-cpu buffers to userspace!\n");
+        if (prev_path == PW_CONSUMER_NONE) {
+            atomic_set(&pw_consumer_path, PW_CONSUMER_NONE);
+        }
         return -ERROR;
     }
 
@@ -5662,9 +5705,25 @@ int pw_set_msr_addrs(struct pw_msr_info __user *remote_info, int size)
                     retVal = -ERROR;
                     goto done;
                 }
+                info_set->compact_base = pw_kmalloc(sizeof(u64) * num_msrs, GFP_KERNEL);
+                if (unlikely(!info_set->compact_base)) {
+                    pw_pr_error("ERROR allocating space for compact c-state baselines!\n");
+                    pw_kfree(INTERNAL_STATE.msr_addrs);
+                    pw_kfree(info_set->prev_msr_vals);
+                    pw_kfree(info_set->curr_msr_count);
+                    pw_kfree(info_set->c_multi_msg_mem);
+                    info_set->prev_msr_vals = NULL;
+                    info_set->curr_msr_count = NULL;
+                    info_set->c_multi_msg_mem = NULL;
+                    retVal = -ERROR;
+                    goto done;
+                }
                 memset(info_set->prev_msr_vals, 0, sizeof(pw_msr_val_t) * num_msrs);
                 memset(info_set->curr_msr_count, 0, sizeof(pw_msr_val_t) * num_msrs);
                 memset(info_set->c_multi_msg_mem, 0, sizeof(pw_msr_val_t) * num_msrs + C_MULTI_MSG_HEADER_SIZE());
+                memset(info_set->compact_base, 0, sizeof(u64) * num_msrs);
+                info_set->compact_mperf = 0;
+                info_set->compact_until_keyframe = 0;
                 for (i=0; i<num_msrs; ++i) {
                     info_set->prev_msr_vals[i].id = msr_addrs[i].id;
                 }
@@ -6162,11 +6221,11 @@ void reset_per_cpu_msr_residencies(void)
 static void reset_trace_sent_fields(void)
 {
     struct tnode *node = NULL;
-    struct hlist_node *curr = NULL;
+    struct hlist_nulls_node *curr = NULL;
     int i=0;
 
     for (i=0; i<NUM_MAP_BUCKETS; ++i) {
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, &timer_map[i].head, list) {
+        hlist_nulls_for_each_entry(node, curr, &timer_map[i], hash_list) {
 	    node->trace_sent = 0;
 	}
     }
@@ -6443,15 +6502,26 @@ int start_collection(PWCollector_cmd_t cmd)
 	}
 #endif
 
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
+        /*
+         * Names (and their ids) are per-collection; MUST be after
+         * the 'irq_map' reset above, which references them.
+         */
+        pw_reset_string_table();
+        /*
+         * The first compact C/P-state sample on every
+         * cpu must be a keyframe.
+         *
+         * START ONLY
+         */
         {
-            destroy_wlock_map();
-            if (init_wlock_map()) {
-                pw_pr_error("ERROR: could NOT initialize wlock map in start_collection1\n");
-                return -ERROR;
+            int cpu = 0;
+            for_each_possible_cpu(cpu) {
+                memset(&per_cpu(pcpu_compact_p_state, cpu), 0, sizeof(struct pw_compact_p_state));
+                if (pw_pcpu_msr_info_sets) {
+                    pw_pcpu_msr_info_sets[cpu].compact_until_keyframe = 0;
+                }
             }
         }
-#endif
 	/*
 	 * Reset collection stats
 	 *
@@ -6669,9 +6739,6 @@ int stop_collection(PWCollector_cmd_t cmd)
      */
     if (cmd == PW_STOP || cmd == PW_CANCEL) {
         delete_all_non_kernel_timers();
-#if DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
-        destroy_wlock_map();
-#endif // DO_USE_CONSTANT_POOL_FOR_WAKELOCK_NAMES
         pw_pr_debug("Debug: deallocating on a stop/cancel!\n");
         pw_deallocate_msr_info_i(&INTERNAL_STATE.msr_addrs);
         // pw_deallocate_platform_res_info_i(&INTERNAL_STATE.platform_res_addrs);
@@ -7174,6 +7241,44 @@ long pw_unlocked_handle_ioctl_i(unsigned int ioctl_num, struct PWCollector_ioctl
         // printk(KERN_INFO "PW_IOCTL_MSR_ADDRS\n");
         return pw_set_msr_addrs((struct pw_msr_info __user *)local_args.in_arg, local_in_len);
     }
+    else if (MATCH_IOCTL(ioctl_num, PW_IOCTL_RELEASE_SEGMENT)) {
+        u32 mask = 0;
+        if (!pw_did_mmap) {
+            pw_pr_error("ERROR: segment release without a mapping!\n");
+            return -ERROR;
+        }
+        if (get_user(mask, (u32 __user *)local_args.in_arg)) {
+            pw_pr_error("ERROR extracting segment mask!\n");
+            return -ERROR;
+        }
+        if (pw_release_segment(mask)) {
+            return -ERROR;
+        }
+        return SUCCESS;
+    }
+    else if (MATCH_IOCTL(ioctl_num, PW_IOCTL_BUFFER_GEOMETRY)) {
+        struct PWCollector_buffer_geometry geometry;
+        if (IS_COLLECTING() || pw_did_mmap) {
+            pw_pr_error("ERROR: cannot resize buffers during a collection, or while they're mapped!\n");
+            return -EBUSY;
+        }
+        if (local_in_len < (int)sizeof(geometry) || copy_from_user(&geometry, (struct PWCollector_buffer_geometry __user *)local_args.in_arg, sizeof(geometry))) {
+            pw_pr_error("ERROR extracting buffer geometry!\n");
+            return -ERROR;
+        }
+        if (pw_set_buffer_geometry(geometry.seg_size_bytes, geometry.num_segs)) {
+            return -ERROR;
+        }
+        return SUCCESS;
+    }
+    else if (MATCH_IOCTL(ioctl_num, PW_IOCTL_BUFFER_STATS)) {
+        int num_stats = local_out_len / (int)sizeof(struct PWCollector_buffer_stats);
+        if (num_stats <= 0) {
+            pw_pr_error("ERROR: buffer stats output too small (%d bytes)!\n", local_out_len);
+            return -ERROR;
+        }
+        return pw_get_buffer_stats((struct PWCollector_buffer_stats __user *)local_args.out_arg, num_stats);
+    }
     else if (MATCH_IOCTL(ioctl_num, PW_IOCTL_PLATFORM_RES_CONFIG)) {
         // printk(KERN_INFO "PW_IOCTL_PLATFORM_RES_CONFIG encountered!\n");
         return pw_set_platform_res_config_i((struct PWCollector_platform_res_info __user *)local_args.in_arg, local_in_len);
@@ -7266,6 +7371,18 @@ static int pw_device_release(struct inode *inode, struct file *file)
 	INTERNAL_STATE.cmd = PW_CANCEL;
 	stop_collection(PW_CANCEL);
     }
+    /*
+     * The VMA holds a reference to the file, so by the time we get
+     * here the client has also unmapped our buffers.
+     */
+    pw_did_mmap = false;
+    atomic_set(&pw_consumer_path, PW_CONSUMER_NONE);
+    /*
+     * Buffer geometry is per-session: the next client starts with the defaults.
+     */
+    if (pw_set_buffer_geometry(PW_MIN_SEG_SIZE_BYTES, NUM_SEGS_PER_BUFFER)) {
+        pw_pr_error("ERROR: could NOT restore the default buffer geometry!\n");
+    }
     module_put(THIS_MODULE);
     /* 
      * We're now ready for our next caller 
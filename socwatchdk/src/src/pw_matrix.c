@@ -70,6 +70,8 @@
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/version.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
 #ifdef CONFIG_X86_WANT_INTEL_MID
     #include <asm/intel-mid.h>
 #endif
@@ -137,6 +139,24 @@ extern u16 pw_scu_fw_major_minor; // defined in 'apwr_driver.c'
 
 static int mt_free_memory(void);
 
+/*
+ * The poll MSR table, grouped by target CPU. Each CPU runs all of its
+ * MSR operations (in table order) in a single cross-CPU call.
+ * 'buff_idx' is the slot in the MSR exchange buffer for reads, or -1
+ * for writes.
+ */
+struct mt_msr_poll_op {
+    u32 lut_idx;
+    s32 buff_idx;
+};
+struct mt_msr_poll_cpu {
+    u32 start;
+    u32 count;
+};
+static struct mt_msr_poll_op *mt_msr_poll_ops = NULL;
+static struct mt_msr_poll_cpu *mt_msr_poll_cpus = NULL;
+static void mt_free_msr_poll_groups(void);
+
 #define PRINT_LUT_LENGTHS(which, what) do { \
     printk(KERN_INFO "GU: ptr_lut has %s_%s_length = %lu\n", #which, #what, ptr_lut->which##_##what##_##length); \
 } while(0)
@@ -314,6 +334,8 @@ static void mt_free_msg_memory(void)
     mt_msg_poll_buff = 0x0;
     mt_msg_term_buff = 0x0;
 
+    mt_free_msr_poll_groups();
+
     // printk(KERN_INFO "OK, freed matrix MSG temp buffers!\n");
 };
 
@@ -623,6 +645,116 @@ static int mt_msg_term_scan(void)
     return MT_SUCCESS;
 };
 
+static void mt_free_msr_poll_groups(void)
+{
+    if (mt_msr_poll_ops) {
+        vfree(mt_msr_poll_ops);
+    }
+    if (mt_msr_poll_cpus) {
+        vfree(mt_msr_poll_cpus);
+    }
+    mt_msr_poll_ops = NULL;
+    mt_msr_poll_cpus = NULL;
+};
+
+/**
+ * init_msr_poll_groups - group the poll MSR table by target CPU.
+ * Must be called after 'ptr_lut->msrs_poll' has been copied from user space.
+ */
+static int mt_init_msr_poll_groups(void)
+{
+    unsigned long lut_loop;
+    unsigned long max_msr_loop = ptr_lut->msr_poll_length;
+    unsigned int cpu;
+    u32 idx = 0;
+    s32 msr_loop = 0;
+
+    mt_free_msr_poll_groups();
+    if (!ptr_lut->msrs_poll || !max_msr_loop) {
+        return MT_SUCCESS;
+    }
+    mt_msr_poll_ops = (struct mt_msr_poll_op *)vmalloc(sizeof(*mt_msr_poll_ops) * max_msr_loop);
+    mt_msr_poll_cpus = (struct mt_msr_poll_cpu *)vmalloc(sizeof(*mt_msr_poll_cpus) * nr_cpu_ids);
+    if (!mt_msr_poll_ops || !mt_msr_poll_cpus) {
+        printk(KERN_INFO "ERROR allocating memory for MSR poll groups!\n");
+        goto ERROR;
+    }
+    memset(mt_msr_poll_cpus, 0, sizeof(*mt_msr_poll_cpus) * nr_cpu_ids);
+    /*
+     * Count the entries for each CPU. Entries targeting CPUs that
+     * don't exist are dropped (the cross-CPU read would fail anyway), but
+     * still consume their slot in the exchange buffer.
+     */
+    for (lut_loop = 0; lut_loop < max_msr_loop; lut_loop++) {
+        const struct mtx_msr *msr = &ptr_lut->msrs_poll[lut_loop];
+        if (msr->operation != READ_OP && msr->operation != WRITE_OP) {
+            dev_dbg(matrix_device, "Error in MSR_OP value..\n");
+            goto ERROR;
+        }
+        if (msr->n_cpu < nr_cpu_ids) {
+            ++mt_msr_poll_cpus[msr->n_cpu].count;
+        }
+    }
+    for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+        mt_msr_poll_cpus[cpu].start = idx;
+        idx += mt_msr_poll_cpus[cpu].count;
+        mt_msr_poll_cpus[cpu].count = 0;
+    }
+    /*
+     * Fill in each CPU's group; the table order within a CPU is preserved.
+     */
+    for (lut_loop = 0; lut_loop < max_msr_loop; lut_loop++) {
+        const struct mtx_msr *msr = &ptr_lut->msrs_poll[lut_loop];
+        s32 buff_idx = -1;
+        if (msr->operation == READ_OP) {
+            if ((unsigned long)msr_loop >= ptr_lut->msr_poll_wb) {
+                printk(KERN_INFO "ERROR: more MSR poll reads than the exchange buffer holds!\n");
+                goto ERROR;
+            }
+            buff_idx = msr_loop++;
+        }
+        if (msr->n_cpu < nr_cpu_ids) {
+            struct mt_msr_poll_cpu *grp = &mt_msr_poll_cpus[msr->n_cpu];
+            struct mt_msr_poll_op *op = &mt_msr_poll_ops[grp->start + grp->count++];
+            op->lut_idx = (u32)lut_loop;
+            op->buff_idx = buff_idx;
+        }
+    }
+    return MT_SUCCESS;
+
+ERROR:
+    mt_free_msr_poll_groups();
+    return -MT_ERROR;
+};
+
+/**
+ * msr_poll_on_cpu - run all of the poll MSR operations targeting the current CPU.
+ * Called via a cross-CPU call, with interrupts disabled.
+ * @info : the MSR exchange buffer
+ */
+static void mt_msr_poll_on_cpu_i(void *info)
+{
+    struct mt_msr_buffer *buff = (struct mt_msr_buffer *)info;
+    const struct mt_msr_poll_cpu *grp = &mt_msr_poll_cpus[raw_smp_processor_id()];
+    u32 i;
+
+    for (i = 0; i < grp->count; ++i) {
+        const struct mt_msr_poll_op *op = &mt_msr_poll_ops[grp->start + i];
+        const struct mtx_msr *msr = &ptr_lut->msrs_poll[op->lut_idx];
+        if (op->buff_idx >= 0) {
+#if ALLOW_MATRIX_MSR_READ_WRITE
+            rdmsr_safe(msr->ecx_address, &buff[op->buff_idx].eax_LSB, &buff[op->buff_idx].edx_MSB);
+#else
+            buff[op->buff_idx].eax_LSB = buff[op->buff_idx].edx_MSB = 0;
+#endif // ALLOW_MATRIX_MSR_READ_WRITE
+        } else {
+#if ALLOW_MATRIX_MSR_READ_WRITE
+            wrmsr_safe(msr->ecx_address, msr->eax_LSB, msr->edx_MSB);
+#endif // ALLOW_MATRIX_MSR_READ_WRITE
+        }
+    }
+};
+
 /**
  * poll_scan - function that is called at each iteration of the poll.
  * at each poll observations are made and stored in kernel buffer.
@@ -630,14 +762,10 @@ static int mt_msg_term_scan(void)
  */
 static int mt_msg_poll_scan(unsigned long poll_loop)
 {
-    unsigned long msr_loop = 0;
     unsigned long mem_loop = 0;
     unsigned long lut_loop;
-    unsigned long max_msr_loop;
     unsigned long max_mem_loop;
-    unsigned long msr_base_addr;
     unsigned long mem_base_addr;
-    unsigned long max_msr_read;
     unsigned long max_cfg_db_loop;
     unsigned long cfg_db_base_addr;
     // unsigned long delta_time;
@@ -654,26 +782,20 @@ static int mt_msg_poll_scan(unsigned long poll_loop)
     MATRIX_GET_TIME_STAMP(mt_msg_poll_buff->timestamp);
     rdtscll(tsc);
 
-    max_msr_loop = ptr_lut->msr_poll_length;
-    max_msr_read = ptr_lut->msr_poll_wb;
     max_mem_loop = xbuff->mem_length;
     max_cfg_db_loop = ptr_lut->cfg_db_poll_length;
-    msr_base_addr = 0; // (poll_loop * max_msr_read);
     mem_base_addr = 0; // (poll_loop * max_mem_loop);
     cfg_db_base_addr = 0; // (poll_loop * max_cfg_db_loop);
 
-    if (ptr_lut->msrs_poll) {
-        for (lut_loop = 0; lut_loop < max_msr_loop; lut_loop++) {
-            if (ptr_lut->msrs_poll[lut_loop].operation == READ_OP) {
-                u32 *__lsb = &(((struct mt_msr_buffer *)(unsigned long)xbuff->ptr_msr_buff)[msr_base_addr+msr_loop].eax_LSB);
-                u32 *__msb = &(((struct mt_msr_buffer *)(unsigned long)xbuff->ptr_msr_buff)[msr_base_addr+msr_loop].edx_MSB);
-                MATRIX_RDMSR_ON_CPU(ptr_lut->msrs_poll[lut_loop].n_cpu, ptr_lut->msrs_poll[lut_loop].ecx_address, __lsb, __msb);
-                msr_loop++;
-            } else if (ptr_lut->msrs_poll[lut_loop].operation == WRITE_OP) {
-                MATRIX_WRMSR_ON_CPU(ptr_lut->msrs_poll[lut_loop].n_cpu, ptr_lut->msrs_poll[lut_loop].ecx_address, ptr_lut->msrs_poll[lut_loop].eax_LSB, ptr_lut->msrs_poll[lut_loop].edx_MSB);
-            } else {
-                dev_dbg(matrix_device, "Error in MSR_OP value..\n");
-                goto MT_MSG_POLL_ERROR;
+    /*
+     * One cross-CPU call per CPU: each CPU reads all of its MSRs straight
+     * into the exchange buffer.
+     */
+    if (mt_msr_poll_ops && mt_msr_poll_cpus) {
+        int cpu;
+        for_each_online_cpu(cpu) {
+            if (mt_msr_poll_cpus[cpu].count) {
+                smp_call_function_single(cpu, &mt_msr_poll_on_cpu_i, (void *)(unsigned long)xbuff->ptr_msr_buff, 1 /* wait */);
             }
         }
     }
@@ -972,6 +1094,10 @@ static int mt_initialize_memory(unsigned long ptr_data)
 		goto ERROR;
 	}
 
+	if (mt_init_msr_poll_groups()) {
+		goto ERROR;
+	}
+
 	io_pm_status_reg =
 	    (mt_platform_pci_read32(ptr_lut->pci_ops_poll->port) &
 	     PWR_MGMT_BASE_ADDR_MASK);
@@ -2135,6 +2261,9 @@ static long mt_device_compat_init_ioctl_i(struct file *file, unsigned int ioctl_
         printk(KERN_INFO "ERROR allocating memory for matrix messages!\n");
         goto error;
     }
+    if (mt_init_msr_poll_groups()) {
+        goto error;
+    }
     mt_calculate_memory_requirements();
 
     io_pm_status_reg =
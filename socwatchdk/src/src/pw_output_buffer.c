@@ -62,6 +62,8 @@
 #include <asm/local.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/log2.h> // for "is_power_of_2"
 
 #include <linux/mm.h> // for "remap_pfn_range"
 #include <asm/io.h> // for "virt_to_phys"
@@ -78,14 +80,28 @@
 u64 pw_num_samples_produced = 0, pw_num_samples_dropped = 0;
 unsigned long pw_buffer_alloc_size = 0;
 int pw_max_num_cpus = -1;
+/*
+ * Output buffer geometry; set via 'pw_set_buffer_geometry()'.
+ * Defaults to NUM_SEGS_PER_BUFFER x 64kB segments.
+ */
+static u32 pw_seg_size_bytes = PW_MIN_SEG_SIZE_BYTES;
+static u32 pw_num_segs_per_buffer = NUM_SEGS_PER_BUFFER;
 /*
  * The size of the 'buffer' data array in each segment.
- * This is 64kB - 2 * sizeof(u32)
+ * This is the segment size - 2 * sizeof(u32)
  */
-#define PW_SEG_DATA_SIZE 65528
-#define PW_SEG_SIZE_BYTES ( PW_SEG_DATA_SIZE + 2 * sizeof(u32) ) /* 64 kB */
+#define PW_SEG_DATA_SIZE ( pw_seg_size_bytes - 2 * sizeof(u32) )
+#define PW_SEG_SIZE_BYTES ( pw_seg_size_bytes )
 #define PW_DATA_BUFFER_SIZE (PW_SEG_SIZE_BYTES)
-#define PW_OUTPUT_BUFFER_SIZE (PW_DATA_BUFFER_SIZE * NUM_SEGS_PER_BUFFER)
+#define PW_OUTPUT_BUFFER_SIZE ( (unsigned long)PW_DATA_BUFFER_SIZE * pw_num_segs_per_buffer )
+/*
+ * Segment states, stored in the 'is_full' field. A segment that has been
+ * handed to an 'mmap' reader stays HELD (and is skipped by both producers
+ * and 'pw_any_seg_full()') until the reader releases it.
+ */
+#define PW_SEG_FREE 0
+#define PW_SEG_FULL 1
+#define PW_SEG_HELD 2
 /*
  * How much space is available in a given segment?
  */
@@ -94,7 +110,7 @@ int pw_max_num_cpus = -1;
 /*
  * Convenience macro: iterate over each segment in a per-cpu output buffer.
  */
-#define for_each_segment(i) for (i=0; i<NUM_SEGS_PER_BUFFER; ++i)
+#define for_each_segment(i) for (i=0; i<pw_num_segs_per_buffer; ++i)
 /*
  * How many buffers are we using?
  */
@@ -104,6 +120,11 @@ int pw_max_num_cpus = -1;
  * Convenience macro: iterate over each per-cpu output buffer.
  */
 #define for_each_output_buffer(i) for (i=0; i<GET_NUM_OUTPUT_BUFFERS(); ++i)
+/*
+ * Decode the (cpu, segment) pair returned to Ring-3 by 'pw_any_seg_full()'.
+ */
+#define MASK_TO_CPU(mask) ( (int)((mask) >> 16) )
+#define MASK_TO_SEG(mask) ( (int)((mask) & 0xffff) )
 
 /*
  * Typedefs and forward declarations.
@@ -121,10 +142,13 @@ struct pw_data_buffer {
 };
 
 struct pw_output_buffer {
-    pw_data_buffer_t *buffers[NUM_SEGS_PER_BUFFER];
+    pw_data_buffer_t *buffers[PW_MAX_SEGS_PER_BUFFER];
+    unsigned long ready_segs; // bit 'i' set ==> segment 'i' is FULL and waiting for the reader
     int buff_index;
     u32 produced_samples;
     u32 dropped_samples;
+    atomic_t segs_in_use; // # of segments that are FULL or HELD
+    u32 high_water_segs; // max value of 'segs_in_use' in the current collection
     int last_seg_read;
     unsigned long free_pages;
     unsigned long mem_alloc_size;
@@ -154,19 +178,105 @@ static DEFINE_PER_CPU(local_t, pw_num_tps) = LOCAL_INIT(0);
 static DEFINE_PER_CPU(local_t, pw_num_d_msg) = LOCAL_INIT(0);
 */
 volatile unsigned long reader_map = 0;
+/*
+ * Summary bitmap: bit 'cpu' set ==> that output buffer has a non-zero 'ready_segs'.
+ * Lets the reader find a full segment without walking every segment of every buffer.
+ */
+static unsigned long *pw_ready_buffer_map = NULL;
 int pw_last_cpu_read = -1;
 s32 pw_last_mask = -1;
 
 /*
  * Function definitions.
  */
+/*
+ * Producer side: mark segment 'seg_index' of 'cpu's output buffer as full
+ * and publish it to the reader.
+ */
+static inline void pw_publish_full_seg_i(pw_output_buffer_t *buffer, int cpu, int seg_index)
+{
+    u32 in_use = 0;
+    if (buffer->buffers[seg_index]->is_full != PW_SEG_FREE) {
+        return; // already published, or handed out to an 'mmap' reader
+    }
+    buffer->buffers[seg_index]->is_full = PW_SEG_FULL;
+    in_use = atomic_inc_return(&buffer->segs_in_use);
+    if (in_use > buffer->high_water_segs) {
+        buffer->high_water_segs = in_use;
+    }
+    set_bit(seg_index, &buffer->ready_segs);
+    smp_mb(); // segment bit MUST be visible before the summary bit
+    set_bit(cpu, pw_ready_buffer_map);
+};
+
+/*
+ * Reader side: segment 'seg_index' of 'cpu's output buffer has been consumed.
+ */
+static inline void pw_retire_seg_i(pw_output_buffer_t *buffer, int cpu, int seg_index)
+{
+    clear_bit(seg_index, &buffer->ready_segs);
+    if (buffer->ready_segs == 0) {
+        clear_bit(cpu, pw_ready_buffer_map);
+        smp_mb();
+        /*
+         * A producer may have published another segment between the
+         * check and the clear; if so, put the summary bit back.
+         */
+        if (buffer->ready_segs != 0) {
+            set_bit(cpu, pw_ready_buffer_map);
+        }
+    }
+};
+
+/*
+ * Find a full segment, starting after the one we returned last (round-robin
+ * over cpus, then over segments). Cost is bounded by the number of words in
+ * the summary bitmap, not the number of segments.
+ */
+static bool pw_find_ready_seg_i(u32 *val)
+{
+    int num_buffers = GET_NUM_OUTPUT_BUFFERS();
+    int cpu = -1, seg = -1;
+    pw_output_buffer_t *buffer = NULL;
+
+    for (;;) {
+        cpu = find_next_bit(pw_ready_buffer_map, num_buffers, pw_last_cpu_read + 1);
+        if (cpu >= num_buffers) {
+            cpu = find_first_bit(pw_ready_buffer_map, num_buffers);
+            if (cpu >= num_buffers) {
+                return false;
+            }
+        }
+        buffer = GET_OUTPUT_BUFFER(cpu);
+        seg = find_next_bit(&buffer->ready_segs, pw_num_segs_per_buffer, buffer->last_seg_read + 1);
+        if (seg >= pw_num_segs_per_buffer) {
+            seg = find_first_bit(&buffer->ready_segs, pw_num_segs_per_buffer);
+        }
+        if (likely(seg < pw_num_segs_per_buffer)) {
+            break;
+        }
+        /*
+         * Stale summary bit (the segments were drained concurrently); drop it and retry.
+         */
+        clear_bit(cpu, pw_ready_buffer_map);
+        smp_mb();
+        if (buffer->ready_segs != 0) {
+            set_bit(cpu, pw_ready_buffer_map);
+        }
+    }
+    pw_last_cpu_read = cpu;
+    buffer->last_seg_read = seg;
+    *val = (cpu & 0xffff) << 16 | (seg & 0xffff);
+    return true;
+};
+
 pw_data_buffer_t inline *pw_get_next_available_segment_i(pw_output_buffer_t *buffer, int size)
 {
     int i=0;
     int buff_index = buffer->buff_index;
 
     for_each_segment(i) {
-        buff_index = CIRCULAR_INC(buff_index, NUM_SEGS_PER_BUFFER_MASK);
+        buff_index = CIRCULAR_INC(buff_index, pw_num_segs_per_buffer - 1);
         if (SPACE_AVAIL(buffer->buffers[buff_index]) >= size) {
             buffer->buff_index = buff_index;
             return buffer->buffers[buff_index];
@@ -185,7 +295,7 @@ static pw_data_buffer_t *get_producer_seg_i(size_t size, int *cpu, u32 *write_in
     {
         pw_output_buffer_t *buffer = GET_OUTPUT_BUFFER(*cpu = CPU());
         int buff_index = buffer->buff_index;
-        if (buff_index < 0 || buff_index >= NUM_SEGS_PER_BUFFER) {
+        if (buff_index < 0 || buff_index >= pw_num_segs_per_buffer) {
             // printk(KERN_INFO "ERROR: cpu = %d, buff_index = %d\n", cpu, buff_index);
             seg = NULL;
             goto prod_seg_done;
@@ -193,7 +303,7 @@ static pw_data_buffer_t *get_producer_seg_i(size_t size, int *cpu, u32 *write_in
         seg = buffer->buffers[buff_index];
 
         if (unlikely(SPACE_AVAIL(seg) < size)) {
-            seg->is_full = 1;
+            pw_publish_full_seg_i(buffer, *cpu, buff_index);
             *should_wakeup = true;
             seg = pw_get_next_available_segment_i(buffer, size);
             // seg = NULL;
@@ -217,60 +327,73 @@ prod_seg_done:
     return seg;
 };
 
-int pw_produce_generic_msg(struct PWCollector_msg *msg, bool allow_wakeup)
+/*
+ * Reserve room for a message with a 'data_len' byte payload in the current
+ * cpu's output buffer and fill in its header. Returns a pointer to the
+ * payload area inside the segment, or NULL if the sample had to be dropped.
+ * The caller writes the payload in place and MUST then call 'pw_commit_msg()'
+ * (also when NULL was returned) without sleeping in between.
+ */
+void *pw_reserve_msg(u64 tsc, u16 cpuidx, u8 data_type, u16 data_len, pw_msg_reservation_t *res)
 {
-    int retval = PW_SUCCESS;
-    bool should_wakeup = false;
-    bool should_print_error = false;
-    bool did_drop_sample = false;
-    int cpu = -1;
-    bool did_switch_buffer = false;
-    int size = 0;
+    int size = data_len + PW_MSG_HEADER_SIZE;
     pw_data_buffer_t *seg = NULL;
-    char *dst = NULL;
+    PWCollector_msg_t *hdr = NULL;
+    bool did_drop_sample = false;
     u32 write_index = 0;
 
-    if (!msg) {
-        pw_pr_error("ERROR: CANNOT produce a NULL msg!\n");
-        return -PW_ERROR;
-    }
-
-    size = msg->data_len + PW_MSG_HEADER_SIZE;
+    res->cpu = -1;
+    res->should_wakeup = false;
 
     pw_pr_debug("[%d]: size = %d\n", RAW_CPU(), size);
 
-    seg = get_producer_seg_i(size, &cpu, &write_index, &should_wakeup, &did_drop_sample);
-
-    if (likely(seg)) {
-        dst = &seg->buffer[write_index];
-        *((PWCollector_msg_t *)dst) = *msg;
-        dst += PW_MSG_HEADER_SIZE;
-        memcpy(dst, (void *)((unsigned long)msg->p_data), msg->data_len);
-    } else {
-        pw_pr_warn("WARNING: NULL seg! Msg type = %u\n", msg->data_type);
+    seg = get_producer_seg_i(size, &res->cpu, &write_index, &res->should_wakeup, &did_drop_sample);
+    if (unlikely(seg == NULL)) {
+        pw_pr_warn("WARNING: NULL seg! Msg type = %u\n", data_type);
+        return NULL;
     }
 
-    if (unlikely(should_wakeup && allow_wakeup && waitqueue_active(&pw_reader_queue))) {
-        set_bit(cpu, &reader_map); // we're guaranteed this won't get reordered!
+    hdr = (PWCollector_msg_t *)&seg->buffer[write_index];
+    hdr->tsc = tsc;
+    hdr->data_len = data_len;
+    hdr->cpuidx = cpuidx;
+    hdr->data_type = data_type;
+    hdr->padding = 0;
+
+    return &seg->buffer[write_index + PW_MSG_HEADER_SIZE];
+};
+
+/*
+ * Finish a message started with 'pw_reserve_msg()': wake up the reader
+ * if the reservation filled a segment.
+ */
+int pw_commit_msg(pw_msg_reservation_t *res, bool allow_wakeup)
+{
+    if (unlikely(res->should_wakeup && allow_wakeup && waitqueue_active(&pw_reader_queue))) {
+        set_bit(res->cpu, &reader_map); // we're guaranteed this won't get reordered!
         smp_mb(); // TODO: do we really need this?
-        // printk(KERN_INFO "[%d]: has full seg!\n", cpu);
-        pw_pr_debug(KERN_INFO "[%d]: has full seg!\n", cpu);
+        pw_pr_debug(KERN_INFO "[%d]: has full seg!\n", res->cpu);
         wake_up_interruptible(&pw_reader_queue);
     }
+    return PW_SUCCESS;
+};
 
-    if (did_drop_sample) {
-        // pw_pr_warn("Dropping sample\n");
-    }
+int pw_produce_generic_msg(struct PWCollector_msg *msg, bool allow_wakeup)
+{
+    pw_msg_reservation_t res;
+    void *dst = NULL;
 
-    if (should_print_error) {
-        // pw_pr_error("ERROR in produce!\n");
+    if (!msg) {
+        pw_pr_error("ERROR: CANNOT produce a NULL msg!\n");
+        return -PW_ERROR;
     }
 
-    if (did_switch_buffer) {
-        // pw_pr_debug("[%d]: switched sub buffers!\n", cpu);
+    dst = pw_reserve_msg(msg->tsc, msg->cpuidx, msg->data_type, msg->data_len, &res);
+    if (likely(dst)) {
+        memcpy(dst, (void *)((unsigned long)msg->p_data), msg->data_len);
     }
 
-    return retval;
+    return pw_commit_msg(&res, allow_wakeup);
 };
 
 int pw_produce_generic_msg_on_cpu(int cpu, struct PWCollector_msg *msg, bool allow_wakeup)
@@ -294,7 +417,7 @@ int pw_produce_generic_msg_on_cpu(int cpu, struct PWCollector_msg *msg, bool all
         char *dst = NULL;
 
         if (unlikely(SPACE_AVAIL(seg) < size)) {
-            seg->is_full = 1;
+            pw_publish_full_seg_i(buffer, cpu, buff_index);
             should_wakeup = true;
             seg = pw_get_next_available_segment_i(buffer, size);
             if (seg == NULL) {
@@ -349,26 +472,51 @@ done:
     return retval;
 };
 
-int pw_init_per_cpu_buffers(void)
+static void pw_free_output_buffers_i(void)
 {
     int cpu = -1;
-    unsigned long per_cpu_mem_size = PW_OUTPUT_BUFFER_SIZE;
 
-    // if (pw_max_num_cpus <= 0)
-    if (GET_NUM_OUTPUT_BUFFERS() <= 0) {
-        // pw_pr_error("ERROR: max # cpus = %d\n", pw_max_num_cpus);
-        pw_pr_error("ERROR: max # output buffers= %d\n", GET_NUM_OUTPUT_BUFFERS());
-        return -PW_ERROR;
+    if (per_cpu_output_buffers != NULL) {
+        // for_each_possible_cpu(cpu) {
+        // for (cpu=0; cpu<pw_max_num_cpus; ++cpu)
+        for_each_output_buffer(cpu) {
+            pw_output_buffer_t *buffer = &per_cpu_output_buffers[cpu];
+            if (buffer->free_pages != 0) {
+                free_pages(buffer->free_pages, get_order(buffer->mem_alloc_size));
+                buffer->free_pages = 0;
+            }
+        }
+        pw_kfree(per_cpu_output_buffers);
+        per_cpu_output_buffers = NULL;
+    }
+    if (pw_ready_buffer_map != NULL) {
+        pw_kfree(pw_ready_buffer_map);
+        pw_ready_buffer_map = NULL;
     }
+    pw_buffer_alloc_size = 0;
+};
 
-    pw_pr_debug("DEBUG: pw_max_num_cpus = %d, num output buffers = %d\n", pw_max_num_cpus, GET_NUM_OUTPUT_BUFFERS());
+/*
+ * Allocate the per-cpu output buffers, using the current geometry.
+ */
+static int pw_alloc_output_buffers_i(void)
+{
+    int cpu = -1;
+    unsigned long per_cpu_mem_size = PW_OUTPUT_BUFFER_SIZE;
 
     per_cpu_output_buffers = (pw_output_buffer_t *)pw_kmalloc(sizeof(pw_output_buffer_t) * GET_NUM_OUTPUT_BUFFERS(), GFP_KERNEL | __GFP_ZERO);
     if (per_cpu_output_buffers == NULL) {
         pw_pr_error("ERROR allocating space for per-cpu output buffers!\n");
-        pw_destroy_per_cpu_buffers();
+        pw_free_output_buffers_i();
+        return -PW_ERROR;
+    }
+    pw_ready_buffer_map = (unsigned long *)pw_kmalloc(sizeof(unsigned long) * BITS_TO_LONGS(GET_NUM_OUTPUT_BUFFERS()), GFP_KERNEL | __GFP_ZERO);
+    if (pw_ready_buffer_map == NULL) {
+        pw_pr_error("ERROR allocating the ready buffer map!\n");
+        pw_free_output_buffers_i();
         return -PW_ERROR;
     }
+    pw_buffer_alloc_size = 0;
     // for (cpu=0; cpu<pw_max_num_cpus; ++cpu)
     for_each_output_buffer(cpu) {
         pw_output_buffer_t *buffer = &per_cpu_output_buffers[cpu];
@@ -379,7 +527,7 @@ int pw_init_per_cpu_buffers(void)
         pw_buffer_alloc_size += (1 << get_order(per_cpu_mem_size)) * PAGE_SIZE;
         if (buffer->free_pages == 0) {
             pw_pr_error("ERROR allocating pages for buffer [%d]!\n", cpu);
-            pw_destroy_per_cpu_buffers();
+            pw_free_output_buffers_i();
             return -PW_ERROR;
         }
         buff = (char *)buffer->free_pages;
@@ -387,6 +535,24 @@ int pw_init_per_cpu_buffers(void)
             buffer->buffers[i] = (pw_data_buffer_t *)buff;
             buff += PW_DATA_BUFFER_SIZE;
         }
+        buffer->last_seg_read = -1;
+    }
+    return PW_SUCCESS;
+};
+
+int pw_init_per_cpu_buffers(void)
+{
+    // if (pw_max_num_cpus <= 0)
+    if (GET_NUM_OUTPUT_BUFFERS() <= 0) {
+        // pw_pr_error("ERROR: max # cpus = %d\n", pw_max_num_cpus);
+        pw_pr_error("ERROR: max # output buffers= %d\n", GET_NUM_OUTPUT_BUFFERS());
+        return -PW_ERROR;
+    }
+
+    pw_pr_debug("DEBUG: pw_max_num_cpus = %d, num output buffers = %d\n", pw_max_num_cpus, GET_NUM_OUTPUT_BUFFERS());
+
+    if (pw_alloc_output_buffers_i()) {
+        return -PW_ERROR;
     }
 
     {
@@ -395,10 +561,54 @@ int pw_init_per_cpu_buffers(void)
     return PW_SUCCESS;
 };
 
-void pw_destroy_per_cpu_buffers(void)
+/*
+ * Change the output buffer geometry. MUST only be called when no
+ * collection is ongoing and the buffers aren't mapped into userspace.
+ * On failure, the previous geometry is restored.
+ */
+int pw_set_buffer_geometry(u32 seg_size_bytes, u32 num_segs)
 {
-    int cpu = -1;
+    u32 old_seg_size_bytes = pw_seg_size_bytes, old_num_segs = pw_num_segs_per_buffer;
+
+    /*
+     * The per-cpu buffers are allocated (and mapped) in power-of-2 page
+     * blocks; a power-of-2 segment size keeps that block exactly
+     * 'seg_size_bytes * num_segs' bytes long.
+     */
+    if (seg_size_bytes < PW_MIN_SEG_SIZE_BYTES || (seg_size_bytes & (PAGE_SIZE - 1)) || !is_power_of_2(seg_size_bytes)) {
+        pw_pr_error("ERROR: invalid segment size %u (MUST be a power-of-2 multiple of %lu, >= %u)\n", seg_size_bytes, (unsigned long)PAGE_SIZE, PW_MIN_SEG_SIZE_BYTES);
+        return -PW_ERROR;
+    }
+    if (num_segs < 2 || num_segs > PW_MAX_SEGS_PER_BUFFER || !is_power_of_2(num_segs)) {
+        pw_pr_error("ERROR: invalid # segments %u (MUST be a power-of-2 in [2, %d])\n", num_segs, PW_MAX_SEGS_PER_BUFFER);
+        return -PW_ERROR;
+    }
+    if (get_order((unsigned long)seg_size_bytes * num_segs) >= MAX_ORDER) {
+        pw_pr_error("ERROR: per-cpu buffer size %lu bytes is too large!\n", (unsigned long)seg_size_bytes * num_segs);
+        return -PW_ERROR;
+    }
+    if (seg_size_bytes == old_seg_size_bytes && num_segs == old_num_segs && per_cpu_output_buffers != NULL) {
+        return PW_SUCCESS;
+    }
 
+    pw_free_output_buffers_i();
+    pw_seg_size_bytes = seg_size_bytes;
+    pw_num_segs_per_buffer = num_segs;
+    if (pw_alloc_output_buffers_i()) {
+        pw_pr_error("ERROR: could NOT allocate %u x %u byte segments; reverting to %u x %u\n", num_segs, seg_size_bytes, old_num_segs, old_seg_size_bytes);
+        pw_seg_size_bytes = old_seg_size_bytes;
+        pw_num_segs_per_buffer = old_num_segs;
+        if (pw_alloc_output_buffers_i()) {
+            pw_pr_error("ERROR: could NOT restore the output buffers!\n");
+        }
+        return -PW_ERROR;
+    }
+    pw_pr_debug("OK: output buffers are now %u x %u bytes per cpu\n", num_segs, seg_size_bytes);
+    return PW_SUCCESS;
+};
+
+void pw_destroy_per_cpu_buffers(void)
+{
 #if DO_DEBUG_OUTPUT
     if (per_cpu_output_buffers != NULL) {
         /*
@@ -416,35 +626,30 @@ void pw_destroy_per_cpu_buffers(void)
         }
     }
 #endif // DO_DEBUG_OUTPUT
-    if (per_cpu_output_buffers != NULL) {
-        // for_each_possible_cpu(cpu) {
-        // for (cpu=0; cpu<pw_max_num_cpus; ++cpu)
-        for_each_output_buffer(cpu) {
-            pw_output_buffer_t *buffer = &per_cpu_output_buffers[cpu];
-            if (buffer->free_pages != 0) {
-                free_pages(buffer->free_pages, get_order(buffer->mem_alloc_size));
-                buffer->free_pages = 0;
-            }
-        }
-        pw_kfree(per_cpu_output_buffers);
-        per_cpu_output_buffers = NULL;
-    }
+    pw_free_output_buffers_i();
 };
 
 void pw_reset_per_cpu_buffers(void)
 {
     int cpu = 0, i = 0;
+    if (unlikely(per_cpu_output_buffers == NULL)) {
+        return;
+    }
     // for_each_possible_cpu(cpu) {
     // for (cpu=0; cpu<pw_max_num_cpus; ++cpu)
     for_each_output_buffer(cpu) {
         pw_output_buffer_t *buffer = GET_OUTPUT_BUFFER(cpu);
         buffer->buff_index = buffer->dropped_samples = buffer->produced_samples = 0;
         buffer->last_seg_read = -1;
+        buffer->ready_segs = 0;
+        atomic_set(&buffer->segs_in_use, 0);
+        buffer->high_water_segs = 0;
 
         for_each_segment(i) {
             memset(buffer->buffers[i], 0, PW_DATA_BUFFER_SIZE);
         }
     }
+    memset(pw_ready_buffer_map, 0, sizeof(unsigned long) * BITS_TO_LONGS(GET_NUM_OUTPUT_BUFFERS()));
     pw_last_cpu_read = -1;
     pw_last_mask = -1;
 };
@@ -485,46 +690,44 @@ bool pw_any_seg_full(u32 *val, const bool *is_flush_mode)
 
     *val = PW_NO_DATA_AVAIL_MASK;
     pw_pr_debug(KERN_INFO "Checking for full seg: val = %u, flush = %s\n", *val, GET_BOOL_STRING(*is_flush_mode));
-    // for_each_online_cpu(num_visited)
+    /*
+     * Common case: producers have published one or more full segments.
+     */
+    if (pw_find_ready_seg_i(val)) {
+        return true;
+    }
+    if (!*is_flush_mode) {
+        return false;
+    }
+    /*
+     * Flush mode: the collection is over, so it's OK to walk every
+     * (partially filled) segment.
+     */
     for_each_output_buffer(num_visited) {
         pw_output_buffer_t *buffer = NULL;
-        /*
-        if (++pw_last_cpu_read >= num_online_cpus()) {
-            pw_last_cpu_read = 0;
-        }
-        */
         if (++pw_last_cpu_read >= GET_NUM_OUTPUT_BUFFERS()) {
             pw_last_cpu_read = 0;
         }
         buffer = GET_OUTPUT_BUFFER(pw_last_cpu_read);
         for_each_segment(i) {
-            if (++buffer->last_seg_read >= NUM_SEGS_PER_BUFFER) {
+            if (++buffer->last_seg_read >= pw_num_segs_per_buffer) {
                 buffer->last_seg_read = 0;
             }
-            if (pw_last_cpu_read == 0) {
-                pw_pr_debug(KERN_INFO "Any_seg_Full: cpu = %d, segment = %d, flush-mode = %s, non-empty = %s\n", pw_last_cpu_read, buffer->last_seg_read, GET_BOOL_STRING(*is_flush_mode), GET_BOOL_STRING(buffer->buffers[buffer->last_seg_read]->bytes_written > 0));
-            }
             smp_mb();
-            if (buffer->buffers[buffer->last_seg_read]->is_full || (*is_flush_mode && buffer->buffers[buffer->last_seg_read]->bytes_written > 0)) {
+            if (buffer->buffers[buffer->last_seg_read]->is_full == PW_SEG_FULL || (buffer->buffers[buffer->last_seg_read]->is_full == PW_SEG_FREE && buffer->buffers[buffer->last_seg_read]->bytes_written > 0)) {
                 *val = (pw_last_cpu_read & 0xffff) << 16 | (buffer->last_seg_read & 0xffff);
-                // pw_last_mask = *val;
                 return true;
             }
         }
     }
     /*
      * Reaches here only if there's no data to be read.
+     * We've drained all buffers and need to tell the userspace application there
+     * isn't any data. Unfortunately, we can't just return a 'zero' value for the
+     * mask (because that could also indicate that segment # 0 of cpu #0 has data).
      */
-    if (*is_flush_mode) {
-        /*
-         * We've drained all buffers and need to tell the userspace application there
-         * isn't any data. Unfortunately, we can't just return a 'zero' value for the
-         * mask (because that could also indicate that segment # 0 of cpu #0 has data).
-         */
-        *val = PW_ALL_WRITES_DONE_MASK;
-        return true;
-    }
-    return false;
+    *val = PW_ALL_WRITES_DONE_MASK;
+    return true;
 };
 
 /*
@@ -547,10 +750,10 @@ unsigned long pw_consume_data(u32 mask, char __user *buffer, size_t bytes_to_rea
         pw_pr_error("Error: bytes_to_read = %u, required to be %lu\n", (unsigned)bytes_to_read, (unsigned long)PW_DATA_BUFFER_SIZE);
         return bytes_to_read;
     }
-    which_cpu = mask >> 16; which_seg = mask & 0xffff;
+    which_cpu = MASK_TO_CPU(mask); which_seg = MASK_TO_SEG(mask);
     pw_pr_debug(KERN_INFO "CONSUME: cpu = %d, seg = %d\n", which_cpu, which_seg);
-    if (which_seg >= NUM_SEGS_PER_BUFFER) {
-        pw_pr_error("Error: which_seg (%d) >= NUM_SEGS_PER_BUFFER (%d)\n", which_seg, NUM_SEGS_PER_BUFFER);
+    if (which_cpu >= GET_NUM_OUTPUT_BUFFERS() || which_seg >= pw_num_segs_per_buffer) {
+        pw_pr_error("Error: which_cpu (%d), which_seg (%d) out of range (# segs = %u)\n", which_cpu, which_seg, pw_num_segs_per_buffer);
         return bytes_to_read;
     }
     /*
@@ -566,15 +769,113 @@ unsigned long pw_consume_data(u32 mask, char __user *buffer, size_t bytes_to_rea
     } else {
         pw_pr_warn("Warning: couldn't copy %u bytes\n", bytes_not_copied);
     }
-    seg->is_full = seg->bytes_written = 0;
+    /*
+     * Retire BEFORE resetting: once the segment is free again a
+     * producer may fill and re-publish it.
+     */
+    pw_retire_seg_i(buff, which_cpu, which_seg);
+    seg->bytes_written = 0;
+    smp_wmb();
+    if (seg->is_full != PW_SEG_FREE) { // partially filled segments (flush mode) were never counted
+        atomic_dec(&buff->segs_in_use);
+    }
+    seg->is_full = PW_SEG_FREE;
     return bytes_not_copied;
 };
 
+static pw_data_buffer_t *pw_get_segment_i(u32 mask)
+{
+    int which_cpu = MASK_TO_CPU(mask), which_seg = MASK_TO_SEG(mask);
+
+    if (unlikely(per_cpu_output_buffers == NULL)) {
+        return NULL;
+    }
+    if (which_cpu >= GET_NUM_OUTPUT_BUFFERS() || which_seg >= pw_num_segs_per_buffer) {
+        pw_pr_error("ERROR: invalid segment mask %u (cpu = %d, seg = %d)\n", mask, which_cpu, which_seg);
+        return NULL;
+    }
+    return GET_OUTPUT_BUFFER(which_cpu)->buffers[which_seg];
+};
+
+/*
+ * 'mmap' consumption: hand the segment identified by 'mask' (as returned
+ * by 'pw_any_seg_full()') over to Ring-3. The reader parses the segment
+ * directly from its mapping and MUST return it via 'pw_release_segment()'
+ * before the producers can reuse it.
+ */
+int pw_hold_segment(u32 mask)
+{
+    pw_data_buffer_t *seg = pw_get_segment_i(mask);
+
+    if (seg == NULL) {
+        return -PW_ERROR;
+    }
+    if (seg->is_full == PW_SEG_FREE) {
+        /*
+         * Partially filled segment (flush mode): it was never published,
+         * but 'pw_release_segment()' will uncount it.
+         */
+        atomic_inc(&GET_OUTPUT_BUFFER(MASK_TO_CPU(mask))->segs_in_use);
+    }
+    seg->is_full = PW_SEG_HELD;
+    smp_mb();
+    pw_retire_seg_i(GET_OUTPUT_BUFFER(MASK_TO_CPU(mask)), MASK_TO_CPU(mask), MASK_TO_SEG(mask));
+    return PW_SUCCESS;
+};
+
+int pw_release_segment(u32 mask)
+{
+    pw_data_buffer_t *seg = pw_get_segment_i(mask);
+
+    if (seg == NULL) {
+        return -PW_ERROR;
+    }
+    if (seg->is_full != PW_SEG_HELD) {
+        pw_pr_error("ERROR: releasing segment %u that was never handed out!\n", mask);
+        return -PW_ERROR;
+    }
+    seg->bytes_written = 0;
+    smp_wmb(); // producers must see the reset count before the segment becomes free
+    seg->is_full = PW_SEG_FREE;
+    atomic_dec(&GET_OUTPUT_BUFFER(MASK_TO_CPU(mask))->segs_in_use);
+    return PW_SUCCESS;
+};
+
 unsigned long pw_get_buffer_size(void)
 {
     return PW_DATA_BUFFER_SIZE;
 };
 
+/*
+ * Copy live per-buffer statistics to Ring-3. Safe to call during a
+ * collection: the counters are read without locking, so a given
+ * entry may be slightly stale. Returns the # of entries copied.
+ */
+int pw_get_buffer_stats(struct PWCollector_buffer_stats __user *stats, int max_num_stats)
+{
+    int cpu = 0;
+
+    if (unlikely(per_cpu_output_buffers == NULL || stats == NULL)) {
+        return -PW_ERROR;
+    }
+    for_each_output_buffer(cpu) {
+        pw_output_buffer_t *buff = GET_OUTPUT_BUFFER(cpu);
+        PWCollector_buffer_stats_t local;
+        if (cpu >= max_num_stats) {
+            break;
+        }
+        local.produced_samples = buff->produced_samples;
+        local.dropped_samples = buff->dropped_samples;
+        local.high_water_segs = buff->high_water_segs;
+        local.num_segs = pw_num_segs_per_buffer;
+        if (copy_to_user(&stats[cpu], &local, sizeof(local))) {
+            pw_pr_error("ERROR copying buffer stats to userspace!\n");
+            return -PW_ERROR;
+        }
+    }
+    return cpu;
+};
+
 void pw_count_samples_produced_dropped(void)
 {
     int cpu = 0;
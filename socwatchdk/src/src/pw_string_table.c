@@ -0,0 +1,257 @@
+/* ***********************************************************************************************
+
+  This file is provided under a dual BSD/GPLv2 license.  When using or 
+  redistributing this file, you may do so under either license.
+
+  GPL LICENSE SUMMARY
+
+  Copyright(c) 2013 Intel Corporation. All rights reserved.
+
+  This program is free software; you can redistribute it and/or modify 
+  it under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+
+  This program is distributed in the hope that it will be useful, but 
+  WITHOUT ANY WARRANTY; without even the implied warranty of 
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU 
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License 
+  along with this program; if not, write to the Free Software 
+  Foundation, Inc., 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+  The full GNU General Public License is included in this distribution 
+  in the file called LICENSE.GPL.
+
+  Contact Information:
+  SOCWatch Developer Team <socwatchdevelopers@intel.com>
+
+  BSD LICENSE 
+
+  Copyright(c) 2013 Intel Corporation. All rights reserved.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without 
+  modification, are permitted provided that the following conditions 
+  are met:
+
+    * Redistributions of source code must retain the above copyright 
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright 
+      notice, this list of conditions and the following disclaimer in 
+      the documentation and/or other materials provided with the 
+      distribution.
+    * Neither the name of Intel Corporation nor the names of its 
+      contributors may be used to endorse or promote products derived 
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR 
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT 
+  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT 
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, 
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY 
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+  ***********************************************************************************************
+*/
+
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+
+#include "pw_lock_defs.h"
+#include "pw_defines.h"
+#include "pw_mem.h"
+#include "pw_string_table.h"
+
+/*
+ * Open-addressed hash index: twice as many slots as entries keeps
+ * probe sequences short even when the table is full.
+ */
+#define PW_STR_TABLE_NUM_SLOTS (2 * PW_STR_TABLE_MAX_ENTRIES)
+#define PW_STR_TABLE_SLOT_MASK (PW_STR_TABLE_NUM_SLOTS - 1)
+
+/*
+ * Typedefs and forward declarations.
+ */
+typedef struct pw_str_entry pw_str_entry_t;
+
+struct pw_str_entry {
+    unsigned long hash;
+    size_t len;
+    const char *str; // points into the arena
+    unsigned long emitted; // bit 'pw_str_kind_t' set ==> already emitted for that kind
+};
+
+/*
+ * Local variable definitions.
+ */
+static pw_str_entry_t *pw_str_entries = NULL;
+/*
+ * Slot value is (entry index + 1); zero ==> empty slot.
+ */
+static u32 *pw_str_slots = NULL;
+static char *pw_str_arena = NULL;
+static int pw_str_num_entries = 0;
+static size_t pw_str_arena_used = 0;
+static DEFINE_SPINLOCK(pw_str_table_lock);
+
+/*
+ * Function definitions.
+ */
+static unsigned long pw_str_hash_i(const char *str, size_t len)
+{
+    unsigned long hash = 0;
+    size_t i = 0;
+
+    for (i=0; i<len; ++i) {
+        hash = (unsigned char)str[i] + (hash << 6) + (hash << 16) - hash;
+    }
+    return hash;
+};
+
+/*
+ * Lock-free lookup. Returns the entry index, or -1 if 'str' isn't interned
+ * yet; in the latter case 'free_slot' is the slot a new entry should go in.
+ */
+static int pw_str_find_i(unsigned long hash, const char *str, size_t len, u32 *free_slot)
+{
+    u32 slot = hash & PW_STR_TABLE_SLOT_MASK;
+    u32 i = 0;
+
+    for (i=0; i<PW_STR_TABLE_NUM_SLOTS; ++i, slot = (slot + 1) & PW_STR_TABLE_SLOT_MASK) {
+        u32 val = ACCESS_ONCE(pw_str_slots[slot]);
+        pw_str_entry_t *entry = NULL;
+
+        if (val == 0) {
+            *free_slot = slot;
+            return -1;
+        }
+        smp_rmb(); // pairs with the 'smp_wmb()' in 'pw_intern_string()'
+        entry = &pw_str_entries[val - 1];
+        if (entry->hash == hash && entry->len == len && !memcmp(entry->str, str, len)) {
+            return val - 1;
+        }
+    }
+    *free_slot = PW_STR_TABLE_NUM_SLOTS;
+    return -1;
+};
+
+/*
+ * Return the id of 'str' (the first 'len' chars), interning it if required.
+ * '*should_emit' is set the FIRST time a given 'kind' sees this name during
+ * the current session; the caller should then send the name <-> id mapping
+ * to Ring-3. Returns -PW_ERROR if the table (or its arena) is full.
+ * Safe to call from atomic context.
+ */
+int pw_intern_string(const char *str, size_t len, pw_str_kind_t kind, bool *should_emit)
+{
+    unsigned long hash = 0;
+    u32 slot = 0;
+    int id = -1;
+
+    if (!str || !should_emit || kind >= PW_STR_NUM_KINDS || !pw_str_entries) {
+        return -PW_ERROR;
+    }
+    hash = pw_str_hash_i(str, len);
+
+    id = pw_str_find_i(hash, str, len, &slot);
+    if (id < 0) {
+        LOCK(pw_str_table_lock);
+        {
+            /*
+             * Someone may have inserted the same name since our lookup.
+             */
+            id = pw_str_find_i(hash, str, len, &slot);
+            if (id < 0 && slot < PW_STR_TABLE_NUM_SLOTS && pw_str_num_entries < PW_STR_TABLE_MAX_ENTRIES && pw_str_arena_used + len + 1 <= PW_STR_TABLE_ARENA_SIZE) {
+                pw_str_entry_t *entry = &pw_str_entries[pw_str_num_entries];
+                char *dst = &pw_str_arena[pw_str_arena_used];
+
+                memcpy(dst, str, len);
+                dst[len] = '\0';
+                pw_str_arena_used += len + 1;
+
+                entry->hash = hash;
+                entry->len = len;
+                entry->str = dst;
+                entry->emitted = 0;
+
+                id = pw_str_num_entries++;
+                smp_wmb(); // entry MUST be visible before it is published in the index
+                pw_str_slots[slot] = id + 1;
+            }
+        }
+        UNLOCK(pw_str_table_lock);
+        if (id < 0) {
+            pw_pr_warn("WARNING: string table full, could NOT intern %.*s\n", (int)len, str);
+            return -PW_ERROR;
+        }
+    }
+    *should_emit = !test_and_set_bit(kind, &pw_str_entries[id].emitted);
+    return id;
+};
+
+const char *pw_get_interned_string(int id)
+{
+    if (id < 0 || id >= ACCESS_ONCE(pw_str_num_entries)) {
+        return NULL;
+    }
+    return pw_str_entries[id].str;
+};
+
+int pw_init_string_table(void)
+{
+    pw_str_entries = pw_kmalloc(sizeof(pw_str_entry_t) * PW_STR_TABLE_MAX_ENTRIES, GFP_KERNEL | __GFP_ZERO);
+    pw_str_slots = pw_kmalloc(sizeof(u32) * PW_STR_TABLE_NUM_SLOTS, GFP_KERNEL | __GFP_ZERO);
+    pw_str_arena = pw_kmalloc(PW_STR_TABLE_ARENA_SIZE, GFP_KERNEL);
+    if (!pw_str_entries || !pw_str_slots || !pw_str_arena) {
+        pw_pr_error("ERROR allocating space for the string table!\n");
+        pw_destroy_string_table();
+        return -PW_ERROR;
+    }
+    pw_str_num_entries = 0;
+    pw_str_arena_used = 0;
+    return PW_SUCCESS;
+};
+
+void pw_destroy_string_table(void)
+{
+    if (pw_str_entries) {
+        pw_kfree(pw_str_entries);
+        pw_str_entries = NULL;
+    }
+    if (pw_str_slots) {
+        pw_kfree(pw_str_slots);
+        pw_str_slots = NULL;
+    }
+    if (pw_str_arena) {
+        pw_kfree(pw_str_arena);
+        pw_str_arena = NULL;
+    }
+    pw_str_num_entries = 0;
+    pw_str_arena_used = 0;
+};
+
+/*
+ * Forget every name. MUST NOT race with 'pw_intern_string()' callers or
+ * with users of previously returned strings (called between collections).
+ */
+void pw_reset_string_table(void)
+{
+    if (!pw_str_entries) {
+        return;
+    }
+    LOCK(pw_str_table_lock);
+    {
+        memset(pw_str_slots, 0, sizeof(u32) * PW_STR_TABLE_NUM_SLOTS);
+        pw_str_num_entries = 0;
+        pw_str_arena_used = 0;
+    }
+    UNLOCK(pw_str_table_lock);
+};
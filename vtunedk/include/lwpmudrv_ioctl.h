@@ -94,6 +94,13 @@ extern "C" {
 #define DRV_OPERATION_FLUSH                        81
 #define DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO 82
 #define DRV_OPERATION_GET_UNCORE_TOPOLOGY          83
+#define DRV_OPERATION_GET_DROPPED_SAMPLES          84
+#define DRV_OPERATION_GET_READY_BUFFERS            85
+#define DRV_OPERATION_READ_BUFFERS                 86
+#define DRV_OPERATION_SET_EMON_TIMER               87
+#define DRV_OPERATION_READ_EMON_TIMER              88
+#define DRV_OPERATION_GET_EM_GROUP_TIMES           89
+#define DRV_OPERATION_RELEASE_SEGMENTS             90
 
 // IOCTL_SETUP
 //
@@ -179,6 +186,13 @@ extern "C" {
 #define LWPMUDRV_IOCTL_FLUSH                        LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_FLUSH)
 #define LWPMUDRV_IOCTL_SET_SCAN_UNCORE_TOPOLOGY_INFO LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO)
 #define LWPMUDRV_IOCTL_GET_UNCORE_TOPOLOGY          LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_UNCORE_TOPOLOGY)
+#define LWPMUDRV_IOCTL_GET_DROPPED_SAMPLES          LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_DROPPED_SAMPLES)
+#define LWPMUDRV_IOCTL_GET_READY_BUFFERS            LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_READY_BUFFERS)
+#define LWPMUDRV_IOCTL_READ_BUFFERS                 LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_READ_BUFFERS)
+#define LWPMUDRV_IOCTL_SET_EMON_TIMER               LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_SET_EMON_TIMER)
+#define LWPMUDRV_IOCTL_READ_EMON_TIMER              LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_READ_EMON_TIMER)
+#define LWPMUDRV_IOCTL_GET_EM_GROUP_TIMES           LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_EM_GROUP_TIMES)
+#define LWPMUDRV_IOCTL_RELEASE_SEGMENTS             LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_RELEASE_SEGMENTS)
 
 #elif defined(DRV_OS_LINUX) || defined(DRV_OS_SOLARIS) || defined (DRV_OS_ANDROID)
 // IOCTL_ARGS
@@ -274,6 +288,13 @@ struct IOCTL_COMPAT_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_COMPAT_FLUSH                  _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_FLUSH, compat_uptr_t)
 #define LWPMUDRV_IOCTL_COMPAT_SET_SCAN_UNCORE_TOPOLOGY_INFO _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO, compat_uptr_t)
 #define LWPMUDRV_IOCTL_COMPAT_GET_UNCORE_TOPOLOGY           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_UNCORE_TOPOLOGY, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_GET_DROPPED_SAMPLES    _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_DROPPED_SAMPLES, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_GET_READY_BUFFERS      _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_READY_BUFFERS, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_READ_BUFFERS           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_BUFFERS, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_SET_EMON_TIMER         _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_EMON_TIMER, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_READ_EMON_TIMER        _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_EMON_TIMER, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_GET_EM_GROUP_TIMES     _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_GROUP_TIMES, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_RELEASE_SEGMENTS       _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_RELEASE_SEGMENTS, compat_uptr_t)
 #endif
 
 #define LWPMUDRV_IOCTL_START                  _IO (LWPMU_IOC_MAGIC,  DRV_OPERATION_START)
@@ -340,6 +361,13 @@ struct IOCTL_COMPAT_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_FLUSH                  _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_FLUSH, IOCTL_ARGS)
 #define LWPMUDRV_IOCTL_SET_SCAN_UNCORE_TOPOLOGY_INFO _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO, IOCTL_ARGS)
 #define LWPMUDRV_IOCTL_GET_UNCORE_TOPOLOGY    _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_UNCORE_TOPOLOGY, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_GET_DROPPED_SAMPLES    _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_DROPPED_SAMPLES, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_GET_READY_BUFFERS      _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_READY_BUFFERS, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_READ_BUFFERS           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_BUFFERS, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_SET_EMON_TIMER         _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_EMON_TIMER, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_READ_EMON_TIMER        _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_EMON_TIMER, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_GET_EM_GROUP_TIMES     _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_GROUP_TIMES, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_RELEASE_SEGMENTS       _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_RELEASE_SEGMENTS, IOCTL_ARGS)
 
 #elif defined(DRV_OS_FREEBSD)
 
@@ -430,6 +458,13 @@ struct IOCTL_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_FLUSH                  _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_FLUSH, IOCTL_ARGS_NODE)
 #define LWPMUDRV_IOCTL_SET_SCAN_UNCORE_TOPOLOGY_INFO _IOW(LWPMU_IOC_MAGIC,DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO, IOCTL_ARGS_NODE)
 #define LWPMUDRV_IOCTL_GET_UNCORE_TOPOLOGY    _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_UNCORE_TOPOLOGY, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_GET_DROPPED_SAMPLES    _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_DROPPED_SAMPLES, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_GET_READY_BUFFERS      _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_READY_BUFFERS, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_READ_BUFFERS           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_BUFFERS, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_SET_EMON_TIMER         _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_EMON_TIMER, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_READ_EMON_TIMER        _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_READ_EMON_TIMER, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_GET_EM_GROUP_TIMES     _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_GROUP_TIMES, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_RELEASE_SEGMENTS       _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_RELEASE_SEGMENTS, IOCTL_ARGS_NODE)
 
 #elif defined(DRV_OS_MAC)
 
@@ -539,6 +574,13 @@ struct CPU_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_FLUSH                  DRV_OPERATION_FLUSH
 #define LWPMUDRV_IOCTL_SET_SCAN_UNCORE_TOPOLOGY_INFO DRV_OPERATION_SET_SCAN_UNCORE_TOPOLOGY_INFO
 #define LWPMUDRV_IOCTL_GET_UNCORE_TOPOLOGY    DRV_OPERATION_GET_UNCORE_TOPOLOGY
+#define LWPMUDRV_IOCTL_GET_DROPPED_SAMPLES    DRV_OPERATION_GET_DROPPED_SAMPLES
+#define LWPMUDRV_IOCTL_GET_READY_BUFFERS      DRV_OPERATION_GET_READY_BUFFERS
+#define LWPMUDRV_IOCTL_READ_BUFFERS           DRV_OPERATION_READ_BUFFERS
+#define LWPMUDRV_IOCTL_SET_EMON_TIMER         DRV_OPERATION_SET_EMON_TIMER
+#define LWPMUDRV_IOCTL_READ_EMON_TIMER        DRV_OPERATION_READ_EMON_TIMER
+#define LWPMUDRV_IOCTL_GET_EM_GROUP_TIMES     DRV_OPERATION_GET_EM_GROUP_TIMES
+#define LWPMUDRV_IOCTL_RELEASE_SEGMENTS       DRV_OPERATION_RELEASE_SEGMENTS
 
 // This is only for MAC OSX
 #define LWPMUDRV_IOCTL_SET_OSX_VERSION        998
@@ -1081,5 +1081,111 @@ typedef enum
     UNCORE_TOPOLOGY_INFO_NODE_IRP        =   5
 }   UNCORE_TOPOLOGY_INFO_NODE_INDEX_TYPE;
 
+/*
+ *  Control page shared with the collector when a per-cpu sample device is
+ *  mmap'ed.  Page offset 0 of the device maps this page read-only.  The
+ *  ring segments are mapped read-only starting at page offset 1; segment j
+ *  starts segment_stride * j bytes into that mapping.  The driver advances
+ *  head after filling buffer_full[head % num_buffers].  Once it is done with
+ *  the segments up to some tail, the consumer passes an OUTPUT_RELEASE_NODE
+ *  to DRV_OPERATION_RELEASE_SEGMENTS; tail must lie between the current
+ *  tail and head.  The driver mirrors the accepted tail into this page.
+ */
+#define OUTPUT_CONTROL_MAX_BUFFERS      64
+#define OUTPUT_CONTROL_SEGMENT_PGOFF    1
+
+typedef struct OUTPUT_CONTROL_NODE_S  OUTPUT_CONTROL_NODE;
+typedef        OUTPUT_CONTROL_NODE   *OUTPUT_CONTROL;
+
+struct OUTPUT_CONTROL_NODE_S {
+    U32   num_buffers;
+    U32   buffer_size;
+    U32   segment_stride;
+    U32   reserved;
+    U64   dropped_samples;
+    U32   head;
+    U32   tail;
+    U32   buffer_full[OUTPUT_CONTROL_MAX_BUFFERS];
+};
+
+#define OUTPUT_CONTROL_num_buffers(x)        (x)->num_buffers
+#define OUTPUT_CONTROL_buffer_size(x)        (x)->buffer_size
+#define OUTPUT_CONTROL_segment_stride(x)     (x)->segment_stride
+#define OUTPUT_CONTROL_dropped_samples(x)    (x)->dropped_samples
+#define OUTPUT_CONTROL_head(x)               (x)->head
+#define OUTPUT_CONTROL_tail(x)               (x)->tail
+#define OUTPUT_CONTROL_buffer_full(x,y)      (x)->buffer_full[(y)]
+
+typedef struct OUTPUT_RELEASE_NODE_S  OUTPUT_RELEASE_NODE;
+typedef        OUTPUT_RELEASE_NODE   *OUTPUT_RELEASE;
+
+struct OUTPUT_RELEASE_NODE_S {
+    U32   cpu_num;
+    U32   tail;
+};
+
+#define OUTPUT_RELEASE_cpu_num(x)            (x)->cpu_num
+#define OUTPUT_RELEASE_tail(x)               (x)->tail
+
+/*
+ *  Aggregated access to the sample buffers through the control device.
+ *  Buffer index i < num_cpus is the sample buffer of cpu i, index num_cpus
+ *  is the module buffer.  Ready masks hold one bit per buffer index.
+ *  A batched read returns a sequence of segments, each preceded by an
+ *  OUTPUT_SEGMENT_HEADER_NODE; a header with size 0 marks the end of data
+ *  for that buffer after a flush.
+ */
+#define OUTPUT_READY_MASK_WORDS(num_cpus)    (((num_cpus) + 1 + 63) / 64)
+
+typedef struct OUTPUT_SEGMENT_HEADER_NODE_S  OUTPUT_SEGMENT_HEADER_NODE;
+typedef        OUTPUT_SEGMENT_HEADER_NODE   *OUTPUT_SEGMENT_HEADER;
+
+struct OUTPUT_SEGMENT_HEADER_NODE_S {
+    U32   buffer_index;
+    U32   size;
+};
+
+#define OUTPUT_SEGMENT_HEADER_buffer_index(x)   (x)->buffer_index
+#define OUTPUT_SEGMENT_HEADER_size(x)           (x)->size
+
+/*
+ *  Kernel driven EMON counting.  Userspace sets the interval with
+ *  DRV_OPERATION_SET_EMON_TIMER after INIT_PMU; from START on, every cpu
+ *  reads its core counters from a local timer, rotates to the next group
+ *  and appends one record to its ring.  DRV_OPERATION_READ_EMON_TIMER
+ *  drains the rings: each record is an EMON_TIMER_RECORD_NODE followed by
+ *  num_events U64 counts indexed by event_id_index.  seq increments once
+ *  per tick on that cpu, so a gap in seq means records were dropped.
+ */
+typedef struct EMON_TIMER_CONFIG_NODE_S  EMON_TIMER_CONFIG_NODE;
+typedef        EMON_TIMER_CONFIG_NODE   *EMON_TIMER_CONFIG;
+
+struct EMON_TIMER_CONFIG_NODE_S {
+    U64   interval_ns;      // 0 disables the timer driven mode
+    U32   ring_records;     // records per cpu, 0 for the module default
+    U32   reserved;
+};
+
+#define EMON_TIMER_CONFIG_interval_ns(x)        (x)->interval_ns
+#define EMON_TIMER_CONFIG_ring_records(x)       (x)->ring_records
+
+typedef struct EMON_TIMER_RECORD_NODE_S  EMON_TIMER_RECORD_NODE;
+typedef        EMON_TIMER_RECORD_NODE   *EMON_TIMER_RECORD;
+
+struct EMON_TIMER_RECORD_NODE_S {
+    U64   tsc;
+    U64   seq;
+    U32   cpu_num;
+    U32   group_id;
+    U32   num_events;
+    U32   reserved;
+};
+
+#define EMON_TIMER_RECORD_tsc(x)                (x)->tsc
+#define EMON_TIMER_RECORD_seq(x)                (x)->seq
+#define EMON_TIMER_RECORD_cpu_num(x)            (x)->cpu_num
+#define EMON_TIMER_RECORD_group_id(x)           (x)->group_id
+#define EMON_TIMER_RECORD_num_events(x)         (x)->num_events
+
 #endif
 
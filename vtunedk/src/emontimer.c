@@ -0,0 +1,433 @@
+/*COPYRIGHT**
+    Copyright (C) 2005-2014 Intel Corporation.  All Rights Reserved.
+
+    This file is part of SEP Development Kit
+
+    SEP Development Kit is free software; you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    version 2 as published by the Free Software Foundation.
+
+    SEP Development Kit is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SEP Development Kit; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    As a special exception, you may use this file as part of a free software
+    library without restriction.  Specifically, if other files instantiate
+    templates or use macros or inline functions from this file, or you compile
+    this file and link it with other files to produce an executable, this
+    file does not by itself cause the resulting executable to be covered by
+    the GNU General Public License.  This exception does not however
+    invalidate any other reasons why the executable file might be covered by
+    the GNU General Public License.
+**COPYRIGHT*/
+
+
+#include "lwpmudrv_defines.h"
+#include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <asm/uaccess.h>
+#include "lwpmudrv_types.h"
+#include "rise_errors.h"
+#include "lwpmudrv_ecb.h"
+#include "lwpmudrv_struct.h"
+#include "lwpmudrv.h"
+#include "control.h"
+#include "utility.h"
+#include "ecb_iterators.h"
+#include "emontimer.h"
+#include "eventmux.h"
+
+extern EVENT_CONFIG   global_ec;
+
+/*
+ *  Per cpu state of the kernel driven counting mode.  The ring is a
+ *  single producer (the timer on that cpu) / single consumer (the
+ *  READ_EMON_TIMER ioctl, serialized by the ioctl lock) queue of fixed
+ *  size slots; head and tail are free running record counts.
+ */
+typedef struct EMONTIMER_CPU_NODE_S  EMONTIMER_CPU_NODE;
+typedef        EMONTIMER_CPU_NODE   *EMONTIMER_CPU;
+
+struct EMONTIMER_CPU_NODE_S {
+    struct hrtimer  timer;
+    DRV_BOOL        armed;
+    S8             *ring;
+    U64             seq;
+    volatile U32    head;
+    volatile U32    tail;
+};
+
+static EMONTIMER_CPU  emon_cpus        = NULL;
+static U64            emon_interval_ns = 0;
+static U32            emon_ring_mask   = 0;
+static U32            emon_max_events  = 0;
+static size_t         emon_slot_size   = 0;
+static DRV_BOOL       emon_running     = FALSE;
+
+#define EMONTIMER_SLOT(node, idx)  ((EMON_TIMER_RECORD)((node)->ring + ((idx) & emon_ring_mask) * emon_slot_size))
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          enum hrtimer_restart emontimer_Tick (
+ *                         struct hrtimer *timer
+ *                         )
+ *
+ * @brief       Read the current group, rotate to the next one and log it
+ *
+ * @param       timer - the per cpu timer that fired
+ *
+ * @return      HRTIMER_RESTART
+ *
+ * <I>Special Notes:</I>
+ *              Runs in interrupt context on the cpu that owns the timer,
+ *              so every PMU access is local and no IPI is sent.  Programming
+ *              the next group resets the counters, which makes each record
+ *              a delta over the last interval.
+ */
+static enum hrtimer_restart
+emontimer_Tick (
+    struct hrtimer *timer
+)
+{
+    U32                this_cpu = CONTROL_THIS_CPU();
+    CPU_STATE          pcpu     = &pcb[this_cpu];
+    EMONTIMER_CPU      node     = &emon_cpus[this_cpu];
+    ECB                ecb;
+    EMON_TIMER_RECORD  rec;
+    U64               *counts;
+    U32                head;
+    U32                idx;
+
+    hrtimer_forward_now(timer, ns_to_ktime(emon_interval_ns));
+
+    if (GLOBAL_STATE_current_phase(driver_state) != DRV_STATE_RUNNING ||
+        !CPU_STATE_accept_interrupt(pcpu)) {
+        return HRTIMER_RESTART;
+    }
+    ecb = PMU_register_data[CPU_STATE_current_group(pcpu)];
+    if (!ecb) {
+        return HRTIMER_RESTART;
+    }
+
+    dispatch->freeze(NULL);
+
+    head = node->head;
+    if (head - node->tail <= emon_ring_mask) {
+        rec    = EMONTIMER_SLOT(node, head);
+        counts = (U64 *)(rec + 1);
+        UTILITY_Read_TSC(&EMON_TIMER_RECORD_tsc(rec));
+        EMON_TIMER_RECORD_seq(rec)        = node->seq;
+        EMON_TIMER_RECORD_cpu_num(rec)    = this_cpu;
+        EMON_TIMER_RECORD_group_id(rec)   = CPU_STATE_current_group(pcpu);
+        EMON_TIMER_RECORD_num_events(rec) = ECB_num_events(ecb);
+        memset(counts, 0, ECB_num_events(ecb) * sizeof(U64));
+        FOR_EACH_DATA_REG(pecb,i) {
+            if (ECB_entries_is_compound_ctr_sub_bit_set(pecb, i)) {
+                continue;
+            }
+            idx = ECB_entries_event_id_index(pecb,i);
+            if (idx < emon_max_events) {
+                counts[idx] = SYS_Read_MSR(ECB_entries_reg_id(pecb,i));
+            }
+        } END_FOR_EACH_DATA_REG;
+        smp_wmb();
+        node->head = head + 1;
+    }
+    node->seq++;
+
+    if (EVENT_CONFIG_num_groups(global_ec) > 1) {
+        EVENTMUX_Next_Group(NULL);
+    }
+    dispatch->write(NULL);
+    dispatch->restart(NULL);
+
+    return HRTIMER_RESTART;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID emontimer_Start_Timer (
+ *                         PVOID param
+ *                         )
+ *
+ * @brief       Arm the timer of the current cpu
+ *
+ * @param       param - dummy
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Called via the parallel control mechanism so that every
+ *              timer is pinned to the cpu whose PMU it reads.
+ */
+static VOID
+emontimer_Start_Timer (
+    PVOID param
+)
+{
+    EMONTIMER_CPU  node;
+
+    preempt_disable();
+    node = &emon_cpus[CONTROL_THIS_CPU()];
+    preempt_enable();
+
+    hrtimer_init(&node->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+    node->timer.function = emontimer_Tick;
+    hrtimer_start(&node->timer, ns_to_ktime(emon_interval_ns), HRTIMER_MODE_REL_PINNED);
+    node->armed = TRUE;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS EMONTIMER_Initialize (
+ *                         EMON_TIMER_CONFIG config
+ *                         )
+ *
+ * @brief       Set up the per cpu rings for the kernel driven counting mode
+ *
+ * @param       config - interval and ring size requested by the user
+ *
+ * @return      OS_STATUS
+ *
+ * <I>Special Notes:</I>
+ *              Must be called after the event groups are configured and
+ *              before the collection starts.  An interval of 0 turns the
+ *              mode off again.  The timer rotates the groups itself, so
+ *              it cannot be combined with event multiplexing.
+ */
+extern OS_STATUS
+EMONTIMER_Initialize (
+    EMON_TIMER_CONFIG config
+)
+{
+    U32  num_cpus = GLOBAL_STATE_num_cpus(driver_state);
+    U32  records;
+    U32  i;
+
+    EMONTIMER_Destroy();
+
+    if (EMON_TIMER_CONFIG_interval_ns(config) == 0) {
+        return OS_SUCCESS;
+    }
+    if (!PMU_register_data || !global_ec) {
+        return OS_FAULT;
+    }
+    if (EVENT_CONFIG_mode(global_ec) != EM_DISABLED) {
+        SEP_PRINT_ERROR("EMONTIMER_Initialize: event multiplexing is enabled\n");
+        return OS_INVALID;
+    }
+    if (EMON_TIMER_CONFIG_interval_ns(config) < EMONTIMER_MIN_INTERVAL_NS) {
+        SEP_PRINT_ERROR("EMONTIMER_Initialize: interval %llu ns is too short\n",
+                        EMON_TIMER_CONFIG_interval_ns(config));
+        return OS_INVALID;
+    }
+
+    records = EMON_TIMER_CONFIG_ring_records(config);
+    if (records == 0) {
+        records = EMONTIMER_DEFAULT_RING_RECORDS;
+    }
+    if (records > EMONTIMER_MAX_RING_RECORDS) {
+        records = EMONTIMER_MAX_RING_RECORDS;
+    }
+    records = roundup_pow_of_two(records);
+
+    emon_max_events = 0;
+    for (i = 0; i < EVENT_CONFIG_num_groups(global_ec); i++) {
+        ECB ecb = PMU_register_data[i];
+        if (ecb && ECB_num_events(ecb) > emon_max_events) {
+            emon_max_events = ECB_num_events(ecb);
+        }
+    }
+    if (emon_max_events == 0) {
+        return OS_FAULT;
+    }
+
+    emon_slot_size = sizeof(EMON_TIMER_RECORD_NODE) + emon_max_events * sizeof(U64);
+    emon_cpus      = CONTROL_Allocate_Memory(num_cpus * sizeof(EMONTIMER_CPU_NODE));
+    if (!emon_cpus) {
+        return OS_NO_MEM;
+    }
+    for (i = 0; i < num_cpus; i++) {
+        emon_cpus[i].ring = CONTROL_Allocate_Memory(records * emon_slot_size);
+        if (!emon_cpus[i].ring) {
+            EMONTIMER_Destroy();
+            return OS_NO_MEM;
+        }
+    }
+    emon_ring_mask   = records - 1;
+    emon_interval_ns = EMON_TIMER_CONFIG_interval_ns(config);
+
+    SEP_PRINT_DEBUG("EMONTIMER_Initialize: interval %llu ns, %u records of %u bytes per cpu\n",
+                    emon_interval_ns, records, (U32)emon_slot_size);
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EMONTIMER_Start (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Start the per cpu counting timers
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Does nothing unless EMONTIMER_Initialize enabled the mode,
+ *              or if multiplexing was enabled by a later configuration.
+ */
+extern VOID
+EMONTIMER_Start (
+    VOID
+)
+{
+    if (!emon_cpus || emon_running) {
+        return;
+    }
+    if (!global_ec || EVENT_CONFIG_mode(global_ec) != EM_DISABLED) {
+        SEP_PRINT_ERROR("EMONTIMER_Start: event multiplexing is enabled, timer not started\n");
+        return;
+    }
+    emon_running = TRUE;
+    CONTROL_Invoke_Parallel(emontimer_Start_Timer, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EMONTIMER_Stop (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Cancel the per cpu counting timers
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Waits for running callbacks.  The rings are kept so that
+ *              the records logged before the stop can still be drained.
+ *              Cpus that were offline at the start never armed a timer.
+ */
+extern VOID
+EMONTIMER_Stop (
+    VOID
+)
+{
+    U32  i;
+
+    if (!emon_cpus || !emon_running) {
+        return;
+    }
+    for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
+        if (emon_cpus[i].armed) {
+            hrtimer_cancel(&emon_cpus[i].timer);
+            emon_cpus[i].armed = FALSE;
+        }
+    }
+    emon_running = FALSE;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS EMONTIMER_Read (
+ *                         char   *buf,
+ *                         size_t  len
+ *                         )
+ *
+ * @brief       Drain the per cpu rings into a user buffer
+ *
+ * @param       buf - user buffer
+ * @param       len - size of buf
+ *
+ * @return      number of bytes copied, or an OS_STATUS error
+ *
+ * <I>Special Notes:</I>
+ *              Copies whole records only.  Each record is the header
+ *              followed by its num_events counts.
+ */
+extern OS_STATUS
+EMONTIMER_Read (
+    char   *buf,
+    size_t  len
+)
+{
+    EMONTIMER_CPU      node;
+    EMON_TIMER_RECORD  rec;
+    size_t             copied = 0;
+    size_t             size;
+    U32                head;
+    U32                i;
+
+    if (!emon_cpus) {
+        return OS_FAULT;
+    }
+
+    for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
+        node = &emon_cpus[i];
+        head = node->head;
+        smp_rmb();
+        while (node->tail != head) {
+            rec  = EMONTIMER_SLOT(node, node->tail);
+            size = sizeof(EMON_TIMER_RECORD_NODE) +
+                   EMON_TIMER_RECORD_num_events(rec) * sizeof(U64);
+            if (copied + size > len) {
+                return (OS_STATUS)copied;
+            }
+            if (copy_to_user(buf + copied, rec, size)) {
+                return OS_FAULT;
+            }
+            copied += size;
+            smp_mb();
+            node->tail++;
+        }
+    }
+
+    return (OS_STATUS)copied;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EMONTIMER_Destroy (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Stop the timers and free the rings
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Safe to call when the mode was never enabled.
+ */
+extern VOID
+EMONTIMER_Destroy (
+    VOID
+)
+{
+    U32  i;
+
+    if (!emon_cpus) {
+        return;
+    }
+    EMONTIMER_Stop();
+    for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
+        emon_cpus[i].ring = CONTROL_Free_Memory(emon_cpus[i].ring);
+    }
+    emon_cpus        = CONTROL_Free_Memory(emon_cpus);
+    emon_interval_ns = 0;
+    emon_ring_mask   = 0;
+    emon_max_events  = 0;
+    emon_slot_size   = 0;
+}
@@ -32,15 +32,36 @@
 #include <linux/jiffies.h>
 #include <linux/time.h>
 #include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <asm/uaccess.h>
 #include "lwpmudrv_types.h"
 #include "rise_errors.h"
 #include "lwpmudrv_ecb.h"
 #include "lwpmudrv_struct.h"
 #include "lwpmudrv.h"
 #include "control.h"
+#include "utility.h"
+#include "eventmux.h"
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+#include "pebs.h"
+#endif
+
+extern DRV_CONFIG     pcfg;
+extern EVENT_CONFIG   global_ec;
 
 static PVOID     em_tables      = NULL;
 static size_t    em_tables_size = 0;
+static ktime_t   em_interval;
+
+/*
+ * Time each group was programmed, in TSC ticks, num_groups entries per cpu,
+ * and the TSC at which the current group of each cpu was switched in.
+ * Kept after the collection stops so that userspace can scale the counts.
+ */
+static U64      *em_group_tsc   = NULL;
+static U64      *em_switch_tsc  = NULL;
+static U32       em_num_groups  = 0;
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -110,50 +131,85 @@ eventmux_Deallocate_Groups (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID eventmux_Timer_Callback_Thread (
+ * @fn          VOID eventmux_Close_Group_Time (
+ *                         PVOID param
  *                         )
  *
- * @brief       Stop all the timer threads and terminate them
+ * @brief       Charge the time since the last switch to the current group
  *
- * @param       none
+ * @param       param - dummy
  *
  * @return      NONE
  *
  * <I>Special Notes:</I>
- *              timer routine - The event multiplexing happens here.
+ *              Must run on the cpu being accounted with interrupts or
+ *              preemption disabled.
  */
 static VOID
-eventmux_Timer_Callback_Thread (
-    unsigned long arg
+eventmux_Close_Group_Time (
+    PVOID  param
 )
 {
-    U32        this_cpu;
-    CPU_STATE  pcpu;
+    U32        this_cpu = CONTROL_THIS_CPU();
+    CPU_STATE  pcpu     = &pcb[this_cpu];
+    U64        now;
 
-    preempt_disable();
-    this_cpu = CONTROL_THIS_CPU();
-    pcpu     = &pcb[this_cpu];
-    preempt_enable();
+    if (em_group_tsc == NULL || em_switch_tsc == NULL) {
+        return;
+    }
+    UTILITY_Read_TSC(&now);
+    em_group_tsc[this_cpu * em_num_groups + CPU_STATE_current_group(pcpu)] += now - em_switch_tsc[this_cpu];
+    em_switch_tsc[this_cpu] = now;
+}
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          enum hrtimer_restart eventmux_Timer_Callback (
+ *                         struct hrtimer *timer
+ *                         )
+ *
+ * @brief       Rotate the event group of the current cpu
+ *
+ * @param       timer - the per cpu multiplexing timer
+ *
+ * @return      HRTIMER_RESTART
+ *
+ * <I>Special Notes:</I>
+ *              timer routine - The event multiplexing happens here.
+ *              The timer is forwarded from its own expiry rather than
+ *              from the current time, so the slices do not drift.
+ */
+static enum hrtimer_restart
+eventmux_Timer_Callback (
+    struct hrtimer *timer
+)
+{
+    CPU_STATE  pcpu = &pcb[CONTROL_THIS_CPU()];
 
+    hrtimer_forward_now(timer, em_interval);
     if (CPU_STATE_em_tables(pcpu) == NULL) {
-        return;
+        return HRTIMER_NORESTART;
     }
 
-    dispatch->swap_group(TRUE);
-    CPU_STATE_em_timer(pcpu)->expires  = jiffies+arg;
-    add_timer(CPU_STATE_em_timer(pcpu));
+    EVENTMUX_Swap_Group(TRUE);
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Set_Counter_Reset(NULL);
+    }
+#endif
+
+    return HRTIMER_RESTART;
 }
 
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn          VOID eventmux_Prepare_Timer_Threads (
- *                         VOID
+ *                         PVOID arg
  *                         )
  *
- * @brief       Stop all the timer threads and terminate them
+ * @brief       Initialize the multiplexing timer of the current cpu
  *
- * @param       NONE
+ * @param       arg - dummy
  *
  * @return      NONE
  *
@@ -163,7 +219,7 @@ eventmux_Timer_Callback_Thread (
  */
 static VOID
 eventmux_Prepare_Timer_Threads (
-                                PVOID arg
+    PVOID arg
 )
 {
     CPU_STATE   pcpu;
@@ -173,14 +229,9 @@ eventmux_Prepare_Timer_Threads (
     preempt_disable();
     pcpu = &pcb[CONTROL_THIS_CPU()];
     preempt_enable();
-    CPU_STATE_em_timer(pcpu) = (struct timer_list*)CONTROL_Allocate_Memory(sizeof(struct timer_list));
 
-    if (CPU_STATE_em_timer(pcpu) == NULL) {
-       SEP_PRINT_ERROR("eventmux_Prepare_Timer_Threads skipped pcpu=NULL\n")
-       return;
-    }
-
-    init_timer(CPU_STATE_em_timer(pcpu));
+    hrtimer_init(&CPU_STATE_em_timer(pcpu), CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+    CPU_STATE_em_timer(pcpu).function = eventmux_Timer_Callback;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -211,39 +262,101 @@ eventmux_Cancel_Timers (
      */
     for (i=0; i < GLOBAL_STATE_active_cpus(driver_state); i++) {
         pcpu = &pcb[i];
-        del_timer_sync(CPU_STATE_em_timer(pcpu));
+        hrtimer_cancel(&CPU_STATE_em_timer(pcpu));
     }
 }
 
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn          VOID eventmux_Start_Timers (
- *                         long unsigned arg
+ *                         PVOID arg
  *                         )
  *
- * @brief       Start the timer on a single cpu
+ * @brief       Start the multiplexing of a single cpu
  *
- * @param       delay   interval time in jiffies
+ * @param       arg - non zero if the group is rotated by the timer
  *
  * @return      NONE
  *
  * <I>Special Notes:</I>
  *              start the timer on a single cpu
- *              Call from each cpu to get cpu affinity for Timer_Callback_Thread
+ *              Call from each cpu to get cpu affinity for the timer callback
  */
 static VOID
-eventmux_Start_Timers(
-                      PVOID arg
-                      )
+eventmux_Start_Timers (
+    PVOID arg
+)
 {
+    U32           this_cpu;
     CPU_STATE     pcpu;
+
     preempt_disable();
-    pcpu = &pcb[CONTROL_THIS_CPU()];
+    this_cpu = CONTROL_THIS_CPU();
+    pcpu     = &pcb[this_cpu];
+    if (em_switch_tsc) {
+        UTILITY_Read_TSC(&em_switch_tsc[this_cpu]);
+    }
     preempt_enable();
-    CPU_STATE_em_timer(pcpu)->function = eventmux_Timer_Callback_Thread;
-    CPU_STATE_em_timer(pcpu)->data     = (unsigned long)arg;
-    CPU_STATE_em_timer(pcpu)->expires  = jiffies+(unsigned long)arg;
-    add_timer(CPU_STATE_em_timer(pcpu));
+
+    if (arg) {
+        hrtimer_start(&CPU_STATE_em_timer(pcpu), em_interval, HRTIMER_MODE_REL_PINNED);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EVENTMUX_Swap_Group (
+ *                         DRV_BOOL restart
+ *                         )
+ *
+ * @brief       Switch the current cpu to its next event group
+ *
+ * @param       restart - passed on to the dispatch swap_group routine
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Used by both the timer and the PMI driven multiplexing so
+ *              that the time spent in every group is recorded. Other
+ *              switches go through EVENTMUX_Next_Group.
+ */
+extern VOID
+EVENTMUX_Swap_Group (
+    DRV_BOOL restart
+)
+{
+    eventmux_Close_Group_Time(NULL);
+    dispatch->swap_group(restart);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EVENTMUX_Next_Group (
+ *                         PVOID param
+ *                         )
+ *
+ * @brief       Make the next event group the current one of the current cpu
+ *
+ * @param       param - dummy
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              For the switches which program the PMU themselves: only the
+ *              group index moves, after the time of the old group is
+ *              recorded. Same context requirements as the accounting.
+ */
+extern VOID
+EVENTMUX_Next_Group (
+    PVOID  param
+)
+{
+    CPU_STATE  pcpu = &pcb[CONTROL_THIS_CPU()];
+
+    eventmux_Close_Group_Time(NULL);
+    CPU_STATE_current_group(pcpu)++;
+    // make the event group list circular
+    CPU_STATE_current_group(pcpu) %= EVENT_CONFIG_num_groups(global_ec);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -260,28 +373,72 @@ eventmux_Start_Timers(
  *
  * <I>Special Notes:</I>
  *              if event multiplexing has been enabled, set up the time slices and
- *              start the timer threads for all the timers
+ *              start the timer threads for all the timers.  The slice is
+ *              eventmux_interval_ns when set, the em_factor in ms otherwise.
  */
-extern VOID 
+extern VOID
 EVENTMUX_Start (
     EVENT_CONFIG ec
 )
 {
-    unsigned long delay;
+    U64 interval_ns;
 
-    if (EVENT_CONFIG_mode(ec) != EM_TIMER_BASED ||
-        EVENT_CONFIG_num_groups(ec) == 1) {
+    if (EVENT_CONFIG_num_groups(ec) == 1) {
         return;
     }
-    /*
-     * notice we want to use group 0's time slice for the initial timer
-     */
-    delay = msecs_to_jiffies(EVENT_CONFIG_em_factor(ec));
-    SEP_PRINT_DEBUG("EVENTMUX_Start: delay is %lu jiffies\n", delay);
+    if (EVENT_CONFIG_mode(ec) != EM_TIMER_BASED) {
+        // groups are rotated by the PMI handler or on request, only start the accounting
+        CONTROL_Invoke_Parallel(eventmux_Start_Timers, (PVOID)(size_t)0);
+        return;
+    }
+
+    interval_ns = eventmux_interval_ns;
+    if (interval_ns == 0) {
+        interval_ns = (U64)EVENT_CONFIG_em_factor(ec) * NSEC_PER_MSEC;
+    }
+    if (interval_ns < EVENTMUX_MIN_INTERVAL_NS) {
+        interval_ns = EVENTMUX_MIN_INTERVAL_NS;
+    }
+    em_interval = ns_to_ktime(interval_ns);
+    SEP_PRINT_DEBUG("EVENTMUX_Start: interval is %llu ns\n", interval_ns);
     /*
      * Start the timer for all cpus
      */
-    CONTROL_Invoke_Parallel(eventmux_Start_Timers, (PVOID)delay);
+    CONTROL_Invoke_Parallel(eventmux_Start_Timers, (PVOID)(size_t)1);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EVENTMUX_Stop (
+ *                         EVENT_CONFIG ec
+ *                         )
+ *
+ * @brief       Stop the multiplexing and close the group time accounting
+ *
+ * @param       ec    - Event Configuration
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Called once the PMU is frozen at stop so that the time
+ *              before the final teardown is not charged to any group.
+ */
+extern VOID
+EVENTMUX_Stop (
+    EVENT_CONFIG ec
+)
+{
+    if (ec == NULL) {
+        return;
+    }
+    if (EVENT_CONFIG_num_groups(ec) == 1) {
+        return;
+    }
+    if (EVENT_CONFIG_mode(ec) == EM_TIMER_BASED) {
+        eventmux_Cancel_Timers();
+    }
+    CONTROL_Invoke_Parallel(eventmux_Close_Group_Time, NULL);
+    em_switch_tsc = CONTROL_Free_Memory(em_switch_tsc);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -307,8 +464,22 @@ EVENTMUX_Initialize (
 )
 {
     S32   size_of_vector;
-    if (EVENT_CONFIG_mode(ec)       == EM_DISABLED ||
-        EVENT_CONFIG_num_groups(ec) == 1) {
+    U32   num_cpus = GLOBAL_STATE_num_cpus(driver_state);
+
+    if (EVENT_CONFIG_num_groups(ec) == 1) {
+        return;
+    }
+
+    // groups may also be switched on request (EMON), account for them too
+    EVENTMUX_Free_Group_Times();
+    em_num_groups = EVENT_CONFIG_num_groups(ec);
+    em_group_tsc  = CONTROL_Allocate_Memory(num_cpus * em_num_groups * sizeof(U64));
+    em_switch_tsc = CONTROL_Allocate_Memory(num_cpus * sizeof(U64));
+    if (!em_group_tsc || !em_switch_tsc) {
+        EVENTMUX_Free_Group_Times();
+    }
+
+    if (EVENT_CONFIG_mode(ec) == EM_DISABLED) {
         return;
     }
 
@@ -320,7 +491,7 @@ EVENTMUX_Initialize (
     em_tables = CONTROL_Allocate_Memory(em_tables_size);
     CONTROL_Invoke_Parallel(eventmux_Allocate_Groups,
                             (VOID *)&(size_of_vector));
-    
+
     if (EVENT_CONFIG_mode(ec) == EM_TIMER_BASED) {
         CONTROL_Invoke_Parallel(eventmux_Prepare_Timer_Threads, NULL);
     }
@@ -340,7 +511,8 @@ EVENTMUX_Initialize (
  *
  * <I>Special Notes:</I>
  *              if event multiplexing has been enabled, then stop and cancel all the timers
- *              free up all the memory that is associated with EM
+ *              free up all the memory that is associated with EM, except
+ *              the group times which stay readable until the next run
  */
 extern VOID
 EVENTMUX_Destroy (
@@ -362,3 +534,67 @@ EVENTMUX_Destroy (
     em_tables_size = 0;
     CONTROL_Invoke_Parallel(eventmux_Deallocate_Groups, (VOID *)(size_t)0);
 }
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS EVENTMUX_Get_Group_Times (
+ *                         char   *buf,
+ *                         size_t  len
+ *                         )
+ *
+ * @brief       Copy the time each group was active to a user buffer
+ *
+ * @param       buf - user buffer
+ * @param       len - size of buf
+ *
+ * @return      OS_STATUS
+ *
+ * <I>Special Notes:</I>
+ *              buf receives num_groups U64 TSC tick counts per cpu.  While
+ *              the collection runs, the slice in progress is not included.
+ */
+extern OS_STATUS
+EVENTMUX_Get_Group_Times (
+    char   *buf,
+    size_t  len
+)
+{
+    size_t size = GLOBAL_STATE_num_cpus(driver_state) * em_num_groups * sizeof(U64);
+
+    if (em_group_tsc == NULL) {
+        return OS_FAULT;
+    }
+    if (len < size) {
+        return OS_NO_MEM;
+    }
+    if (copy_to_user(buf, em_group_tsc, size)) {
+        return OS_FAULT;
+    }
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EVENTMUX_Free_Group_Times (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Release the group time accounting of the last run
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Called when the driver state is cleaned up.
+ */
+extern VOID
+EVENTMUX_Free_Group_Times (
+    VOID
+)
+{
+    em_group_tsc  = CONTROL_Free_Memory(em_group_tsc);
+    em_switch_tsc = CONTROL_Free_Memory(em_switch_tsc);
+    em_num_groups = 0;
+}
@@ -31,6 +31,7 @@
 
 #include <linux/smp.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #if defined(DRV_IA32)
 #include <asm/apic.h>
 #endif
@@ -124,7 +125,7 @@ struct CPU_STATE_NODE_S {
     S64        *em_tables;           // holds the data that is saved/restored
                                      // during event multiplexing
 
-    struct timer_list *em_timer;
+    struct hrtimer em_timer;         // per cpu event multiplexing timer
     U32         current_group;
     S32         trigger_count;
     S32         trigger_event_num;
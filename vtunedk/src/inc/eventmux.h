@@ -36,11 +36,33 @@
 #include "lwpmudrv_ecb.h"
 #include "lwpmudrv_types.h"
 
+/*
+ * Shortest multiplexing slice accepted from eventmux_interval_ns
+ */
+#define EVENTMUX_MIN_INTERVAL_NS   10000
+
+extern  unsigned long  eventmux_interval_ns;
+
 extern VOID 
 EVENTMUX_Start (
     EVENT_CONFIG ec
 );
 
+extern VOID
+EVENTMUX_Stop (
+    EVENT_CONFIG ec
+);
+
+extern VOID
+EVENTMUX_Swap_Group (
+    DRV_BOOL restart
+);
+
+extern VOID
+EVENTMUX_Next_Group (
+    PVOID  param
+);
+
 extern VOID
 EVENTMUX_Initialize (
     EVENT_CONFIG ec
@@ -51,4 +73,15 @@ EVENTMUX_Destroy (
     EVENT_CONFIG ec
 );
 
+extern OS_STATUS
+EVENTMUX_Get_Group_Times (
+    char   *buf,
+    size_t  len
+);
+
+extern VOID
+EVENTMUX_Free_Group_Times (
+    VOID
+);
+
 #endif /* _EVENTMUX_H_ */
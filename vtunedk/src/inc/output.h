@@ -29,6 +29,8 @@
 #ifndef _OUTPUT_H_
 #define _OUTPUT_H_
 
+#include <linux/mm.h>
+#include <linux/poll.h>
 #if defined (DRV_USE_NMI)
 #include <linux/timer.h>
 #endif
@@ -36,7 +38,7 @@
 /* 
  * Initial allocation 
  * Size of buffer     = 512KB (2^19)
- * number of buffers  = 2
+ * number of buffers  = 2 (can be raised with the output_num_buffers parameter)
  * The max size of the buffer cannot exceed 1<<22 i.e. 4MB
  */
 #define OUTPUT_SMALL_BUFFER        (1<<15)
@@ -44,8 +46,11 @@
 #define OUTPUT_MEMORY_THRESHOLD    0x8000000
 
 extern  U32                   output_buffer_size;
+extern  U32                   output_num_buffers;
 #define OUTPUT_BUFFER_SIZE    output_buffer_size
-#define OUTPUT_NUM_BUFFERS    2
+#define OUTPUT_NUM_BUFFERS    output_num_buffers
+#define OUTPUT_DEFAULT_NUM_BUFFERS 2
+#define OUTPUT_MAX_NUM_BUFFERS     OUTPUT_CONTROL_MAX_BUFFERS
 #if defined (DRV_ANDROID)
 #define MODULE_BUFF_SIZE      1
 #else
@@ -56,16 +61,38 @@ extern  U32                   output_buffer_size;
 
 /*
  *  Data type declarations and accessors macros
+ *
+ *  The buffers form a single-producer/single-consumer ring of
+ *  OUTPUT_NUM_BUFFERS segments.  The producer (PMI handler on the owning
+ *  cpu, or the module writer under buffer_lock) fills segment
+ *  head % OUTPUT_NUM_BUFFERS and publishes it by advancing head.  The reader
+ *  drains segment tail % OUTPUT_NUM_BUFFERS and releases it by advancing tail.
+ *  Segments [tail, head) are full; the producer never owns more than the
+ *  one segment it is currently filling.
+ *
+ *  head, tail, buffer_full and dropped_samples are mirrored into the control
+ *  page, which can be mmap'ed (read-only) by the collector.  The kernel only
+ *  ever trusts its own copies: an mmap consumer hands its tail back through
+ *  OUTPUT_Release_Segments, which checks it against head.
+ *
+ *  The segments are carved out of one vmalloc_user() area (area), so that
+ *  user mappings hold their own page references and outlive the buffers.
  */
 typedef struct {
     spinlock_t  buffer_lock;
     U32         remaining_buffer_size;
     U32         current_buffer;
     U32         total_buffer_size;
-    U32         next_buffer[OUTPUT_NUM_BUFFERS];
-    U32         buffer_full[OUTPUT_NUM_BUFFERS];
-    U8         *buffer[OUTPUT_NUM_BUFFERS];
     U32         signal_full;
+    volatile U32 head;
+    volatile U32 tail;
+    U32         mmapped;
+    U32         eof_pending;
+    U64         dropped_samples;
+    U32         buffer_full[OUTPUT_MAX_NUM_BUFFERS];
+    U8         *buffer[OUTPUT_MAX_NUM_BUFFERS];
+    U8         *area;
+    OUTPUT_CONTROL control;
 } OUTPUT_NODE, *OUTPUT;
 
 #define OUTPUT_buffer_lock(x)            (x)->buffer_lock
@@ -75,6 +102,15 @@ typedef struct {
 #define OUTPUT_buffer_full(x,y)          (x)->buffer_full[(y)]
 #define OUTPUT_current_buffer(x)         (x)->current_buffer
 #define OUTPUT_signal_full(x)            (x)->signal_full
+#define OUTPUT_head(x)                   (x)->head
+#define OUTPUT_tail(x)                   (x)->tail
+#define OUTPUT_dropped_samples(x)        (x)->dropped_samples
+#define OUTPUT_mmapped(x)                (x)->mmapped
+#define OUTPUT_eof_pending(x)            (x)->eof_pending
+#define OUTPUT_control(x)                (x)->control
+#define OUTPUT_area(x)                   (x)->area
+#define OUTPUT_segment_stride(x)         PAGE_ALIGN(OUTPUT_total_buffer_size(x))
+#define OUTPUT_num_full(x)               (OUTPUT_head(x) - OUTPUT_tail(x))
 /*
  *  Add an array of control buffer for per-cpu 
  */
@@ -102,6 +138,13 @@ extern int       OUTPUT_Flush (VOID);
 extern ssize_t   OUTPUT_Module_Read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
 extern ssize_t   OUTPUT_Sample_Read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
 extern void*     OUTPUT_Reserve_Buffer_Space (BUFFER_DESC  bd, U32 size);
+extern U64       OUTPUT_Get_Dropped_Samples (S32 cpu_num);
+extern int       OUTPUT_Sample_Mmap (struct file *filp, struct vm_area_struct *vma);
+extern OS_STATUS OUTPUT_Release_Segments (U32 cpu_num, U32 tail);
+extern unsigned int OUTPUT_Sample_Poll (struct file *filp, poll_table *wait);
+extern unsigned int OUTPUT_Poll_Ready (struct file *filp, poll_table *wait);
+extern U32       OUTPUT_Get_Ready_Buffers (U64 *ready_mask, U32 num_words);
+extern ssize_t   OUTPUT_Read_Buffers (char *buf, size_t count, U64 *read_mask, U32 num_words);
 
 #if defined (DRV_USE_NMI)
 extern OS_STATUS OUTPUT_Initialize_Timers(void);
@@ -56,6 +56,8 @@
 #define DEVICE_ID_BITSHIFT                    16
 #define LOWER_4_BYTES_MASK                    0x00000000FFFFFFFF
 #define MAX_BUSNO                             256
+#define MAX_DEVFN                             256
+#define PCI_CONFIG_SPACE_SIZE                 4096
 #define NEXT_ADDR_OFFSET                      4
 #define NEXT_ADDR_SHIFT                       32
 #define DRV_IS_PCI_VENDOR_ID_INTEL            0x8086
@@ -94,6 +96,26 @@ PCI_Write_Ulong (
     U32 pci_address,
     U32 value
 );
+
+extern VOID
+PCI_Map_Config_Space (
+    U32 bus,
+    U32 dev,
+    U32 func
+);
+
+extern VOID
+PCI_Unmap_Config_Space (
+    VOID
+);
+
+extern U64
+PCI_Read_U64 (
+    U32 bus,
+    U32 dev,
+    U32 func,
+    U32 offset
+);
 #endif
 
 #endif  
@@ -202,6 +202,15 @@ struct  DTS_BUFFER_EXT_NODE_S {
 #define DTS_BUFFER_EXT_counter_reset2(x)     (x)->counter_reset2
 #define DTS_BUFFER_EXT_counter_reset3(x)     (x)->counter_reset3
 
+/*
+ * Number of PEBS records collected per PMI (see the pebs_batch_records
+ * module parameter). 1 keeps one interrupt per precise event.
+ */
+#define PEBS_DEFAULT_BATCH_RECORDS  1
+#define PEBS_MAX_BATCH_RECORDS      64
+
+extern  U32   pebs_batch_records;
+
 extern VOID
 PEBS_Initialize (
     DRV_CONFIG  cfg
@@ -217,22 +226,48 @@ PEBS_Reset_Index (
     S32 this_cpu
 );
 
+extern VOID
+PEBS_Set_Counter_Reset (
+    PVOID  param
+);
+
+extern VOID
+PEBS_Start (
+    VOID
+);
+
+extern S8*
+PEBS_Sample_Template (
+    S32   this_cpu,
+    U32   size
+);
+
 extern VOID
 PEBS_Modify_IP (
     void       *sample,
-    DRV_BOOL    is_64bit_addr
+    DRV_BOOL    is_64bit_addr,
+    S8         *pebs_rec
 );
 
 extern VOID
 PEBS_Modify_TSC (
-    void       *sample
+    void       *sample,
+    S8         *pebs_rec
 );
 
 extern VOID
 PEBS_Fill_Buffer (
     S8            *buffer,
     EVENT_DESC    evt_desc,
-    DRV_BOOL      virt_phys_translation_ena
+    DRV_BOOL      virt_phys_translation_ena,
+    S8            *pebs_rec
+);
+
+extern S8*
+PEBS_Next_Record (
+    S32    this_cpu,
+    U32    event_idx,
+    S8    *pebs_rec
 );
 
 extern U64
@@ -251,8 +286,8 @@ typedef        PEBS_DISPATCH_NODE   *PEBS_DISPATCH;
 struct PEBS_DISPATCH_NODE_S {
     VOID (*initialize_threshold)(DTS_BUFFER_EXT, U32);
     U64  (*overflow)(S32, U64);
-    VOID (*modify_ip)(void*, DRV_BOOL);
-    VOID (*modify_tsc)(void*);
+    VOID (*modify_ip)(void*, DRV_BOOL, S8*);
+    VOID (*modify_tsc)(void*, S8*);
 };
 
 #endif  
@@ -31,6 +31,7 @@
 
 #include <linux/version.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
@@ -75,6 +76,7 @@
 #include "linuxos.h"
 #include "sys_info.h"
 #include "eventmux.h"
+#include "emontimer.h"
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #include "pebs.h"
 #endif
@@ -117,6 +119,15 @@ DISPATCH                dispatch              = NULL;
 #endif
 U64                     total_ram             = 0;
 U32                     output_buffer_size    = OUTPUT_LARGE_BUFFER;
+U32                     output_num_buffers    = OUTPUT_DEFAULT_NUM_BUFFERS;
+module_param(output_num_buffers, uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(output_num_buffers, "Number of sample buffer segments per cpu (2-64)");
+U32                     pebs_batch_records    = PEBS_DEFAULT_BATCH_RECORDS;
+module_param(pebs_batch_records, uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(pebs_batch_records, "Number of PEBS records collected per interrupt (1-64)");
+unsigned long           eventmux_interval_ns  = 0;
+module_param(eventmux_interval_ns, ulong, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(eventmux_interval_ns, "Event multiplexing slice in ns (0 uses the collector's em_factor in ms)");
 static  S32             em_groups_count       = 0;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #endif
@@ -533,6 +544,11 @@ lwpmudrv_Clean_Up (
         goto signal_end;
     }
 
+#if defined(EMON)
+    EMONTIMER_Destroy();
+#endif
+    EVENTMUX_Free_Group_Times();
+
     if (PMU_register_data) {
         for (i = 0; i < GLOBAL_STATE_num_em_groups(driver_state); i++) {
             CONTROL_Free_Memory(PMU_register_data[i]);
@@ -930,42 +946,6 @@ lwpmudrv_Terminate (
     return OS_SUCCESS;
 }
 
-#ifdef EMON
-/* ------------------------------------------------------------------------- */
-/*!
- * @fn static void lwpmudrv_Switch_To_Next_Group(param)
- *
- * @param   param - unused dummy
- *
- * @return none
- *
- * @brief  Switch to the next event group.
- * @brief  This function assumes an active collection is frozen
- * @brief  or no collection is active.
- *
- * <I>Special Notes</I>
- */
-static VOID
-lwpmudrv_Switch_To_Next_Group (
-    PVOID  param
-)
-{
-    U32            this_cpu;
-    CPU_STATE      pcpu;
-
-    preempt_disable();
-    this_cpu = CONTROL_THIS_CPU();
-    pcpu     = &pcb[this_cpu];
-    preempt_enable();
-
-    CPU_STATE_current_group(pcpu)++;
-    // make the event group list circular
-    CPU_STATE_current_group(pcpu) %= EVENT_CONFIG_num_groups(global_ec);
-
-    return;
-}
-#endif
-
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn  static OS_STATUS lwmpudrv_Get_Driver_State(IOCTL_ARGS arg)
@@ -1169,8 +1149,6 @@ lwpmudrv_Switch_Group (
     VOID
 )
 {
-    S32            idx;
-    CPU_STATE      pcpu;
     OS_STATUS      status        = OS_SUCCESS;
     U32            current_state = GLOBAL_STATE_current_phase(driver_state);
 
@@ -1179,10 +1157,7 @@ lwpmudrv_Switch_Group (
         return status;
     }
     status = lwpmudrv_Pause();
-    for (idx = 0; idx < GLOBAL_STATE_num_cpus(driver_state); idx++) {
-        pcpu = &pcb[idx];
-        CPU_STATE_current_group(pcpu)++;
-    }
+    CONTROL_Invoke_Parallel(EVENTMUX_Next_Group, (VOID *)0);
     CONTROL_Invoke_Parallel(dispatch->write, (VOID *)0);
     if (pcfg && (DRV_CONFIG_start_paused(pcfg) == FALSE)) {
         lwpmudrv_Resume();
@@ -1891,7 +1866,7 @@ lwpmudrv_Read_Counters_And_Switch_Group (
 
     // step 7
     // for each processor, increment its current group number
-    CONTROL_Invoke_Parallel(lwpmudrv_Switch_To_Next_Group, (VOID *)(size_t)0);
+    CONTROL_Invoke_Parallel(EVENTMUX_Next_Group, (VOID *)(size_t)0);
     // step 8
     CONTROL_Invoke_Parallel(dispatch->write, (VOID *)(size_t)0);
 #if defined(DRV_IA32) || defined(DRV_EM64T)
@@ -2604,6 +2579,12 @@ lwpmudrv_Start (
     cpu0_TSC = tsc_info[0];
 #endif
 
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Start();
+    }
+#endif
+
     if (DRV_CONFIG_start_paused(pcfg)) {
         GLOBAL_STATE_current_phase(driver_state) = DRV_STATE_PAUSED;
     }
@@ -2631,6 +2612,9 @@ lwpmudrv_Start (
 #endif
 
     EVENTMUX_Start(global_ec);
+#if defined(EMON)
+    EMONTIMER_Start();
+#endif
     lwpmudrv_Dump_Tracer ("start", 0);
 
 
@@ -2674,6 +2658,11 @@ lwpmudrv_Prepare_Stop (
         return OS_SUCCESS;
     }
 
+#if defined(EMON)
+    // the counting timers touch the PMU, so they must be gone before the freeze
+    EMONTIMER_Stop();
+#endif
+
     if (current_state != DRV_STATE_IDLE          &&
         current_state != DRV_STATE_RESERVED) {
         for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
@@ -2689,6 +2678,7 @@ lwpmudrv_Prepare_Stop (
         }
         CONTROL_Invoke_Parallel(dispatch->freeze, (PVOID)(size_t)0);
         SEP_PRINT_DEBUG("lwpmudrv_Prepare_Stop: Outside of all interrupts\n");
+        EVENTMUX_Stop(global_ec);
 
         if (DRV_CONFIG_enable_chipset(pcfg)) {
             cs_dispatch->stop_chipset();
@@ -3661,6 +3651,236 @@ lwpmudrv_Get_Num_Samples (
     return put_user(samples, (U64*)args->r_buf);
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Get_Dropped_Samples(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Returns the number of samples dropped on each cpu because
+ * @brief       its output buffer ring was full
+ *
+ * <I>Special Notes</I>
+ *              r_buf receives one U64 per cpu.  May be called while the
+ *              collection is running.
+ */
+static OS_STATUS
+lwpmudrv_Get_Dropped_Samples (
+    IOCTL_ARGS args
+)
+{
+    S32               cpu_num;
+    U64               dropped;
+
+    if (cpu_buf == NULL) {
+        SEP_PRINT_ERROR("Output buffers were not initialized\n");
+        return OS_FAULT;
+    }
+    if (args->r_buf == NULL ||
+        args->r_len < GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64)) {
+        SEP_PRINT_ERROR("dropped samples buffer has been misconfigured\n");
+        return OS_NO_MEM;
+    }
+
+    for (cpu_num = 0; cpu_num < GLOBAL_STATE_num_cpus(driver_state); cpu_num++) {
+        dropped = OUTPUT_Get_Dropped_Samples(cpu_num);
+        SEP_PRINT_DEBUG("Dropped samples for cpu %d = %lld\n", cpu_num, dropped);
+        if (put_user(dropped, (U64*)args->r_buf + cpu_num)) {
+            return OS_FAULT;
+        }
+    }
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Get_Ready_Buffers(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return number of ready buffers, or an OS_STATUS error
+ *
+ * @brief       Returns the mask of the sample buffers (and the module
+ * @brief       buffer, at index num_cpus) that have data to read
+ *
+ * <I>Special Notes</I>
+ *              r_buf receives OUTPUT_READY_MASK_WORDS(num_cpus) U64 words.
+ */
+static OS_STATUS
+lwpmudrv_Get_Ready_Buffers (
+    IOCTL_ARGS args
+)
+{
+    U32        num_words = OUTPUT_READY_MASK_WORDS(GLOBAL_STATE_num_cpus(driver_state));
+    U64       *ready_mask;
+    OS_STATUS  status;
+
+    if (args->r_buf == NULL || args->r_len < num_words * sizeof(U64)) {
+        SEP_PRINT_ERROR("ready mask buffer has been misconfigured\n");
+        return OS_NO_MEM;
+    }
+    ready_mask = CONTROL_Allocate_Memory(num_words * sizeof(U64));
+    if (!ready_mask) {
+        return OS_NO_MEM;
+    }
+
+    status = OUTPUT_Get_Ready_Buffers(ready_mask, num_words);
+    if (copy_to_user(args->r_buf, ready_mask, num_words * sizeof(U64))) {
+        status = OS_FAULT;
+    }
+    CONTROL_Free_Memory(ready_mask);
+
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Read_Buffers(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return number of bytes read, or an OS_STATUS error
+ *
+ * @brief       Drains the full segments of the buffers selected in w_buf
+ * @brief       into r_buf
+ *
+ * <I>Special Notes</I>
+ *              w_buf holds OUTPUT_READY_MASK_WORDS(num_cpus) U64 words,
+ *              typically the mask returned by DRV_OPERATION_GET_READY_BUFFERS.
+ */
+static OS_STATUS
+lwpmudrv_Read_Buffers (
+    IOCTL_ARGS args
+)
+{
+    U32        num_words = OUTPUT_READY_MASK_WORDS(GLOBAL_STATE_num_cpus(driver_state));
+    U64       *read_mask;
+    OS_STATUS  status;
+
+    if (args->w_buf == NULL || args->w_len < num_words * sizeof(U64) ||
+        args->r_buf == NULL || args->r_len == 0) {
+        SEP_PRINT_ERROR("batched read has been misconfigured\n");
+        return OS_NO_MEM;
+    }
+    read_mask = CONTROL_Allocate_Memory(num_words * sizeof(U64));
+    if (!read_mask) {
+        return OS_NO_MEM;
+    }
+
+    if (copy_from_user(read_mask, args->w_buf, num_words * sizeof(U64))) {
+        status = OS_FAULT;
+    }
+    else {
+        status = OUTPUT_Read_Buffers(args->r_buf, args->r_len, read_mask, num_words);
+    }
+    CONTROL_Free_Memory(read_mask);
+
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Release_Segments(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Hands the segments an mmap consumer has read back to the
+ * @brief       producer of a per-cpu sample ring
+ *
+ * <I>Special Notes</I>
+ *              w_buf holds an OUTPUT_RELEASE_NODE.
+ */
+static OS_STATUS
+lwpmudrv_Release_Segments (
+    IOCTL_ARGS args
+)
+{
+    OUTPUT_RELEASE_NODE  release;
+
+    if (args->w_buf == NULL || args->w_len < sizeof(OUTPUT_RELEASE_NODE)) {
+        SEP_PRINT_ERROR("segment release has been misconfigured\n");
+        return OS_INVALID;
+    }
+    if (copy_from_user(&release, args->w_buf, sizeof(OUTPUT_RELEASE_NODE))) {
+        return OS_FAULT;
+    }
+
+    return OUTPUT_Release_Segments(OUTPUT_RELEASE_cpu_num(&release), OUTPUT_RELEASE_tail(&release));
+}
+
+#if defined(EMON)
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Set_EMON_Timer(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Enable the kernel driven counting mode for the next run
+ *
+ * <I>Special Notes</I>
+ *              w_buf holds an EMON_TIMER_CONFIG_NODE.  Must be issued after
+ *              INIT_PMU and before START of a counting mode collection.
+ */
+static OS_STATUS
+lwpmudrv_Set_EMON_Timer (
+    IOCTL_ARGS args
+)
+{
+    EMON_TIMER_CONFIG_NODE  config;
+
+    if (args->w_buf == NULL || args->w_len < sizeof(EMON_TIMER_CONFIG_NODE)) {
+        SEP_PRINT_ERROR("EMON timer configuration has been misconfigured\n");
+        return OS_NO_MEM;
+    }
+    if (GLOBAL_STATE_current_phase(driver_state) != DRV_STATE_IDLE) {
+        return OS_IN_PROGRESS;
+    }
+    if (!pcfg || DRV_CONFIG_counting_mode(pcfg) == FALSE) {
+        SEP_PRINT_ERROR("[lwpmudrv_Set_EMON_Timer] Not in counting mode!\n");
+        return OS_FAULT;
+    }
+    if (copy_from_user(&config, args->w_buf, sizeof(EMON_TIMER_CONFIG_NODE))) {
+        return OS_FAULT;
+    }
+
+    return EMONTIMER_Initialize(&config);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Read_EMON_Timer(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return number of bytes read, or an OS_STATUS error
+ *
+ * @brief       Drains the records logged by the kernel driven counting mode
+ *
+ * <I>Special Notes</I>
+ *              May be called while the collection is running and after
+ *              it has stopped, until the next collection is set up.
+ */
+static OS_STATUS
+lwpmudrv_Read_EMON_Timer (
+    IOCTL_ARGS args
+)
+{
+    if (args->r_buf == NULL || args->r_len == 0) {
+        SEP_PRINT_ERROR("EMON timer read has been misconfigured\n");
+        return OS_NO_MEM;
+    }
+
+    return EMONTIMER_Read(args->r_buf, args->r_len);
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn  static OS_STATUS lwpmudrv_Set_Device_Num_Units(IOCTL_ARGS arg)
@@ -3920,6 +4140,27 @@ lwpmu_Service_IOCTL (
         return status;
     }
 
+    /*
+     * The buffer readers run concurrently with the control thread
+     * (including a pending stop, which waits for them), so they must not
+     * take the ioctl lock.
+     */
+    if (cmd == DRV_OPERATION_GET_READY_BUFFERS) {
+        SEP_PRINT_DEBUG("DRV_OPERATION_GET_READY_BUFFERS\n");
+        status = lwpmudrv_Get_Ready_Buffers(&local_args);
+        return status;
+    }
+    if (cmd == DRV_OPERATION_READ_BUFFERS) {
+        SEP_PRINT_DEBUG("DRV_OPERATION_READ_BUFFERS\n");
+        status = lwpmudrv_Read_Buffers(&local_args);
+        return status;
+    }
+    if (cmd == DRV_OPERATION_RELEASE_SEGMENTS) {
+        SEP_PRINT_DEBUG("DRV_OPERATION_RELEASE_SEGMENTS\n");
+        status = lwpmudrv_Release_Segments(&local_args);
+        return status;
+    }
+
     MUTEX_LOCK(ioctl_lock);
     switch (cmd) {
 
@@ -4084,6 +4325,16 @@ lwpmu_Service_IOCTL (
             SEP_PRINT_DEBUG("DRV_OPERATION_READ_AND_RESET\n");
             status = lwpmudrv_Read_And_Reset_Counters(&local_args);
             break;
+
+        case DRV_OPERATION_SET_EMON_TIMER:
+            SEP_PRINT_DEBUG("DRV_OPERATION_SET_EMON_TIMER\n");
+            status = lwpmudrv_Set_EMON_Timer(&local_args);
+            break;
+
+        case DRV_OPERATION_READ_EMON_TIMER:
+            SEP_PRINT_DEBUG("DRV_OPERATION_READ_EMON_TIMER\n");
+            status = lwpmudrv_Read_EMON_Timer(&local_args);
+            break;
 #endif
 
 
@@ -4127,6 +4378,20 @@ lwpmu_Service_IOCTL (
             status = lwpmudrv_Get_Num_Samples(&local_args);
             break;
 
+        case DRV_OPERATION_GET_DROPPED_SAMPLES:
+            SEP_PRINT_DEBUG("DRV_OPERATION_GET_DROPPED_SAMPLES\n");
+            status = lwpmudrv_Get_Dropped_Samples(&local_args);
+            break;
+
+        case DRV_OPERATION_GET_EM_GROUP_TIMES:
+            SEP_PRINT_DEBUG("DRV_OPERATION_GET_EM_GROUP_TIMES\n");
+            if (local_args.r_buf == NULL || local_args.r_len == 0) {
+                status = OS_NO_MEM;
+                break;
+            }
+            status = EVENTMUX_Get_Group_Times(local_args.r_buf, local_args.r_len);
+            break;
+
         case DRV_OPERATION_SET_DEVICE_NUM_UNITS:
             SEP_PRINT_DEBUG("DRV_OPERATION_SET_DEVICE_NUM_UNITS\n");
             status = lwpmudrv_Set_Device_Num_Units(&local_args);
@@ -4365,6 +4630,7 @@ static struct file_operations lwpmu_Fops = {
     .compat_ioctl = lwpmu_Device_Control_Compat,
 #endif
     .read =    lwpmu_Read,
+    .poll =    OUTPUT_Poll_Ready,
     .write =   lwpmu_Write,
     .open =    lwpmu_Open,
     .release = NULL,
@@ -4391,6 +4657,8 @@ static struct file_operations lwsamp_Fops = {
     .owner =   THIS_MODULE,
     IOCTL_OP = NULL,                //None needed
     .read =    OUTPUT_Sample_Read,
+    .mmap =    OUTPUT_Sample_Mmap,
+    .poll =    OUTPUT_Sample_Poll,
     .write =   NULL,                //No writing accepted
     .open =    lwpmu_Open,
     .release = NULL,
@@ -4556,6 +4824,13 @@ lwpmu_Load (
     if (total_ram <= OUTPUT_MEMORY_THRESHOLD) {
         output_buffer_size = OUTPUT_SMALL_BUFFER;
     }
+    if (output_num_buffers < OUTPUT_DEFAULT_NUM_BUFFERS) {
+        output_num_buffers = OUTPUT_DEFAULT_NUM_BUFFERS;
+    }
+    if (output_num_buffers > OUTPUT_MAX_NUM_BUFFERS) {
+        output_num_buffers = OUTPUT_MAX_NUM_BUFFERS;
+    }
+    SEP_PRINT_DEBUG("Using %d output buffers of %d bytes per cpu\n", output_num_buffers, output_buffer_size);
 
     MUTEX_INIT(ioctl_lock);
     in_finish_code = 0;
@@ -4618,6 +4893,9 @@ lwpmu_Unload (
     pcb_size            = 0;
     tsc_info            = CONTROL_Free_Memory(tsc_info);
     core_to_package_map = CONTROL_Free_Memory(core_to_package_map);
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    PCI_Unmap_Config_Space();
+#endif
 
 #if defined (DRV_ANDROID)
     unregister_chrdev(MAJOR(lwpmu_DevNum), SEP_DRIVER_NAME);
@@ -34,7 +34,11 @@
 #include <linux/timer.h>
 #include <linux/time.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
@@ -55,6 +59,8 @@
  */
 static wait_queue_head_t flush_queue;
 static atomic_t          flush_writers;
+static DECLARE_WAIT_QUEUE_HEAD(output_ready_queue);
+static DEFINE_MUTEX(output_read_lock);
 extern S32               abnormal_terminate;
 static volatile int      flush = 0;
 #if defined(CONTINUOUS_PROFILER)
@@ -87,13 +93,88 @@ output_Free_Buffers (
     }
     outbuf = &BUFFER_DESC_outbuf(buffer);
     for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
-        CONTROL_Free_Memory(OUTPUT_buffer(outbuf,j));
         OUTPUT_buffer(outbuf,j) = NULL;
     }
+    /*
+     *  Pages still mapped by a collector hold their own references and
+     *  are only given back once the last mapping goes away
+     */
+    if (OUTPUT_area(outbuf)) {
+        vfree(OUTPUT_area(outbuf));
+        OUTPUT_area(outbuf) = NULL;
+    }
+    if (OUTPUT_control(outbuf)) {
+        vfree(OUTPUT_control(outbuf));
+        OUTPUT_control(outbuf) = NULL;
+    }
 
     return;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static VOID output_Signal_Reader (BUFFER_DESC bd)
+ *
+ *  @param  bd            IN buffer that has data for its reader
+ *
+ *  Wake up the reader blocked on this buffer and, if anyone is waiting for
+ *  the aggregated readiness of all the buffers, that waiter as well.
+ *
+ */
+static VOID
+output_Signal_Reader (
+    BUFFER_DESC  bd
+)
+{
+    wake_up_interruptible_sync(&BUFFER_DESC_queue(bd));
+    // pairs with the barrier in the waiter's set_current_state()
+    smp_mb();
+    if (waitqueue_active(&output_ready_queue)) {
+        wake_up_interruptible_sync(&output_ready_queue);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static U32 output_Publish_Segment (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *
+ *  @result TRUE if the producer owns a fresh segment, FALSE if the ring is full
+ *
+ *  Mark the segment currently being filled as full and move the producer to
+ *  the next segment of the ring.  The segment is only handed over when there
+ *  is a free one to move to; otherwise the producer keeps its segment and the
+ *  caller has to drop the record.
+ *
+ * <I>Special Notes:</I>
+ *      Only the producer of the buffer may call this routine.
+ *
+ */
+static U32
+output_Publish_Segment (
+    OUTPUT  outbuf
+)
+{
+    U32  head = OUTPUT_head(outbuf);
+
+    if (head + 1 - OUTPUT_tail(outbuf) >= OUTPUT_NUM_BUFFERS) {
+        return FALSE;
+    }
+    OUTPUT_buffer_full(outbuf, OUTPUT_current_buffer(outbuf)) =
+            OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+    OUTPUT_CONTROL_buffer_full(OUTPUT_control(outbuf), OUTPUT_current_buffer(outbuf)) =
+            OUTPUT_buffer_full(outbuf, OUTPUT_current_buffer(outbuf));
+    // the byte count must be visible before the reader sees the new head
+    smp_wmb();
+    OUTPUT_head(outbuf)                  = head + 1;
+    OUTPUT_CONTROL_head(OUTPUT_control(outbuf)) = head + 1;
+    OUTPUT_current_buffer(outbuf)        = (head + 1) % OUTPUT_NUM_BUFFERS;
+    OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_total_buffer_size(outbuf);
+
+    return TRUE;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *  @fn  int OUTPUT_Reserve_Buffer_Space (OUTPUT      outbuf,
@@ -108,6 +189,13 @@ output_Free_Buffers (
  *  signal the caller that the flush routine needs to be called.
  *
  * <I>Special Notes:</I>
+ *      The segments are zeroed by the reader when they are released, so
+ *      the reserved space is already clear and no memset is needed here.
+ *      Segments consumed through mmap cannot be cleared by the reader, so
+ *      once the buffer has been mapped each reservation is cleared instead.
+ *      If every segment of the ring is waiting for the reader, the record
+ *      is dropped and counted in the dropped_samples of the buffer.
+ *      Nothing can be reserved while the buffers are being flushed.
  *
  */
 extern void*
@@ -119,66 +207,42 @@ OUTPUT_Reserve_Buffer_Space (
     char   *outloc      = NULL;
     OUTPUT  outbuf      = &BUFFER_DESC_outbuf(bd);
 
-#if defined(CONTINUOUS_PROFILER)
+    /*
+     * Once flushed, the partial segment has been handed to the reader and
+     * the producer has no space left. Publishing again would queue an empty
+     * segment, which the reader takes for end of data, so records from
+     * stragglers are dropped in every build, not just CONTINUOUS_PROFILER.
+     * The PMU is frozen and the OS hooks are gone by then.
+     */
     if (flush) {
         return NULL;
     }
-#endif
 
-    if (OUTPUT_remaining_buffer_size(outbuf) >= size) {
-        outloc = (OUTPUT_buffer(outbuf,OUTPUT_current_buffer(outbuf)) +
-          (OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf)));
-    }
-    else {
-        U32  i, j, start;
-        OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-                OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
-
-        //
-        // Massive Naive assumption:  Must find a way to fix it.
-        // In spite of the loop.
-        // The next buffer to fill are monotonically increasing
-        // indicies.
-        //
+    if (OUTPUT_remaining_buffer_size(outbuf) < size) {
 #if defined(CONTINUOUS_PROFILER)
         if (!cp) {
-            signal_full = TRUE;
+            OUTPUT_signal_full(outbuf) = TRUE;
         }
 #else
         OUTPUT_signal_full(outbuf) = TRUE;
 #endif
-
-        start = OUTPUT_current_buffer(outbuf);
-        for (i = start+1; i < start+OUTPUT_NUM_BUFFERS; i++) {
-
-            j = i%OUTPUT_NUM_BUFFERS;
-
-#if defined(CONTINUOUS_PROFILER)
-            //don't check if buffer has data when doing CP
-            if (!OUTPUT_buffer_full(outbuf,j) || cp) {
-#else
-            if (!OUTPUT_buffer_full(outbuf,j)) {
-#endif
-                OUTPUT_current_buffer(outbuf) = j;
-                OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_total_buffer_size(outbuf);
-                outloc = OUTPUT_buffer(outbuf,j);
-            }
-#if !(defined(CONFIG_PREEMPT_RT) || defined(DRV_USE_NMI))
-            else {
-                OUTPUT_signal_full(outbuf) = FALSE;
-                SEP_PRINT_DEBUG("Warning: Output buffers are full. Might be dropping some samples.\n");
-                break;
-            }
-#endif
+        if (!output_Publish_Segment(outbuf)) {
+            OUTPUT_dropped_samples(outbuf)++;
+            OUTPUT_CONTROL_dropped_samples(OUTPUT_control(outbuf)) = OUTPUT_dropped_samples(outbuf);
+            SEP_PRINT_DEBUG("Warning: Output buffers are full. Might be dropping some samples.\n");
         }
     }
-    if (outloc) {
+    if (OUTPUT_remaining_buffer_size(outbuf) >= size) {
+        outloc = (OUTPUT_buffer(outbuf,OUTPUT_current_buffer(outbuf)) +
+          (OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf)));
         OUTPUT_remaining_buffer_size(outbuf) -= size;
-        memset(outloc, 0, size);
+        if (OUTPUT_mmapped(outbuf)) {
+            memset(outloc, 0, size);
+        }
     }
 #if !(defined(CONFIG_PREEMPT_RT) || defined (DRV_USE_NMI))
     if (OUTPUT_signal_full(outbuf)) {
-        wake_up_interruptible_sync(&BUFFER_DESC_queue(bd));
+        output_Signal_Reader(bd);
         OUTPUT_signal_full(outbuf) = FALSE;
     }
 #endif
@@ -186,6 +250,65 @@ OUTPUT_Reserve_Buffer_Space (
     return outloc;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static VOID output_Flush_Segment (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *
+ *  Hand the partially filled segment of a stopped producer to the reader.
+ *
+ * <I>Special Notes:</I>
+ *      The producer must be quiescent.  The ring always keeps one segment
+ *      for the producer, so there is room for it in [tail, head) even when
+ *      all the other segments are full.  No space is left for further
+ *      records until the buffers are initialized again.
+ *
+ */
+static VOID
+output_Flush_Segment (
+    OUTPUT  outbuf
+)
+{
+    U32  used = OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+
+    if (used == 0) {
+        return;
+    }
+    OUTPUT_buffer_full(outbuf, OUTPUT_current_buffer(outbuf)) = used;
+    OUTPUT_CONTROL_buffer_full(OUTPUT_control(outbuf), OUTPUT_current_buffer(outbuf)) = used;
+    smp_wmb();
+    OUTPUT_head(outbuf)++;
+    OUTPUT_CONTROL_head(OUTPUT_control(outbuf)) = OUTPUT_head(outbuf);
+    OUTPUT_current_buffer(outbuf)        = OUTPUT_head(outbuf) % OUTPUT_NUM_BUFFERS;
+    OUTPUT_remaining_buffer_size(outbuf) = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  U64 OUTPUT_Get_Dropped_Samples (S32 cpu_num)
+ *
+ *  @param  cpu_num       IN cpu whose sample buffer is queried
+ *
+ *  @result number of records dropped because the sample ring was full
+ *
+ * <I>Special Notes:</I>
+ *      The counter is written only by the owning cpu; a slightly stale
+ *      value may be returned while sampling is running.
+ *
+ */
+extern U64
+OUTPUT_Get_Dropped_Samples (
+    S32  cpu_num
+)
+{
+    if (cpu_buf == NULL) {
+        return 0;
+    }
+
+    return OUTPUT_dropped_samples(&BUFFER_DESC_outbuf(&cpu_buf[cpu_num]));
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *
@@ -256,6 +379,58 @@ OUTPUT_Module_Fill (
 }
 
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static VOID output_Release_Segment (OUTPUT outbuf, U32 cur_buf, size_t size)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *  @param  cur_buf       IN segment at the tail of the ring
+ *  @param  size          IN number of bytes used in the segment
+ *
+ *  Clear a segment that has been copied out and give it back to the producer.
+ *
+ */
+static VOID
+output_Release_Segment (
+    OUTPUT  outbuf,
+    U32     cur_buf,
+    size_t  size
+)
+{
+    memset(OUTPUT_buffer(outbuf, cur_buf), 0, size);
+    OUTPUT_buffer_full(outbuf, cur_buf) = 0;
+    smp_mb();
+    OUTPUT_tail(outbuf)++;
+    OUTPUT_CONTROL_tail(OUTPUT_control(outbuf)) = OUTPUT_tail(outbuf);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static VOID output_Signal_EOF (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer that has been drained
+ *
+ *  Account for the end of data of a flushed buffer.  Each buffer counted
+ *  by OUTPUT_Flush is accounted once, whichever read path reports it.
+ *
+ */
+static VOID
+output_Signal_EOF (
+    OUTPUT  outbuf
+)
+{
+    DRV_BOOL flush_val;
+
+    if (xchg(&OUTPUT_eof_pending(outbuf), FALSE) == FALSE) {
+        return;
+    }
+    flush_val = atomic_dec_and_test(&flush_writers);
+    SEP_PRINT_DEBUG("output_Signal_EOF decremented flush_writers\n");
+    if (flush_val == TRUE) {
+        wake_up_interruptible_sync(&flush_queue);
+    }
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *  @fn  ssize_t  output_Read(struct file  *filp,
@@ -289,40 +464,37 @@ output_Read (
     BUFFER_DESC   kernel_buf
 )
 {
-    ssize_t  to_copy;
+    ssize_t  to_copy  = 0;
     ssize_t  uncopied;
     OUTPUT   outbuf = &BUFFER_DESC_outbuf(kernel_buf);
-    U32      cur_buf, i;
+    U32      cur_buf;
 
 /* Buffer is filled by output_fill_modules. */
 
-    cur_buf = OUTPUT_current_buffer(outbuf);
-    for (i=0; i<OUTPUT_NUM_BUFFERS; i++) { //iterate through all buffers
-        cur_buf++;
-        if (cur_buf >= OUTPUT_NUM_BUFFERS) { cur_buf = 0; } //circularly
-        if ((to_copy = OUTPUT_buffer_full(outbuf, cur_buf))) {
-            break;
-        }
-    }
-    SEP_PRINT_DEBUG("buffer %d has %d bytes ready\n", (S32)cur_buf, (S32)to_copy);
-    if (!flush && to_copy == 0) {
+    if (!flush && OUTPUT_num_full(outbuf) == 0) {
 #if defined(CONFIG_PREEMPT_RT)
         do {
             unsigned long delay;
             delay = msecs_to_jiffies(1000);
             wait_event_interruptible_timeout(BUFFER_DESC_queue(kernel_buf),
-                                 flush||OUTPUT_buffer_full(outbuf, cur_buf), delay);
-        } while (!(flush||OUTPUT_buffer_full(outbuf, cur_buf)));
+                                 flush||OUTPUT_num_full(outbuf), delay);
+        } while (!(flush||OUTPUT_num_full(outbuf)));
 #else
         if (wait_event_interruptible(BUFFER_DESC_queue(kernel_buf),
-                                 flush||OUTPUT_buffer_full(outbuf, cur_buf))) {
+                                 flush||OUTPUT_num_full(outbuf))) {
             return OS_RESTART_SYSCALL;
         }
 #endif
-        SEP_PRINT_DEBUG("Get to copy\n", (S32)cur_buf);
+        SEP_PRINT_DEBUG("output_Read awakened\n");
+    }
+
+    cur_buf = OUTPUT_tail(outbuf) % OUTPUT_NUM_BUFFERS;
+    if (OUTPUT_num_full(outbuf)) {
+        // pairs with the smp_wmb() in output_Publish_Segment
+        smp_rmb();
         to_copy = OUTPUT_buffer_full(outbuf, cur_buf);
-        SEP_PRINT_DEBUG("output_Read awakened, buffer %d has %d bytes\n",cur_buf, (int)to_copy );
     }
+    SEP_PRINT_DEBUG("buffer %d has %d bytes ready\n", (S32)cur_buf, (S32)to_copy);
 
     /* Ensure that the user's buffer is large enough */
     if (to_copy > count) {
@@ -335,8 +507,10 @@ output_Read (
         uncopied = copy_to_user(buf,
                                 OUTPUT_buffer(outbuf, cur_buf),
                                 to_copy);
-        /* Mark the buffer empty */
-        OUTPUT_buffer_full(outbuf, cur_buf) = 0;
+        if (OUTPUT_num_full(outbuf)) {
+            /* Clear and release the segment back to the producer */
+            output_Release_Segment(outbuf, cur_buf, to_copy);
+        }
         *f_pos += to_copy-uncopied;
         if (uncopied) {
             SEP_PRINT_DEBUG("only copied %d of %lld bytes of module records\n",
@@ -352,11 +526,7 @@ output_Read (
     // At end-of-file, decrement the count of active buffer writers
 
     if (to_copy == 0) {
-        DRV_BOOL flush_val = atomic_dec_and_test(&flush_writers);
-        SEP_PRINT_DEBUG("output_Read decremented flush_writers\n");
-        if (flush_val == TRUE) {
-            wake_up_interruptible_sync(&flush_queue);
-        }
+        output_Signal_EOF(outbuf);
     }
 
     return to_copy;
@@ -607,6 +777,434 @@ OUTPUT_Sample_Read (
 #endif
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  int  OUTPUT_Sample_Mmap(struct file            *filp,
+ *                               struct vm_area_struct  *vma)
+ *
+ *  @brief  Map the sample ring of a cpu into the collector
+ *
+ *  @param *filp   a file pointer
+ *  @param *vma    the user mapping
+ *
+ *  @return OS_SUCCESS, or a negative error
+ *
+ *  Page offset 0 maps the OUTPUT_CONTROL page (head, tail and the byte count
+ *  of each full segment).  Page offset OUTPUT_CONTROL_SEGMENT_PGOFF maps the
+ *  ring segments back to back.  Both mappings are read-only.  The collector
+ *  consumes segments [tail, head) in place and releases them with
+ *  OUTPUT_Release_Segments.
+ *
+ * <I>Special Notes:</I>
+ *      Do not mix read() and mmap consumption on the same device.
+ *      Once mapped, the buffer stays in "mmapped" mode (reservations are
+ *      cleared by the producer) until the driver is unloaded.
+ *      The mappings hold references on the vmalloc_user() pages, so they
+ *      stay valid (if stale) after the buffers have been destroyed.
+ *
+ */
+extern int
+OUTPUT_Sample_Mmap (
+    struct file            *filp,
+    struct vm_area_struct  *vma
+)
+{
+    int            i;
+    OUTPUT         outbuf;
+    unsigned long  size   = vma->vm_end - vma->vm_start;
+
+    i = iminor(filp->f_dentry->d_inode); // kernel pointer - not user pointer
+    SEP_PRINT_DEBUG("mmap request for samples on minor %d, pgoff %lu, size %lu\n", i, vma->vm_pgoff, size);
+
+    if (cpu_buf == NULL || i < 0 || i >= GLOBAL_STATE_num_cpus(driver_state) ||
+        OUTPUT_control(&BUFFER_DESC_outbuf(&cpu_buf[i])) == NULL) {
+        SEP_PRINT_ERROR("OUTPUT_Sample_Mmap: output buffers are not initialized\n");
+        return OS_FAULT;
+    }
+    outbuf = &BUFFER_DESC_outbuf(&cpu_buf[i]);
+
+    // the consumer hands its tail back through OUTPUT_Release_Segments only
+    if (vma->vm_flags & VM_WRITE) {
+        SEP_PRINT_ERROR("OUTPUT_Sample_Mmap: sample buffers can only be mapped read-only\n");
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_RESERVED;
+#endif
+
+    if (vma->vm_pgoff == 0) {
+        if (size != PAGE_SIZE) {
+            return OS_INVALID;
+        }
+        return remap_vmalloc_range(vma, OUTPUT_control(outbuf), 0);
+    }
+
+    if (vma->vm_pgoff != OUTPUT_CONTROL_SEGMENT_PGOFF ||
+        size > OUTPUT_segment_stride(outbuf) * OUTPUT_NUM_BUFFERS) {
+        return OS_INVALID;
+    }
+
+    // clear the reservations before the collector can skip the read() path
+    OUTPUT_mmapped(outbuf) = TRUE;
+
+    return remap_vmalloc_range(vma, OUTPUT_area(outbuf), 0);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  OS_STATUS  OUTPUT_Release_Segments(U32 cpu_num, U32 tail)
+ *
+ *  @brief  Give the segments an mmap consumer is done with back to the producer
+ *
+ *  @param  cpu_num   cpu whose sample ring is consumed
+ *  @param  tail      the consumer's new tail
+ *
+ *  @return OS_SUCCESS, or OS_INVALID if tail is outside [tail, head]
+ *
+ * <I>Special Notes:</I>
+ *      The tail only moves forward and never past head, so the producer
+ *      cannot be made to overwrite segments that have not been consumed.
+ *      The producer clears the reservations of a mapped ring, so the
+ *      released segments are not zeroed here.
+ *
+ */
+extern OS_STATUS
+OUTPUT_Release_Segments (
+    U32  cpu_num,
+    U32  tail
+)
+{
+    OUTPUT  outbuf;
+    U32     cur_buf;
+
+    if (cpu_buf == NULL || cpu_num >= (U32)GLOBAL_STATE_num_cpus(driver_state)) {
+        return OS_INVALID;
+    }
+    outbuf = &BUFFER_DESC_outbuf(&cpu_buf[cpu_num]);
+    if (OUTPUT_control(outbuf) == NULL || !OUTPUT_mmapped(outbuf)) {
+        return OS_INVALID;
+    }
+
+    if (mutex_lock_interruptible(&output_read_lock)) {
+        return OS_RESTART_SYSCALL;
+    }
+    if (tail - OUTPUT_tail(outbuf) > OUTPUT_head(outbuf) - OUTPUT_tail(outbuf)) {
+        mutex_unlock(&output_read_lock);
+        SEP_PRINT_ERROR("OUTPUT_Release_Segments: tail %u of cpu %u is outside [%u, %u]\n",
+                        tail, cpu_num, OUTPUT_tail(outbuf), OUTPUT_head(outbuf));
+        return OS_INVALID;
+    }
+    while (OUTPUT_tail(outbuf) != tail) {
+        cur_buf = OUTPUT_tail(outbuf) % OUTPUT_NUM_BUFFERS;
+        OUTPUT_buffer_full(outbuf, cur_buf) = 0;
+        // the consumer is done with the segment before the producer may reuse it
+        smp_mb();
+        OUTPUT_tail(outbuf)++;
+    }
+    OUTPUT_CONTROL_tail(OUTPUT_control(outbuf)) = OUTPUT_tail(outbuf);
+    mutex_unlock(&output_read_lock);
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  unsigned int  OUTPUT_Sample_Poll(struct file  *filp,
+ *                                        poll_table   *wait)
+ *
+ *  @brief  Report whether the sample ring of a cpu has full segments
+ *
+ *  @param *filp   a file pointer
+ *  @param *wait   the poll table
+ *
+ *  @return POLLIN when at least one segment is full or a flush is pending
+ *
+ * <I>Special Notes:</I>
+ *      Lets an mmap consumer sleep until data is available without
+ *      going through read().
+ *
+ */
+extern unsigned int
+OUTPUT_Sample_Poll (
+    struct file  *filp,
+    poll_table   *wait
+)
+{
+    int          i;
+    OUTPUT       outbuf;
+
+    i = iminor(filp->f_dentry->d_inode); // kernel pointer - not user pointer
+    if (cpu_buf == NULL || i < 0 || i >= GLOBAL_STATE_num_cpus(driver_state) ||
+        OUTPUT_control(&BUFFER_DESC_outbuf(&cpu_buf[i])) == NULL) {
+        return POLLERR;
+    }
+    outbuf = &BUFFER_DESC_outbuf(&cpu_buf[i]);
+
+    poll_wait(filp, &BUFFER_DESC_queue(&cpu_buf[i]), wait);
+    if (flush || OUTPUT_num_full(outbuf)) {
+        return POLLIN | POLLRDNORM;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static BUFFER_DESC output_Buffer_Desc (U32 index)
+ *
+ *  @param  index   buffer index: a cpu number, or num_cpus for the module buffer
+ *
+ *  @return the buffer, or NULL if it does not exist or is not initialized
+ *
+ */
+static BUFFER_DESC
+output_Buffer_Desc (
+    U32  index
+)
+{
+    BUFFER_DESC  bd = NULL;
+
+    if (index < (U32)GLOBAL_STATE_num_cpus(driver_state)) {
+        if (cpu_buf != NULL) {
+            bd = &cpu_buf[index];
+        }
+    }
+    else if (index == (U32)GLOBAL_STATE_num_cpus(driver_state)) {
+        bd = module_buf;
+    }
+    if (bd == NULL || OUTPUT_control(&BUFFER_DESC_outbuf(bd)) == NULL) {
+        return NULL;
+    }
+
+    return bd;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static DRV_BOOL output_Buffer_Ready (BUFFER_DESC bd)
+ *
+ *  @return TRUE if a read of the buffer would not block
+ *
+ */
+static DRV_BOOL
+output_Buffer_Ready (
+    BUFFER_DESC  bd
+)
+{
+    OUTPUT  outbuf = &BUFFER_DESC_outbuf(bd);
+
+    return (OUTPUT_num_full(outbuf) || (flush && OUTPUT_eof_pending(outbuf))) ? TRUE : FALSE;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  U32  OUTPUT_Get_Ready_Buffers(U64 *ready_mask, U32 num_words)
+ *
+ *  @brief  Build the mask of the buffers that have full segments
+ *
+ *  @param  ready_mask   OUT one bit per buffer index
+ *  @param  num_words    IN  number of U64 words in ready_mask
+ *
+ *  @return number of ready buffers
+ *
+ * <I>Special Notes:</I>
+ *      Buffer index num_cpus is the module buffer.  After a flush, a buffer
+ *      is also ready until its end of data has been read.
+ *
+ */
+extern U32
+OUTPUT_Get_Ready_Buffers (
+    U64  *ready_mask,
+    U32   num_words
+)
+{
+    U32          i, n;
+    U32          num_ready = 0;
+    BUFFER_DESC  bd;
+
+    memset(ready_mask, 0, num_words * sizeof(U64));
+    n = min_t(U32, num_words * 64, GLOBAL_STATE_num_cpus(driver_state) + 1);
+    for (i = 0; i < n; i++) {
+        bd = output_Buffer_Desc(i);
+        if (bd && output_Buffer_Ready(bd)) {
+            ready_mask[i / 64] |= (U64)1 << (i % 64);
+            num_ready++;
+        }
+    }
+
+    return num_ready;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  unsigned int  OUTPUT_Poll_Ready(struct file  *filp,
+ *                                       poll_table   *wait)
+ *
+ *  @brief  Report whether any sample or module buffer has data
+ *
+ *  @param *filp   a file pointer
+ *  @param *wait   the poll table
+ *
+ *  @return POLLIN when at least one buffer is ready
+ *
+ * <I>Special Notes:</I>
+ *      A single collector thread can wait here for all the cpus, then use
+ *      OUTPUT_Get_Ready_Buffers/OUTPUT_Read_Buffers to drain them.
+ *
+ */
+extern unsigned int
+OUTPUT_Poll_Ready (
+    struct file  *filp,
+    poll_table   *wait
+)
+{
+    U32          i, n;
+    BUFFER_DESC  bd;
+
+    poll_wait(filp, &output_ready_queue, wait);
+
+    n = (U32)GLOBAL_STATE_num_cpus(driver_state) + 1;
+    for (i = 0; i < n; i++) {
+        bd = output_Buffer_Desc(i);
+        if (bd && output_Buffer_Ready(bd)) {
+            return POLLIN | POLLRDNORM;
+        }
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  static ssize_t  output_Read_Buffers(char    *buf,
+ *                                           size_t   count,
+ *                                           U64     *read_mask,
+ *                                           U32      num_words)
+ *
+ *  @brief  Body of OUTPUT_Read_Buffers, called with output_read_lock held
+ *
+ */
+static ssize_t
+output_Read_Buffers (
+    char    *buf,
+    size_t   count,
+    U64     *read_mask,
+    U32      num_words
+)
+{
+    U32                          i, n, cur_buf;
+    size_t                       to_copy;
+    size_t                       total     = 0;
+    DRV_BOOL                     too_small = FALSE;
+    BUFFER_DESC                  bd;
+    OUTPUT                       outbuf;
+    OUTPUT_SEGMENT_HEADER_NODE   header;
+
+    if (abnormal_terminate) {
+        return 0;
+    }
+
+    n = min_t(U32, num_words * 64, GLOBAL_STATE_num_cpus(driver_state) + 1);
+    for (i = 0; i < n; i++) {
+        if (!(read_mask[i / 64] & ((U64)1 << (i % 64)))) {
+            continue;
+        }
+        bd = output_Buffer_Desc(i);
+        if (bd == NULL) {
+            continue;
+        }
+        outbuf = &BUFFER_DESC_outbuf(bd);
+        OUTPUT_SEGMENT_HEADER_buffer_index(&header) = i;
+
+        while (OUTPUT_num_full(outbuf)) {
+            cur_buf = OUTPUT_tail(outbuf) % OUTPUT_NUM_BUFFERS;
+            // pairs with the smp_wmb() in output_Publish_Segment
+            smp_rmb();
+            to_copy = OUTPUT_buffer_full(outbuf, cur_buf);
+            if (total + sizeof(header) + to_copy > count) {
+                too_small = TRUE;
+                goto done;
+            }
+            OUTPUT_SEGMENT_HEADER_size(&header) = (U32)to_copy;
+            if (copy_to_user(buf + total, &header, sizeof(header)) ||
+                copy_to_user(buf + total + sizeof(header), OUTPUT_buffer(outbuf, cur_buf), to_copy)) {
+                return OS_FAULT;
+            }
+            output_Release_Segment(outbuf, cur_buf, to_copy);
+            total += sizeof(header) + to_copy;
+        }
+
+        if (flush && OUTPUT_eof_pending(outbuf)) {
+            if (total + sizeof(header) > count) {
+                too_small = TRUE;
+                goto done;
+            }
+            OUTPUT_SEGMENT_HEADER_size(&header) = 0;
+            if (copy_to_user(buf + total, &header, sizeof(header))) {
+                return OS_FAULT;
+            }
+            total += sizeof(header);
+            output_Signal_EOF(outbuf);
+        }
+    }
+
+done:
+    if (total == 0 && too_small) {
+        SEP_PRINT_DEBUG("user buffer is too small\n");
+        return OS_NO_MEM;
+    }
+
+    return total;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  ssize_t  OUTPUT_Read_Buffers(char    *buf,
+ *                                    size_t   count,
+ *                                    U64     *read_mask,
+ *                                    U32      num_words)
+ *
+ *  @brief  Drain the full segments of several buffers in one call
+ *
+ *  @param *buf        user buffer
+ *  @param  count      size of the user's buffer
+ *  @param *read_mask  buffers to drain, one bit per buffer index
+ *  @param  num_words  number of U64 words in read_mask
+ *
+ *  @return number of bytes read, or a negative error
+ *
+ *  Every segment is preceded by an OUTPUT_SEGMENT_HEADER_NODE.  Once a
+ *  flushed buffer is drained, a header of size 0 reports its end of data.
+ *  Never waits for data; wait with poll() on the control device first.
+ *
+ * <I>Special Notes:</I>
+ *      Callers are serialized on output_read_lock.
+ *      Do not read a buffer through both this call and its own device.
+ *
+ */
+extern ssize_t
+OUTPUT_Read_Buffers (
+    char    *buf,
+    size_t   count,
+    U64     *read_mask,
+    U32      num_words
+)
+{
+    ssize_t  res;
+
+    // concurrent readers would release the same segment twice
+    if (mutex_lock_interruptible(&output_read_lock)) {
+        return OS_RESTART_SYSCALL;
+    }
+    res = output_Read_Buffers(buf, count, read_mask, num_words);
+    mutex_unlock(&output_read_lock);
+
+    return res;
+}
+
 /*
  *  @fn output_Initialized_Buffers()
  *
@@ -620,6 +1218,7 @@ OUTPUT_Sample_Read (
  * <I>Special Notes:</I>
  *     Multiple (OUTPUT_NUM_BUFFERS) buffers will be allocated
  *     Each buffer is of size (OUTPUT_BUFFER_SIZE)
+ *     The ring indices and the dropped sample count are reset
  *     Each field in the buffer is initialized
  *     The event queue for the OUTPUT is initialized
  *
@@ -645,24 +1244,50 @@ output_Initialized_Buffers (
     }
     outbuf = &(BUFFER_DESC_outbuf(desc));
     spin_lock_init(&OUTPUT_buffer_lock(outbuf));
-    for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
-        if (OUTPUT_buffer(outbuf,j) == NULL) {
-            OUTPUT_buffer(outbuf,j) = CONTROL_Allocate_Memory(OUTPUT_BUFFER_SIZE * factor);
+    OUTPUT_total_buffer_size(outbuf)     = OUTPUT_BUFFER_SIZE * factor;
+    /*
+     *  The control page and the segments are mapped into the collector.
+     *  vmalloc_user() gives zeroed, page aligned memory whose pages the
+     *  mappings can take references on.
+     */
+    if (OUTPUT_control(outbuf) == NULL) {
+        OUTPUT_control(outbuf) = (OUTPUT_CONTROL)vmalloc_user(PAGE_SIZE);
+        if (!OUTPUT_control(outbuf)) {
+            SEP_PRINT_DEBUG("OUTPUT Initialize_Buffer: Failed Allocation\n");
+            return NULL;
         }
-        OUTPUT_buffer_full(outbuf,j) = 0;
-        if (!OUTPUT_buffer(outbuf,j)) {
+    }
+    else {
+        memset(OUTPUT_control(outbuf), 0, PAGE_SIZE);
+    }
+    if (OUTPUT_area(outbuf) == NULL) {
+        OUTPUT_area(outbuf) = vmalloc_user(OUTPUT_segment_stride(outbuf) * OUTPUT_NUM_BUFFERS);
+        if (!OUTPUT_area(outbuf)) {
             SEP_PRINT_DEBUG("OUTPUT Initialize_Buffer: Failed Allocation\n");
             /*return NULL to tell the caller that allocation failed*/
             return NULL;
         }
     }
+    else {
+        // reserved space is expected to be zeroed; a previous run may have left data behind
+        memset(OUTPUT_area(outbuf), 0, OUTPUT_segment_stride(outbuf) * OUTPUT_NUM_BUFFERS);
+    }
+    for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
+        OUTPUT_buffer(outbuf,j)      = OUTPUT_area(outbuf) + j * OUTPUT_segment_stride(outbuf);
+        OUTPUT_buffer_full(outbuf,j) = 0;
+    }
     /*
      *  Initialize the remaining fields in the BUFFER_DESC
      */
     OUTPUT_current_buffer(outbuf)        = 0;
+    OUTPUT_head(outbuf)                  = 0;
+    OUTPUT_tail(outbuf)                  = 0;
+    OUTPUT_dropped_samples(outbuf)       = 0;
     OUTPUT_signal_full(outbuf)           = FALSE;
     OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_BUFFER_SIZE * factor;
-    OUTPUT_total_buffer_size(outbuf)     = OUTPUT_BUFFER_SIZE * factor;
+    OUTPUT_CONTROL_num_buffers(OUTPUT_control(outbuf))    = OUTPUT_NUM_BUFFERS;
+    OUTPUT_CONTROL_buffer_size(OUTPUT_control(outbuf))    = OUTPUT_total_buffer_size(outbuf);
+    OUTPUT_CONTROL_segment_stride(OUTPUT_control(outbuf)) = OUTPUT_segment_stride(outbuf);
     init_waitqueue_head(&BUFFER_DESC_queue(desc));
     return(desc);
 }
@@ -697,7 +1322,7 @@ output_Timer_Callback (
     }
 
     if (OUTPUT_signal_full(outbuf)) {
-        wake_up_interruptible_sync(&BUFFER_DESC_queue(module_buf));
+        output_Signal_Reader(module_buf);
         OUTPUT_signal_full(outbuf) = FALSE;
     }
     if (cpu_buf != NULL) {
@@ -708,7 +1333,7 @@ output_Timer_Callback (
                 return;
             }
             if (OUTPUT_signal_full(outbuf)) {
-                wake_up_interruptible_sync(&BUFFER_DESC_queue(&cpu_buf[i]));
+                output_Signal_Reader(&cpu_buf[i]);
                 OUTPUT_signal_full(outbuf) = FALSE;
             }
         }
@@ -856,16 +1481,27 @@ OUTPUT_Flush (
         }
         outbuf = &(cpu_buf[i].outbuf);
         writers += 1;
+        OUTPUT_eof_pending(outbuf) = TRUE;
 #if defined(CONTINUOUS_PROFILER)
         if (!cp) {
-            OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-                OUTPUT_BUFFER_SIZE - OUTPUT_remaining_buffer_size(outbuf);
+            output_Flush_Segment(outbuf);
         }
 #else
-        OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-            OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+        output_Flush_Segment(outbuf);
 #endif
     }
+
+    // Flush all data from the module buffers
+
+    outbuf = &BUFFER_DESC_outbuf(module_buf);
+    OUTPUT_eof_pending(outbuf) = TRUE;
+#if defined(CONTINUOUS_PROFILER)
+    if (!cp) {
+        output_Flush_Segment(outbuf);
+    }
+#else
+    output_Flush_Segment(outbuf);
+#endif
     atomic_set(&flush_writers, writers + OTHER_C_DEVICES);
     // Flip the switch to terminate the output threads
     // Do not do this earlier, as threads may terminate before all the data is flushed
@@ -874,34 +1510,14 @@ OUTPUT_Flush (
         if (CPU_STATE_initial_mask(&pcb[i]) == 0) {
             continue;
         }
-        outbuf = &BUFFER_DESC_outbuf(&cpu_buf[i]);
 #if defined(CONTINUOUS_PROFILER)
-        if (!cp) {
-            OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-                OUTPUT_BUFFER_SIZE - OUTPUT_remaining_buffer_size(outbuf);
-        }
         SEP_PRINT("OUTPUT_Flush - waking up cpu_buf[%d]\n", i);
-#else
-        OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-            OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
 #endif
-        wake_up_interruptible_sync(&BUFFER_DESC_queue(&cpu_buf[i]));
+        output_Signal_Reader(&cpu_buf[i]);
     }
 
-    // Flush all data from the module buffers
-
-    outbuf = &BUFFER_DESC_outbuf(module_buf);
-#if defined(CONTINUOUS_PROFILER)
-    if (!cp) {
-        OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-            OUTPUT_BUFFER_SIZE - OUTPUT_remaining_buffer_size(outbuf);
-    }
-#else
-    OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) =
-                              OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
-#endif
     SEP_PRINT_DEBUG("OUTPUT_Flush - waking up module_queue\n");
-    wake_up_interruptible_sync(&BUFFER_DESC_queue(module_buf));
+    output_Signal_Reader(module_buf);
 
     //Wait for buffers to empty
     if (wait_event_interruptible(flush_queue, atomic_read(&flush_writers)==0)) {
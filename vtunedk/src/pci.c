@@ -27,8 +27,12 @@
 **COPYRIGHT*/
 
 #include "lwpmudrv_defines.h"
+#include <linux/version.h>
 #include <linux/errno.h>
 #include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/acpi.h>
 #include <asm/page.h>
 #include <asm/io.h>
 
@@ -39,8 +43,24 @@
 #include "lwpmudrv_chipset.h"
 
 #include "lwpmudrv.h"
+#include "control.h"
 #include "pci.h"
 
+/*
+ * CF8/CFC accesses are two-step, serialize the driver's own users.
+ */
+static DEFINE_SPINLOCK(pci_io_lock);
+
+/*
+ * ECAM (MMCONFIG) state: physical base of segment 0 from the ACPI MCFG table,
+ * and per-bus tables of mapped device/function config spaces, indexed by devfn.
+ */
+static U64            pci_ecam_base      = 0;
+static U32            pci_ecam_start_bus = 0;
+static U32            pci_ecam_end_bus   = 0;
+static DRV_BOOL       pci_ecam_probed    = FALSE;
+static VOID __iomem **pci_ecam_map[MAX_BUSNO];
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn extern int PCI_Read_From_Memory_Address(addr, val)
@@ -144,10 +164,13 @@ PCI_Read_Ulong (
     U32 pci_address
 )
 {
-    U32 temp_ulong = 0;
+    U32           temp_ulong = 0;
+    unsigned long flags;
 
+    spin_lock_irqsave(&pci_io_lock, flags);
     outl(pci_address,PCI_ADDR_IO);
     temp_ulong = inl(PCI_DATA_IO);
+    spin_unlock_irqrestore(&pci_io_lock, flags);
 
     return temp_ulong;
 }
@@ -171,8 +194,203 @@ PCI_Write_Ulong (
     U32 value
 )
 {
+    unsigned long flags;
+
+    spin_lock_irqsave(&pci_io_lock, flags);
     outl(pci_address, PCI_ADDR_IO);
     outl(value, PCI_DATA_IO);
+    spin_unlock_irqrestore(&pci_io_lock, flags);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static VOID pci_Probe_ECAM(VOID)
+ *
+ * @param   None
+ *
+ * @return  None
+ *
+ * @brief   Find the ECAM base of PCI segment 0 in the ACPI MCFG table
+ *
+ */
+static VOID
+pci_Probe_ECAM (
+    VOID
+)
+{
+#if defined(CONFIG_ACPI)
+    struct acpi_table_header     *hdr = NULL;
+    struct acpi_mcfg_allocation  *cfg;
+    U32                           n, i;
+
+    if (pci_ecam_probed) {
+        return;
+    }
+    pci_ecam_probed = TRUE;
+
+    if (ACPI_FAILURE(acpi_get_table(ACPI_SIG_MCFG, 0, &hdr)) || hdr == NULL) {
+        SEP_PRINT_DEBUG("pci_Probe_ECAM: no MCFG table, using port I/O\n");
+        return;
+    }
+    n   = (hdr->length - sizeof(struct acpi_table_mcfg)) / sizeof(struct acpi_mcfg_allocation);
+    cfg = (struct acpi_mcfg_allocation *)((S8 *)hdr + sizeof(struct acpi_table_mcfg));
+    for (i = 0; i < n; i++, cfg++) {
+        if (cfg->pci_segment == 0 && cfg->address) {
+            pci_ecam_base      = cfg->address;
+            pci_ecam_start_bus = cfg->start_bus_number;
+            pci_ecam_end_bus   = cfg->end_bus_number;
+            SEP_PRINT_DEBUG("pci_Probe_ECAM: base 0x%llx, buses %d-%d\n",
+                            pci_ecam_base, pci_ecam_start_bus, pci_ecam_end_bus);
+            break;
+        }
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+    acpi_put_table(hdr);
+#endif
+#else
+    pci_ecam_probed = TRUE;
+#endif
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn extern VOID PCI_Map_Config_Space(bus, dev, func)
+ *
+ * @param   bus   - bus number
+ * @param   dev   - device number
+ * @param   func  - function number
+ *
+ * @return  None
+ *
+ * @brief   Map the 4K config space of a device through ECAM, if available
+ *
+ * <I>Special Notes:</I>
+ *          Called in process context when scanning for uncore devices.
+ *          Devices that are not mapped keep using port I/O.
+ */
+extern VOID
+PCI_Map_Config_Space (
+    U32 bus,
+    U32 dev,
+    U32 func
+)
+{
+    U32           devfn = ((dev & 0x1F) << 3) | (func & 0x07);
+    VOID __iomem *va;
+
+    pci_Probe_ECAM();
+    if (!pci_ecam_base || bus >= MAX_BUSNO ||
+        bus < pci_ecam_start_bus || bus > pci_ecam_end_bus) {
+        return;
+    }
+    if (!pci_ecam_map[bus]) {
+        pci_ecam_map[bus] = CONTROL_Allocate_Memory(MAX_DEVFN * sizeof(VOID __iomem *));
+        if (!pci_ecam_map[bus]) {
+            return;
+        }
+        memset(pci_ecam_map[bus], 0, MAX_DEVFN * sizeof(VOID __iomem *));
+    }
+    if (pci_ecam_map[bus][devfn]) {
+        return;
+    }
+    // the MCFG base address is that of bus 0, even when the segment starts higher
+    va = ioremap_nocache(pci_ecam_base + (((U64)bus << 20) | ((U64)devfn << 12)),
+                         PCI_CONFIG_SPACE_SIZE);
+    if (va) {
+        pci_ecam_map[bus][devfn] = va;
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn extern VOID PCI_Unmap_Config_Space(VOID)
+ *
+ * @param   None
+ *
+ * @return  None
+ *
+ * @brief   Drop all of the ECAM mappings
+ *
+ */
+extern VOID
+PCI_Unmap_Config_Space (
+    VOID
+)
+{
+    U32 bus, devfn;
+
+    for (bus = 0; bus < MAX_BUSNO; bus++) {
+        if (!pci_ecam_map[bus]) {
+            continue;
+        }
+        for (devfn = 0; devfn < MAX_DEVFN; devfn++) {
+            if (pci_ecam_map[bus][devfn]) {
+                iounmap(pci_ecam_map[bus][devfn]);
+            }
+        }
+        pci_ecam_map[bus] = CONTROL_Free_Memory(pci_ecam_map[bus]);
+    }
 
     return;
 }
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn extern U64 PCI_Read_U64(bus, dev, func, offset)
+ *
+ * @param   bus     - bus number
+ * @param   dev     - device number
+ * @param   func    - function number
+ * @param   offset  - config space offset of the low dword
+ *
+ * @return  the 64-bit value at offset
+ *
+ * @brief   Read a 64-bit counter from PCI configuration space
+ *
+ * <I>Special Notes:</I>
+ *          Reads both dwords, through ECAM if the device is mapped and
+ *          through port I/O otherwise, and re-reads the low dword to
+ *          detect a wrap in between.
+ */
+extern U64
+PCI_Read_U64 (
+    U32 bus,
+    U32 dev,
+    U32 func,
+    U32 offset
+)
+{
+    U32           devfn = ((dev & 0x1F) << 3) | (func & 0x07);
+    VOID __iomem *va    = (bus < MAX_BUSNO && pci_ecam_map[bus]) ? pci_ecam_map[bus][devfn] : NULL;
+    U64           value_low, value_high, value_lo_2;
+
+    if (va) {
+        // config space only takes dword accesses on many host bridges
+        value_low  = readl(va + offset);
+        value_high = readl(va + offset + NEXT_ADDR_OFFSET);
+        value_lo_2 = readl(va + offset);
+        if (value_lo_2 < value_low) {
+            value_low  = value_lo_2;
+            value_high = readl(va + offset + NEXT_ADDR_OFFSET);
+        }
+        return (value_high << NEXT_ADDR_SHIFT) | value_low;
+    }
+
+    value_low  = LOWER_4_BYTES_MASK & PCI_Read_Ulong(FORM_PCI_ADDR(bus, dev, func, offset));
+    value_high = (U64)PCI_Read_Ulong(FORM_PCI_ADDR(bus, dev, func, offset + NEXT_ADDR_OFFSET));
+    // Now we have to check if the lower 32 bits overflowed in between the reads
+    value_lo_2 = LOWER_4_BYTES_MASK & PCI_Read_Ulong(FORM_PCI_ADDR(bus, dev, func, offset));
+    if (value_lo_2 < value_low) {
+        // overflow occurred, use new lower bits and reread the top bits as well.
+        value_low  = value_lo_2;
+        value_high = (U64)PCI_Read_Ulong(FORM_PCI_ADDR(bus, dev, func, offset + NEXT_ADDR_OFFSET));
+    }
+
+    return (value_high << NEXT_ADDR_SHIFT) | value_low;
+}
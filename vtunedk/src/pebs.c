@@ -38,11 +38,17 @@
 #include "control.h"
 #include "core2.h"
 #include "utility.h"
+#include "ecb_iterators.h"
+#include "msrdefs.h"
 #include "pebs.h"
 
 static PEBS_DISPATCH  pebs_dispatch           = NULL;
 static PVOID          pebs_global_memory      = NULL;
 static size_t         pebs_global_memory_size = 0;
+static U32            pebs_record_length      = 0;
+static U32            pebs_batch              = 1;
+static S8            *pebs_template           = NULL;
+static U32            pebs_template_size      = 0;
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -62,7 +68,7 @@ pebs_Corei7_Initialize_Threshold (
     U32              pebs_record_size
 )
 {
-    DTS_BUFFER_EXT_pebs_threshold(dts)  = DTS_BUFFER_EXT_pebs_base(dts) + pebs_record_size;
+    DTS_BUFFER_EXT_pebs_threshold(dts)  = DTS_BUFFER_EXT_pebs_base(dts) + pebs_batch * pebs_record_size;
 
     return;
 }
@@ -80,7 +86,8 @@ pebs_Corei7_Initialize_Threshold (
  * <I>Special Notes:</I>
  *    Check the global overflow field of the buffer descriptor.
  *    Precise events can be allocated on any of the 4 general purpose
- *    registers.
+ *    registers. In batched mode, the overflow fields of all of the
+ *    records in the buffer are merged.
  */
 static U64
 pebs_Corei7_Overflow (
@@ -89,16 +96,17 @@ pebs_Corei7_Overflow (
 )
 {
     DTS_BUFFER_EXT   dtes     = CPU_STATE_dts_buffer(&pcb[this_cpu]);
-    U8               status   = FALSE;
-    PEBS_REC_EXT     pebs_base;
+    S8              *pebs_rec;
+    S8              *pebs_index;
 
     if (!dtes) {
         return overflow_status;
     }
-    status = (U8)((dtes) && (DTS_BUFFER_EXT_pebs_index(dtes) != DTS_BUFFER_EXT_pebs_base(dtes)));
-    if (status) {
-        pebs_base = (PEBS_REC_EXT)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        overflow_status  |= PEBS_REC_EXT_glob_perf_overflow(pebs_base);
+    pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
+    for (pebs_rec  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
+         pebs_rec + pebs_record_length <= pebs_index;
+         pebs_rec += pebs_record_length) {
+        overflow_status |= PEBS_REC_EXT_glob_perf_overflow((PEBS_REC_EXT)pebs_rec);
     }
 
     return overflow_status;
@@ -166,12 +174,13 @@ pebs_Core2_Overflow (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID pebs_Modify_IP (sample, is_64bit_addr)
+ * @fn          VOID pebs_Modify_IP (sample, is_64bit_addr, pebs_rec)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       pebs_rec      - the PEBS record
  *
  * @return      NONE
  *
@@ -181,26 +190,21 @@ pebs_Core2_Overflow (
 static VOID
 pebs_Modify_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    S8          *pebs_rec
 )
 {
     SampleRecordPC  *psamp = sample;
-    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
 
-    if (dtes && psamp) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
-        SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index) {
-            PEBS_REC_EXT  pb = (PEBS_REC_EXT)pebs_base;
-            if (is_64bit_addr) {
-                SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT_linear_ip(pb);
-                SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT_r_flags(pb);
-            }
-            else {
-                SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT_linear_ip(pb) & 0xFFFFFFFF;
-                SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT_r_flags(pb) & 0xFFFFFFFF;
-            }
+    if (pebs_rec && psamp) {
+        PEBS_REC_EXT  pb = (PEBS_REC_EXT)pebs_rec;
+        if (is_64bit_addr) {
+            SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT_linear_ip(pb);
+            SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT_r_flags(pb);
+        }
+        else {
+            SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT_linear_ip(pb) & 0xFFFFFFFF;
+            SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT_r_flags(pb) & 0xFFFFFFFF;
         }
     }
 
@@ -209,12 +213,13 @@ pebs_Modify_IP (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID pebs_Modify_IP_With_Eventing_IP (sample, is_64bit_addr)
+ * @fn          VOID pebs_Modify_IP_With_Eventing_IP (sample, is_64bit_addr, pebs_rec)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       pebs_rec      - the PEBS record
  *
  * @return      NONE
  *
@@ -224,26 +229,21 @@ pebs_Modify_IP (
 static VOID
 pebs_Modify_IP_With_Eventing_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    S8          *pebs_rec
 )
 {
     SampleRecordPC  *psamp = sample;
-    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
 
-    if (dtes && psamp) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
-        SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index) {
-            PEBS_REC_EXT1  pb = (PEBS_REC_EXT1)pebs_base;
-            if (is_64bit_addr) {
-                SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb);
-                SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT1_r_flags(pb);
-            }
-            else {
-                SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb) & 0xFFFFFFFF;
-                SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT1_r_flags(pb) & 0xFFFFFFFF;
-            }
+    if (pebs_rec && psamp) {
+        PEBS_REC_EXT1  pb = (PEBS_REC_EXT1)pebs_rec;
+        if (is_64bit_addr) {
+            SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb);
+            SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT1_r_flags(pb);
+        }
+        else {
+            SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb) & 0xFFFFFFFF;
+            SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT1_r_flags(pb) & 0xFFFFFFFF;
         }
     }
 
@@ -252,11 +252,12 @@ pebs_Modify_IP_With_Eventing_IP (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID pebs_Modify_TSC (sample)
+ * @fn          VOID pebs_Modify_TSC (sample, pebs_rec)
  *
  * @brief       Change the TSC field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
+ * @param       pebs_rec      - the PEBS record
  *
  * @return      NONE
  *
@@ -265,22 +266,16 @@ pebs_Modify_IP_With_Eventing_IP (
  */
 static VOID
 pebs_Modify_TSC (
-    void        *sample
+    void        *sample,
+    S8          *pebs_rec
 )
 {
     SampleRecordPC  *psamp = sample;
-    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
-    S8              *pebs_base, *pebs_index;
     PEBS_REC_EXT2    pb;
 
-    if (dtes && psamp) {
-        pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
-        SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index) {
-            pb = (PEBS_REC_EXT2)pebs_base;
-            SAMPLE_RECORD_tsc(psamp) = PEBS_REC_EXT2_tsc(pb);
-        }
+    if (pebs_rec && psamp) {
+        pb = (PEBS_REC_EXT2)pebs_rec;
+        SAMPLE_RECORD_tsc(psamp) = PEBS_REC_EXT2_tsc(pb);
     }
 
     return;
@@ -329,7 +324,7 @@ PEBS_DISPATCH_NODE  perfver4_pebs =
      pebs_Modify_TSC
 };
 
-#define PER_CORE_BUFFER_SIZE(record_size)  (sizeof(DTS_BUFFER_EXT_NODE) +  2 * (record_size) + 64)
+#define PER_CORE_BUFFER_SIZE(record_size)  (sizeof(DTS_BUFFER_EXT_NODE) +  (pebs_batch + 1) * (record_size) + 64)
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -358,7 +353,7 @@ pebs_Alloc_DTS_Buffer (
     int             this_cpu;
 
     /*
-     * one PEBS record... need 2 records so that
+     * pebs_batch PEBS records... need one more record so that
      * threshold can be less than absolute max
      */
     preempt_disable();
@@ -385,7 +380,7 @@ pebs_Alloc_DTS_Buffer (
 
     /*
      * Program the DTES Buffer for Precise EBS.
-     * Set PEBS buffer for one PEBS record
+     * Set PEBS buffer for pebs_batch PEBS records
      */
     dts = (DTS_BUFFER_EXT)dts_buffer;
 
@@ -395,7 +390,11 @@ pebs_Alloc_DTS_Buffer (
     DTS_BUFFER_EXT_threshold(dts)       = 0;
     DTS_BUFFER_EXT_pebs_base(dts)       = pebs_base;
     DTS_BUFFER_EXT_pebs_index(dts)      = pebs_base;
-    DTS_BUFFER_EXT_pebs_max(dts)        = pebs_base + 2 * pebs_record_size;
+    DTS_BUFFER_EXT_pebs_max(dts)        = pebs_base + (pebs_batch + 1) * pebs_record_size;
+    DTS_BUFFER_EXT_counter_reset0(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset1(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset2(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset3(dts)  = 0;
 
     pebs_dispatch->initialize_threshold(dts, pebs_record_size);
 
@@ -474,6 +473,128 @@ pebs_Deallocate_Buffers (
     return;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U64 pebs_Counter_Mask (event_idx)
+ *
+ * @brief       Find the overflow status bit of the counter a precise event is on
+ *
+ * @param       event_idx  -  event index from the overflow event mask
+ *
+ * @return      the overflow status bit, 0 if the event is not found
+ *
+ * <I>Special Notes:</I>
+ *              Uses the current group of the current cpu.
+ */
+static U64
+pebs_Counter_Mask (
+    U32   event_idx
+)
+{
+    U64   mask = 0;
+
+    FOR_EACH_DATA_REG(pecb, i) {
+        if (ECB_entries_precise_get(pecb, i)          &&
+            ECB_entries_is_gp_reg_get(pecb, i)        &&
+            ECB_entries_event_id_index(pecb, i) == event_idx) {
+            mask = (U64)1 << (ECB_entries_reg_id(pecb, i) - IA32_PMC0);
+            break;
+        }
+    } END_FOR_EACH_DATA_REG;
+
+    return mask;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID pebs_Set_Counter_Reset (dtes)
+ *
+ * @brief       Program the PEBS counter reset values of the DS area
+ *
+ * @param       dtes  -  the DS area of the current cpu
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              In batched mode the PMI fires only when the buffer reaches its
+ *              threshold, so the hardware has to reload the precise counters
+ *              after each record. Use the same reload values the overflow
+ *              handler writes. Only PMC0-3 have a reset field.
+ *              The groups are only known once the EM config has been set.
+ */
+static VOID
+pebs_Set_Counter_Reset (
+    DTS_BUFFER_EXT   dtes
+)
+{
+    U64  *counter_reset = &DTS_BUFFER_EXT_counter_reset0(dtes);
+    U32   index;
+
+    if (PMU_register_data == NULL) {
+        return;
+    }
+
+    FOR_EACH_DATA_REG(pecb, i) {
+        if (ECB_entries_precise_get(pecb, i) && ECB_entries_is_gp_reg_get(pecb, i)) {
+            index = ECB_entries_reg_id(pecb, i) - IA32_PMC0;
+            if (index < 4) {
+                counter_reset[index] = ECB_entries_reg_value(pecb, i);
+            }
+        }
+    } END_FOR_EACH_DATA_REG;
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          S8* PEBS_Next_Record (this_cpu, event_idx, pebs_rec)
+ *
+ * @brief       Walk the PEBS records that belong to a precise event
+ *
+ * @param       this_cpu   -  the current cpu
+ *              event_idx  -  event index from the overflow event mask
+ *              pebs_rec   -  the previous record, NULL to start from the base
+ *
+ * @return      the next record of the event, NULL if there are no more
+ *
+ * <I>Special Notes:</I>
+ *              Without batching, the record at the base is the only one.
+ *              With batching, records between the base and the index are
+ *              matched against the counter the event is on; the Core2 record
+ *              format has no overflow field, so all records match.
+ */
+extern S8*
+PEBS_Next_Record (
+    S32    this_cpu,
+    U32    event_idx,
+    S8    *pebs_rec
+)
+{
+    DTS_BUFFER_EXT   dtes = CPU_STATE_dts_buffer(&pcb[this_cpu]);
+    S8              *pebs_index;
+    U64              mask = 0;
+
+    if (!dtes) {
+        return NULL;
+    }
+    pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
+    pebs_rec   = pebs_rec ? pebs_rec + pebs_record_length : (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
+    if (pebs_batch <= 1) {
+        return (pebs_rec == (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes) && pebs_rec != pebs_index) ? pebs_rec : NULL;
+    }
+    if (pebs_record_length >= sizeof(PEBS_REC_EXT_NODE)) {
+        mask = pebs_Counter_Mask(event_idx);
+    }
+    for (; pebs_rec + pebs_record_length <= pebs_index; pebs_rec += pebs_record_length) {
+        if (!mask || (PEBS_REC_EXT_glob_perf_overflow((PEBS_REC_EXT)pebs_rec) & mask)) {
+            return pebs_rec;
+        }
+    }
+
+    return NULL;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn          U64 PEBS_Overflowed (this_cpu, overflow_status)
@@ -512,6 +633,8 @@ PEBS_Overflowed (
  *
  * <I>Special Notes:</I>
  *              reset index to next PEBS record to base of buffer
+ *              In batched mode, also reload the counter reset values
+ *              from the current group.
  */
 extern VOID
 PEBS_Reset_Index (
@@ -523,6 +646,9 @@ PEBS_Reset_Index (
     if (dtes) {
         SEP_PRINT_DEBUG("PEBS Reset Index: %d\n", this_cpu);
         DTS_BUFFER_EXT_pebs_index(dtes) = DTS_BUFFER_EXT_pebs_base(dtes);
+        if (pebs_batch > 1) {
+            pebs_Set_Counter_Reset(dtes);
+        }
     }
 
     return;
@@ -530,12 +656,160 @@ PEBS_Reset_Index (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID PEBS_Modify_IP (sample, is_64bit_addr)
+ * @fn          VOID PEBS_Set_Counter_Reset (param)
+ *
+ * @brief       Load the PEBS counter reset values of the current group
+ *
+ * @param       param  -  dummy
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Only needed in batched mode. Called on every cpu when the
+ *              collection starts and whenever the current group changes
+ *              outside of the PMI handler.
+ */
+extern VOID
+PEBS_Set_Counter_Reset (
+    PVOID  param
+)
+{
+    DTS_BUFFER_EXT   dtes = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
+
+    if (dtes && pebs_batch > 1) {
+        pebs_Set_Counter_Reset(dtes);
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID pebs_Single_Record (param)
+ *
+ * @brief       Go back to one PEBS record per interrupt on the current cpu
+ *
+ * @param       param  -  dummy
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Called on every cpu before the counters are started, once
+ *              pebs_batch has been dropped to 1.
+ */
+static VOID
+pebs_Single_Record (
+    PVOID  param
+)
+{
+    DTS_BUFFER_EXT   dtes = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
+
+    if (dtes) {
+        DTS_BUFFER_EXT_pebs_index(dtes)      = DTS_BUFFER_EXT_pebs_base(dtes);
+        DTS_BUFFER_EXT_counter_reset0(dtes)  = 0;
+        DTS_BUFFER_EXT_counter_reset1(dtes)  = 0;
+        DTS_BUFFER_EXT_counter_reset2(dtes)  = 0;
+        DTS_BUFFER_EXT_counter_reset3(dtes)  = 0;
+        pebs_dispatch->initialize_threshold(dtes, pebs_record_length);
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID PEBS_Start (VOID)
+ *
+ * @brief       Prepare batched PEBS for a collection
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              The sample descriptors are known by now. Allocate one sample
+ *              template per cpu, large enough for the largest sample, and
+ *              load the counter reset values of the current groups.
+ *              Without a template the extra records could not be emitted,
+ *              so the collection falls back to one record per interrupt.
+ */
+extern VOID
+PEBS_Start (
+    VOID
+)
+{
+    EVENT_DESC  evt_desc;
+    U32         size = 0;
+    S32         i;
+
+    if (pebs_batch <= 1) {
+        return;
+    }
+
+    for (i = 0; i < GLOBAL_STATE_num_descriptors(driver_state); i++) {
+        evt_desc = desc_data[i];
+        if (evt_desc && EVENT_DESC_sample_size(evt_desc) > size) {
+            size = EVENT_DESC_sample_size(evt_desc);
+        }
+    }
+    if (size > pebs_template_size) {
+        pebs_template      = CONTROL_Free_Memory(pebs_template);
+        pebs_template_size = 0;
+        pebs_template      = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) * size);
+        if (pebs_template) {
+            pebs_template_size = size;
+        }
+    }
+    if (pebs_template == NULL) {
+        SEP_PRINT_WARNING("PEBS_Start: no sample template, one PEBS record per interrupt\n");
+        pebs_batch = 1;
+        CONTROL_Invoke_Parallel(pebs_Single_Record, (PVOID)(size_t)0);
+        return;
+    }
+
+    CONTROL_Invoke_Parallel(PEBS_Set_Counter_Reset, (PVOID)(size_t)0);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          S8* PEBS_Sample_Template (this_cpu, size)
+ *
+ * @brief       Get the sample template of a cpu
+ *
+ * @param       this_cpu  -  the current cpu
+ *              size      -  size of the sample to copy into the template
+ *
+ * @return      the template, NULL if there is none large enough
+ *
+ * <I>Special Notes:</I>
+ *              The batched records are built from a copy of the first sample:
+ *              once another sample is reserved, the segment holding the
+ *              first one may already be handed to the reader.
+ */
+extern S8*
+PEBS_Sample_Template (
+    S32   this_cpu,
+    U32   size
+)
+{
+    if (pebs_template == NULL || size > pebs_template_size) {
+        return NULL;
+    }
+
+    return pebs_template + (size_t)this_cpu * pebs_template_size;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID PEBS_Modify_IP (sample, is_64bit_addr, pebs_rec)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       pebs_rec      - the PEBS record
  *
  * @return      NONE
  *
@@ -545,21 +819,23 @@ PEBS_Reset_Index (
 extern VOID
 PEBS_Modify_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    S8          *pebs_rec
 )
 {
-    pebs_dispatch->modify_ip(sample, is_64bit_addr);
+    pebs_dispatch->modify_ip(sample, is_64bit_addr, pebs_rec);
     return;
 }
 
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID PEBS_Modify_TSC (sample)
+ * @fn          VOID PEBS_Modify_TSC (sample, pebs_rec)
  *
  * @brief       Change the TSC field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
+ * @param       pebs_rec      - the PEBS record
  *
  * @return      NONE
  *
@@ -568,11 +844,12 @@ PEBS_Modify_IP (
  */
 extern VOID
 PEBS_Modify_TSC (
-    void        *sample
+    void        *sample,
+    S8          *pebs_rec
 )
 {
     if (pebs_dispatch->modify_tsc != NULL) {
-        pebs_dispatch->modify_tsc(sample);
+        pebs_dispatch->modify_tsc(sample, pebs_rec);
     }
     return;
 }
@@ -581,12 +858,13 @@ PEBS_Modify_TSC (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID PEBS_Fill_Buffer (S8 *buffer, EVENT_CONFIG ec)
+ * @fn          VOID PEBS_Fill_Buffer (S8 *buffer, EVENT_DESC evt_desc, virt_phys_translation_ena, pebs_rec)
  *
  * @brief       Fill the buffer with the pebs data
  *
- * @param       buffer  -  area to write the data into
- *              ec      -  current event config
+ * @param       buffer    -  area to write the data into
+ *              evt_desc  -  current event descriptor
+ *              pebs_rec  -  the PEBS record to copy from
  *
  * @return      NONE
  *
@@ -597,19 +875,18 @@ extern VOID
 PEBS_Fill_Buffer (
     S8           *buffer,
     EVENT_DESC    evt_desc,
-    DRV_BOOL      virt_phys_translation_ena
+    DRV_BOOL      virt_phys_translation_ena,
+    S8           *pebs_rec
 )
 {
-    DTS_BUFFER_EXT   dtes       = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
     DEAR_INFO_NODE   dear_info  = {0};
     PEBS_REC_EXT1    pebs_base_ext1;
     PEBS_REC_EXT2    pebs_base_ext2;
 
-    if (dtes) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
+    {
+        S8   *pebs_base  = pebs_rec;
         SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index){
+        if (pebs_base) {
             if (EVENT_DESC_pebs_offset(evt_desc)) {
                 SEP_PRINT_DEBUG("PEBS buffer has data available\n");
                 memcpy(buffer + EVENT_DESC_pebs_offset(evt_desc),
@@ -695,6 +972,18 @@ PEBS_Initialize (
                 break;
         }
         if (pebs_dispatch) {
+            /*
+             * Core2 raises the PMI on the first record: no batching there.
+             */
+            pebs_batch = pebs_batch_records;
+            if (pebs_batch < 1 || pebs_dispatch == &core2_pebs) {
+                pebs_batch = 1;
+            }
+            if (pebs_batch > PEBS_MAX_BATCH_RECORDS) {
+                pebs_batch = PEBS_MAX_BATCH_RECORDS;
+            }
+            pebs_record_length = pebs_record_size;
+            SEP_PRINT_DEBUG("PEBS records per interrupt: %d\n", pebs_batch);
             pebs_global_memory_size = GLOBAL_STATE_num_cpus(driver_state) * PER_CORE_BUFFER_SIZE(pebs_record_size);
             pebs_global_memory = (PVOID)CONTROL_Allocate_KMemory(pebs_global_memory_size);
             CONTROL_Invoke_Parallel(pebs_Allocate_Buffers, (VOID *)&pebs_record_size);
@@ -726,6 +1015,8 @@ PEBS_Destroy (
         CONTROL_Invoke_Parallel(pebs_Deallocate_Buffers, (VOID *)(size_t)0);
         pebs_global_memory = CONTROL_Free_Memory(pebs_global_memory);
         pebs_global_memory_size = 0;
+        pebs_template = CONTROL_Free_Memory(pebs_template);
+        pebs_template_size = 0;
     }
 
     return;
@@ -46,6 +46,7 @@
 #include "control.h"
 #include "pmi.h"
 #include "utility.h"
+#include "eventmux.h"
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #include "pebs.h"
 #endif
@@ -113,6 +114,9 @@ PMI_Interrupt_Handler (
     U64             *result_buffer;
     U64              diff;
     U64              lbr_tos_from_ip = 0;
+    S8              *pebs_rec        = NULL;
+    SampleRecordPC  *psamp_rec;
+    S8              *psamp_tmpl;
 
     this_cpu = CONTROL_THIS_CPU();
     pcpu     = &pcb[this_cpu];
@@ -181,15 +185,18 @@ PMI_Interrupt_Handler (
                 SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).highWord %x\n", SAMPLE_RECORD_csd(psamp).u2.highWord);
 
                 SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
+                pebs_rec = NULL;
                 if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i]) == 1) {
+                    pebs_rec = PEBS_Next_Record(this_cpu, DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]), NULL);
                     if (EVENT_DESC_pebs_offset(evt_desc) ||
                         EVENT_DESC_latency_offset_in_sample(evt_desc)) {
                         PEBS_Fill_Buffer((S8 *)psamp,
                                      evt_desc,
-                                     DRV_CONFIG_virt_phys_translation(pcfg));
+                                     DRV_CONFIG_virt_phys_translation(pcfg),
+                                     pebs_rec);
                     }
-                    PEBS_Modify_IP((S8 *)psamp, FALSE);
-                    PEBS_Modify_TSC((S8 *)psamp);
+                    PEBS_Modify_IP((S8 *)psamp, FALSE, pebs_rec);
+                    PEBS_Modify_TSC((S8 *)psamp, pebs_rec);
                 }
                 if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
                     lbr_tos_from_ip = dispatch->read_lbrs(!DRV_CONFIG_store_lbrs(pcfg) ? NULL:((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
@@ -248,18 +255,50 @@ PMI_Interrupt_Handler (
                         }
                     }
                 }
+                /*
+                 * Batched PEBS: one more sample for each of the remaining
+                 * records of this event. Everything but the PEBS data is
+                 * taken from a copy of the sample built above: reserving
+                 * the next sample may hand that one over to the reader.
+                 */
+                psamp_tmpl = NULL;
+                if (pebs_rec) {
+                    psamp_tmpl = PEBS_Sample_Template(this_cpu, EVENT_DESC_sample_size(evt_desc));
+                    if (psamp_tmpl) {
+                        memcpy(psamp_tmpl, psamp, EVENT_DESC_sample_size(evt_desc));
+                    }
+                }
+                while (psamp_tmpl &&
+                       (pebs_rec = PEBS_Next_Record(this_cpu, DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]), pebs_rec))) {
+                    psamp_rec = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
+                                                EVENT_DESC_sample_size(evt_desc));
+                    if (!psamp_rec) {
+                        break;
+                    }
+                    memcpy(psamp_rec, psamp_tmpl, EVENT_DESC_sample_size(evt_desc));
+                    CPU_STATE_num_samples(pcpu) += 1;
+                    if (EVENT_DESC_pebs_offset(evt_desc) ||
+                        EVENT_DESC_latency_offset_in_sample(evt_desc)) {
+                        PEBS_Fill_Buffer((S8 *)psamp_rec,
+                                     evt_desc,
+                                     DRV_CONFIG_virt_phys_translation(pcfg),
+                                     pebs_rec);
+                    }
+                    PEBS_Modify_IP((S8 *)psamp_rec, FALSE, pebs_rec);
+                    PEBS_Modify_TSC((S8 *)psamp_rec, pebs_rec);
+                }
             } // for
         }
     }
-    if (DRV_CONFIG_pebs_mode(pcfg)) {
-        PEBS_Reset_Index(this_cpu);
-    }
-
     APIC_Ack_Eoi();
 
     // Reset the data counters
     if (CPU_STATE_trigger_count(&pcb[this_cpu]) == 0) {
-        dispatch->swap_group(FALSE);
+        EVENTMUX_Swap_Group(FALSE);
+    }
+    // after the swap, so that batched PEBS reloads the counters of the new group
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
     }
     // Re-enable the counter control
     dispatch->restart(NULL);
@@ -354,6 +393,9 @@ PMI_Interrupt_Handler (
     U64             *result_buffer;
     U64              diff;
     U64              lbr_tos_from_ip = 0;
+    S8              *pebs_rec        = NULL;
+    SampleRecordPC  *psamp_rec;
+    S8              *psamp_tmpl;
 
     // Disable the counter control
     dispatch->freeze(NULL);
@@ -424,15 +466,18 @@ PMI_Interrupt_Handler (
                 }
 
                 SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
+                pebs_rec = NULL;
                 if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i])) {
+                    pebs_rec = PEBS_Next_Record(this_cpu, DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]), NULL);
                     if ( EVENT_DESC_pebs_offset(evt_desc) ||
                          EVENT_DESC_latency_offset_in_sample(evt_desc)) {
                          PEBS_Fill_Buffer((S8 *)psamp,
                                      evt_desc,
-                                     DRV_CONFIG_virt_phys_translation(pcfg));
+                                     DRV_CONFIG_virt_phys_translation(pcfg),
+                                     pebs_rec);
                     }
-                    PEBS_Modify_IP((S8 *)psamp, is_64bit_addr);
-                    PEBS_Modify_TSC((S8 *)psamp);
+                    PEBS_Modify_IP((S8 *)psamp, is_64bit_addr, pebs_rec);
+                    PEBS_Modify_TSC((S8 *)psamp, pebs_rec);
                 }
                 if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
                     lbr_tos_from_ip = dispatch->read_lbrs(!DRV_CONFIG_store_lbrs(pcfg) ? NULL:((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
@@ -496,18 +541,50 @@ PMI_Interrupt_Handler (
                         }
                     }
                 }
+                /*
+                 * Batched PEBS: one more sample for each of the remaining
+                 * records of this event. Everything but the PEBS data is
+                 * taken from a copy of the sample built above: reserving
+                 * the next sample may hand that one over to the reader.
+                 */
+                psamp_tmpl = NULL;
+                if (pebs_rec) {
+                    psamp_tmpl = PEBS_Sample_Template(this_cpu, EVENT_DESC_sample_size(evt_desc));
+                    if (psamp_tmpl) {
+                        memcpy(psamp_tmpl, psamp, EVENT_DESC_sample_size(evt_desc));
+                    }
+                }
+                while (psamp_tmpl &&
+                       (pebs_rec = PEBS_Next_Record(this_cpu, DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]), pebs_rec))) {
+                    psamp_rec = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
+                                                EVENT_DESC_sample_size(evt_desc));
+                    if (!psamp_rec) {
+                        break;
+                    }
+                    memcpy(psamp_rec, psamp_tmpl, EVENT_DESC_sample_size(evt_desc));
+                    CPU_STATE_num_samples(pcpu) += 1;
+                    if (EVENT_DESC_pebs_offset(evt_desc) ||
+                        EVENT_DESC_latency_offset_in_sample(evt_desc)) {
+                        PEBS_Fill_Buffer((S8 *)psamp_rec,
+                                     evt_desc,
+                                     DRV_CONFIG_virt_phys_translation(pcfg),
+                                     pebs_rec);
+                    }
+                    PEBS_Modify_IP((S8 *)psamp_rec, is_64bit_addr, pebs_rec);
+                    PEBS_Modify_TSC((S8 *)psamp_rec, pebs_rec);
+                }
             }
         }
     }
-    if (DRV_CONFIG_pebs_mode(pcfg)) {
-        PEBS_Reset_Index(this_cpu);
-    }
-
     APIC_Ack_Eoi();
 
     // Reset the data counters
     if (CPU_STATE_trigger_count(&pcb[this_cpu]) == 0) {
-        dispatch->swap_group(FALSE);
+        EVENTMUX_Swap_Group(FALSE);
+    }
+    // after the swap, so that batched PEBS reloads the counters of the new group
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
     }
     // Re-enable the counter control
     dispatch->restart(NULL);
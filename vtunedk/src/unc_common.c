@@ -442,9 +442,6 @@ UNC_COMMON_PCI_Read_Counts (
     U64            *data       = (U64*) param;
     U32             cur_grp    = LWPMU_DEVICE_cur_group(&devices[id]);
     ECB             pecb       = LWPMU_DEVICE_PMU_register_data(&devices[id])[cur_grp];
-    U32             pci_address;
-    U64             value_high          = 0;
-    U64             value_lo_2          = 0;
     U32             this_cpu            = CONTROL_THIS_CPU();
     U32             package_num         = core_to_package_map[this_cpu];
     U32             bus_no              = unc_package_to_bus_map[package_num];
@@ -457,38 +454,10 @@ UNC_COMMON_PCI_Read_Counts (
     //Read in the counts into temporary buffer
     FOR_EACH_DATA_REG_UNC(pecb, id, i) {
         data  = (U64 *)((S8*)param + ECB_entries_counter_event_offset(pecb,i));
-        // read lower 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    ECB_entries_reg_id(pecb,i));
-        *data = LOWER_4_BYTES_MASK & PCI_Read_Ulong(pci_address);
-
-        // read upper 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    (ECB_entries_reg_id(pecb,i) + NEXT_ADDR_OFFSET));
-        value_high                  = (U64)PCI_Read_Ulong(pci_address);
-        // Now we have to check if the lower 32 bits overflowed in between the reads
-        // reread lower 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    ECB_entries_reg_id(pecb,i));
-        value_lo_2                  = LOWER_4_BYTES_MASK & PCI_Read_Ulong(pci_address);
-        if (value_lo_2 < *data) {
-            // overflow occurred
-            // use new lower bits
-            *data = value_lo_2;
-            // reread the top bits as well.
-            pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                        ECB_entries_dev_no(pecb,i),
-                                                        ECB_entries_func_no(pecb,i),
-                                                        (ECB_entries_reg_id(pecb,i) + NEXT_ADDR_OFFSET));
-             value_high                  = (U64)PCI_Read_Ulong(pci_address);
-        }
-        *data |= value_high << NEXT_ADDR_SHIFT;
+        *data = PCI_Read_U64(bus_no,
+                             ECB_entries_dev_no(pecb,i),
+                             ECB_entries_func_no(pecb,i),
+                             ECB_entries_reg_id(pecb,i));
 
     } END_FOR_EACH_DATA_REG_UNC;
 
@@ -511,10 +480,6 @@ UNC_COMMON_PCI_Read_PMU_Data(
 )
 {
     U32             dev_idx             = *((U32*)param);
-    U32             pci_address;
-    U64             value_low           = 0;
-    U64             value_high          = 0;
-    U64             value_lo_2          = 0;
     U32             this_cpu            = CONTROL_THIS_CPU();
     U32             package_num         = 0;
     U32             bus_no              = 0;
@@ -552,39 +517,10 @@ UNC_COMMON_PCI_Read_PMU_Data(
             sub_evt_index*num_packages*LWPMU_DEVICE_num_units(&devices[dev_idx])+
             package_num * LWPMU_DEVICE_num_units(&devices[dev_idx]);
 
-        // read lower 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    ECB_entries_reg_id(pecb,i));
-        
-        value_low = LOWER_4_BYTES_MASK & PCI_Read_Ulong(pci_address);
-
-        // read upper 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    (ECB_entries_reg_id(pecb,i) + NEXT_ADDR_OFFSET));
-        value_high                  = (U64)PCI_Read_Ulong(pci_address);
-        // Now we have to check if the lower 32 bits overflowed in between the reads
-        // reread lower 4 bytes
-        pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                    ECB_entries_dev_no(pecb,i),
-                                                    ECB_entries_func_no(pecb,i),
-                                                    ECB_entries_reg_id(pecb,i));
-        value_lo_2                  = LOWER_4_BYTES_MASK & PCI_Read_Ulong(pci_address);
-        if (value_lo_2 < value_low) {
-            // overflow occurred
-            // use new lower bits
-            value_low = value_lo_2;
-            // reread the top bits as well.
-            pci_address                 = FORM_PCI_ADDR(bus_no,
-                                                        ECB_entries_dev_no(pecb,i),
-                                                        ECB_entries_func_no(pecb,i),
-                                                        (ECB_entries_reg_id(pecb,i) + NEXT_ADDR_OFFSET));
-            value_high                  = (U64)PCI_Read_Ulong(pci_address);
-        }
-        buffer[j] = (value_high << NEXT_ADDR_SHIFT) | value_low;
+        buffer[j] = PCI_Read_U64(bus_no,
+                                 ECB_entries_dev_no(pecb,i),
+                                 ECB_entries_func_no(pecb,i),
+                                 ECB_entries_reg_id(pecb,i));
         SEP_PRINT_DEBUG("j = %d value = 0x%x pkg = %d  e_id = %d\n",j, buffer[j],package_num, ECB_entries_emon_event_id_index_local(pecb,i));
         //Increment sub_evt_index so that the next event position is adjusted
         if ((prev_ei == -1 )|| (prev_ei != cur_ei)) {
@@ -650,6 +586,8 @@ UNC_COMMON_PCI_Scan_For_Uncore(
                      continue;
                  }
                  UNCORE_TOPOLOGY_INFO_pcidev_is_found_in_platform(&uncore_topology, dev_node, j, k) = 1;
+                 // map the config space once, counters are then read with MMIO loads
+                 PCI_Map_Config_Space(busno, j, k);
                  SEP_PRINT_DEBUG("found device %d at B:D:F = %d:%d:%d\n", dev_node, busno,j,k);
              }
          }
@@ -40,6 +40,7 @@
 #include "pebs.h"
 #include "time.h"
 #include "nmiwd.h"
+#include "profile.h"
 
 #include <linux/spinlock.h>
 #include <linux/hardirq.h>
@@ -209,6 +210,7 @@ struct vtss_task_data
     vtss_tcb_t       tcb;
     struct vtss_transport_data* trnd;
     struct vtss_transport_data* trnd_aux;
+    vtss_vma_index_t*           vmi; /* shared by all threads of the process */
 #if defined(CONFIG_PREEMPT_NOTIFIERS) && defined(VTSS_USE_PREEMPT_NOTIFIERS)
     struct preempt_notifier preempt_notifier;
 #endif
@@ -238,13 +240,47 @@ static int vtss_mmap_all(struct vtss_task_data*, struct task_struct*);
 static int vtss_kmap_all(struct vtss_task_data*);
 
 #ifdef CONFIG_PREEMPT_RT
-static DEFINE_RAW_RWLOCK(vtss_recovery_rwlock);
 static DEFINE_RAW_RWLOCK(vtss_transtort_init_rwlock);
+typedef raw_spinlock_t vtss_recovery_spinlock_t;
+#define vtss_recovery_spin_lock_init(lock)               raw_spin_lock_init(lock)
+#define vtss_recovery_spin_lock_irqsave(lock, flags)     raw_spin_lock_irqsave(lock, flags)
+#define vtss_recovery_spin_unlock_irqrestore(lock, flags) raw_spin_unlock_irqrestore(lock, flags)
 #else
-static DEFINE_RWLOCK(vtss_recovery_rwlock);
 static DEFINE_RWLOCK(vtss_transport_init_rwlock);
+typedef spinlock_t vtss_recovery_spinlock_t;
+#define vtss_recovery_spin_lock_init(lock)               spin_lock_init(lock)
+#define vtss_recovery_spin_lock_irqsave(lock, flags)     spin_lock_irqsave(lock, flags)
+#define vtss_recovery_spin_unlock_irqrestore(lock, flags) spin_unlock_irqrestore(lock, flags)
 #endif
-static DEFINE_PER_CPU_SHARED_ALIGNED(struct vtss_task_data*, vtss_recovery_tskd);
+
+/*
+ * Per-cpu recovery slot: the task that is "in context" on the cpu.
+ * Each slot has its own lock, and the context switch path only takes
+ * the lock of the cpu it runs on, so it never contends with (or bounces
+ * cache lines between) other cpus. Only task destruction and collector
+ * init walk the slots of all cpus.
+ */
+struct vtss_recovery_slot
+{
+    vtss_recovery_spinlock_t lock;
+    struct vtss_task_data*   tskd;
+};
+static DEFINE_PER_CPU_SHARED_ALIGNED(struct vtss_recovery_slot, vtss_recovery_slot);
+
+#define vtss_recovery_lock(cpu, flags) \
+    vtss_recovery_spin_lock_irqsave(&per_cpu(vtss_recovery_slot, cpu).lock, flags)
+#define vtss_recovery_unlock(cpu, flags) \
+    vtss_recovery_spin_unlock_irqrestore(&per_cpu(vtss_recovery_slot, cpu).lock, flags)
+#define vtss_recovery_tskd(cpu) per_cpu(vtss_recovery_slot, cpu).tskd
+
+static inline void vtss_recovery_set(int cpu, struct vtss_task_data* tskd)
+{
+    unsigned long flags;
+
+    vtss_recovery_lock(cpu, flags);
+    vtss_recovery_tskd(cpu) = tskd;
+    vtss_recovery_unlock(cpu, flags);
+}
 
 #if defined(CONFIG_PREEMPT_NOTIFIERS) && defined(VTSS_USE_PREEMPT_NOTIFIERS)
 static void vtss_notifier_sched_in (struct preempt_notifier *notifier, int cpu);
@@ -770,12 +806,12 @@ static void vtss_target_dtr(vtss_task_map_item_t* item, void* args)
     }
 #endif
     /* Clear per_cpu recovery data for this tskd */
-    write_lock_irqsave(&vtss_recovery_rwlock, flags);
     for_each_possible_cpu(cpu) {
-        if (per_cpu(vtss_recovery_tskd, cpu) == tskd)
-            per_cpu(vtss_recovery_tskd, cpu) = NULL;
+        vtss_recovery_lock(cpu, flags);
+        if (vtss_recovery_tskd(cpu) == tskd)
+            vtss_recovery_tskd(cpu) = NULL;
+        vtss_recovery_unlock(cpu, flags);
     }
-    write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
     /* Finish trace transport */
     read_lock_irqsave(&vtss_transport_init_rwlock, flags);
     if (atomic_read(&vtss_transport_initialized) != 0 && tskd->trnd != NULL) {
@@ -809,6 +845,8 @@ static void vtss_target_dtr(vtss_task_map_item_t* item, void* args)
     }
     read_unlock_irqrestore(&vtss_transport_init_rwlock, flags);
     tskd->stk.destroy(&tskd->stk);
+    vtss_vma_index_put(tskd->vmi);
+    tskd->vmi = NULL;
 }
 
 int vtss_target_new(pid_t tid, pid_t pid, pid_t ppid, const char* filename, struct vtss_transport_data* trnd, struct vtss_transport_data* trnd_aux)
@@ -838,6 +876,7 @@ int vtss_target_new(pid_t tid, pid_t pid, pid_t ppid, const char* filename, stru
     tskd->pid        = pid;
     tskd->trnd       = NULL;
     tskd->trnd_aux   = NULL;
+    tskd->vmi        = NULL;
     tskd->ppid       = ppid;
 
     tskd->m32        = 0; /* unknown so far, assume native */
@@ -869,6 +908,9 @@ int vtss_target_new(pid_t tid, pid_t pid, pid_t ppid, const char* filename, stru
     }
     tskd->filename[size] = '\0';
     tskd->taskname[0] = '\0';
+    if (tskd->tid == tskd->pid) { /* New process, filled in by vtss_mmap_all() */
+        tskd->vmi = vtss_vma_index_create();
+    }
     /* Transport initialization */
     read_lock_irqsave(&vtss_transport_init_rwlock, flags);
     if (atomic_read(&vtss_transport_initialized) != 0){
@@ -914,6 +956,8 @@ int vtss_target_new(pid_t tid, pid_t pid, pid_t ppid, const char* filename, stru
         tskd0 = (struct vtss_task_data*)&item0->data;
         tskd->trnd = tskd0->trnd;
         tskd->trnd_aux = tskd0->trnd_aux;
+        tskd->vmi = tskd0->vmi;
+        vtss_vma_index_addref(tskd->vmi);
         if (tskd->trnd != NULL) {
             vtss_transport_addref(tskd->trnd);
         }
@@ -928,6 +972,8 @@ int vtss_target_new(pid_t tid, pid_t pid, pid_t ppid, const char* filename, stru
         read_unlock_irqrestore(&vtss_transport_init_rwlock, flags);
         return -ENOMEM;
     }
+    if (tskd->stk.acc != NULL)
+        tskd->stk.acc->m_vmi = tskd->vmi;
     /* Create cpuevent chain */
     memset(tskd->cpuevent_chain, 0, VTSS_CFG_CHAIN_SIZE*sizeof(cpuevent_t));
     vtss_cpuevents_upload(tskd->cpuevent_chain, &reqcfg.cpuevent_cfg_v1[0], reqcfg.cpuevent_count_v1);
@@ -1447,6 +1493,9 @@ static int vtss_mmap_all(struct vtss_task_data* tskd, struct task_struct* task)
         VTSS_SET_MMAP_INIT(tskd);
         vtss_time_get_sync(&cputsc, &realtsc);
         down_read(&mm->mmap_sem);
+        if (vtss_vma_index_load(tskd->vmi, mm)) {
+            TRACE("vma index is not loaded, validation falls back to find_vma()");
+        }
         for (vma = mm->mmap; vma != NULL; vma = vma->vm_next) {
             TRACE("vma=[0x%lx - 0x%lx], flags=0x%lx", vma->vm_start, vma->vm_end, vma->vm_flags);
             if ((vma->vm_flags & VM_EXEC) && !(vma->vm_flags & VM_WRITE) &&
@@ -1485,7 +1534,7 @@ static int vtss_mmap_all(struct vtss_task_data* tskd, struct task_struct* task)
     return repeat;
 }
 
-void vtss_mmap(struct file *file, unsigned long addr, unsigned long pgoff, unsigned long size)
+void vtss_mmap(struct file *file, unsigned long addr, unsigned long pgoff, unsigned long size, unsigned long vm_flags)
 {
     unsigned long flags;
     vtss_task_map_item_t* item = vtss_task_map_get_item(TASK_TID(current));
@@ -1496,20 +1545,26 @@ void vtss_mmap(struct file *file, unsigned long addr, unsigned long pgoff, unsig
         atomic_inc(&vtss_mmap_reg_callcnt);
         if (unlikely(VTSS_IS_COMPLETE(tskd)))
             tskd = vtss_wait_for_completion(&item);
-        if (tskd != NULL && (!VTSS_IS_MMAP_INIT(tskd))) {
-            char *tmp = (char*)__get_free_page(GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN);
-            long long cputsc, realtsc;
-            vtss_time_get_sync(&cputsc, &realtsc);
-                        
-            if (tmp != NULL) {
-                char* pname = D_PATH(file, tmp, PAGE_SIZE);
-                if (!IS_ERR(pname)) {
-                    TRACE("vma=[0x%lx - 0x%lx], file='%s', pgoff=%lu", addr, addr+size, pname, pgoff);
-                    if (vtss_record_module(tskd->trnd_aux, tskd->m32, addr, size, pname, pgoff, cputsc, realtsc, SAFE)) {
-                        TRACE("vtss_record_module() FAIL");
+        if (tskd != NULL) {
+            if (vtss_vma_index_add(tskd->vmi, addr, addr + size)) {
+                TRACE("vma=[0x%lx - 0x%lx] is not indexed", addr, addr+size);
+            }
+            /* Only read-only file mappings are reported as modules */
+            if (!VTSS_IS_MMAP_INIT(tskd) && !(vm_flags & VM_WRITE) && file != NULL && file->f_dentry) {
+                char *tmp = (char*)__get_free_page(GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN);
+                long long cputsc, realtsc;
+                vtss_time_get_sync(&cputsc, &realtsc);
+
+                if (tmp != NULL) {
+                    char* pname = D_PATH(file, tmp, PAGE_SIZE);
+                    if (!IS_ERR(pname)) {
+                        TRACE("vma=[0x%lx - 0x%lx], file='%s', pgoff=%lu", addr, addr+size, pname, pgoff);
+                        if (vtss_record_module(tskd->trnd_aux, tskd->m32, addr, size, pname, pgoff, cputsc, realtsc, SAFE)) {
+                            TRACE("vtss_record_module() FAIL");
+                        }
                     }
+                    free_page((unsigned long)tmp);
                 }
-                free_page((unsigned long)tmp);
             }
             vtss_task_map_put_item(item);
         }
@@ -1611,9 +1666,7 @@ static void vtss_sched_switch_from(vtss_task_map_item_t* item, struct task_struc
         else
             VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPOUT);
         if (likely(!VTSS_ERROR_STORE_SWAPOUT(tskd))) {
-            write_lock_irqsave(&vtss_recovery_rwlock, flags);
-            per_cpu(vtss_recovery_tskd, tskd->cpu) = NULL;
-            write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+            vtss_recovery_set(tskd->cpu, NULL);
             tskd->state &= ~VTSS_ST_IN_CONTEXT;
 
             if (likely(!VTSS_IS_COMPLETE(tskd) &&
@@ -1650,6 +1703,8 @@ static void vtss_sched_switch_from(vtss_task_map_item_t* item, struct task_struc
             }
         }
     }
+    /* the task may run on another cpu next, publish its staged records */
+    vtss_transport_stage_flush();
     preempt_enable_no_resched();
     local_irq_restore(flags);
 }
@@ -1706,8 +1761,8 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
         unsigned long flags;
         struct vtss_task_data* cpu_tskd;
 
-        write_lock_irqsave(&vtss_recovery_rwlock, flags);
-        cpu_tskd = per_cpu(vtss_recovery_tskd, cpu);
+        vtss_recovery_lock(cpu, flags);
+        cpu_tskd = vtss_recovery_tskd(cpu);
         if (unlikely((reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX) &&
             cpu_tskd != NULL &&
             VTSS_IN_CONTEXT(cpu_tskd) &&
@@ -1715,12 +1770,12 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
         {
             VTSS_STORE_SWAPOUT(cpu_tskd, 1, NOT_SAFE);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(cpu_tskd))) {
-                per_cpu(vtss_recovery_tskd, cpu) = NULL;
+                vtss_recovery_tskd(cpu) = NULL;
                 cpu_tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 cpu_tskd = NULL;
             }
         }
-        write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+        vtss_recovery_unlock(cpu, flags);
         /* Exit from context for the task if error was */
         if (unlikely(VTSS_IN_CONTEXT(tskd) && VTSS_ERROR_STORE_SWAPOUT(tskd))) {
             if (reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX)
@@ -1728,9 +1783,7 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
             else
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPOUT);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, tskd->cpu) = NULL;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_set(tskd->cpu, NULL);
                 tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 if (unlikely(cpu == tskd->cpu))
                     cpu_tskd = NULL;
@@ -1757,9 +1810,7 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPIN);
             }
             if (likely(!VTSS_ERROR_STORE_SWAPIN(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, cpu) = tskd;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_set(cpu, tskd);
                 tskd->state |= VTSS_ST_IN_CONTEXT;
                 tskd->cpu = cpu;
                 if (likely(VTSS_NEED_STACK_SAVE(tskd) &&
@@ -1888,8 +1939,8 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
         unsigned long flags;
         struct vtss_task_data* cpu_tskd;
 
-        write_lock_irqsave(&vtss_recovery_rwlock, flags);
-        cpu_tskd = per_cpu(vtss_recovery_tskd, cpu);
+        vtss_recovery_lock(cpu, flags);
+        cpu_tskd = vtss_recovery_tskd(cpu);
         if (unlikely((reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX) &&
             cpu_tskd != NULL && cpu_tskd != tskd &&
             VTSS_IN_CONTEXT(cpu_tskd) &&
@@ -1897,12 +1948,12 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
         {
             VTSS_STORE_SWAPOUT(cpu_tskd, 1, NOT_SAFE);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(cpu_tskd))) {
-                per_cpu(vtss_recovery_tskd, cpu) = NULL;
+                vtss_recovery_tskd(cpu) = NULL;
                 cpu_tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 cpu_tskd = NULL;
             }
         }
-        write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+        vtss_recovery_unlock(cpu, flags);
         /* Enter in context for the task if CPU is free and no error */
         if (unlikely(cpu_tskd == NULL &&
             !VTSS_IN_CONTEXT(tskd) &&
@@ -1915,9 +1966,7 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
             else
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPIN);
             if (likely(!VTSS_ERROR_STORE_SWAPIN(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, cpu) = tskd;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_set(cpu, tskd);
                 tskd->state |= VTSS_ST_IN_CONTEXT;
                 tskd->cpu = cpu;
                 if (unlikely(VTSS_NEED_STACK_SAVE(tskd) &&
@@ -2038,31 +2087,6 @@ asmlinkage void vtss_pmi_handler(struct pt_regs *regs)
 
 /* ------------------------------------------------------------------------- */
 
-#ifdef VTSS_DEBUG_PROFILE
-cycles_t vtss_profile_cnt_stk  = 0;
-cycles_t vtss_profile_clk_stk  = 0;
-cycles_t vtss_profile_cnt_ctx  = 0;
-cycles_t vtss_profile_clk_ctx  = 0;
-cycles_t vtss_profile_cnt_pmi  = 0;
-cycles_t vtss_profile_clk_pmi  = 0;
-cycles_t vtss_profile_cnt_pmu  = 0;
-cycles_t vtss_profile_clk_pmu  = 0;
-cycles_t vtss_profile_cnt_sys  = 0;
-cycles_t vtss_profile_clk_sys  = 0;
-cycles_t vtss_profile_cnt_bts  = 0;
-cycles_t vtss_profile_clk_bts  = 0;
-cycles_t vtss_profile_cnt_vma  = 0;
-cycles_t vtss_profile_clk_vma  = 0;
-cycles_t vtss_profile_cnt_pgp  = 0;
-cycles_t vtss_profile_clk_pgp  = 0;
-cycles_t vtss_profile_cnt_cpy  = 0;
-cycles_t vtss_profile_clk_cpy  = 0;
-cycles_t vtss_profile_cnt_vld  = 0;
-cycles_t vtss_profile_clk_vld  = 0;
-cycles_t vtss_profile_cnt_unw  = 0;
-cycles_t vtss_profile_clk_unw  = 0;
-#endif
-
 int vtss_cmd_open(void)
 {
     return 0;
@@ -2158,9 +2182,11 @@ int vtss_collection_fini(void)
     atomic_set(&vtss_transport_initialized, 0);
     write_unlock_irqrestore(&vtss_transport_init_rwlock, flags);
     vtss_transport_fini();
+    vtss_stack_table_fini();
     vtss_session_uid = 0;
     vtss_session_gid = 0;
     vtss_time_limit  = 0ULL; /* set default value */
+    vtss_transport_mode = VTSS_TRANSPORT_MODE_MERGE; /* set default value */
     TRACE("watchdog state repair");
     //workaround on the problem when pmi enabling while the collection is stopping, but some threads is still collecting data
     on_each_cpu(vtss_collector_pmi_disable_on_cpu, NULL, SMP_CALL_FUNCTION_ARGS);
@@ -2168,8 +2194,6 @@ int vtss_collection_fini(void)
     atomic_set(&vtss_start_paused, 0);
     atomic_set(&vtss_collector_state, VTSS_COLLECTOR_STOPPED);
     INFO("vtss++ collection stopped");
-    
-    VTSS_PROFILE_PRINT(printk);
     return 0;
 }
 
@@ -2188,30 +2212,7 @@ int vtss_cmd_start(void)
    vtss_nmi_watchdog_disable(0);
 
     INFO("Starting vtss++ collection");
-#ifdef VTSS_DEBUG_PROFILE
-    vtss_profile_cnt_stk  = 0;
-    vtss_profile_clk_stk  = 0;
-    vtss_profile_cnt_ctx  = 0;
-    vtss_profile_clk_ctx  = 0;
-    vtss_profile_cnt_pmi  = 0;
-    vtss_profile_clk_pmi  = 0;
-    vtss_profile_cnt_pmu  = 0;
-    vtss_profile_clk_pmu  = 0;
-    vtss_profile_cnt_sys  = 0;
-    vtss_profile_clk_sys  = 0;
-    vtss_profile_cnt_bts  = 0;
-    vtss_profile_clk_bts  = 0;
-    vtss_profile_cnt_vma  = 0;
-    vtss_profile_clk_vma  = 0;
-    vtss_profile_cnt_pgp  = 0;
-    vtss_profile_clk_pgp  = 0;
-    vtss_profile_cnt_cpy  = 0;
-    vtss_profile_clk_cpy  = 0;
-    vtss_profile_cnt_vld  = 0;
-    vtss_profile_clk_vld  = 0;
-    vtss_profile_cnt_unw  = 0;
-    vtss_profile_clk_unw  = 0;
-#endif
+    vtss_profile_reset();
     atomic_set(&vtss_target_count, 0);
     atomic_set(&vtss_mmap_reg_callcnt, 1);
     cpumask_copy(&vtss_collector_cpumask, vtss_procfs_cpumask());
@@ -2228,6 +2229,7 @@ int vtss_cmd_start(void)
 #endif
     vtss_procfs_ctrl_flush();
     rc |= vtss_transport_init();
+    rc |= vtss_stack_table_init();
     atomic_set(&vtss_transport_initialized, 1);
     rc |= vtss_task_map_init();
     rc |= vtss_dsa_init();
@@ -2372,10 +2374,10 @@ int vtss_debug_info(struct seq_file *s)
     seq_cpumask_list(s, &vtss_collector_cpumask);
     seq_putc(s, '\n');
 
-#ifdef VTSS_DEBUG_PROFILE
-    seq_puts(s, "\n[profile]\n");
-    VTSS_PROFILE_PRINT(seq_printf, s,);
-#endif
+    if (vtss_profile_enabled) {
+        seq_puts(s, "\n[profile]\n");
+        rc |= vtss_profile_show(s);
+    }
     rc |= vtss_transport_debug_info(s);
     rc |= vtss_task_map_foreach(vtss_debug_info_target, s);
     return rc;
@@ -2401,14 +2403,16 @@ void vtss_fini(void)
 
     vtss_procfs_fini();
     vtss_user_vm_fini();
+    vtss_profile_fini();
     vtss_cpuevents_fini();
     vtss_globals_fini();
+    /* task map items are freed by RCU callbacks */
+    rcu_barrier();
 }
 
 int vtss_init(void)
 {
     int cpu, rc = 0;
-    unsigned long flags;
 
 #ifdef VTSS_GET_TASK_STRUCT
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39)
@@ -2430,15 +2434,15 @@ int vtss_init(void)
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39) */
 #endif /* VTSS_GET_TASK_STRUCT */
 
-    write_lock_irqsave(&vtss_recovery_rwlock, flags);
     for_each_possible_cpu(cpu) {
-        per_cpu(vtss_recovery_tskd, cpu) = NULL;
+        vtss_recovery_spin_lock_init(&per_cpu(vtss_recovery_slot, cpu).lock);
+        vtss_recovery_tskd(cpu) = NULL;
     }
-    write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
     cpumask_copy(&vtss_collector_cpumask, cpu_present_mask);
 
     rc |= vtss_globals_init();
     rc |= vtss_cpuevents_init();
+    rc |= vtss_profile_init();
     rc |= vtss_user_vm_init();
     rc |= vtss_procfs_init();
     return rc;
@@ -57,7 +57,7 @@ void vtss_target_exit(struct task_struct* task);
 void vtss_syscall_enter(struct pt_regs *regs);
 void vtss_syscall_leave(struct pt_regs *regs);
 void vtss_kmap(struct task_struct* task, const char* name, unsigned long addr, unsigned long pgoff, unsigned long size);
-void vtss_mmap(struct file *file, unsigned long addr, unsigned long pgoff, unsigned long size);
+void vtss_mmap(struct file *file, unsigned long addr, unsigned long pgoff, unsigned long size, unsigned long vm_flags);
 void vtss_mmap_reload(struct file *file, unsigned long addr);
 void vtss_sched_switch(struct task_struct *prev, struct task_struct *next, void* prev_bp, void* next_ip);
 
@@ -388,12 +388,10 @@ static int rp_mmap_region_leave(struct kretprobe_instance *ri, struct pt_regs *r
 
 //    TRACE("ri=0x%p, data=0x%p: rc=0x%lx", ri, data, rc);
 //#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-    if ((rc == data->addr) &&
-        (data->flags & VM_EXEC) && !(data->flags & VM_WRITE) &&
-        data->file && data->file->f_dentry)
+    if ((rc == data->addr) && (data->flags & VM_EXEC))
     {
         if (vtss_mmap_count < 100)TRACE("file=0x%p, addr=0x%lx, pgoff=%lu, size=%lu", data->file, data->addr, data->pgoff, data->size);
-        vtss_mmap(data->file, data->addr, data->pgoff, data->size);
+        vtss_mmap(data->file, data->addr, data->pgoff, data->size, data->flags);
     } else
     {
         if (vtss_mmap_count < 100)TRACE("Address range was not added to the map, addr=0x%lx, pgoff=%lu, size=%lu, rc = %lx", data->addr, data->pgoff, data->size, rc);
@@ -31,6 +31,8 @@
 #include "collector.h"
 #include "cpuevents.h"
 #include "nmiwd.h"
+#include "profile.h"
+#include "transport.h"
 
 #include <linux/list.h>         /* for struct list_head */
 #include <linux/module.h>
@@ -51,6 +53,8 @@
 #define VTSS_PROCFS_TARGETS_NAME   ".targets"
 #define VTSS_PROCFS_TIMESRC_NAME   ".time_source"
 #define VTSS_PROCFS_TIMELIMIT_NAME ".time_limit"
+#define VTSS_PROCFS_PROFILE_NAME   ".profile"
+#define VTSS_PROCFS_TRANSPORT_NAME ".transport"
 
 #ifdef VTSS_AUTOCONF_USER_COPY_WITHOUT_CHECK
 #define vtss_copy_from_user _copy_from_user
@@ -923,6 +927,109 @@ static const struct file_operations vtss_procfs_timelimit_fops = {
 
 /* ************************************************************************* */
 
+static int vtss_procfs_profile_show(struct seq_file *s, void *v)
+{
+    return vtss_profile_show(s);
+}
+
+static int vtss_procfs_profile_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, vtss_procfs_profile_show, NULL);
+}
+
+/* "1" - enable, "0" - disable, "reset" - clear collected histograms */
+static ssize_t vtss_procfs_profile_write(struct file *file, const char __user * buf, size_t count, loff_t * ppos)
+{
+    char buff[8];
+    size_t len = min(count, sizeof(buff) - 1);
+
+    if (copy_from_user(buff, buf, len))
+        return -EFAULT;
+    buff[len] = '\0';
+    if (!strncmp(buff, "reset", 5)) {
+        vtss_profile_reset();
+    } else if (buff[0] == '1') {
+        vtss_profile_enabled = 1;
+    } else if (buff[0] == '0') {
+        vtss_profile_enabled = 0;
+    } else {
+        return -EINVAL;
+    }
+    TRACE("vtss_profile_enabled=%d", vtss_profile_enabled);
+    return count;
+}
+
+static const struct file_operations vtss_procfs_profile_fops = {
+    .owner   = THIS_MODULE,
+    .open    = vtss_procfs_profile_open,
+    .read    = seq_read,
+    .write   = vtss_procfs_profile_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/* ************************************************************************* */
+
+static ssize_t vtss_procfs_transport_read(struct file* file, char __user* buf, size_t size, loff_t* ppos)
+{
+    ssize_t rc = 0;
+
+    if (*ppos == 0) {
+        char buff[8]; /* enough for "merge" or "mmap" string */
+        rc = snprintf(buff, sizeof(buff)-2, "%s", (vtss_transport_mode == VTSS_TRANSPORT_MODE_MMAP) ? "mmap" : "merge");
+        rc = (rc < 0) ? 0 : rc;
+        buff[rc++] = '\n';
+        buff[rc]   = '\0';
+        *ppos += rc;
+        if (rc <= size) {
+            if (copy_to_user(buf, buff, rc)) {
+                rc = -EFAULT;
+            }
+        } else {
+            rc = -EINVAL;
+        }
+    }
+    return rc;
+}
+
+/* Takes effect for transports created after the change, i.e. the next collection */
+static ssize_t vtss_procfs_transport_write(struct file *file, const char __user * buf, size_t count, loff_t * ppos)
+{
+    char val[8];
+
+    if (count < 4 || vtss_copy_from_user(val, buf, 4)) {
+        ERROR("Error in copy_from_user()");
+        return -EFAULT;
+    }
+    val[4] = '\0';
+    if (!strncmp(val, "mmap", 4))
+        vtss_transport_mode = VTSS_TRANSPORT_MODE_MMAP;
+    if (!strncmp(val, "merg", 4))
+        vtss_transport_mode = VTSS_TRANSPORT_MODE_MERGE;
+    TRACE("transport mode=%s", (vtss_transport_mode == VTSS_TRANSPORT_MODE_MMAP) ? "mmap" : "merge");
+    return count;
+}
+
+static int vtss_procfs_transport_open(struct inode *inode, struct file *file)
+{
+    return 0;
+}
+
+static int vtss_procfs_transport_close(struct inode *inode, struct file *file)
+{
+    return 0;
+}
+
+static const struct file_operations vtss_procfs_transport_fops = {
+    .owner   = THIS_MODULE,
+    .read    = vtss_procfs_transport_read,
+    .write   = vtss_procfs_transport_write,
+    .open    = vtss_procfs_transport_open,
+    .release = vtss_procfs_transport_close,
+};
+
+/* ************************************************************************* */
+
 static void vtss_procfs_rmdir(void)
 {
     if (vtss_procfs_root != NULL) {
@@ -1000,6 +1107,8 @@ void vtss_procfs_fini(void)
         remove_proc_entry(VTSS_PROCFS_TARGETS_NAME,   vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_TIMESRC_NAME,   vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_TIMELIMIT_NAME, vtss_procfs_root);
+        remove_proc_entry(VTSS_PROCFS_PROFILE_NAME,   vtss_procfs_root);
+        remove_proc_entry(VTSS_PROCFS_TRANSPORT_NAME, vtss_procfs_root);
         vtss_procfs_rmdir();
     }
 }
@@ -1058,5 +1167,7 @@ int vtss_procfs_init(void)
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_TARGETS_NAME,   &vtss_procfs_targets_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_TIMESRC_NAME,   &vtss_procfs_timesrc_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_TIMELIMIT_NAME, &vtss_procfs_timelimit_fops);
+    rc |= vtss_procfs_create_entry(VTSS_PROCFS_PROFILE_NAME,   &vtss_procfs_profile_fops);
+    rc |= vtss_procfs_create_entry(VTSS_PROCFS_TRANSPORT_NAME, &vtss_procfs_transport_fops);
     return rc;
 }
@@ -0,0 +1,191 @@
+/*
+  Copyright (C) 2010-2014 Intel Corporation.  All Rights Reserved.
+
+  This file is part of SEP Development Kit
+
+  SEP Development Kit is free software; you can redistribute it
+  and/or modify it under the terms of the GNU General Public License
+  version 2 as published by the Free Software Foundation.
+
+  SEP Development Kit is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with SEP Development Kit; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+
+  As a special exception, you may use this file as part of a free software
+  library without restriction.  Specifically, if other files instantiate
+  templates or use macros or inline functions from this file, or you compile
+  this file and link it with other files to produce an executable, this
+  file does not by itself cause the resulting executable to be covered by
+  the GNU General Public License.  This exception does not however
+  invalidate any other reasons why the executable file might be covered by
+  the GNU General Public License.
+*/
+#include "vtss_config.h"
+#include "profile.h"
+
+#include <linux/bitops.h>       /* for fls64() */
+#include <linux/math64.h>       /* for div64_u64() */
+#include <linux/string.h>       /* for memset() */
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+struct vtss_profile_hist
+{
+    u64 count;
+    u64 sum;
+    u32 buckets[VTSS_PROFILE_BUCKETS];
+};
+
+struct vtss_profile_data
+{
+    struct vtss_profile_hist hist[VTSS_PROFILE_COUNT];
+};
+
+static const char* vtss_profile_names[VTSS_PROFILE_COUNT] = {
+    [VTSS_PROFILE_ctx] = "ctx",
+    [VTSS_PROFILE_pmi] = "pmi",
+    [VTSS_PROFILE_pmu] = "pmu",
+    [VTSS_PROFILE_sys] = "sys",
+    [VTSS_PROFILE_bts] = "bts",
+    [VTSS_PROFILE_stk] = "stk",
+    [VTSS_PROFILE_unw] = "unw",
+    [VTSS_PROFILE_vld] = "vld",
+    [VTSS_PROFILE_vma] = "vma",
+    [VTSS_PROFILE_pgp] = "pgp",
+    [VTSS_PROFILE_cpy] = "cpy",
+    [VTSS_PROFILE_trn] = "trn",
+};
+
+int vtss_profile_enabled = 0;
+
+/* Allocated dynamically: the static per-cpu area reserved for modules is small */
+static struct vtss_profile_data __percpu* vtss_profile_data = NULL;
+
+void vtss_profile_record(int id, cycles_t cycles)
+{
+    int idx;
+    struct vtss_profile_hist* hist;
+
+    if (unlikely(vtss_profile_data == NULL || id < 0 || id >= VTSS_PROFILE_COUNT))
+        return;
+
+    idx = fls64((u64)cycles);
+    if (idx >= VTSS_PROFILE_BUCKETS)
+        idx = VTSS_PROFILE_BUCKETS - 1;
+    /* Updates are per-cpu and not atomic, a rare loss from a nested PMI is fine */
+    hist = &per_cpu_ptr(vtss_profile_data, get_cpu())->hist[id];
+    hist->count++;
+    hist->sum += cycles;
+    hist->buckets[idx]++;
+    put_cpu();
+}
+
+void vtss_profile_reset(void)
+{
+    int cpu;
+
+    if (vtss_profile_data == NULL)
+        return;
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(vtss_profile_data, cpu), 0, sizeof(struct vtss_profile_data));
+    }
+}
+
+/* Upper bound of the bucket where the given quantile (in percents) falls */
+static u64 vtss_profile_quantile(struct vtss_profile_hist* hist, int percent)
+{
+    int i;
+    u64 n = 0;
+    u64 target = (hist->count * percent + 99) / 100;
+
+    for (i = 0; i < VTSS_PROFILE_BUCKETS; i++) {
+        n += hist->buckets[i];
+        if (n >= target)
+            return 1ULL << i;
+    }
+    return 1ULL << (VTSS_PROFILE_BUCKETS - 1);
+}
+
+static u64 vtss_profile_max(struct vtss_profile_hist* hist)
+{
+    int i;
+
+    for (i = VTSS_PROFILE_BUCKETS - 1; i >= 0; i--) {
+        if (hist->buckets[i])
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+int vtss_profile_show(struct seq_file *s)
+{
+    int id, cpu, i;
+    struct vtss_profile_hist total;
+
+    seq_printf(s, "enabled=%d\n", vtss_profile_enabled);
+    if (vtss_profile_data == NULL)
+        return 0;
+
+    for (id = 0; id < VTSS_PROFILE_COUNT; id++) {
+        memset(&total, 0, sizeof(total));
+        for_each_possible_cpu(cpu) {
+            struct vtss_profile_hist* hist = &per_cpu_ptr(vtss_profile_data, cpu)->hist[id];
+            total.count += hist->count;
+            total.sum   += hist->sum;
+            for (i = 0; i < VTSS_PROFILE_BUCKETS; i++)
+                total.buckets[i] += hist->buckets[i];
+        }
+        if (total.count == 0)
+            continue;
+        seq_printf(s, "%s: n=%llu avg=%llu p50<%llu p99<%llu max<%llu\n",
+                    vtss_profile_names[id], total.count, div64_u64(total.sum, total.count),
+                    vtss_profile_quantile(&total, 50), vtss_profile_quantile(&total, 99),
+                    vtss_profile_max(&total));
+        seq_puts(s, "  log2:");
+        for (i = 0; i < VTSS_PROFILE_BUCKETS; i++) {
+            if (total.buckets[i])
+                seq_printf(s, " %d:%u", i, total.buckets[i]);
+        }
+        seq_putc(s, '\n');
+        for_each_possible_cpu(cpu) {
+            struct vtss_profile_hist* hist = &per_cpu_ptr(vtss_profile_data, cpu)->hist[id];
+            if (hist->count)
+                seq_printf(s, "  cpu%d: n=%llu avg=%llu p99<%llu max<%llu\n",
+                            cpu, hist->count, div64_u64(hist->sum, hist->count),
+                            vtss_profile_quantile(hist, 99), vtss_profile_max(hist));
+        }
+    }
+    return 0;
+}
+
+int vtss_profile_init(void)
+{
+#ifdef VTSS_DEBUG_PROFILE
+    vtss_profile_enabled = 1; /* VTSS=profile build turns histograms on at load */
+#else
+    vtss_profile_enabled = 0;
+#endif
+    vtss_profile_data = alloc_percpu(struct vtss_profile_data);
+    if (vtss_profile_data == NULL) {
+        ERROR("Unable to allocate latency histograms");
+        return -ENOMEM;
+    }
+    vtss_profile_reset();
+    return 0;
+}
+
+void vtss_profile_fini(void)
+{
+    vtss_profile_enabled = 0;
+    if (vtss_profile_data != NULL) {
+        /* Wait for in-flight records from irq context */
+        synchronize_sched();
+        free_percpu(vtss_profile_data);
+        vtss_profile_data = NULL;
+    }
+}
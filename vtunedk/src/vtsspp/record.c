@@ -622,7 +622,8 @@ int vtss_record_configs(struct vtss_transport_data* trnd, int m32, int is_safe)
             VTSS_CFGTRACE_HWCFG  | VTSS_CFGTRACE_SAMPLE  | VTSS_CFGTRACE_TP     |
             VTSS_CFGTRACE_MODULE | VTSS_CFGTRACE_PROCTHR | VTSS_CFGTRACE_STACKS |
             VTSS_CFGTRACE_BRANCH | VTSS_CFGTRACE_EXECTX  | VTSS_CFGTRACE_TBS    |
-            VTSS_CFGTRACE_LASTBR | VTSS_CFGTRACE_TREE    | VTSS_CFGTRACE_SYNCARG;
+            VTSS_CFGTRACE_LASTBR | VTSS_CFGTRACE_TREE    | VTSS_CFGTRACE_SYNCARG |
+            VTSS_CFGTRACE_KSTKIDX;
         colrec.len = (unsigned char)sizeof(colname);
         rc |= vtss_transport_record_write(trnd, &colrec, sizeof(colrec), (void*)colname, sizeof(colname), is_safe);
     }
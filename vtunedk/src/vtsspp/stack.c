@@ -36,6 +36,9 @@
 
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/hardirq.h>      /* for in_nmi() */
 #include <linux/highmem.h>      /* for kmap()/kunmap() */
 #include <linux/pagemap.h>      /* for page_cache_release() */
 #include <asm/page.h>
@@ -445,6 +448,101 @@ int vtss_stack_dump(struct vtss_transport_data* trnd, stack_control_t* stk, stru
     return rc;
 }
 
+/*
+ * Kernel call chain table, used when the reader asks for it with
+ * VTSS_CFGTRACE_KSTKIDX. A chain seen for the first time is written
+ * with its id in stk_trace_kernel_record_t::idx (a definition). Repeated
+ * chains are written with the id only and no chain data (a reference).
+ * The table is per cpu and direct mapped, so an entry is replaced on
+ * collision and the next sample of the evicted chain defines it again.
+ * Ids are unique across cpus, so a reference never depends on a
+ * definition from another cpu's stream. Entries are keyed by the
+ * transport's gen, not its address, which a new transport may reuse,
+ * and a definition is never staged, so it is only remembered once it
+ * is known to be in the ring buffer.
+ */
+#define VTSS_STACK_TABLE_SIZE  256 /* entries per cpu, should be 2^n */
+#define VTSS_STACK_TABLE_CHAIN 240 /* longer chains are always written in full */
+
+struct vtss_stack_table_entry
+{
+    unsigned int                gen;
+    u32                         hash;
+    unsigned short              size;
+    unsigned char               chain[VTSS_STACK_TABLE_CHAIN];
+};
+
+static DEFINE_PER_CPU(struct vtss_stack_table_entry*, vtss_stack_table);
+
+/**
+ * Look the chain up in the current cpu's table.
+ * Returns the chain id and sets *is_new if the chain has to be defined,
+ * or -1 if the chain is not tracked.
+ * Must be called with irqs disabled.
+ */
+static unsigned int vtss_stack_table_lookup(struct vtss_transport_data* trnd, unsigned char* chain, int size, u32* hash, int* is_new)
+{
+    unsigned int slot;
+    unsigned int gen = vtss_transport_get_gen(trnd);
+    int cpu = smp_processor_id();
+    struct vtss_stack_table_entry* table = per_cpu(vtss_stack_table, cpu);
+    struct vtss_stack_table_entry* entry;
+
+    *is_new = 1;
+    if (table == NULL || size <= 0 || size > VTSS_STACK_TABLE_CHAIN)
+        return (unsigned int)-1;
+    *hash = jhash(chain, size, gen);
+    slot  = *hash & (VTSS_STACK_TABLE_SIZE - 1);
+    entry = &table[slot];
+    if (entry->gen == gen && entry->hash == *hash && entry->size == size && !memcmp(entry->chain, chain, size))
+        *is_new = 0;
+    return (unsigned int)(cpu * VTSS_STACK_TABLE_SIZE + slot);
+}
+
+/**
+ * Remember a chain once its definition is in the trace.
+ * Must be called with irqs disabled, on the cpu of the lookup.
+ */
+static void vtss_stack_table_insert(struct vtss_transport_data* trnd, unsigned int idx, u32 hash, unsigned char* chain, int size)
+{
+    struct vtss_stack_table_entry* entry;
+
+    entry = &per_cpu(vtss_stack_table, smp_processor_id())[idx % VTSS_STACK_TABLE_SIZE];
+    entry->gen  = vtss_transport_get_gen(trnd);
+    entry->hash = hash;
+    entry->size = (unsigned short)size;
+    memcpy(entry->chain, chain, size);
+}
+
+int vtss_stack_table_init(void)
+{
+    int cpu;
+    struct vtss_stack_table_entry* table;
+
+    for_each_possible_cpu(cpu) {
+        table = (struct vtss_stack_table_entry*)vmalloc(VTSS_STACK_TABLE_SIZE * sizeof(struct vtss_stack_table_entry));
+        if (table != NULL) {
+            memset(table, 0, VTSS_STACK_TABLE_SIZE * sizeof(struct vtss_stack_table_entry));
+        } else {
+            /* chains are written in full on this cpu */
+            ERROR("Not enough memory for cpu%d stack table", cpu);
+        }
+        per_cpu(vtss_stack_table, cpu) = table;
+    }
+    return 0;
+}
+
+void vtss_stack_table_fini(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        if (per_cpu(vtss_stack_table, cpu) != NULL)
+            vfree(per_cpu(vtss_stack_table, cpu));
+        per_cpu(vtss_stack_table, cpu) = NULL;
+    }
+}
+
 int vtss_stack_record_kernel(struct vtss_transport_data* trnd, stack_control_t* stk, pid_t tid, int cpu, unsigned long long stitch_id, int is_safe)
 {
     int rc = -EFAULT;
@@ -482,6 +580,10 @@ int vtss_stack_record_kernel(struct vtss_transport_data* trnd, stack_control_t*
 
 #else
     stk_trace_kernel_record_t* stkrec;
+    unsigned int idx = (unsigned int)-1;
+    u32 hash = 0;
+    int is_new = 1;
+
     if (stklen == 0)
     {
         // kernel is empty
@@ -490,8 +592,16 @@ int vtss_stack_record_kernel(struct vtss_transport_data* trnd, stack_control_t*
         return 0;
     }
     TRACE("ip=0x%p, sp=0x%p, fp=0x%p: Trace %d bytes", stk->ip.vdp, stk->sp.vdp, stk->fp.vdp, stklen);
+    if ((reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_KSTKIDX) && irqs_disabled() && !in_nmi()) {
+        idx = vtss_stack_table_lookup(trnd, stk->kernel_callchain, stklen, &hash, &is_new);
+        if (!is_new)
+            stklen = 0; /* reference to the chain defined before */
+    }
     //implementation is done for UEC NOT USED
-    stkrec = (stk_trace_kernel_record_t*)vtss_transport_record_reserve(trnd, &entry, sizeof(stk_trace_kernel_record_t) + stklen);
+    if (is_new && idx != (unsigned int)-1)
+        stkrec = (stk_trace_kernel_record_t*)vtss_transport_record_reserve_direct(trnd, &entry, sizeof(stk_trace_kernel_record_t) + stklen);
+    else
+        stkrec = (stk_trace_kernel_record_t*)vtss_transport_record_reserve(trnd, &entry, sizeof(stk_trace_kernel_record_t) + stklen);
     if (likely(stkrec)) {
     /// save current alt. stack:
     /// [flagword - 4b][residx]
@@ -502,9 +612,13 @@ int vtss_stack_record_kernel(struct vtss_transport_data* trnd, stack_control_t*
     stkrec->size     = (unsigned short)stklen + sizeof(stkrec->size) + sizeof(stkrec->type);
     stkrec->type     = (sizeof(void*) == 8) ? UECSYSTRACE_CLEAR_STACK64 : UECSYSTRACE_CLEAR_STACK32;
     stkrec->size += sizeof(unsigned int);
-    stkrec->idx   = -1;
-    memcpy((char*)stkrec+sizeof(stk_trace_kernel_record_t), stk->kernel_callchain, stklen);
+    stkrec->idx   = idx;
+    if (stklen)
+        memcpy((char*)stkrec+sizeof(stk_trace_kernel_record_t), stk->kernel_callchain, stklen);
     rc = vtss_transport_record_commit(trnd, entry, is_safe);
+    /* later samples may refer to the chain only once its definition is in the ring */
+    if (rc == 0 && is_new && idx != (unsigned int)-1)
+        vtss_stack_table_insert(trnd, idx, hash, stk->kernel_callchain, stklen);
     }
 #endif
     return rc;
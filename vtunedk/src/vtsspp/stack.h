@@ -37,4 +37,7 @@
 int vtss_stack_dump(struct vtss_transport_data* trnd, stack_control_t* stk, struct task_struct* task, struct pt_regs* regs, void* reg_fp, int in_irq);
 int vtss_stack_record(struct vtss_transport_data* trnd, stack_control_t* stk, pid_t tid, int cpu, int is_safe);
 
+int  vtss_stack_table_init(void);
+void vtss_stack_table_fini(void);
+
 #endif /* _VTSS_STACK_H_ */
@@ -30,61 +30,172 @@
 
 #include <linux/jhash.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
+/*
+ * Lookups walk the hash under rcu_read_lock() only, so the context switch
+ * and PMI paths never write to a shared cache line except the usage count
+ * of the item they found. Updates take a per-bucket spinlock. The global
+ * vtss_task_map_lock is taken for read by updaters and for write by the
+ * resize and init/fini paths, which swap the whole table.
+ *
+ * Each item has two hash nodes: the live table links item->hlist[ver] and
+ * a resize links the other node into the new table, so readers still
+ * walking the old table always see consistent chains.
+ */
 #ifdef CONFIG_PREEMPT_RT
 static DEFINE_RAW_RWLOCK(vtss_task_map_lock);
+typedef raw_spinlock_t vtss_task_map_spinlock_t;
+#define vtss_task_map_spin_lock_init(lock)               raw_spin_lock_init(lock)
+#define vtss_task_map_spin_lock_irqsave(lock, flags)     raw_spin_lock_irqsave(lock, flags)
+#define vtss_task_map_spin_unlock_irqrestore(lock, flags) raw_spin_unlock_irqrestore(lock, flags)
 #else
 static DEFINE_RWLOCK(vtss_task_map_lock);
+typedef spinlock_t vtss_task_map_spinlock_t;
+#define vtss_task_map_spin_lock_init(lock)               spin_lock_init(lock)
+#define vtss_task_map_spin_lock_irqsave(lock, flags)     spin_lock_irqsave(lock, flags)
+#define vtss_task_map_spin_unlock_irqrestore(lock, flags) spin_unlock_irqrestore(lock, flags)
 #endif
 
 /* Should be 2^n */
-#define HASH_TABLE_SIZE (1 << 10)
+#define HASH_TABLE_SIZE     (1 << 10)
+#define HASH_TABLE_SIZE_MAX (1 << 16)
+
+struct vtss_task_map_bucket
+{
+    struct hlist_head        head;
+    vtss_task_map_spinlock_t lock;
+};
+
+struct vtss_task_map_table
+{
+    unsigned int size;  /* number of buckets, 2^n */
+    unsigned int ver;   /* index of vtss_task_map_item_t::hlist[] linked into this table */
+    struct vtss_task_map_bucket bucket[0];
+};
+
+static struct vtss_task_map_table* vtss_task_map_table = NULL;
+static atomic_t vtss_task_map_count = ATOMIC_INIT(0);
+
+static void vtss_task_map_resize(struct work_struct *work);
+static DECLARE_WORK(vtss_task_map_resize_work, vtss_task_map_resize);
 
-static struct hlist_head vtss_task_map_hash_table[HASH_TABLE_SIZE] = { {NULL} };
-static atomic_t  vtss_map_initialized = ATOMIC_INIT(0);
 /** Compute the map hash */
-static inline u32 vtss_task_map_hash(pid_t key) __attribute__ ((always_inline));
-static inline u32 vtss_task_map_hash(pid_t key)
+static inline u32 vtss_task_map_hash(pid_t key, unsigned int size) __attribute__ ((always_inline));
+static inline u32 vtss_task_map_hash(pid_t key, unsigned int size)
+{
+    return (jhash_1word(key, 0) & (size - 1));
+}
+
+static inline struct vtss_task_map_bucket* vtss_task_map_bucket(struct vtss_task_map_table* table, pid_t key)
+{
+    return &table->bucket[vtss_task_map_hash(key, table->size)];
+}
+
+static struct vtss_task_map_table* vtss_task_map_table_alloc(unsigned int size, unsigned int ver)
+{
+    unsigned int i;
+    size_t bytes = sizeof(struct vtss_task_map_table) + size*sizeof(struct vtss_task_map_bucket);
+    struct vtss_task_map_table* table;
+
+    if (bytes <= PAGE_SIZE)
+        table = (struct vtss_task_map_table*)kmalloc(bytes, GFP_KERNEL);
+    else
+        table = (struct vtss_task_map_table*)vmalloc(bytes);
+    if (table != NULL) {
+        table->size = size;
+        table->ver  = ver;
+        for (i = 0; i < size; i++) {
+            INIT_HLIST_HEAD(&table->bucket[i].head);
+            vtss_task_map_spin_lock_init(&table->bucket[i].lock);
+        }
+    }
+    return table;
+}
+
+static void vtss_task_map_table_free(struct vtss_task_map_table* table)
+{
+    if (table == NULL)
+        return;
+    if (is_vmalloc_addr(table))
+        vfree(table);
+    else
+        kfree(table);
+}
+
+static void vtss_task_map_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, vtss_task_map_item_t, rcu));
+}
+
+/**
+ * Call the destructor and free the item after a grace period,
+ * lockless readers may still walk over it.
+ */
+static void vtss_task_map_destroy(vtss_task_map_item_t* item)
 {
-    return (jhash_1word(key, 0) & (HASH_TABLE_SIZE - 1));
+    if (item->dtor)
+        item->dtor(item, NULL);
+    item->dtor = NULL;
+    call_rcu(&item->rcu, vtss_task_map_free_rcu);
+}
+
+/**
+ * Unlink the item from its bucket.
+ * Caller holds vtss_task_map_lock for read or write.
+ */
+static void vtss_task_map_unlink(struct vtss_task_map_table* table, vtss_task_map_item_t* item)
+{
+    unsigned long flags;
+    struct vtss_task_map_bucket* bucket = vtss_task_map_bucket(table, item->key);
+
+    vtss_task_map_spin_lock_irqsave(&bucket->lock, flags);
+    if (item->in_list) {
+        item->in_list = 0;
+        hlist_del_init_rcu(&item->hlist[table->ver]);
+        atomic_dec(&vtss_task_map_count);
+    }
+    vtss_task_map_spin_unlock_irqrestore(&bucket->lock, flags);
 }
 
 /**
  * Get an item if it's present in the hash table and increment its usage.
  * Returns NULL if not present.
- * Takes a read lock on vtss_task_map_lock.
+ * Lockless, safe in any context.
  */
 vtss_task_map_item_t* vtss_task_map_get_item(pid_t key)
 {
-    unsigned long flags;
+    struct vtss_task_map_table* table;
     struct hlist_head *head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
     struct hlist_node *node = NULL;
 #endif
-    struct hlist_node *temp = NULL;
     vtss_task_map_item_t *item;
-//    printk("get start");
-    if (atomic_read(&vtss_map_initialized)==0)return NULL;
 
-    read_lock_irqsave(&vtss_task_map_lock, flags);
-    head = &vtss_task_map_hash_table[vtss_task_map_hash(key)];
+    rcu_read_lock();
+    table = rcu_dereference(vtss_task_map_table);
+    if (table == NULL) {
+        rcu_read_unlock();
+        return NULL;
+    }
+    head = &vtss_task_map_bucket(table, key)->head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-    hlist_for_each_entry_safe(item, node, temp, head, hlist)
+    hlist_for_each_entry_rcu(item, node, head, hlist[table->ver])
 #else
-    hlist_for_each_entry_safe(item, temp, head,  hlist)
-#endif    
+    hlist_for_each_entry_rcu(item, head, hlist[table->ver])
+#endif
     {
-        if (key == item->key) {
-            atomic_inc(&item->usage);
-            read_unlock_irqrestore(&vtss_task_map_lock, flags);
-//            printk("get end 1");
+        /* Skip items whose last reference is being dropped right now */
+        if (key == item->key && atomic_inc_not_zero(&item->usage)) {
+            rcu_read_unlock();
             return item;
         }
     }
-    read_unlock_irqrestore(&vtss_task_map_lock, flags);
-//    printk("get end");
+    rcu_read_unlock();
     return NULL;
 }
 
@@ -95,27 +206,19 @@ vtss_task_map_item_t* vtss_task_map_get_item(pid_t key)
 int vtss_task_map_put_item(vtss_task_map_item_t* item)
 {
     unsigned long flags;
+    struct vtss_task_map_table* table;
 
-//    printk("put start");
     if ((item != NULL) && atomic_dec_and_test(&item->usage)) {
         if (item->in_list) {
-            write_lock_irqsave(&vtss_task_map_lock, flags);
-            if (item->in_list) {
-                item->in_list = 0;
-                hlist_del_init(&item->hlist);
-            }
-            write_unlock_irqrestore(&vtss_task_map_lock, flags);
-        }
-        if (atomic_read(&item->usage) == 0) {
-            if (item->dtor)
-                item->dtor(item, NULL);
-            item->dtor = NULL;
-            kfree(item);
-//            printk("put end 1");
-            return 1;
+            read_lock_irqsave(&vtss_task_map_lock, flags);
+            table = vtss_task_map_table;
+            if (table != NULL)
+                vtss_task_map_unlink(table, item);
+            read_unlock_irqrestore(&vtss_task_map_lock, flags);
         }
+        vtss_task_map_destroy(item);
+        return 1;
     }
-//    printk("put end");
     return 0;
 }
 
@@ -123,85 +226,84 @@ int vtss_task_map_put_item(vtss_task_map_item_t* item)
  * Add the item into the hash table with incremented usage.
  * Remove the item with the same key.
  * Returns 1 if old item was destroyed otherwise 0.
- * Takes a write lock on vtss_task_map_lock.
+ * Takes a read lock on vtss_task_map_lock and the bucket lock.
  */
 int vtss_task_map_add_item(vtss_task_map_item_t* item2)
 {
-    unsigned long flags;
+    unsigned long flags, bflags;
     int ret = 0;
-    struct hlist_head *head;
+    unsigned int count = 0;
+    struct vtss_task_map_table* table;
+    struct vtss_task_map_bucket* bucket;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
     struct hlist_node *node = NULL;
 #endif
     vtss_task_map_item_t *item = NULL;
     struct hlist_node *temp = NULL;
-//    printk("add item\n");
-    if ((item2 != NULL) && !item2->in_list) {
-        write_lock_irqsave(&vtss_task_map_lock, flags);
-        if (!item2->in_list)
-        {
-        head = &vtss_task_map_hash_table[vtss_task_map_hash(item2->key)];
+
+    if ((item2 == NULL) || item2->in_list)
+        return 0;
+    read_lock_irqsave(&vtss_task_map_lock, flags);
+    table = vtss_task_map_table;
+    if (table == NULL) {
+        read_unlock_irqrestore(&vtss_task_map_lock, flags);
+        return 0;
+    }
+    bucket = vtss_task_map_bucket(table, item2->key);
+    vtss_task_map_spin_lock_irqsave(&bucket->lock, bflags);
+    if (!item2->in_list) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-        hlist_for_each_entry_safe(item, node, temp, head, hlist)
+        hlist_for_each_entry_safe(item, node, temp, &bucket->head, hlist[table->ver])
 #else
-        hlist_for_each_entry_safe(item, temp, head, hlist)
+        hlist_for_each_entry_safe(item, temp, &bucket->head, hlist[table->ver])
 #endif
         {
             if (item2->key == item->key) {
                 /* Already there, remove it */
-                hlist_del_init(&item->hlist);
-//                printk("add item delete from list\n");
-                if (atomic_read(&item->usage) == 0){
-                    //item = NULL; // it will be deleted in "put"
-                    item->in_list = 0;
-                }
-                else if ( atomic_dec_and_test(&item->usage)) {
-//                    printk("add item delete item really\n");
-                    if (item->dtor)
-                        item->dtor(item, NULL);
-                    item->dtor = NULL;
-                    kfree(item);
+                hlist_del_init_rcu(&item->hlist[table->ver]);
+                item->in_list = 0;
+                atomic_dec(&vtss_task_map_count);
+                /* If usage is 0 already it will be destroyed in "put" */
+                if (atomic_read(&item->usage) != 0 && atomic_dec_and_test(&item->usage)) {
+                    vtss_task_map_destroy(item);
                     ret = 1;
-                    //item = NULL;
-                } else item->in_list = 0;
+                }
                 break;
             }
-            //item = NULL;
         }
         atomic_inc(&item2->usage);
-        hlist_add_head(&item2->hlist, head);
+        hlist_add_head_rcu(&item2->hlist[table->ver], &bucket->head);
         item2->in_list = 1;
-        write_unlock_irqrestore(&vtss_task_map_lock, flags);
-        }
+        count = atomic_inc_return(&vtss_task_map_count);
     }
+    vtss_task_map_spin_unlock_irqrestore(&bucket->lock, bflags);
+    /* Grow the table once there is more than one thread per bucket */
+    if (count > table->size && table->size < HASH_TABLE_SIZE_MAX)
+        schedule_work(&vtss_task_map_resize_work);
+    read_unlock_irqrestore(&vtss_task_map_lock, flags);
     return ret;
 }
 
 /**
  * Remove the item from the hash table and destroy if usage == 0.
  * Returns 1 if item was destroyed otherwise 0.
- * Takes a write lock on vtss_task_map_lock.
+ * Takes a read lock on vtss_task_map_lock and the bucket lock.
  */
 int vtss_task_map_del_item(vtss_task_map_item_t* item)
 {
     unsigned long flags;
+    struct vtss_task_map_table* table;
 
-//    printk("delete item\n");
     if (item != NULL) {
         if (item->in_list) {
-            write_lock_irqsave(&vtss_task_map_lock, flags);
-            if (item->in_list) {
-                item->in_list = 0;
-                hlist_del_init(&item->hlist);
-            }
-            write_unlock_irqrestore(&vtss_task_map_lock, flags);
+            read_lock_irqsave(&vtss_task_map_lock, flags);
+            table = vtss_task_map_table;
+            if (table != NULL)
+                vtss_task_map_unlink(table, item);
+            read_unlock_irqrestore(&vtss_task_map_lock, flags);
         }
         if (atomic_dec_and_test(&item->usage)) {
-//    printk("delete item really\n");
-            if (item->dtor)
-                item->dtor(item, NULL);
-            item->dtor = NULL;
-            kfree(item);
+            vtss_task_map_destroy(item);
             return 1;
         }
     }
@@ -210,7 +312,6 @@ int vtss_task_map_del_item(vtss_task_map_item_t* item)
 
 /**
  * allocate item + data but not insert it into the hash table, usage = 1
- * Takes a write lock on vtss_task_map_lock.
  */
 vtss_task_map_item_t* vtss_task_map_alloc(pid_t key, size_t size, vtss_task_map_func_t* dtor, gfp_t flags)
 {
@@ -221,14 +322,72 @@ vtss_task_map_item_t* vtss_task_map_alloc(pid_t key, size_t size, vtss_task_map_
         item->key     = key;
         item->in_list = 0;
         item->dtor    = dtor;
+        INIT_HLIST_NODE(&item->hlist[0]);
+        INIT_HLIST_NODE(&item->hlist[1]);
     }
     return item;
 }
 
-int vtss_task_map_foreach(vtss_task_map_func_t* func, void* args)
+/**
+ * Rehash all items into a table sized for the current number of threads.
+ * Runs from a work item since the table is allocated with GFP_KERNEL.
+ */
+static void vtss_task_map_resize(struct work_struct *work)
 {
     int i;
     unsigned long flags;
+    unsigned int size;
+    struct vtss_task_map_table *old, *table;
+    struct hlist_head *head;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+    struct hlist_node *node = NULL;
+#endif
+    vtss_task_map_item_t *item;
+
+    old = vtss_task_map_table;
+    if (old == NULL)
+        return;
+    size = old->size;
+    while (size < (unsigned int)atomic_read(&vtss_task_map_count) && size < HASH_TABLE_SIZE_MAX)
+        size <<= 1;
+    if (size <= old->size)
+        return;
+    table = vtss_task_map_table_alloc(size, !old->ver);
+    if (table == NULL) {
+        ERROR("Unable to grow the task map to %u buckets", size);
+        return;
+    }
+    write_lock_irqsave(&vtss_task_map_lock, flags);
+    old = vtss_task_map_table;
+    if (old == NULL || old->size >= size) {
+        write_unlock_irqrestore(&vtss_task_map_lock, flags);
+        vtss_task_map_table_free(table);
+        return;
+    }
+    table->ver = !old->ver;
+    for (i = 0; i < old->size; i++) {
+        head = &old->bucket[i].head;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+        hlist_for_each_entry(item, node, head, hlist[old->ver])
+#else
+        hlist_for_each_entry(item, head, hlist[old->ver])
+#endif
+        {
+            hlist_add_head_rcu(&item->hlist[table->ver], &vtss_task_map_bucket(table, item->key)->head);
+        }
+    }
+    rcu_assign_pointer(vtss_task_map_table, table);
+    write_unlock_irqrestore(&vtss_task_map_lock, flags);
+    TRACE("task map resized %u -> %u buckets", old->size, table->size);
+    /* Wait for readers still walking the old chains */
+    synchronize_rcu();
+    vtss_task_map_table_free(old);
+}
+
+int vtss_task_map_foreach(vtss_task_map_func_t* func, void* args)
+{
+    int i;
+    struct vtss_task_map_table* table;
     struct hlist_head *head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
     struct hlist_node *node = NULL;
@@ -239,39 +398,42 @@ int vtss_task_map_foreach(vtss_task_map_func_t* func, void* args)
         ERROR("Function pointer is NULL");
         return -EINVAL;
     }
-    read_lock_irqsave(&vtss_task_map_lock, flags);
-    for (i = 0; i < HASH_TABLE_SIZE; i++) {
-        head = &vtss_task_map_hash_table[i];
+    rcu_read_lock();
+    table = rcu_dereference(vtss_task_map_table);
+    for (i = 0; table != NULL && i < table->size; i++) {
+        head = &table->bucket[i].head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-        hlist_for_each_entry(item, node, head, hlist)
+        hlist_for_each_entry_rcu(item, node, head, hlist[table->ver])
 #else
-        hlist_for_each_entry(item, head, hlist)
+        hlist_for_each_entry_rcu(item, head, hlist[table->ver])
 #endif
         {
             func(item, args);
         }
     }
-    read_unlock_irqrestore(&vtss_task_map_lock, flags);
+    rcu_read_unlock();
     return 0;
 }
 
 int vtss_task_map_init(void)
 {
-    int i;
     unsigned long flags;
-    struct hlist_head *head;
+    struct vtss_task_map_table *old, *table;
 
-    write_lock_irqsave(&vtss_task_map_lock, flags);
-    for (i = 0; i < HASH_TABLE_SIZE; i++) {
-        head = &vtss_task_map_hash_table[i];
-        INIT_HLIST_HEAD(head);
+    table = vtss_task_map_table_alloc(HASH_TABLE_SIZE, 0);
+    if (table == NULL) {
+        ERROR("Unable to allocate the task map");
+        return -ENOMEM;
     }
+    write_lock_irqsave(&vtss_task_map_lock, flags);
+    old = vtss_task_map_table;
+    atomic_set(&vtss_task_map_count, 0);
+    rcu_assign_pointer(vtss_task_map_table, table);
     write_unlock_irqrestore(&vtss_task_map_lock, flags);
-    
-    atomic_set(&vtss_map_initialized,1);
-    
-    
-    
+    if (old != NULL) {
+        synchronize_rcu();
+        vtss_task_map_table_free(old);
+    }
     return 0;
 }
 
@@ -279,6 +441,7 @@ void vtss_task_map_fini(void)
 {
     int i;
     unsigned long flags;
+    struct vtss_task_map_table* table;
     struct hlist_head *head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
     struct hlist_node *node = NULL;
@@ -286,32 +449,36 @@ void vtss_task_map_fini(void)
     struct hlist_node *temp;
     vtss_task_map_item_t *item;
 
-    atomic_set(&vtss_map_initialized,0);
+    cancel_work_sync(&vtss_task_map_resize_work);
     write_lock_irqsave(&vtss_task_map_lock, flags);
-    for (i = 0; i < HASH_TABLE_SIZE; i++) {
-        head = &vtss_task_map_hash_table[i];
+    table = vtss_task_map_table;
+    rcu_assign_pointer(vtss_task_map_table, NULL);
+    for (i = 0; table != NULL && i < table->size; i++) {
+        head = &table->bucket[i].head;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-        hlist_for_each_entry_safe(item, node, temp, head, hlist)
-#else        
-        hlist_for_each_entry_safe(item, temp, head, hlist)
+        hlist_for_each_entry_safe(item, node, temp, head, hlist[table->ver])
+#else
+        hlist_for_each_entry_safe(item, temp, head, hlist[table->ver])
 #endif
         {
-            hlist_del_init(&item->hlist);
-            if (atomic_read(&item->usage) == 0){
-                //item = NULL; // it will be deleted in "put"
-                item->in_list = 0;
+            hlist_del_init_rcu(&item->hlist[table->ver]);
+            item->in_list = 0;
+            if (atomic_read(&item->usage) == 0) {
+                /* it will be deleted in "put" */
             }
             else if (atomic_dec_and_test(&item->usage)) {
-                if (item->dtor)
-                    item->dtor(item, NULL);
-                item->dtor = NULL;
-                kfree(item);
+                vtss_task_map_destroy(item);
             } else {
-                item->in_list = 0;
                 ERROR("item=0x%p is busy now, key=%d, usage=%d", item, item->key, atomic_read(&item->usage));
             }
         }
-        INIT_HLIST_HEAD(head);
     }
+    atomic_set(&vtss_task_map_count, 0);
     write_unlock_irqrestore(&vtss_task_map_lock, flags);
+    /* The resize work may have been queued again by a late add */
+    cancel_work_sync(&vtss_task_map_resize_work);
+    if (table != NULL) {
+        synchronize_rcu();
+        vtss_task_map_table_free(table);
+    }
 }
@@ -31,6 +31,7 @@
 #include "vtss_autoconf.h"
 
 #include <linux/list.h>         /* for struct hlist_node */
+#include <linux/rcupdate.h>     /* for struct rcu_head */
 #include <asm/atomic.h>         /* for atomic_t */
 
 struct _vtss_task_map_item_t;
@@ -38,7 +39,8 @@ typedef void (vtss_task_map_func_t) (struct _vtss_task_map_item_t* item, void* a
 
 typedef struct _vtss_task_map_item_t
 {
-    struct hlist_node     hlist;
+    struct hlist_node     hlist[2]; /* one per hash table generation */
+    struct rcu_head       rcu;
     pid_t                 key;
     atomic_t              usage;
     int                   in_list;
@@ -46,7 +48,7 @@ typedef struct _vtss_task_map_item_t
     char                  data[0]; /* placeholder for data */
 } vtss_task_map_item_t;
 
-/** find item in list and return with incremented usage */
+/** find item in list and return with incremented usage, lockless */
 vtss_task_map_item_t* vtss_task_map_get_item(pid_t key);
 /** just decrement usage and destroy if usage become zero */
 int  vtss_task_map_put_item(vtss_task_map_item_t* item);
@@ -28,6 +28,8 @@
 #include "vtss_config.h"
 #include "transport.h"
 #include "procfs.h"
+#include "globals.h"
+#include "time.h"
 #ifdef VTSS_USE_UEC
 #include "uec.h"
 #else
@@ -45,7 +47,10 @@
 #include <linux/spinlock.h>
 #include <asm/uaccess.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>      /* for vmalloc_user() */
+#include <linux/mm.h>           /* for remap_vmalloc_range() */
 #include <linux/nmi.h>
+#include <linux/hardirq.h>      /* for in_nmi() */
 
 #include "vtsstrace.h"
 
@@ -82,6 +87,7 @@ struct vtss_transport_temp
     unsigned long seq_end;
     size_t        size;
     unsigned int  order;
+    int           pool;    /* cpu of the blob pool it came from or -1 */
     char          data[0];
 };
 
@@ -90,8 +96,10 @@ struct vtss_transport_temp
 #define VTSS_TRANSPORT_MAX_RESERVE_SIZE (VTSS_RING_BUFFER_PAGE_SIZE - \
                                         sizeof(struct ring_buffer_event) - \
                                         sizeof(struct vtss_transport_entry) - 64)
-#define VTSS_TRANSPORT_IS_EMPTY(trnd)   (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) == 0)
-#define VTSS_TRANSPORT_DATA_READY(trnd) (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) > VTSS_MERGE_MEM_LIMIT/4)
+#define VTSS_TRANSPORT_IS_EMPTY(trnd)   ((trnd)->ring ? !vtss_transport_ring_ready(trnd) : \
+                                        (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) == 0))
+#define VTSS_TRANSPORT_DATA_READY(trnd) ((trnd)->ring ? vtss_transport_ring_ready(trnd) : \
+                                        (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) > VTSS_MERGE_MEM_LIMIT/4))
 
 struct rb_page
 {
@@ -100,8 +108,113 @@ struct rb_page
     char    data[VTSS_RING_BUFFER_PAGE_SIZE];
 };
 
+/*
+ * Per-cpu staging area. Small records reserved with interrupts disabled
+ * are appended here and committed to the ring buffer as one event with a
+ * single seqnum, so the reader merges whole batches. The lock is only
+ * contended when another cpu completes the transport, and is never held
+ * while a record is written: 'busy' marks the record being written, a
+ * nested reserve on the cpu then goes to the ring buffer directly, and
+ * a commit asked for meanwhile is left to the writer ('flush').
+ * The entry handed out for a staged record is the stage address tagged
+ * with VTSS_TRANSPORT_STAGE_TAG.
+ */
+#define VTSS_TRANSPORT_STAGE_SIZE       (VTSS_TRANSPORT_MAX_RESERVE_SIZE - 1)
+#define VTSS_TRANSPORT_STAGE_RECORD_MAX 256 /* larger records go directly to the ring buffer */
+#define VTSS_TRANSPORT_STAGE_TAG        0x1UL
+
+struct vtss_transport_stage
+{
+#ifdef CONFIG_PREEMPT_RT
+    raw_spinlock_t              lock;
+#else
+    spinlock_t                  lock;
+#endif
+    struct vtss_transport_data* trnd;     /* transport the staged records belong to */
+    size_t                      size;     /* committed bytes */
+    size_t                      reserved; /* bytes of the record being written */
+    unsigned int                count;    /* committed records */
+    int                         busy;     /* a record is being written at data[size] */
+    int                         flush;    /* commit once the record is written */
+    char                        data[VTSS_TRANSPORT_STAGE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct vtss_transport_stage*, vtss_transport_stage);
+
+#ifdef CONFIG_PREEMPT_RT
+#define vtss_transport_stage_lock(stage)                raw_spin_lock(&(stage)->lock)
+#define vtss_transport_stage_unlock(stage)              raw_spin_unlock(&(stage)->lock)
+#define vtss_transport_stage_lock_irqsave(stage, flags) raw_spin_lock_irqsave(&(stage)->lock, flags)
+#define vtss_transport_stage_unlock_irqrestore(stage, flags) raw_spin_unlock_irqrestore(&(stage)->lock, flags)
+#else
+#define vtss_transport_stage_lock(stage)                spin_lock(&(stage)->lock)
+#define vtss_transport_stage_unlock(stage)              spin_unlock(&(stage)->lock)
+#define vtss_transport_stage_lock_irqsave(stage, flags) spin_lock_irqsave(&(stage)->lock, flags)
+#define vtss_transport_stage_unlock_irqrestore(stage, flags) spin_unlock_irqrestore(&(stage)->lock, flags)
+#endif
+
+/*
+ * Per-cpu pool of preallocated blobs for large records, one free list per
+ * page order. Records reserved in interrupt context take blobs from here
+ * instead of the page allocator; the reader returns them to the pool of
+ * the cpu they came from.
+ * Only the owning cpu takes blobs, under the lock. Blobs are given back
+ * without it, onto a 'returned' list the owner takes over as a whole once
+ * its free list runs dry, so a blob can be freed from any context. An NMI
+ * only trylocks: it may have interrupted a taker on the same cpu.
+ */
+#define VTSS_TRANSPORT_POOL_ORDERS  5  /* up to order 4, enough for a 64K record */
+#define VTSS_TRANSPORT_POOL_MAX     16 /* max blobs per order per cpu */
+
+struct vtss_transport_pool
+{
+#ifdef CONFIG_PREEMPT_RT
+    raw_spinlock_t              lock;
+#else
+    spinlock_t                  lock;
+#endif
+    struct vtss_transport_temp* head[VTSS_TRANSPORT_POOL_ORDERS];    /* free list */
+    struct vtss_transport_temp* returned[VTSS_TRANSPORT_POOL_ORDERS]; /* given back, lock-free */
+    atomic_t                    nused[VTSS_TRANSPORT_POOL_ORDERS];
+    unsigned int                total[VTSS_TRANSPORT_POOL_ORDERS];
+    unsigned long               exhausted[VTSS_TRANSPORT_POOL_ORDERS];
+    unsigned long               busy;    /* NMI found the pool locked */
+    struct vtss_transport_temp* blobs[VTSS_TRANSPORT_POOL_ORDERS][VTSS_TRANSPORT_POOL_MAX];
+};
+
+static DEFINE_PER_CPU(struct vtss_transport_pool*, vtss_transport_pool);
+
+#ifdef CONFIG_PREEMPT_RT
+#define vtss_transport_pool_lock(pool)    raw_spin_lock(&(pool)->lock)
+#define vtss_transport_pool_trylock(pool) raw_spin_trylock(&(pool)->lock)
+#define vtss_transport_pool_unlock(pool)  raw_spin_unlock(&(pool)->lock)
+#else
+#define vtss_transport_pool_lock(pool)    spin_lock(&(pool)->lock)
+#define vtss_transport_pool_trylock(pool) spin_trylock(&(pool)->lock)
+#define vtss_transport_pool_unlock(pool)  spin_unlock(&(pool)->lock)
+#endif
+
+/*
+ * Per-cpu ring of the mmap transport mode, see transport.h for the layout.
+ * Writers on a cpu may nest (NMI inside irq inside task), so space is
+ * claimed with a cmpxchg on head and data_head is published only by the
+ * outermost writer. Preemption is disabled from reserve till commit.
+ */
+#define VTSS_TRANSPORT_RING_PAGES 32 /* data pages per cpu, should be 2^n */
+
+struct vtss_transport_ring
+{
+    struct vtss_transport_ring_ctrl* ctrl;
+    char*         data;
+    unsigned long mask;
+    local_t       head;
+    local_t       nest;
+};
+
 #endif /* VTSS_USE_UEC */
 
+int vtss_transport_mode = VTSS_TRANSPORT_MODE_MERGE;
+
 extern int uid;
 extern int gid;
 extern int mode;
@@ -116,6 +229,7 @@ static DEFINE_SPINLOCK(vtss_transport_list_lock);
 static LIST_HEAD(vtss_transport_list);
 
 static atomic_t vtss_transport_npages = ATOMIC_INIT(0);
+static atomic_t vtss_transport_gen    = ATOMIC_INIT(0);
 
 #define VTSS_TR_REG    (1<<0)
 #define VTSS_TR_CFG    (1<<1) /* aux */
@@ -126,6 +240,7 @@ struct vtss_transport_data
     struct file*        file;
     wait_queue_head_t   waitq;
     char                name[36];    /* enough for "%d-%d.%d.aux" */
+    unsigned int        gen;         /* unique (non-zero) while the module is loaded */
 
     atomic_t            refcount;
     atomic_t            loscount;
@@ -142,10 +257,17 @@ struct vtss_transport_data
     unsigned long       seqcpu[NR_CPUS];
     atomic_t            seqnum;
     int                 is_abort;
+    struct vtss_transport_ring* ring; /* per-cpu rings in mmap mode, NULL otherwise */
+    void*               ring_area;
+    unsigned long       ring_size;
 #endif
     int type;
 };
 
+#ifndef VTSS_USE_UEC
+static int vtss_transport_ring_ready(struct vtss_transport_data* trnd);
+#endif
+
 void vtss_transport_addref(struct vtss_transport_data* trnd)
 {
     atomic_inc(&trnd->refcount);
@@ -161,6 +283,11 @@ char *vtss_transport_get_filename(struct vtss_transport_data* trnd)
     return trnd->name;
 }
 
+unsigned int vtss_transport_get_gen(struct vtss_transport_data* trnd)
+{
+    return trnd->gen;
+}
+
 int vtss_transport_is_overflowing(struct vtss_transport_data* trnd)
 {
     return atomic_read(&trnd->is_overflow);
@@ -196,6 +323,11 @@ void vtss_transport_callback(uec_t* uec, int reason, void *context)
 
 #define VTSS_TRANSPORT_IS_EMPTY(trnd)   (UEC_FILLED_SIZE(trnd->uec) == 0)
 #define VTSS_TRANSPORT_DATA_READY(trnd) (UEC_FILLED_SIZE(trnd->uec) != 0)
+
+void vtss_transport_stage_flush(void)
+{
+    /* UEC has no staging */
+}
  
 int vtss_transport_record_write(struct vtss_transport_data* trnd, void* part0, size_t size0, void* part1, size_t size1, int is_safe)
 {
@@ -258,8 +390,460 @@ int vtss_transport_record_write(struct vtss_transport_data* trnd, void* part0, s
     return record;
 }
 */
-void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** entry, size_t size)
+/**
+ * Number of blobs of the order to preallocate on each cpu.
+ * Stacks mostly need 8K-16K blobs, branch traces the larger ones.
+ */
+static unsigned int vtss_transport_pool_size(unsigned int order)
+{
+    int flags = reqcfg.trace_cfg.trace_flags;
+    int stacks = (flags & VTSS_CFGTRACE_STACKS) != 0;
+    int branch = (flags & (VTSS_CFGTRACE_BRANCH | VTSS_CFGTRACE_LASTBR)) != 0;
+
+    switch (order) {
+    case 0:  return 2;
+    case 1:  return stacks ? 8 : 2;
+    case 2:  return stacks ? 4 : 1;
+    case 3:  return branch ? 4 : 1;
+    case 4:  return branch ? 2 : 0;
+    default: return 0;
+    }
+}
+
+static struct vtss_transport_temp* vtss_transport_pool_get(unsigned int order)
+{
+    unsigned long flags;
+    struct vtss_transport_pool* pool;
+    struct vtss_transport_temp* blob = NULL;
+
+    if (order >= VTSS_TRANSPORT_POOL_ORDERS)
+        return NULL;
+    local_irq_save(flags);
+    pool = per_cpu(vtss_transport_pool, smp_processor_id());
+    if (unlikely(pool == NULL)) {
+        local_irq_restore(flags);
+        return NULL;
+    }
+    if (in_nmi()) {
+        if (!vtss_transport_pool_trylock(pool)) {
+            pool->busy++;
+            local_irq_restore(flags);
+            return NULL;
+        }
+    } else {
+        vtss_transport_pool_lock(pool);
+    }
+    blob = pool->head[order];
+    if (blob == NULL && ACCESS_ONCE(pool->returned[order]) != NULL)
+        blob = xchg(&pool->returned[order], NULL);
+    if (blob != NULL) {
+        pool->head[order] = blob->next;
+        atomic_inc(&pool->nused[order]);
+    } else {
+        pool->exhausted[order]++;
+    }
+    vtss_transport_pool_unlock(pool);
+    local_irq_restore(flags);
+    return blob;
+}
+
+static void vtss_transport_pool_put(struct vtss_transport_temp* blob)
+{
+    struct vtss_transport_temp* old;
+    struct vtss_transport_pool* pool = per_cpu(vtss_transport_pool, blob->pool);
+
+    blob->prev = NULL;
+    do {
+        old = ACCESS_ONCE(pool->returned[blob->order]);
+        blob->next = old;
+    } while (cmpxchg(&pool->returned[blob->order], old, blob) != old);
+    /* the blob is on the list before it stops being counted as used */
+    atomic_dec(&pool->nused[blob->order]);
+}
+
+static void vtss_transport_pool_init(void)
+{
+    int cpu;
+    unsigned int order, i, n;
+    struct vtss_transport_pool* pool;
+    struct vtss_transport_temp* blob;
+
+    for_each_possible_cpu(cpu) {
+        pool = (struct vtss_transport_pool*)kmalloc_node(sizeof(struct vtss_transport_pool), (GFP_KERNEL | __GFP_ZERO), cpu_to_node(cpu));
+        per_cpu(vtss_transport_pool, cpu) = pool;
+        if (pool == NULL) {
+            ERROR("Not enough memory for cpu%d blob pool", cpu);
+            continue;
+        }
+#ifdef CONFIG_PREEMPT_RT
+        raw_spin_lock_init(&pool->lock);
+#else
+        spin_lock_init(&pool->lock);
+#endif
+        for (order = 0; order < VTSS_TRANSPORT_POOL_ORDERS; order++) {
+            n = vtss_transport_pool_size(order);
+            for (i = 0; i < n && i < VTSS_TRANSPORT_POOL_MAX; i++) {
+                struct page* page = alloc_pages_node(cpu_to_node(cpu), (GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN), order);
+                if (page == NULL) {
+                    TRACE("cpu%d blob pool: only %u of %u order%u blobs", cpu, i, n, order);
+                    break;
+                }
+                blob = (struct vtss_transport_temp*)page_address(page);
+                blob->order = order;
+                blob->pool  = cpu;
+                blob->next  = pool->head[order];
+                pool->head[order] = blob;
+                pool->blobs[order][i] = blob;
+            }
+            pool->total[order] = i;
+        }
+    }
+}
+
+static void vtss_transport_pool_fini(void)
+{
+    int cpu, wait_count = VTSS_TRANSPORT_COMPLETE_TIMEOUT;
+    unsigned int order, i, nused;
+    struct vtss_transport_pool* pool;
+    struct vtss_transport_temp* blob;
+
+    /* records still being written on other cpus give their blobs back soon */
+    do {
+        nused = 0;
+        for_each_possible_cpu(cpu) {
+            pool = per_cpu(vtss_transport_pool, cpu);
+            if (pool == NULL)
+                continue;
+            for (order = 0; order < VTSS_TRANSPORT_POOL_ORDERS; order++)
+                nused += atomic_read(&pool->nused[order]);
+        }
+        if (nused == 0)
+            break;
+        msleep_interruptible(100);
+    } while (--wait_count > 0);
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu(vtss_transport_pool, cpu);
+        per_cpu(vtss_transport_pool, cpu) = NULL;
+        if (pool == NULL)
+            continue;
+        for (order = 0; order < VTSS_TRANSPORT_POOL_ORDERS; order++) {
+            nused = atomic_read(&pool->nused[order]);
+            if (nused == 0) {
+                for (i = 0; i < pool->total[order]; i++)
+                    free_pages((unsigned long)pool->blobs[order][i], order);
+                continue;
+            }
+            /* a blob still in use must not be freed, only the free ones are */
+            ERROR("cpu%d blob pool: %u of %u order%u blobs are not returned",
+                    cpu, nused, pool->total[order], order);
+            while ((blob = pool->head[order]) != NULL) {
+                pool->head[order] = blob->next;
+                free_pages((unsigned long)blob, order);
+            }
+            while ((blob = pool->returned[order]) != NULL) {
+                pool->returned[order] = blob->next;
+                free_pages((unsigned long)blob, order);
+            }
+        }
+        kfree(pool);
+    }
+}
+
+/** Free a blob or temp buffer to where it came from */
+static void vtss_transport_temp_free(struct vtss_transport_temp* temp)
 {
+    if (temp->pool >= 0) {
+        vtss_transport_pool_put(temp);
+    } else {
+        atomic_sub(1<<temp->order, &vtss_transport_npages);
+        free_pages((unsigned long)temp, temp->order);
+    }
+}
+
+/**
+ * Commit staged records as one ring buffer event.
+ * Returns -EFAULT if they are lost, the loss is also counted in loscount.
+ * While a record is being written the commit is left to its writer.
+ * Caller holds the stage lock.
+ */
+static int vtss_transport_stage_commit(struct vtss_transport_stage* stage)
+{
+    int rc = 0;
+    struct ring_buffer_event* event;
+    struct vtss_transport_entry* data;
+    struct vtss_transport_data* trnd = stage->trnd;
+
+    if (stage->busy) {
+        stage->flush = 1;
+        return 0;
+    }
+    if (trnd != NULL && stage->size != 0) {
+#ifdef VTSS_AUTOCONF_RING_BUFFER_FLAGS
+        event = ring_buffer_lock_reserve(trnd->buffer, stage->size + sizeof(struct vtss_transport_entry), 0);
+#else
+        event = ring_buffer_lock_reserve(trnd->buffer, stage->size + sizeof(struct vtss_transport_entry));
+#endif
+        if (unlikely(event == NULL)) {
+            atomic_add(stage->count, &trnd->loscount);
+            atomic_inc(&trnd->is_overflow);
+            TRACE("'%s' ring_buffer_lock_reserve failed for %u staged records", trnd->name, stage->count);
+            rc = -EFAULT;
+        } else {
+            data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
+            data->seqnum = atomic_inc_return(&trnd->seqnum);
+            data->size   = stage->size;
+            memcpy(data->data, stage->data, stage->size);
+#ifdef VTSS_AUTOCONF_RING_BUFFER_FLAGS
+            ring_buffer_unlock_commit(trnd->buffer, event, 0);
+#else
+            ring_buffer_unlock_commit(trnd->buffer, event);
+#endif
+        }
+    }
+    stage->trnd  = NULL;
+    stage->size  = 0;
+    stage->count = 0;
+    stage->flush = 0;
+    return rc;
+}
+
+/**
+ * Reserve space for a record in the current cpu's staging area.
+ * Returns NULL if the record has to go directly to the ring buffer.
+ * The stage stays busy, but unlocked, until vtss_transport_record_commit().
+ */
+static void* vtss_transport_stage_reserve(struct vtss_transport_data* trnd, void** entry, size_t size)
+{
+    void* record;
+    struct vtss_transport_stage* stage;
+
+    if (size > VTSS_TRANSPORT_STAGE_RECORD_MAX || !irqs_disabled() || in_nmi())
+        return NULL;
+    stage = per_cpu(vtss_transport_stage, smp_processor_id());
+    if (unlikely(stage == NULL))
+        return NULL;
+    vtss_transport_stage_lock(stage);
+    /* Checked under the lock to not race with vtss_transport_complete() */
+    if (unlikely(stage->busy || atomic_read(&trnd->is_complete))) {
+        vtss_transport_stage_unlock(stage);
+        return NULL;
+    }
+    if (stage->trnd != trnd || stage->size + size > VTSS_TRANSPORT_STAGE_SIZE)
+        vtss_transport_stage_commit(stage);
+    stage->trnd     = trnd;
+    stage->reserved = size;
+    stage->busy     = 1;
+    record = (void*)&stage->data[stage->size];
+    vtss_transport_stage_unlock(stage);
+    *entry = (void*)((unsigned long)stage | VTSS_TRANSPORT_STAGE_TAG);
+    return record;
+}
+
+/**
+ * Commit the current cpu's staged records of the transport so that a
+ * record written directly to the ring buffer gets a later seqnum.
+ */
+static void vtss_transport_stage_flush_trnd(struct vtss_transport_data* trnd)
+{
+    unsigned long flags;
+    struct vtss_transport_stage* stage;
+
+    if (in_nmi())
+        return;
+    local_irq_save(flags);
+    stage = per_cpu(vtss_transport_stage, smp_processor_id());
+    if (stage != NULL && stage->trnd == trnd) {
+        vtss_transport_stage_lock(stage);
+        if (stage->trnd == trnd)
+            vtss_transport_stage_commit(stage);
+        vtss_transport_stage_unlock(stage);
+    }
+    local_irq_restore(flags);
+}
+
+/**
+ * Commit staged records of the transport on all cpus,
+ * or all staged records if trnd is NULL.
+ */
+static void vtss_transport_stage_flush_all(struct vtss_transport_data* trnd)
+{
+    int cpu;
+    unsigned long flags;
+    struct vtss_transport_stage* stage;
+
+    for_each_possible_cpu(cpu) {
+        stage = per_cpu(vtss_transport_stage, cpu);
+        if (stage == NULL || stage->trnd == NULL)
+            continue;
+        vtss_transport_stage_lock_irqsave(stage, flags);
+        if (trnd == NULL || stage->trnd == trnd)
+            vtss_transport_stage_commit(stage);
+        vtss_transport_stage_unlock_irqrestore(stage, flags);
+    }
+}
+
+/**
+ * Commit all records staged on the current cpu.
+ * Called when a traced task is switched out, so its records are in the
+ * ring buffer before it can run on another cpu.
+ */
+void vtss_transport_stage_flush(void)
+{
+    unsigned long flags;
+    struct vtss_transport_stage* stage;
+
+    if (in_nmi())
+        return;
+    local_irq_save(flags);
+    stage = per_cpu(vtss_transport_stage, smp_processor_id());
+    if (stage != NULL && stage->trnd != NULL) {
+        vtss_transport_stage_lock(stage);
+        vtss_transport_stage_commit(stage);
+        vtss_transport_stage_unlock(stage);
+    }
+    local_irq_restore(flags);
+}
+
+static int vtss_transport_ring_alloc(struct vtss_transport_data* trnd)
+{
+    int cpu;
+    unsigned long data_size = VTSS_TRANSPORT_RING_PAGES * PAGE_SIZE;
+    unsigned long slot_size = PAGE_SIZE + data_size;
+
+    trnd->ring = (struct vtss_transport_ring*)kmalloc(nr_cpu_ids * sizeof(struct vtss_transport_ring), (GFP_KERNEL | __GFP_ZERO));
+    if (trnd->ring == NULL)
+        return -ENOMEM;
+    trnd->ring_size = nr_cpu_ids * slot_size;
+    /* zeroed and allowed to be remapped to user space */
+    trnd->ring_area = vmalloc_user(trnd->ring_size);
+    if (trnd->ring_area == NULL) {
+        kfree(trnd->ring);
+        trnd->ring = NULL;
+        return -ENOMEM;
+    }
+    for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+        struct vtss_transport_ring* ring = &trnd->ring[cpu];
+
+        ring->ctrl = (struct vtss_transport_ring_ctrl*)((char*)trnd->ring_area + cpu * slot_size);
+        ring->data = (char*)ring->ctrl + PAGE_SIZE;
+        ring->mask = data_size - 1;
+        local_set(&ring->head, 0);
+        local_set(&ring->nest, 0);
+        ring->ctrl->data_size = data_size;
+        ring->ctrl->slot_size = slot_size;
+        ring->ctrl->nr_slots  = nr_cpu_ids;
+        ring->ctrl->cpu       = cpu;
+    }
+    return 0;
+}
+
+static void vtss_transport_ring_free(struct vtss_transport_data* trnd)
+{
+    /* pages still mapped by the reader keep their own references */
+    if (trnd->ring_area != NULL)
+        vfree(trnd->ring_area);
+    kfree(trnd->ring);
+    trnd->ring_area = NULL;
+    trnd->ring = NULL;
+}
+
+static int vtss_transport_ring_ready(struct vtss_transport_data* trnd)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct vtss_transport_ring_ctrl* ctrl = trnd->ring[cpu].ctrl;
+        if (ACCESS_ONCE(ctrl->data_head) != ACCESS_ONCE(ctrl->data_tail))
+            return 1;
+    }
+    return 0;
+}
+
+#ifndef WRITE_ONCE
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+/*
+ * Make data_head visible, the outermost writer on the cpu does it.
+ * head is read after the nest count drops: a writer nesting before
+ * that publishes its own head, which must not be replaced by an older one.
+ */
+static void vtss_transport_ring_publish(struct vtss_transport_ring* ring)
+{
+    unsigned long head;
+
+again:
+    if (!local_dec_and_test(&ring->nest))
+        return;
+    barrier();
+    head = local_read(&ring->head);
+    smp_wmb(); /* records before data_head */
+    WRITE_ONCE(ring->ctrl->data_head, head);
+    barrier();
+    /* a nested writer may have claimed space after we read head */
+    if (unlikely(head != local_read(&ring->head))) {
+        local_inc(&ring->nest);
+        goto again;
+    }
+}
+
+/**
+ * Reserve space for a record in the current cpu's ring.
+ * On success preemption is disabled until vtss_transport_record_commit().
+ */
+static void* vtss_transport_ring_reserve(struct vtss_transport_data* trnd, void** entry, size_t size)
+{
+    struct vtss_transport_ring* ring = &trnd->ring[get_cpu()];
+    struct vtss_transport_ring_record* rec;
+    size_t len = sizeof(struct vtss_transport_ring_record) + size;
+    unsigned long head, pos, pad, next, tail;
+
+    local_inc(&ring->nest);
+    do {
+        head = local_read(&ring->head);
+        pos  = head & ring->mask;
+        /* a record never wraps, pad up to the ring start instead */
+        pad  = (pos + len > ring->mask + 1) ? ring->mask + 1 - pos : 0;
+        next = head + pad + ALIGN(len, 8);
+        tail = (unsigned long)ACCESS_ONCE(ring->ctrl->data_tail);
+        if (unlikely(next - tail > ring->mask + 1)) {
+            ring->ctrl->lost++;
+            atomic_inc(&trnd->loscount);
+            atomic_inc(&trnd->is_overflow);
+            vtss_transport_ring_publish(ring);
+            put_cpu();
+            return NULL;
+        }
+    } while (local_cmpxchg(&ring->head, head, next) != head);
+    smp_mb(); /* data_tail read before the records are overwritten */
+    if (pad) {
+        rec = (struct vtss_transport_ring_record*)&ring->data[pos];
+        rec->size  = pad;
+        rec->flags = VTSS_TRANSPORT_RING_PADDING;
+        pos = 0;
+    }
+    rec = (struct vtss_transport_ring_record*)&ring->data[pos];
+    rec->size   = len;
+    rec->flags  = 0;
+    rec->cputsc = vtss_time_cpu();
+    *entry = (void*)ring;
+    return (void*)(rec + 1);
+}
+
+static void vtss_transport_ring_complete(struct vtss_transport_data* trnd)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        trnd->ring[cpu].ctrl->complete = 1;
+    }
+    smp_wmb();
+}
+
+static void* vtss_transport_record_reserve_internal(struct vtss_transport_data* trnd, void** entry, size_t size, int can_stage)
+{
+    void* record;
     struct ring_buffer_event* event;
     struct vtss_transport_entry* data;
 
@@ -278,6 +862,16 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
         return NULL;
     }
 
+    if (trnd->ring != NULL)
+        return vtss_transport_ring_reserve(trnd, entry, size);
+
+    if (can_stage) {
+        record = vtss_transport_stage_reserve(trnd, entry, size);
+        if (likely(record != NULL))
+            return record;
+    }
+    vtss_transport_stage_flush_trnd(trnd);
+
     if (likely(size < VTSS_TRANSPORT_MAX_RESERVE_SIZE)) {
 #if 0
         if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT/2) {
@@ -305,32 +899,40 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
         return (void*)data->data;
     } else { /* blob */
         unsigned int order = get_order(size + sizeof(struct vtss_transport_temp));
-        struct vtss_transport_temp* blob;
-
-        if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT/2) {
-            TRACE("'%s' memory limit for blob %zu bytes", trnd->name, size);
-//            ERROR("'%s' memory limit for blob %zu bytes", trnd->name, size);
-            atomic_inc(&trnd->loscount);
-            return NULL;
+        struct vtss_transport_temp* blob = NULL;
+        int in_irq_ctx = (in_interrupt() || irqs_disabled());
+
+        if (in_irq_ctx)
+            blob = vtss_transport_pool_get(order);
+        /* the page allocator is not NMI safe */
+        if (blob == NULL && !in_nmi()) {
+            if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT/2) {
+                TRACE("'%s' memory limit for blob %zu bytes", trnd->name, size);
+            } else {
+                blob = (struct vtss_transport_temp*)__get_free_pages((GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN), order);
+                if (blob != NULL) {
+                    atomic_add(1<<order, &vtss_transport_npages);
+                    blob->order = order;
+                    blob->pool  = -1;
+                }
+            }
         }
-        blob = (struct vtss_transport_temp*)__get_free_pages((GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN), order);
+        if (blob == NULL && !in_irq_ctx)
+            blob = vtss_transport_pool_get(order);
         if (unlikely(blob == NULL)) {
             TRACE("'%s' no memory for blob %zu bytes", trnd->name, size);
 //            ERROR("'%s' no memory for blob %zu bytes", trnd->name, size);
             atomic_inc(&trnd->loscount);
             return NULL;
         }
-        atomic_add(1<<order, &vtss_transport_npages);
         blob->size  = size;
-        blob->order = order;
 #ifdef VTSS_AUTOCONF_RING_BUFFER_FLAGS
         event = ring_buffer_lock_reserve(trnd->buffer, sizeof(void*) + sizeof(struct vtss_transport_entry), 0);
 #else
         event = ring_buffer_lock_reserve(trnd->buffer, sizeof(void*) + sizeof(struct vtss_transport_entry));
 #endif
         if (unlikely(event == NULL)) {
-            free_pages((unsigned long)blob, order);
-            atomic_sub(1<<order, &vtss_transport_npages);
+            vtss_transport_temp_free(blob);
             atomic_inc(&trnd->loscount);
             atomic_inc(&trnd->is_overflow);
             TRACE("'%s' ring_buffer_lock_reserve failed overflow", trnd->name);
@@ -346,6 +948,26 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
     }
 }
 
+void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** entry, size_t size)
+{
+    void* record;
+
+    VTSS_PROFILE(trn, record = vtss_transport_record_reserve_internal(trnd, entry, size, 1));
+    return record;
+}
+
+/**
+ * Reserve a record that is never staged, so a 0 from the commit
+ * means it is in the ring buffer.
+ */
+void* vtss_transport_record_reserve_direct(struct vtss_transport_data* trnd, void** entry, size_t size)
+{
+    void* record;
+
+    VTSS_PROFILE(trn, record = vtss_transport_record_reserve_internal(trnd, entry, size, 0));
+    return record;
+}
+
 int vtss_transport_is_ready(struct vtss_transport_data* trnd)
 {
     /*if (atomic_read(&trnd->is_complete)) {
@@ -365,6 +987,38 @@ int vtss_transport_record_commit(struct vtss_transport_data* trnd, void* entry,
         ERROR("Transport or Entry is NULL");
         return -EINVAL;
     }
+    if (trnd->ring != NULL) {
+        vtss_transport_ring_publish((struct vtss_transport_ring*)entry);
+        put_cpu();
+        if (unlikely(is_safe)) {
+            if (waitqueue_active(&trnd->waitq))
+                wake_up_interruptible(&trnd->waitq);
+        }
+        return 0;
+    }
+    /*
+     * A staged record only reaches the ring buffer with the rest of its
+     * stage, so 0 does not say it is there unless is_safe commits the stage
+     * right away. Use vtss_transport_record_reserve_direct() to be sure.
+     */
+    if ((unsigned long)entry & VTSS_TRANSPORT_STAGE_TAG) {
+        unsigned long flags;
+        struct vtss_transport_stage* stage = (struct vtss_transport_stage*)((unsigned long)entry & ~VTSS_TRANSPORT_STAGE_TAG);
+
+        vtss_transport_stage_lock_irqsave(stage, flags);
+        stage->size += stage->reserved;
+        stage->reserved = 0;
+        stage->count++;
+        stage->busy = 0;
+        if (unlikely(is_safe || stage->flush))
+            rc = vtss_transport_stage_commit(stage);
+        vtss_transport_stage_unlock_irqrestore(stage, flags);
+        if (unlikely(is_safe && VTSS_TRANSPORT_DATA_READY(trnd))) {
+            if (waitqueue_active(&trnd->waitq))
+                wake_up_interruptible(&trnd->waitq);
+        }
+        return rc;
+    }
 #ifdef VTSS_AUTOCONF_RING_BUFFER_FLAGS
     rc = ring_buffer_unlock_commit(trnd->buffer, event, 0);
 #else
@@ -460,8 +1114,7 @@ static void vtss_transport_temp_free_all(struct vtss_transport_data* trnd, struc
         TRACE("'%s' [%lu, %lu), size=%zu of %lu",
                 trnd->name, temp->seq_begin, temp->seq_end,
                 temp->size, (PAGE_SIZE << temp->order));
-        free_pages((unsigned long)temp, temp->order);
-        atomic_sub(1<<temp->order, &vtss_transport_npages);
+        vtss_transport_temp_free(temp);
         *pstore = NULL;
         pstore = head; /* restart from head */
     }
@@ -493,8 +1146,7 @@ static struct vtss_transport_temp* vtss_transport_temp_merge(struct vtss_transpo
             }
             prev->next = temp->next;
             *pstore = prev;
-            free_pages((unsigned long)temp, temp->order);
-            atomic_sub(1<<temp->order, &vtss_transport_npages);
+            vtss_transport_temp_free(temp);
             return prev;
         }
         /* try to merge with next element... */
@@ -514,8 +1166,7 @@ static struct vtss_transport_temp* vtss_transport_temp_merge(struct vtss_transpo
                         next->seq_begin, next->seq_end);
                 vtss_transport_temp_free_all(trnd, &(next->prev));
             }
-            free_pages((unsigned long)next, next->order);
-            atomic_sub(1<<next->order, &vtss_transport_npages);
+            vtss_transport_temp_free(next);
             return temp;
         }
     }
@@ -561,6 +1212,7 @@ static int vtss_transport_temp_store_data(struct vtss_transport_data* trnd, unsi
         temp->seq_begin = seqnum;
         temp->size  = 0;
         temp->order = order;
+        temp->pool  = -1;
         if (*pstore) {
             ERROR("'%s' new [%lu - %lu), size=%u ==> [%lu - %lu)", trnd->name,
                     seqnum, seqnum + 1, size, (*pstore)->seq_begin, (*pstore)->seq_end);
@@ -582,6 +1234,7 @@ static int vtss_transport_temp_store_data(struct vtss_transport_data* trnd, unsi
             next->seq_begin = seqnum;
             next->size  = 0;
             next->order = order;
+            next->pool  = -1;
             temp->next  = next;
             pstore = &(temp->next);
             temp = next;
@@ -657,8 +1310,7 @@ static size_t vtss_transport_temp_flush(struct vtss_transport_data* trnd, char _
                     ERROR("'%s' [%lu, %lu) incorrect prev link", trnd->name, temp->seq_begin, temp->seq_end);
                     vtss_transport_temp_free_all(trnd, &(temp->prev));
                 }
-                free_pages((unsigned long)temp, temp->order);
-                atomic_sub(1<<temp->order, &vtss_transport_npages);
+                vtss_transport_temp_free(temp);
                 pstore = &(trnd->head); /* restart from head */
             } else {
                 pstore = (trnd->seqdone < temp->seq_begin) ? &(temp->prev) : &(temp->next);
@@ -683,8 +1335,7 @@ static size_t vtss_transport_temp_parse_event(struct vtss_transport_data* trnd,
         } else { /* blob */
             struct vtss_transport_temp* blob = *((struct vtss_transport_temp**)(data->data));
             TRACE("DROP seq=%lu, size=%zu, from cpu%d", seqnum, blob->size, cpu);
-            free_pages((unsigned long)blob, blob->order);
-            atomic_sub(1<<blob->order, &vtss_transport_npages);
+            vtss_transport_temp_free(blob);
         }
 #ifndef VTSS_NO_MERGE
     } else if (trnd->seqdone != seqnum) { /* disordered event */
@@ -731,8 +1382,7 @@ static size_t vtss_transport_temp_parse_event(struct vtss_transport_data* trnd,
                     (size_t)8UL /* FIXME: just something is not overflowed output buffer */
 #endif
                 );
-                free_pages((unsigned long)blob, blob->order);
-                atomic_sub(1<<blob->order, &vtss_transport_npages);
+                vtss_transport_temp_free(blob);
                 trnd->seqdone++;
             }
         }
@@ -751,6 +1401,10 @@ static ssize_t vtss_transport_read(struct file *file, char __user* buf, size_t s
 
     if (unlikely(trnd == NULL || buf == NULL))
         return -EINVAL;
+#ifndef VTSS_USE_UEC
+    if (trnd->ring != NULL)
+        return -EINVAL; /* the reader maps the rings and merges records itself */
+#endif
     while (!atomic_read(&trnd->is_complete) && !VTSS_TRANSPORT_DATA_READY(trnd)) {
         if (file->f_flags & O_NONBLOCK)
             return -EAGAIN;
@@ -957,6 +1611,22 @@ static unsigned int vtss_transport_poll(struct file *file, poll_table* poll_tabl
     return rc;
 }
 
+#ifndef VTSS_USE_UEC
+static int vtss_transport_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vtss_transport_data* trnd = (struct vtss_transport_data*)file->private_data;
+
+    if (trnd == NULL || trnd->ring == NULL)
+        return -EINVAL;
+    if (vma->vm_pgoff != 0 || (vma->vm_end - vma->vm_start) != trnd->ring_size) {
+        TRACE("'%s' wrong mapping: offset=%lu, size=%lu of %lu", trnd->name,
+                vma->vm_pgoff, (vma->vm_end - vma->vm_start), trnd->ring_size);
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, trnd->ring_area, 0);
+}
+#endif
+
 static int vtss_transport_open(struct inode *inode, struct file *file)
 {
     int rc;
@@ -1017,6 +1687,9 @@ static struct file_operations vtss_transport_fops = {
     .open    = vtss_transport_open,
     .release = vtss_transport_close,
     .poll    = vtss_transport_poll,
+#ifndef VTSS_USE_UEC
+    .mmap    = vtss_transport_mmap,
+#endif
 };
 
 static void vtss_transport_remove(struct vtss_transport_data* trnd)
@@ -1045,6 +1718,10 @@ struct vtss_transport_data* vtss_transport_create_trnd(void)
     atomic_set(&trnd->is_overflow, 0);
     trnd->file = NULL;
     trnd->type = VTSS_TR_REG;
+    /* a new transport may get the address of a freed one, but not its gen */
+    do {
+        trnd->gen = (unsigned int)atomic_inc_return(&vtss_transport_gen);
+    } while (trnd->gen == 0);
 #ifdef VTSS_USE_UEC
     trnd->uec = (uec_t*)kmalloc(sizeof(uec_t), GFP_KERNEL);
     if (trnd->uec != NULL) {
@@ -1071,6 +1748,13 @@ struct vtss_transport_data* vtss_transport_create_trnd(void)
     trnd->seqdone  = 1;
     trnd->head     = NULL;
     atomic_set(&trnd->seqnum, 0);
+    if (vtss_transport_mode == VTSS_TRANSPORT_MODE_MMAP) {
+        if (vtss_transport_ring_alloc(trnd) == 0) {
+            TRACE("Use %d * %lu bytes for mmap transport", nr_cpu_ids, (unsigned long)VTSS_TRANSPORT_RING_PAGES*PAGE_SIZE);
+            return trnd;
+        }
+        ERROR("Unable to allocate mmap transport, use the merge mode");
+    }
     trnd->buffer = ring_buffer_alloc(rb_size*PAGE_SIZE, 0);
 //    printk("allocated %lu bytes for transport buffer, PAGE_SIZE=%lx, buffer_size = %lx\n", (unsigned long)rb_size*PAGE_SIZE, (unsigned long)PAGE_SIZE, ring_buffer_size(trnd->buffer));
     if (trnd->buffer == NULL) {
@@ -1089,7 +1773,9 @@ static void vtss_transport_destroy_trnd(struct vtss_transport_data* trnd)
         kfree(trnd->uec);
 #else
         printk("buffer deallocated %d \n", num_present_cpus());
-        ring_buffer_free(trnd->buffer);
+        if (trnd->buffer != NULL)
+            ring_buffer_free(trnd->buffer);
+        vtss_transport_ring_free(trnd);
 #endif
         kfree(trnd);
 }
@@ -1122,6 +1808,12 @@ int vtss_transport_create_pde (struct vtss_transport_data* trnd, uid_t cuid, gid
         return 1;
     }
 //    vtss_transport_create_pde(trnd)
+    /* The reader of the mmap mode writes data_tail back, so it opens the file for write */
+#ifndef VTSS_USE_UEC
+    if (trnd->ring != NULL)
+        pde = proc_create_data(trnd->name, (mode_t)(mode ? (mode & 0666) : 0660), procfs_root, &vtss_transport_fops, trnd);
+    else
+#endif
     pde = proc_create_data(trnd->name, (mode_t)(mode ? (mode & 0444) : 0440), procfs_root, &vtss_transport_fops, trnd);
 
     if (pde == NULL) {
@@ -1199,10 +1891,21 @@ int vtss_transport_complete(struct vtss_transport_data* trnd)
     if (atomic_read(&trnd->refcount)) {
         ERROR("'%s' refcount=%d != 0", trnd->name, atomic_read(&trnd->refcount));
     }
+#ifndef VTSS_USE_UEC
+    /* No more staging after is_complete is set, so flush what is left */
+    atomic_inc(&trnd->is_complete);
+    if (trnd->ring != NULL)
+        vtss_transport_ring_complete(trnd);
+    vtss_transport_stage_flush_all(trnd);
+    if (waitqueue_active(&trnd->waitq)) {
+        wake_up_interruptible(&trnd->waitq);
+    }
+#else
     if (waitqueue_active(&trnd->waitq)) {
         wake_up_interruptible(&trnd->waitq);
     }
     atomic_inc(&trnd->is_complete);
+#endif
     return 0;
 }
 
@@ -1240,6 +1943,34 @@ int vtss_transport_debug_info(struct seq_file *s)
     struct vtss_transport_data *trnd = NULL;
 
     seq_printf(s, "\n[transport]\nnbuffers=%u (%lu bytes)\n", atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE);
+#ifndef VTSS_USE_UEC
+    {
+        unsigned int order, nfree, total;
+        unsigned long exhausted, busy = 0;
+        struct vtss_transport_pool* pool;
+
+        for (order = 0; order < VTSS_TRANSPORT_POOL_ORDERS; order++) {
+            nfree = total = 0;
+            exhausted = 0;
+            for_each_possible_cpu(cpu) {
+                pool = per_cpu(vtss_transport_pool, cpu);
+                if (pool == NULL)
+                    continue;
+                nfree     += pool->total[order] - atomic_read(&pool->nused[order]);
+                total     += pool->total[order];
+                exhausted += pool->exhausted[order];
+            }
+            seq_printf(s, "blobpool[%lu]=%u of %u free, exhausted=%lu\n",
+                        (PAGE_SIZE << order), nfree, total, exhausted);
+        }
+        for_each_possible_cpu(cpu) {
+            pool = per_cpu(vtss_transport_pool, cpu);
+            if (pool != NULL)
+                busy += pool->busy;
+        }
+        seq_printf(s, "blobpool busy in NMI=%lu\n", busy);
+    }
+#endif
     spin_lock_irqsave(&vtss_transport_list_lock, flags);
     list_for_each(p, &vtss_transport_list) {
         trnd = list_entry(p, struct vtss_transport_data, list);
@@ -1253,7 +1984,16 @@ int vtss_transport_debug_info(struct seq_file *s)
 #ifdef VTSS_USE_UEC
                     0UL);
 #else
-                    ring_buffer_entries(trnd->buffer));
+                    trnd->buffer ? ring_buffer_entries(trnd->buffer) : 0UL);
+        if (trnd->ring != NULL) {
+            for_each_possible_cpu(cpu) {
+                struct vtss_transport_ring_ctrl* ctrl = trnd->ring[cpu].ctrl;
+                if (ctrl->data_head || ctrl->lost)
+                    seq_printf(s, "ring[%03d]=%llu of %llu, lost=%u\n", cpu,
+                                (unsigned long long)ctrl->data_tail, (unsigned long long)ctrl->data_head, ctrl->lost);
+            }
+            continue;
+        }
         if (!ring_buffer_empty(trnd->buffer)) {
             for_each_online_cpu(cpu) {
                 unsigned long count = ring_buffer_entries_cpu(trnd->buffer, cpu);
@@ -1272,7 +2012,32 @@ int vtss_transport_debug_info(struct seq_file *s)
 int vtss_transport_init(void)
 {
     unsigned long flags;
+#ifndef VTSS_USE_UEC
+    int cpu;
 
+    for_each_possible_cpu(cpu) {
+        struct vtss_transport_stage* stage = (struct vtss_transport_stage*)kmalloc_node(
+                sizeof(struct vtss_transport_stage), GFP_KERNEL, cpu_to_node(cpu));
+        if (stage == NULL) {
+            /* records will go directly to the ring buffer on this cpu */
+            ERROR("Not enough memory for cpu%d staging area", cpu);
+        } else {
+#ifdef CONFIG_PREEMPT_RT
+            raw_spin_lock_init(&stage->lock);
+#else
+            spin_lock_init(&stage->lock);
+#endif
+            stage->trnd     = NULL;
+            stage->size     = 0;
+            stage->reserved = 0;
+            stage->count    = 0;
+            stage->busy     = 0;
+            stage->flush    = 0;
+        }
+        per_cpu(vtss_transport_stage, cpu) = stage;
+    }
+    vtss_transport_pool_init();
+#endif
     atomic_set(&vtss_transport_npages, 0);
     spin_lock_irqsave(&vtss_transport_list_lock, flags);
     INIT_LIST_HEAD(&vtss_transport_list);
@@ -1287,6 +2052,34 @@ int vtss_transport_init(void)
     return 0;
 }
 
+#ifndef VTSS_USE_UEC
+/** Give back the blobs of the records nobody is going to read */
+static void vtss_transport_drain(struct vtss_transport_data* trnd)
+{
+    int cpu;
+    u64 ts;
+    struct ring_buffer_event* event;
+
+    if (trnd->buffer == NULL)
+        return;
+    for_each_online_cpu(cpu) {
+        while (NULL !=
+#ifdef VTSS_AUTOCONF_RING_BUFFER_LOST_EVENTS
+            (event = ring_buffer_consume(trnd->buffer, cpu, &ts, NULL))
+#else
+            (event = ring_buffer_consume(trnd->buffer, cpu, &ts))
+#endif
+            )
+        {
+            struct vtss_transport_entry* data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
+
+            if (data->size == 0) /* blob */
+                vtss_transport_temp_free(*((struct vtss_transport_temp**)(data->data)));
+        }
+    }
+}
+#endif
+
 void vtss_transport_fini(void)
 {
     int wait_count = VTSS_TRANSPORT_COMPLETE_TIMEOUT;
@@ -1298,6 +2091,9 @@ void vtss_transport_fini(void)
 #ifdef VTSS_TRANSPORT_TIMER_INTERVAL
     del_timer_sync(&vtss_transport_timer);
 #endif
+#ifndef VTSS_USE_UEC
+    vtss_transport_stage_flush_all(NULL);
+#endif
 
 again:
     spin_lock_irqsave(&vtss_transport_list_lock, flags);
@@ -1340,7 +2136,10 @@ again:
             ERROR("'%s' drop %lu events", trnd->name, (count - trnd->seqdone - 1));
         }
         vtss_transport_temp_free_all(trnd, &(trnd->head));
-        ring_buffer_free(trnd->buffer);
+        vtss_transport_drain(trnd);
+        if (trnd->buffer != NULL)
+            ring_buffer_free(trnd->buffer);
+        vtss_transport_ring_free(trnd);
 #endif
         kfree(trnd);
         wait_count = VTSS_TRANSPORT_COMPLETE_TIMEOUT;
@@ -1351,4 +2150,15 @@ again:
         ERROR("lost %u (%lu bytes) buffers", atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE);
     }
     atomic_set(&vtss_transport_npages, 0);
+#ifndef VTSS_USE_UEC
+    {
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            kfree(per_cpu(vtss_transport_stage, cpu));
+            per_cpu(vtss_transport_stage, cpu) = NULL;
+        }
+    }
+    vtss_transport_pool_fini();
+#endif
 }
@@ -34,21 +34,57 @@
 
 struct vtss_transport_data;
 
+/*
+ * Transport modes, applied to the transports created after the change.
+ * In the mmap mode each transport file maps one slot per possible cpu:
+ * a control page followed by a power of 2 ring of records which the
+ * reader merges itself by their cpu timestamps. read() is not supported.
+ */
+#define VTSS_TRANSPORT_MODE_MERGE 0 /* default, ordered stream through read() */
+#define VTSS_TRANSPORT_MODE_MMAP  1
+
+extern int vtss_transport_mode;
+
+struct vtss_transport_ring_ctrl
+{
+    __u64 data_head;  /* written by the kernel: end of committed records */
+    __u64 data_tail;  /* written by the reader: head it has consumed up to */
+    __u32 data_size;  /* ring size in bytes, 2^n */
+    __u32 slot_size;  /* distance between slots in the mapping */
+    __u32 nr_slots;
+    __u32 cpu;
+    __u32 lost;       /* records dropped because the ring was full */
+    __u32 complete;   /* set when no more records will be written */
+};
+
+#define VTSS_TRANSPORT_RING_PADDING 0x1 /* skip to the ring start, only size and flags are valid */
+
+struct vtss_transport_ring_record
+{
+    __u32 size;       /* header and data, the next record starts 8 byte aligned */
+    __u32 flags;
+    __u64 cputsc;
+    /* trace record follows */
+};
+
 void vtss_transport_addref(struct vtss_transport_data* trnd);
 int  vtss_transport_delref(struct vtss_transport_data* trnd);
 
 #ifndef VTSS_USE_UEC
 void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** entry, size_t size);
+void* vtss_transport_record_reserve_direct(struct vtss_transport_data* trnd, void** entry, size_t size);
 //void* vtss_transport_record_reserve_try_hard(struct vtss_transport_data* trnd, void** entry, size_t size);
 int   vtss_transport_record_commit(struct vtss_transport_data* trnd, void* entry, int is_safe);
 #endif
 int   vtss_transport_record_write(struct vtss_transport_data* trnd, void* part0, size_t size0, void* part1, size_t size1, int is_safe);
 int   vtss_transport_record_write_all(void* part0, size_t size0, void* part1, size_t size1, int is_safe);
+void  vtss_transport_stage_flush(void);
 int   vtss_transport_complete(struct vtss_transport_data* trnd);
 struct vtss_transport_data* vtss_transport_create(pid_t ppid, pid_t pid, uid_t cuid, gid_t cgid);
 struct vtss_transport_data* vtss_transport_create_aux(struct vtss_transport_data* main_trnd, uid_t cuid, gid_t cgid);
 
 char* vtss_transport_get_filename(struct vtss_transport_data* trnd);
+unsigned int vtss_transport_get_gen(struct vtss_transport_data* trnd);
 int   vtss_transport_is_overflowing(struct vtss_transport_data* trnd);
 int   vtss_transport_is_ready(struct vtss_transport_data* trnd);
 int   vtss_transport_debug_info(struct seq_file *s);
@@ -153,6 +153,11 @@ static int unwind_stack_fwd(stack_control_t* stk)
     char* vals = stk->value_cache;
     size_t val_size = 0;
 
+    /// window of the stack cached in vals while comparing against the map
+    char* cache_lo = NULL;
+    size_t cache_len = 0;
+    char ipvals[IP_SEARCH_RANGE * sizeof(size_t)];
+
     /* check for bad args */
 
     if(!stk->buffer)
@@ -221,17 +226,24 @@ static int unwind_stack_fwd(stack_control_t* stk)
                     stkmap_common = stkmap_curr;
                     continue;
                 }
-                /// read in the actual stack contents
-                if (stk->acc->read(stk->acc, stkmap_curr->sp.szp, &vals[0], stride) != stride) {
-                    TRACE("SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p", stkmap_curr->sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
-                    /// clear the stack map
-                    stkmap_common = stkmap_end = stkmap_start;
-                    /// search the entire stack, the map is emptied
-                    search_border.chp = bp - stride;
-                    goto end_of_search;
+                /// read in the actual stack contents, a page at most per read
+                if(stkmap_curr->sp.chp < cache_lo || stkmap_curr->sp.chp + stride > cache_lo + cache_len)
+                {
+                    cache_lo = stkmap_curr->sp.chp;
+                    cache_len = min(PAGE_SIZE - (unsigned long)(stkmap_curr->sp.szt & (~PAGE_MASK)), (unsigned long)VTSS_STACK_CACHE_SIZE);
+                    /// don't read beyond the last map element
+                    cache_len = min(cache_len, (size_t)((stkmap_end - 1)->sp.chp + stride - cache_lo));
+                    if (stk->acc->read(stk->acc, stkmap_curr->sp.szp, &vals[0], cache_len) != cache_len) {
+                        TRACE("SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p", stkmap_curr->sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
+                        /// clear the stack map
+                        stkmap_common = stkmap_end = stkmap_start;
+                        /// search the entire stack, the map is emptied
+                        search_border.chp = bp - stride;
+                        goto end_of_search;
+                    }
                 }
                 value.szt = 0;
-                value.szt = wow64 ? *(u32*)(&vals[0]) : *(u64*)(&vals[0]);
+                value.szt = wow64 ? *(u32*)(&vals[stkmap_curr->sp.chp - cache_lo]) : *(u64*)(&vals[stkmap_curr->sp.chp - cache_lo]);
                 //value.szt = (size_t)(wow64 ? *stkmap_curr->sp.uip : *stkmap_curr->sp.szp);
                 /// check if the current element has changed
                 if(stkmap_curr->value.szt != value.szt)
@@ -294,7 +306,7 @@ static int unwind_stack_fwd(stack_control_t* stk)
                                 val_idx = 0;
                                 val_size = min(PAGE_SIZE-(unsigned long)(search_sp.szt&(~PAGE_MASK)), (unsigned long)(search_border.chp-search_sp.chp+stride));
                                 val_size = min((size_t)IP_SEARCH_RANGE * stride, val_size);
-                                if (stk->acc->read(stk->acc, search_sp.szp, &vals[val_idx], val_size) != val_size) {
+                                if (stk->acc->read(stk->acc, search_sp.szp, &ipvals[val_idx], val_size) != val_size) {
                                     TRACE("SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p", search_sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
                                     //printk("failed to read 0!!! SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p\n", search_sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
                                     /// clear the stack map
@@ -306,7 +318,7 @@ static int unwind_stack_fwd(stack_control_t* stk)
                                     goto end_of_search;
                                 }
                                 }
-                                value.szt = wow64 ? *(u32*)(&vals[val_idx]) : *(u64*)(&vals[val_idx]);
+                                value.szt = wow64 ? *(u32*)(&ipvals[val_idx]) : *(u64*)(&ipvals[val_idx]);
 //                                value.szt = ((stkptr_t*)&vals[val_idx])->szt;
                                 //stk->value.szt = value.szt = (size_t)(wow64 ? *search_sp.uip : *search_sp.szp);
                                 /// this is a relaxed IP search condition (to increase the performance)
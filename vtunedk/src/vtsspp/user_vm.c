@@ -34,6 +34,8 @@
 #include "user_vm.h"
 
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/sort.h>
 #include <linux/vmstat.h>
 #include <linux/highmem.h>      /* for kmap()/kunmap() */
 #include <linux/pagemap.h>      /* for page_cache_release() */
@@ -306,13 +308,264 @@ static int vtss_user_vm_page_pin(struct user_vm_accessor* this, unsigned long ad
 }
 
 
+/* ------------------------------------------------------------------------- */
+/*
+ * Executable range index of a traced process.
+ *
+ * The index is a sorted array of disjoint [start, end) ranges, built once
+ * from the VMA list when the process becomes a target and then extended
+ * from the mmap hook, so the sampling path rarely walks the VMA tree.
+ * Readers (validate, possibly in NMI) search it under rcu_read_lock() only.
+ * New ranges are appended unsorted after the sorted part, up to
+ * VTSS_VMA_INDEX_TAIL of them; only then is the array copied, sorted,
+ * merged and published again.
+ * Unmaps are not tracked, so a hit is only a hint to be confirmed with
+ * find_vma(). A miss is reliable unless a range was lost, then the index
+ * answers "may be" for every address.
+ */
+#ifdef CONFIG_PREEMPT_RT
+typedef raw_spinlock_t vtss_vma_index_spinlock_t;
+#define vtss_vma_index_spin_lock_init(lock)               raw_spin_lock_init(lock)
+#define vtss_vma_index_spin_lock_irqsave(lock, flags)     raw_spin_lock_irqsave(lock, flags)
+#define vtss_vma_index_spin_unlock_irqrestore(lock, flags) raw_spin_unlock_irqrestore(lock, flags)
+#else
+typedef spinlock_t vtss_vma_index_spinlock_t;
+#define vtss_vma_index_spin_lock_init(lock)               spin_lock_init(lock)
+#define vtss_vma_index_spin_lock_irqsave(lock, flags)     spin_lock_irqsave(lock, flags)
+#define vtss_vma_index_spin_unlock_irqrestore(lock, flags) spin_unlock_irqrestore(lock, flags)
+#endif
+
+#define VTSS_VMA_INDEX_TAIL 32 /* unsorted ranges before a rebuild */
+
+struct vtss_vma_range
+{
+    unsigned long start;
+    unsigned long end;
+};
+
+struct vtss_vma_ranges
+{
+    struct rcu_head       rcu;
+    int                   count; /* sorted, disjoint ranges */
+    int                   tail;  /* unsorted ranges after them */
+    int                   size;
+    struct vtss_vma_range range[0];
+};
+
+struct vtss_vma_index
+{
+    struct rcu_head           rcu;
+    atomic_t                  usage;
+    vtss_vma_index_spinlock_t lock; /* serializes updaters */
+    int                       lost; /* not loaded or a range was not added */
+    struct vtss_vma_ranges*   ranges;
+};
+
+static struct vtss_vma_ranges* vtss_vma_ranges_alloc(int size, gfp_t gfp)
+{
+    struct vtss_vma_ranges* r = (struct vtss_vma_ranges*)kmalloc(sizeof(struct vtss_vma_ranges) + size*sizeof(struct vtss_vma_range), gfp);
+    if (r != NULL) {
+        r->count = 0;
+        r->tail  = 0;
+        r->size  = size;
+    }
+    return r;
+}
+
+static void vtss_vma_ranges_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct vtss_vma_ranges, rcu));
+}
+
+static int vtss_vma_range_cmp(const void* a, const void* b)
+{
+    const struct vtss_vma_range* ra = (const struct vtss_vma_range*)a;
+    const struct vtss_vma_range* rb = (const struct vtss_vma_range*)b;
+
+    return (ra->start < rb->start) ? -1 : (ra->start > rb->start) ? 1 : 0;
+}
+
+/* Sort the first count ranges and merge the ones which overlap or touch */
+static void vtss_vma_ranges_merge(struct vtss_vma_ranges* r)
+{
+    int i, n = 0;
+
+    sort(r->range, r->count, sizeof(struct vtss_vma_range), vtss_vma_range_cmp, NULL);
+    for (i = 0; i < r->count; i++) {
+        if (n && r->range[i].start <= r->range[n-1].end) {
+            r->range[n-1].end = max(r->range[n-1].end, r->range[i].end);
+        } else {
+            r->range[n++] = r->range[i];
+        }
+    }
+    r->count = n;
+}
+
+static void vtss_vma_index_publish(vtss_vma_index_t* vmi, struct vtss_vma_ranges* r)
+{
+    struct vtss_vma_ranges* old = vmi->ranges;
+
+    rcu_assign_pointer(vmi->ranges, r);
+    if (old != NULL)
+        call_rcu(&old->rcu, vtss_vma_ranges_free_rcu);
+}
+
+vtss_vma_index_t* vtss_vma_index_create(void)
+{
+    vtss_vma_index_t* vmi = (vtss_vma_index_t*)kmalloc(sizeof(vtss_vma_index_t), GFP_KERNEL);
+
+    if (vmi != NULL) {
+        atomic_set(&vmi->usage, 1);
+        vtss_vma_index_spin_lock_init(&vmi->lock);
+        vmi->lost   = 1;
+        vmi->ranges = NULL;
+    } else {
+        ERROR("No memory for vma index");
+    }
+    return vmi;
+}
+
+void vtss_vma_index_addref(vtss_vma_index_t* vmi)
+{
+    if (vmi != NULL)
+        atomic_inc(&vmi->usage);
+}
+
+static void vtss_vma_index_free_rcu(struct rcu_head *head)
+{
+    vtss_vma_index_t* vmi = container_of(head, vtss_vma_index_t, rcu);
+
+    kfree(vmi->ranges);
+    kfree(vmi);
+}
+
+void vtss_vma_index_put(vtss_vma_index_t* vmi)
+{
+    if (vmi != NULL && atomic_dec_and_test(&vmi->usage))
+        call_rcu(&vmi->rcu, vtss_vma_index_free_rcu);
+}
+
+/* Rebuild the index from the VMA list, the caller holds mm->mmap_sem */
+int vtss_vma_index_load(vtss_vma_index_t* vmi, struct mm_struct* mm)
+{
+    int count = 0;
+    unsigned long flags;
+    struct vm_area_struct* vma;
+    struct vtss_vma_ranges* r;
+
+    if (vmi == NULL || mm == NULL)
+        return -EINVAL;
+    for (vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+        if (vma->vm_flags & VM_EXEC)
+            count++;
+    r = vtss_vma_ranges_alloc(count + VTSS_VMA_INDEX_TAIL, GFP_KERNEL);
+    if (r == NULL) {
+        ERROR("No memory for %d vma ranges", count);
+        return -ENOMEM;
+    }
+    /* The list is sorted by address, so only the last range can be extended */
+    for (vma = mm->mmap; vma != NULL && r->count < count; vma = vma->vm_next) {
+        if (!(vma->vm_flags & VM_EXEC))
+            continue;
+        if (r->count && r->range[r->count-1].end == vma->vm_start) {
+            r->range[r->count-1].end = vma->vm_end;
+        } else {
+            r->range[r->count].start = vma->vm_start;
+            r->range[r->count].end   = vma->vm_end;
+            r->count++;
+        }
+    }
+    vtss_vma_index_spin_lock_irqsave(&vmi->lock, flags);
+    vtss_vma_index_publish(vmi, r);
+    vmi->lost = 0;
+    vtss_vma_index_spin_unlock_irqrestore(&vmi->lock, flags);
+    TRACE("vma index: %d ranges of %d vmas", r->count, mm->map_count);
+    return 0;
+}
+
+/* Add [start, end) to the index, called from the mmap hook in atomic context */
+int vtss_vma_index_add(vtss_vma_index_t* vmi, unsigned long start, unsigned long end)
+{
+    int i, n;
+    unsigned long flags;
+    struct vtss_vma_ranges *old, *r;
+
+    if (vmi == NULL || start >= end)
+        return -EINVAL;
+    vtss_vma_index_spin_lock_irqsave(&vmi->lock, flags);
+    old = vmi->ranges;
+    if (old != NULL && old->tail < VTSS_VMA_INDEX_TAIL && old->count + old->tail < old->size) {
+        old->range[old->count + old->tail].start = start;
+        old->range[old->count + old->tail].end   = end;
+        smp_wmb(); /* the range before the tail count */
+        ACCESS_ONCE(old->tail) = old->tail + 1;
+        vtss_vma_index_spin_unlock_irqrestore(&vmi->lock, flags);
+        return 0;
+    }
+    n = (old ? old->count + old->tail : 0) + 1;
+    r = vtss_vma_ranges_alloc(n + VTSS_VMA_INDEX_TAIL, GFP_ATOMIC);
+    if (r == NULL) {
+        vmi->lost = 1;
+        vtss_vma_index_spin_unlock_irqrestore(&vmi->lock, flags);
+        TRACE("No memory for vma range [0x%lx - 0x%lx]", start, end);
+        return -ENOMEM;
+    }
+    for (i = 0; i < n - 1; i++)
+        r->range[i] = old->range[i];
+    r->range[n-1].start = start;
+    r->range[n-1].end   = end;
+    r->count = n;
+    vtss_vma_ranges_merge(r);
+    vtss_vma_index_publish(vmi, r);
+    vtss_vma_index_spin_unlock_irqrestore(&vmi->lock, flags);
+    return 0;
+}
+
+/*
+ * Returns 0 if addr is outside of every executable mapping seen,
+ * 1 if it may be inside one. Without an index the answer is always 1.
+ */
+int vtss_vma_index_find(vtss_vma_index_t* vmi, unsigned long addr)
+{
+    int i, lo, hi, tail, rc = 0;
+    struct vtss_vma_ranges* r;
+
+    if (vmi == NULL)
+        return 1;
+    rcu_read_lock();
+    r = rcu_dereference(vmi->ranges);
+    if (r == NULL || ACCESS_ONCE(vmi->lost)) {
+        rc = 1;
+    } else {
+        lo = 0;
+        hi = r->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (addr < r->range[mid].start) {
+                hi = mid;
+            } else if (addr >= r->range[mid].end) {
+                lo = mid + 1;
+            } else {
+                rc = 1;
+                break;
+            }
+        }
+        tail = ACCESS_ONCE(r->tail);
+        smp_rmb(); /* pairs with the smp_wmb() in vtss_vma_index_add() */
+        for (i = r->count; !rc && i < r->count + tail; i++)
+            if (addr >= r->range[i].start && addr < r->range[i].end)
+                rc = 1;
+    }
+    rcu_read_unlock();
+    return rc;
+}
+
 #ifdef VTSS_VMA_SEARCH_BOOST
+/* Executable mappings come from m_vmi, only vdso and stack need a lookup here */
 static void vtss_vma_cache_init(struct user_vm_accessor* this)
 {
     struct vm_area_struct* vma;
     int callcnt = atomic_read(&vtss_mmap_reg_callcnt);
-    int i = 0;
-    int is_vdso_found = 0;
 
     if (!this) return;
     if (this->mmap_reg_callcnt >= callcnt) return;
@@ -320,54 +573,24 @@ static void vtss_vma_cache_init(struct user_vm_accessor* this)
 
     this->mmap_vdso_start = 0;
     this->mmap_vdso_end = 0;
-    this->mmap_mms_start = 0;
-    this->mmap_mms_end = 0;
     this->mmap_stack_start = 0;
     this->mmap_stack_end = 0;
 
     if (unlikely(!this->m_mm)){
          return;
     }
-/*
-    this->mmap_code_start_addr = this->m_mm->start_code;
-    this->mmap_code_end_addr = this->m_mm->end_code;
-    this->mmap_heap_start_addr = this->m_mm->start_brk;
-    this->mmap_heap_end_addr = this->m_mm->brk;
-
-    //////////////////////////////
-    this->mmap_mms_addr = this->m_mm->brk;
-    this->mmap_vdso_addr = (unsigned long)this->m_mm->context.vdso; //VTSS_USER_SPACE_HIGH;
-    this->mmap_end_addr = (unsigned long)this->m_mm->context.vdso+PAGE_SIZE; //VTSS_USER_SPACE_HIGH;
-
-    vma = find_vma(this->m_mm, (unsigned long)this->m_mm->context.vdso);
-    if (vma){
-        this->mmap_end_addr = vma->vm_end;
-    }
-
-    return;
-*/
-    for (vma = this->m_mm->mmap; vma != NULL; vma = vma->vm_next) {
-            if (vma->vm_mm && vma->vm_start == (long)vma->vm_mm->context.vdso) {
-                is_vdso_found = 1;
-                this->mmap_vdso_start = vma->vm_start;
-                this->mmap_vdso_end = vma->vm_end;
-            } else if ((vma->vm_flags & VM_EXEC)) {
-                    if (vma->vm_start <= this->m_mm->start_stack && this->m_mm->start_stack < vma->vm_end){
-                        this->mmap_stack_start = vma->vm_start;
-                        this->mmap_stack_end = vma->vm_end;
-                    } else if (vma->vm_start !=this->m_mm->start_code){
-                        if (this->mmap_mms_start > vma->vm_start || this->mmap_mms_start == 0) this->mmap_mms_start = vma->vm_start;
-                        if (this->mmap_mms_end < vma->vm_end) this->mmap_mms_end = vma->vm_end;
-                    }
-            }
-//            printk("start_stack=0x%lx, vma=0x%lx:0x%lx\n", this->m_mm->start_stack, vma->vm_start,vma->vm_end);
-    }
-    if (!is_vdso_found && this->m_mm->context.vdso) {
+    if (this->m_mm->context.vdso) {
         this->mmap_vdso_start = (unsigned long)this->m_mm->context.vdso;
         this->mmap_vdso_end = (unsigned long)this->m_mm->context.vdso + PAGE_SIZE;
+        vma = find_vma(this->m_mm, this->mmap_vdso_start);
+        if (vma && vma->vm_start == this->mmap_vdso_start)
+            this->mmap_vdso_end = vma->vm_end;
+    }
+    vma = find_vma(this->m_mm, this->m_mm->start_stack);
+    if (vma && (vma->vm_flags & VM_EXEC) && vma->vm_start <= this->m_mm->start_stack) {
+        this->mmap_stack_start = vma->vm_start;
+        this->mmap_stack_end = vma->vm_end;
     }
-//    printk(" cache end: callcnt=%d,mmap_vdso=0x%lx:0x%lx; mmap_mms=0x%lx:0x%lx;mmap_stack=0x%lx:0x%lx\n",callcnt,this->mmap_vdso_start,this->mmap_vdso_end,this->mmap_mms_start,this->mmap_mms_end,this->mmap_stack_start, this->mmap_stack_end);
-
 }
 #endif
 
@@ -426,9 +649,7 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
 {
     size_t i, cpsize, bytes = 0;
     unsigned long offset, addr = (unsigned long)from;
-#ifdef VTSS_DEBUG_PROFILE
-    cycles_t start_vma_time = get_cycles();
-#endif
+    cycles_t start_vma_time = vtss_profile_start();
 #ifndef VTSS_VMA_CACHE
     mm_segment_t old_fs = get_fs();
 
@@ -458,24 +679,16 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
         if (!access_ok(VERIFY_READ, addr, cpsize))
             break; /* Don't have a read access */
         if (page_id != this->m_page_id) {
-#ifdef VTSS_DEBUG_PROFILE
-            cycles_t start_pgp_time = get_cycles();
-#endif
+            cycles_t start_pgp_time = vtss_profile_start();
             TRACE("not in cache 0x%lx", this->m_page_id);
             vtss_user_vm_page_unpin(this);
             if (vtss_user_vm_page_pin(this, addr)) {
                 vtss_user_vm_page_unpin(this);
-#ifdef VTSS_DEBUG_PROFILE
-                vtss_profile_cnt_pgp++;
-                vtss_profile_clk_pgp += get_cycles() - start_pgp_time;
-#endif
+                VTSS_PROFILE_END(pgp, start_pgp_time);
                 TRACE("page lock FAIL");
                 break; /* Cannot get a page for an access */
             }
-#ifdef VTSS_DEBUG_PROFILE
-            vtss_profile_cnt_pgp++;
-            vtss_profile_clk_pgp += get_cycles() - start_pgp_time;
-#endif
+            VTSS_PROFILE_END(pgp, start_pgp_time);
         }
 #ifdef VTSS_VMA_CACHE
         memcpy(to, this->m_buffer + offset, cpsize);
@@ -507,10 +720,7 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
         set_fs(old_fs);
     }
 #endif
-#ifdef VTSS_DEBUG_PROFILE
-    vtss_profile_cnt_vma++;
-    vtss_profile_clk_vma += get_cycles() - start_vma_time;
-#endif
+    VTSS_PROFILE_END(vma, start_vma_time);
     return bytes;
 }
 
@@ -565,11 +775,12 @@ static int vtss_user_vm_validate(struct user_vm_accessor* this, unsigned long ip
 //        if (this->mmap_stack_start <= ip && ip < this->m_mm->start_stack) return 0; //not used stack area
 //        if (this->m_mm->start_stack <= ip && ip < this->mmap_stack_end) return 1;
 
+        /* Without an index find_vma() below decides */
         if ((this->m_mm->start_code <= ip  && ip < this->m_mm->end_code) ||
             (this->mmap_vdso_start <= ip && ip < this->mmap_vdso_end) ||
 //            (this->m_mm->start_stack <= ip && ip < this->mmap_stack_end)  ||
             (this->mmap_stack_start <= ip && ip < this->mmap_stack_end)  ||
-            (this->mmap_mms_start <= ip && ip < this->mmap_mms_end)){
+            vtss_vma_index_find(this->m_vmi, ip)){
             st = 1;
         } else if (this->m_mm->start_brk <= ip && ip < this->m_mm->brk)/*for java it can be code*/{
             //java functions can be called without call.
@@ -643,8 +854,6 @@ user_vm_accessor_t* vtss_user_vm_accessor_init(int in_irq, cycles_t limit)
 
         acc->mmap_vdso_start = 0;
         acc->mmap_vdso_end = 0;
-        acc->mmap_mms_start = 0;
-        acc->mmap_mms_end = 0;
         acc->mmap_stack_start = 0;
         acc->mmap_stack_end = 0;
 
@@ -33,6 +33,9 @@
 #include <linux/sched.h>        /* for struct task_struct */
 #include <linux/mm.h>           /* for struct vm_area_struct */
 
+/* Sorted index of the executable ranges of one address space, see user_vm.c */
+typedef struct vtss_vma_index vtss_vma_index_t;
+
 typedef struct user_vm_accessor
 {
 /* public: */
@@ -60,11 +63,10 @@ typedef struct user_vm_accessor
     int mmap_reg_callcnt;
 
     struct vm_area_struct* m_vma_cache;
+    vtss_vma_index_t*      m_vmi; /* owned by the target, may be NULL */
 
     unsigned long mmap_vdso_start;
     unsigned long mmap_vdso_end;
-    unsigned long mmap_mms_start;
-    unsigned long mmap_mms_end;
     unsigned long mmap_stack_start;
     unsigned long mmap_stack_end;
 
@@ -73,6 +75,13 @@ typedef struct user_vm_accessor
 user_vm_accessor_t* vtss_user_vm_accessor_init(int in_irq, cycles_t limit);
 void vtss_user_vm_accessor_fini(user_vm_accessor_t* acc);
 
+vtss_vma_index_t* vtss_vma_index_create(void);
+void vtss_vma_index_addref(vtss_vma_index_t* vmi);
+void vtss_vma_index_put(vtss_vma_index_t* vmi);
+int  vtss_vma_index_load(vtss_vma_index_t* vmi, struct mm_struct* mm);
+int  vtss_vma_index_add(vtss_vma_index_t* vmi, unsigned long start, unsigned long end);
+int  vtss_vma_index_find(vtss_vma_index_t* vmi, unsigned long addr);
+
 int  vtss_user_vm_init(void);
 void vtss_user_vm_fini(void);
 
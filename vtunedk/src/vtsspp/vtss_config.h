@@ -38,6 +38,7 @@
 #include <linux/smp.h>          /* for smp_processor_id() */
 #include <linux/cpumask.h>
 #include <linux/percpu.h>
+#include <linux/timex.h>        /* for get_cycles() */
 
 #define VTSS_TO_STR_AUX(x) #x
 #define VTSS_TO_STR(x)     VTSS_TO_STR_AUX(x)
@@ -65,84 +66,40 @@ extern int vtss_check_trace(const char* func_name, int* flag);
 extern int vtss_time_source; /* 0 - raw clock monotinic (default), 1 - TSC */
 extern cycles_t vtss_time_limit;
 
-#ifdef VTSS_DEBUG_PROFILE
-extern cycles_t vtss_profile_cnt_stk;
-extern cycles_t vtss_profile_clk_stk;
-extern cycles_t vtss_profile_cnt_ctx;
-extern cycles_t vtss_profile_clk_ctx;
-extern cycles_t vtss_profile_cnt_pmi;
-extern cycles_t vtss_profile_clk_pmi;
-extern cycles_t vtss_profile_cnt_pmu;
-extern cycles_t vtss_profile_clk_pmu;
-extern cycles_t vtss_profile_cnt_sys;
-extern cycles_t vtss_profile_clk_sys;
-extern cycles_t vtss_profile_cnt_bts;
-extern cycles_t vtss_profile_clk_bts;
-extern cycles_t vtss_profile_cnt_vma;
-extern cycles_t vtss_profile_clk_vma;
-extern cycles_t vtss_profile_cnt_pgp;
-extern cycles_t vtss_profile_clk_pgp;
-extern cycles_t vtss_profile_cnt_cpy;
-extern cycles_t vtss_profile_clk_cpy;
-extern cycles_t vtss_profile_cnt_vld;
-extern cycles_t vtss_profile_clk_vld;
-extern cycles_t vtss_profile_cnt_unw;
-extern cycles_t vtss_profile_clk_unw;
-
-#define VTSS_PROFILE(name, expr) do {   \
-    cycles_t start_time = get_cycles(); \
-    (expr);                             \
-    vtss_profile_cnt_##name++;          \
-    vtss_profile_clk_##name += get_cycles() - start_time; \
+/* Latency probes, see profile.c */
+enum {
+    VTSS_PROFILE_ctx = 0,   /* context switch */
+    VTSS_PROFILE_pmi,       /* PMI handler */
+    VTSS_PROFILE_pmu,       /* PMU restart/sample */
+    VTSS_PROFILE_sys,       /* quantum border */
+    VTSS_PROFILE_bts,       /* BTS dump/record */
+    VTSS_PROFILE_stk,       /* stack dump */
+    VTSS_PROFILE_unw,       /* one unwind step */
+    VTSS_PROFILE_vld,       /* ip validation */
+    VTSS_PROFILE_vma,       /* user memory read */
+    VTSS_PROFILE_pgp,       /* page pin */
+    VTSS_PROFILE_cpy,       /* page copy */
+    VTSS_PROFILE_trn,       /* transport record reserve */
+    VTSS_PROFILE_COUNT
+};
+
+extern int vtss_profile_enabled;
+extern void vtss_profile_record(int id, cycles_t cycles);
+
+static inline cycles_t vtss_profile_start(void)
+{
+    return unlikely(vtss_profile_enabled) ? get_cycles() : 0;
+}
+
+#define VTSS_PROFILE_END(name, start) do { \
+    if (unlikely(start)) vtss_profile_record(VTSS_PROFILE_##name, get_cycles() - (start)); \
   } while (0)
 
-#define VTSS_PROFILE_PRINT(func, ...) do { \
-    func(__VA_ARGS__ "#ctx=%15lld n=%9lld\n", \
-        vtss_profile_clk_ctx, vtss_profile_cnt_ctx); \
-    func(__VA_ARGS__ "#pmi=%15lld n=%9lld\n", \
-        vtss_profile_clk_pmi, vtss_profile_cnt_pmi/2); \
-    func(__VA_ARGS__ "*pmu=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_pmu, vtss_profile_cnt_pmu, \
-        (vtss_profile_clk_pmu*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))/100, \
-        (vtss_profile_clk_pmu*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))%100); \
-    func(__VA_ARGS__ "*sys=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_sys, vtss_profile_cnt_sys, \
-        (vtss_profile_clk_sys*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))/100, \
-        (vtss_profile_clk_sys*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))%100); \
-    func(__VA_ARGS__ "*bts=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_bts, vtss_profile_cnt_bts, \
-        (vtss_profile_clk_bts*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))/100, \
-        (vtss_profile_clk_bts*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))%100); \
-    func(__VA_ARGS__ "*stk=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_stk, vtss_profile_cnt_stk, \
-        (vtss_profile_clk_stk*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))/100, \
-        (vtss_profile_clk_stk*10000/(vtss_profile_clk_ctx+vtss_profile_clk_pmi+1))%100); \
-    func(__VA_ARGS__ ".unw=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_unw, vtss_profile_cnt_unw, \
-        (vtss_profile_clk_unw*10000/(vtss_profile_clk_stk+1))/100, \
-        (vtss_profile_clk_unw*10000/(vtss_profile_clk_stk+1))%100); \
-    func(__VA_ARGS__ "..vl=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_vld, vtss_profile_cnt_vld, \
-        (vtss_profile_clk_vld*10000/(vtss_profile_clk_unw+1))/100, \
-        (vtss_profile_clk_vld*10000/(vtss_profile_clk_unw+1))%100); \
-    func(__VA_ARGS__ "..vm=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_vma, vtss_profile_cnt_vma, \
-        (vtss_profile_clk_vma*10000/(vtss_profile_clk_unw+1))/100, \
-        (vtss_profile_clk_vma*10000/(vtss_profile_clk_unw+1))%100); \
-    func(__VA_ARGS__ "...c=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_cpy, vtss_profile_cnt_cpy, \
-        (vtss_profile_clk_cpy*10000/(vtss_profile_clk_vma+1))/100, \
-        (vtss_profile_clk_cpy*10000/(vtss_profile_clk_vma+1))%100); \
-    func(__VA_ARGS__ "...p=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
-        vtss_profile_clk_pgp, vtss_profile_cnt_pgp, \
-        (vtss_profile_clk_pgp*10000/(vtss_profile_clk_vma+1))/100, \
-        (vtss_profile_clk_pgp*10000/(vtss_profile_clk_vma+1))%100); \
-  } while(0)
-
-#else  /* VTSS_DEBUG_PROFILE */
-#define VTSS_PROFILE(name, expr) (expr)
-#define VTSS_PROFILE_PRINT(func, ...)
-#endif /* VTSS_DEBUG_PROFILE */
+#define VTSS_PROFILE(name, expr) do {                 \
+    cycles_t vtss_profile_start_time = vtss_profile_start(); \
+    (expr);                                           \
+    VTSS_PROFILE_END(name, vtss_profile_start_time);  \
+  } while (0)
 
 #if defined(CONFIG_PREEMPT_NOTIFIERS) && !defined(CONFIG_TRACEPOINTS)
 #define VTSS_USE_PREEMPT_NOTIFIERS 1 /* Use backup scheme */
@@ -93,6 +93,7 @@ extern "C" {
 #define VTSS_CFGTRACE_DBGSAMP   0x40000 // generate debug exception upon event samples
 #define VTSS_CFGTRACE_THRNORM   0x80000 // normalize thread-to-processor subscription
 #define VTSS_CFGTRACE_LBRCSTK   0x100000 // collect LBR call stacks
+#define VTSS_CFGTRACE_KSTKIDX   0x200000 // refer to repeated kernel call chains by index
 
 #define VTSS_CFGSTATE_SYS       0x80000000  // system function ID space
 